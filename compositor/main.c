@@ -124,6 +124,7 @@ struct wet_compositor {
 	struct wet_output_config *parsed_options;
 	bool drm_use_current_mode;
 	struct wl_listener heads_changed_listener;
+	struct wl_listener seat_created_listener;
 	int (*simple_output_configure)(struct weston_output *output);
 	bool init_failed;
 	struct wl_list layoutput_list;	/**< wet_layoutput::compositor_link */
@@ -695,6 +696,8 @@ usage(int error_code)
 		"\tnormal 90 180 270 flipped flipped-90 flipped-180 flipped-270\n"
 		"  --use-pixman\t\tUse the pixman (CPU) renderer (default: no rendering)\n"
 		"  --no-outputs\t\tDo not create any virtual outputs\n"
+		"  --refresh-rate=HZ\tRefresh rate of the outputs (default: 60)\n"
+		"  --unthrottled\t\tPresent each frame as soon as it is rendered\n"
 		"\n");
 #endif
 
@@ -723,6 +726,8 @@ usage(int error_code)
 		"  --use-pixman\t\tUse the pixman (CPU) renderer\n"
 		"  --output-count=COUNT\tCreate multiple outputs\n"
 		"  --sprawl\t\tCreate one fullscreen output for every parent output\n"
+		"  --forward-subsurfaces\tShow the top-most opaque client buffer as\n"
+		"\t\t\ta sub-surface in the parent compositor\n"
 		"  --display=DISPLAY\tWayland display to connect to\n\n");
 #endif
 
@@ -1055,6 +1060,28 @@ out:
 	return ret;
 }
 
+/* weston.ini [seat] sections, matched by name */
+static void
+wet_seat_created(struct wl_listener *listener, void *data)
+{
+	struct wet_compositor *wet =
+		container_of(listener, struct wet_compositor,
+			     seat_created_listener);
+	struct weston_seat *seat = data;
+	struct weston_config_section *section;
+	int coalesce;
+
+	section = weston_config_get_section(wet->config, "seat", "name",
+					    seat->seat_name);
+	weston_config_section_get_bool(section, "coalesce-pointer-motion",
+				       &coalesce, false);
+	if (coalesce) {
+		weston_log("Coalescing pointer motion of seat %s.\n",
+			   seat->seat_name);
+		weston_seat_set_pointer_coalescing(seat, true);
+	}
+}
+
 static int
 weston_compositor_init_config(struct weston_compositor *ec,
 			      struct weston_config *config)
@@ -1062,6 +1089,11 @@ weston_compositor_init_config(struct weston_compositor *ec,
 	struct xkb_rule_names xkb_names;
 	struct weston_config_section *s;
 	int repaint_msec;
+	int repaint_adaptive;
+	int occluded_frame_rate;
+	int renderer_threads;
+	int input_thread;
+	char *timeline_format;
 	int vt_switching;
 	int cal;
 
@@ -1100,8 +1132,46 @@ weston_compositor_init_config(struct weston_compositor *ec,
 	} else {
 		ec->repaint_msec = repaint_msec;
 	}
-	weston_log("Output repaint window is %d ms maximum.\n",
-		   ec->repaint_msec);
+	weston_config_section_get_bool(s, "repaint-window-adaptive",
+				       &repaint_adaptive, false);
+	ec->repaint_window_adaptive = repaint_adaptive;
+	if (ec->repaint_window_adaptive)
+		weston_log("Output repaint window is adaptive, "
+			   "starting at %d ms.\n", ec->repaint_msec);
+	else
+		weston_log("Output repaint window is %d ms maximum.\n",
+			   ec->repaint_msec);
+
+	weston_config_section_get_int(s, "occluded-frame-rate",
+				      &occluded_frame_rate, 0);
+	if (occluded_frame_rate < 0 || occluded_frame_rate > 1000) {
+		weston_log("Invalid occluded-frame-rate value in config: %d\n",
+			   occluded_frame_rate);
+	} else if (occluded_frame_rate > 0) {
+		ec->occluded_frame_interval_msec = 1000 / occluded_frame_rate;
+		weston_log("Frame callbacks of occluded surfaces are "
+			   "throttled to %d Hz.\n", occluded_frame_rate);
+	}
+
+	weston_config_section_get_int(s, "renderer-threads",
+				      &renderer_threads, 0);
+	if (renderer_threads < 0 || renderer_threads > 64)
+		weston_log("Invalid renderer-threads value in config: %d\n",
+			   renderer_threads);
+	else
+		ec->renderer_threads = renderer_threads;
+
+	weston_config_section_get_bool(s, "input-thread", &input_thread, false);
+	ec->input_thread = input_thread;
+
+	weston_config_section_get_string(s, "timeline-format",
+					 &timeline_format, "json");
+	if (strcmp(timeline_format, "binary") == 0)
+		ec->timeline_binary = true;
+	else if (strcmp(timeline_format, "json") != 0)
+		weston_log("Invalid timeline-format value in config: %s\n",
+			   timeline_format);
+	free(timeline_format);
 
 	/* weston.ini [libinput] */
 	s = weston_config_get_section(config, "libinput", NULL, NULL);
@@ -2195,14 +2265,15 @@ drm_heads_changed(struct wl_listener *listener, void *arg)
 }
 
 static int
-drm_backend_remoted_output_configure(struct weston_output *output,
-				     struct weston_config_section *section,
-				     char *modeline,
-				     const struct weston_remoting_api *api)
+remoted_output_configure(struct weston_output *output,
+			 struct weston_config_section *section,
+			 char *modeline,
+			 const struct weston_remoting_api *api)
 {
 	char *gbm_format = NULL;
 	char *seat = NULL;
 	char *host = NULL;
+	char *gst_pipeline = NULL;
 	int port, ret;
 
 	ret = api->set_mode(output, modeline);
@@ -2227,6 +2298,15 @@ drm_backend_remoted_output_configure(struct weston_output *output,
 	api->set_seat(output, seat);
 	free(seat);
 
+	/* A custom pipeline needs no destination. */
+	weston_config_section_get_string(section, "gst-pipeline",
+					 &gst_pipeline, NULL);
+	if (gst_pipeline) {
+		api->set_gst_pipeline(output, gst_pipeline);
+		free(gst_pipeline);
+		return 0;
+	}
+
 	weston_config_section_get_string(section, "host", &host, NULL);
 	if (!host) {
 		weston_log("Cannot configure an output \"%s\". Invalid host\n",
@@ -2272,8 +2352,7 @@ remoted_output_init(struct weston_compositor *c,
 		goto err;
 	}
 
-	ret = drm_backend_remoted_output_configure(output, section, modeline,
-						   api);
+	ret = remoted_output_configure(output, section, modeline, api);
 	if (ret < 0) {
 		weston_log("Cannot configure remoted output \"%s\".\n",
 			   output_name);
@@ -2393,6 +2472,24 @@ load_drm_backend(struct weston_compositor *c,
 	return ret;
 }
 
+/* Refresh rate in mHz from the "@rate" of a mode, 0 if there is none */
+static int
+parse_refresh_rate(const char *str)
+{
+	double rate;
+	char *end;
+
+	if (!str)
+		return 0;
+
+	errno = 0;
+	rate = strtod(str, &end);
+	if (errno || end == str || *end != '\0' || rate <= 0 || rate > 1000)
+		return -1;
+
+	return (int)(rate * 1000.0 + 0.5);
+}
+
 static int
 headless_backend_output_configure(struct weston_output *output)
 {
@@ -2402,8 +2499,61 @@ headless_backend_output_configure(struct weston_output *output)
 		.scale = 1.0,
 		.transform = WL_OUTPUT_TRANSFORM_NORMAL
 	};
+	const struct weston_headless_output_api *api =
+		weston_headless_output_get_api(output->compositor);
+	struct weston_config *wc = wet_get_config(output->compositor);
+	struct weston_config_section *section;
+	char *mode, *rate, *export_socket;
+	int unthrottled;
+	int export_buffers;
+	int refresh = 0;
 
-	return wet_configure_windowed_output_from_config(output, &defaults);
+	if (wet_configure_windowed_output_from_config(output, &defaults) < 0)
+		return -1;
+
+	section = weston_config_get_section(wc, "output", "name", output->name);
+	if (!section)
+		return 0;
+
+	weston_config_section_get_bool(section, "unthrottled",
+				       &unthrottled, 0);
+	weston_config_section_get_string(section, "mode", &mode, NULL);
+	rate = mode ? strchr(mode, '@') : NULL;
+
+	if (unthrottled) {
+		refresh = WESTON_HEADLESS_REFRESH_UNTHROTTLED;
+	} else if (rate) {
+		refresh = parse_refresh_rate(rate + 1);
+		if (refresh < 0) {
+			weston_log("Invalid refresh rate in mode %s for output "
+				   "%s. Using the default.\n", mode,
+				   output->name);
+			refresh = 0;
+		}
+	}
+	free(mode);
+
+	if (refresh != 0 && (!api || api->set_refresh(output, refresh) < 0)) {
+		weston_log("Cannot set the refresh rate of output %s.\n",
+			   output->name);
+		return -1;
+	}
+
+	weston_config_section_get_string(section, "export-socket",
+					 &export_socket, NULL);
+	weston_config_section_get_int(section, "export-buffers",
+				      &export_buffers, 3);
+	if (export_socket &&
+	    (!api || api->set_export(output, export_socket,
+				     export_buffers) < 0)) {
+		weston_log("Cannot export output %s, it needs the pixman "
+			   "renderer and 2 to 8 buffers.\n", output->name);
+		free(export_socket);
+		return -1;
+	}
+	free(export_socket);
+
+	return 0;
 }
 
 static int
@@ -2413,8 +2563,10 @@ load_headless_backend(struct weston_compositor *c,
 	const struct weston_windowed_output_api *api;
 	struct weston_headless_backend_config config = {{ 0, }};
 	int no_outputs = 0;
+	int unthrottled = 0;
 	int ret = 0;
 	char *transform = NULL;
+	char *refresh_rate = NULL;
 
 	struct wet_output_config *parsed_options = wet_init_parsed_options(c);
 	if (!parsed_options)
@@ -2426,10 +2578,24 @@ load_headless_backend(struct weston_compositor *c,
 		{ WESTON_OPTION_BOOLEAN, "use-pixman", 0, &config.use_pixman },
 		{ WESTON_OPTION_STRING, "transform", 0, &transform },
 		{ WESTON_OPTION_BOOLEAN, "no-outputs", 0, &no_outputs },
+		{ WESTON_OPTION_STRING, "refresh-rate", 0, &refresh_rate },
+		{ WESTON_OPTION_BOOLEAN, "unthrottled", 0, &unthrottled },
 	};
 
 	parse_options(options, ARRAY_LENGTH(options), argc, argv);
 
+	if (unthrottled) {
+		config.refresh = WESTON_HEADLESS_REFRESH_UNTHROTTLED;
+	} else if (refresh_rate) {
+		config.refresh = parse_refresh_rate(refresh_rate);
+		if (config.refresh < 0) {
+			weston_log("Invalid refresh rate \"%s\"\n",
+				   refresh_rate);
+			config.refresh = 0;
+		}
+	}
+	free(refresh_rate);
+
 	if (transform) {
 		if (weston_parse_transform(transform, &parsed_options->transform) < 0) {
 			weston_log("Invalid transform \"%s\"\n", transform);
@@ -2462,6 +2628,10 @@ load_headless_backend(struct weston_compositor *c,
 			return -1;
 	}
 
+	/* remoting, from the virtual outputs of the pixman renderer */
+	if (config.use_pixman)
+		load_remoting(c, wc);
+
 	return 0;
 }
 
@@ -2730,6 +2900,7 @@ load_wayland_backend(struct weston_compositor *c,
 	int32_t use_pixman_ = 0;
 	int32_t sprawl_ = 0;
 	int32_t fullscreen_ = 0;
+	int32_t forward_subsurfaces_ = 0;
 
 	struct wet_output_config *parsed_options = wet_init_parsed_options(c);
 	if (!parsed_options)
@@ -2748,12 +2919,14 @@ load_wayland_backend(struct weston_compositor *c,
 		{ WESTON_OPTION_INTEGER, "output-count", 0, &count },
 		{ WESTON_OPTION_BOOLEAN, "fullscreen", 0, &fullscreen_ },
 		{ WESTON_OPTION_BOOLEAN, "sprawl", 0, &sprawl_ },
+		{ WESTON_OPTION_BOOLEAN, "forward-subsurfaces", 0, &forward_subsurfaces_ },
 	};
 
 	parse_options(wayland_options, ARRAY_LENGTH(wayland_options), argc, argv);
 	config.sprawl = sprawl_;
 	config.use_pixman = use_pixman_;
 	config.fullscreen = fullscreen_;
+	config.forward_subsurfaces = forward_subsurfaces_;
 
 	section = weston_config_get_section(wc, "shell", NULL, NULL);
 	weston_config_section_get_string(section, "cursor-theme",
@@ -3032,6 +3205,10 @@ int main(int argc, char *argv[])
 	if (weston_compositor_init_config(wet.compositor, config) < 0)
 		goto out;
 
+	wet.seat_created_listener.notify = wet_seat_created;
+	wl_signal_add(&wet.compositor->seat_created_signal,
+		      &wet.seat_created_listener);
+
 	weston_config_section_get_bool(section, "require-input",
 				       &require_input, true);
 	wet.compositor->require_input = require_input;
@@ -27,15 +27,29 @@
 #include "config.h"
 
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/un.h>
 #include <stdbool.h>
+#include <unistd.h>
+#ifdef HAVE_LINUX_MEMFD_H
+#include <sys/syscall.h>
+#include <linux/memfd.h>
+#endif
 
 #include "compositor.h"
 #include "compositor-headless.h"
+#include "output-export.h"
 #include "shared/helpers.h"
+#include "shared/os-compatibility.h"
+#include "shared/timespec-util.h"
 #include "pixman-renderer.h"
 #include "presentation-time-server-protocol.h"
 #include "windowed-output-api.h"
@@ -46,19 +60,91 @@ struct headless_backend {
 
 	struct weston_seat fake_seat;
 	bool use_pixman;
+	int refresh; /* default of the outputs */
 };
 
 struct headless_head {
 	struct weston_head base;
 };
 
+#define HEADLESS_MAX_BUFFERS 8
+#define HEADLESS_VIRTUAL_BUFFERS 3
+
+/* A buffer an output is rendered to, shared with the consumer of an
+ * export or lent to the plugin of a virtual output, as an opaque
+ * struct weston_headless_virtual_buffer. When the output is disabled
+ * while the plugin holds it, it is orphaned and freed on release. */
+struct headless_buffer {
+	struct headless_output *output;	/* NULL once orphaned */
+	pixman_image_t *image;
+	void *data;
+	size_t size;
+	int stride;
+	int fd;			/* -1 for the scratch buffer */
+	bool held;		/* by the consumer or the plugin */
+	uint64_t seq;		/* of the last frame rendered to it */
+
+	/* Output damage since the buffer was last rendered to, in global
+	 * coordinates. It is repainted along with the next frame. */
+	pixman_region32_t stale;
+};
+
+/* The buffers an output is rendered into directly. When the consumer
+ * holds all of them, the frame goes to a private scratch buffer, so that
+ * rendering never waits on it. */
+struct headless_buffer_ring {
+	int n_buffers;
+	struct headless_buffer *buffers[HEADLESS_MAX_BUFFERS];
+	struct headless_buffer *scratch;
+	struct headless_buffer *current;
+	uint64_t seq;
+};
+
+/* Hands the buffers of an output to a consumer process, see
+ * output-export.h. */
+struct headless_export {
+	struct headless_output *output;
+	char *socket_path;
+	int listen_fd;
+	struct wl_event_source *listen_source;
+	int client_fd;
+	struct wl_event_source *client_source;
+
+	pixman_region32_t pending;	/* not sent to the consumer yet */
+	bool behind;			/* the last frame was not sent */
+
+	uint64_t frames_sent;
+	uint64_t frames_not_sent;
+};
+
 struct headless_output {
 	struct weston_output base;
 
 	struct weston_mode mode;
 	struct wl_event_source *finish_frame_timer;
+	struct wl_event_source *finish_frame_idle; /* when unthrottled */
 	uint32_t *image_buf;
 	pixman_image_t *image;
+
+	/* Exported and virtual outputs are rendered into the ring. */
+	struct headless_buffer_ring ring;
+
+	char *export_path;
+	int export_buffers;
+	struct headless_export *export;
+
+	/* Virtual outputs hand their frames to a plugin. */
+	bool is_virtual;
+	weston_headless_submit_frame_cb submit_frame;
+	pixman_region32_t unsent;	/* damage not handed over yet */
+
+	/* Vblank k happens at vblank_base + k * refresh_nsec, k being the
+	 * media stream counter. refresh_nsec is 0 when unthrottled. */
+	int refresh;
+	int64_t refresh_nsec;
+	struct timespec vblank_base;
+	struct timespec pending_vblank;
+	uint64_t pending_msc;
 };
 
 static inline struct headless_head *
@@ -79,25 +165,673 @@ to_headless_backend(struct weston_compositor *base)
 	return container_of(base->backend, struct headless_backend, base);
 }
 
+/* The last vblank at or before now, and its counter */
 static void
-headless_output_start_repaint_loop(struct weston_output *output)
+headless_output_last_vblank(struct headless_output *output,
+			    const struct timespec *now,
+			    struct timespec *vblank, uint64_t *msc)
 {
+	int64_t elapsed = timespec_sub_to_nsec(now, &output->vblank_base);
+
+	*msc = elapsed > 0 ? elapsed / output->refresh_nsec : 0;
+	timespec_add_nsec(vblank, &output->vblank_base,
+			  *msc * output->refresh_nsec);
+}
+
+static void
+headless_output_start_repaint_loop(struct weston_output *output_base)
+{
+	struct headless_output *output = to_headless_output(output_base);
 	struct timespec ts;
 
-	weston_compositor_read_presentation_clock(output->compositor, &ts);
-	weston_output_finish_frame(output, &ts, WP_PRESENTATION_FEEDBACK_INVALID);
+	weston_compositor_read_presentation_clock(output_base->compositor, &ts);
+	if (output->refresh_nsec)
+		headless_output_last_vblank(output, &ts, &ts,
+					    &output_base->msc);
+
+	weston_output_finish_frame(output_base, &ts,
+				   WP_PRESENTATION_FEEDBACK_INVALID);
 }
 
 static int
 finish_frame_handler(void *data)
+{
+	struct headless_output *output = data;
+
+	output->base.msc = output->pending_msc;
+	weston_output_finish_frame(&output->base, &output->pending_vblank,
+				   WP_PRESENTATION_FEEDBACK_KIND_VSYNC);
+
+	return 1;
+}
+
+static void
+finish_frame_idle_handler(void *data)
 {
 	struct headless_output *output = data;
 	struct timespec ts;
 
+	output->finish_frame_idle = NULL;
+
 	weston_compositor_read_presentation_clock(output->base.compositor, &ts);
+	output->base.msc++;
 	weston_output_finish_frame(&output->base, &ts, 0);
+}
 
-	return 1;
+/* Present the frame just rendered on the next vblank, or right away when
+ * unthrottled. */
+static void
+headless_output_schedule_finish_frame(struct headless_output *output)
+{
+	struct wl_event_loop *loop;
+	struct timespec now;
+	int64_t delay_nsec;
+
+	if (!output->refresh_nsec) {
+		loop = wl_display_get_event_loop(
+				output->base.compositor->wl_display);
+		output->finish_frame_idle =
+			wl_event_loop_add_idle(loop, finish_frame_idle_handler,
+					       output);
+		return;
+	}
+
+	weston_compositor_read_presentation_clock(output->base.compositor,
+						  &now);
+	headless_output_last_vblank(output, &now, &output->pending_vblank,
+				    &output->pending_msc);
+	output->pending_msc++;
+	timespec_add_nsec(&output->pending_vblank, &output->pending_vblank,
+			  output->refresh_nsec);
+
+	/* Timers have millisecond resolution; fire just after the vblank. */
+	delay_nsec = timespec_sub_to_nsec(&output->pending_vblank, &now);
+	wl_event_source_timer_update(output->finish_frame_timer,
+				     MAX(1, (delay_nsec + 999999) / 1000000));
+}
+
+/* Damage in global coordinates, as rectangles of the output buffer */
+static void
+headless_output_buffer_damage(struct headless_output *output,
+			      pixman_region32_t *global,
+			      pixman_region32_t *transformed)
+{
+	struct weston_output *base = &output->base;
+	pixman_region32_t damage;
+
+	pixman_region32_init(&damage);
+	pixman_region32_intersect(&damage, &base->region, global);
+	pixman_region32_translate(&damage, -base->x, -base->y);
+	weston_transformed_region(base->width, base->height,
+				  base->transform, base->current_scale,
+				  &damage, transformed);
+	pixman_region32_fini(&damage);
+}
+
+static int
+headless_create_shared_file(const char *name, size_t size)
+{
+	int fd;
+
+#if defined(HAVE_LINUX_MEMFD_H) && defined(F_ADD_SEALS)
+	/* Sealed, so that the consumer cannot shrink the file under us. */
+	fd = syscall(SYS_memfd_create, name,
+		     MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd >= 0) {
+		if (ftruncate(fd, size) < 0 ||
+		    fcntl(fd, F_ADD_SEALS,
+			  F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0) {
+			close(fd);
+			return -1;
+		}
+
+		return fd;
+	}
+#endif
+
+	return os_create_anonymous_file(size);
+}
+
+static void
+headless_buffer_destroy(struct headless_buffer *buffer)
+{
+	if (buffer->image) {
+		pixman_image_unref(buffer->image);
+		pixman_region32_fini(&buffer->stale);
+	}
+	if (buffer->data != MAP_FAILED)
+		munmap(buffer->data, buffer->size);
+	if (buffer->fd >= 0)
+		close(buffer->fd);
+	free(buffer);
+}
+
+static struct headless_buffer *
+headless_buffer_create(struct headless_output *output, const char *name,
+		       bool shared)
+{
+	struct weston_mode *mode = output->base.current_mode;
+	struct headless_buffer *buffer;
+
+	buffer = zalloc(sizeof *buffer);
+	if (!buffer)
+		return NULL;
+
+	buffer->output = output;
+	buffer->stride = mode->width * 4;
+	buffer->size = (size_t)buffer->stride * mode->height;
+	buffer->fd = -1;
+
+	if (shared) {
+		buffer->fd = headless_create_shared_file(name, buffer->size);
+		if (buffer->fd >= 0)
+			buffer->data = mmap(NULL, buffer->size,
+					    PROT_READ | PROT_WRITE, MAP_SHARED,
+					    buffer->fd, 0);
+		else
+			buffer->data = MAP_FAILED;
+	} else {
+		buffer->data = mmap(NULL, buffer->size, PROT_READ | PROT_WRITE,
+				    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	}
+	if (buffer->data == MAP_FAILED)
+		goto err;
+
+	buffer->image = pixman_image_create_bits(PIXMAN_x8r8g8b8,
+						 mode->width, mode->height,
+						 buffer->data, buffer->stride);
+	if (!buffer->image)
+		goto err;
+
+	/* Nothing has been rendered to it yet. */
+	pixman_region32_init(&buffer->stale);
+	pixman_region32_copy(&buffer->stale, &output->base.region);
+
+	return buffer;
+
+err:
+	headless_buffer_destroy(buffer);
+	return NULL;
+}
+
+/* Buffers still held are freed when they are released. */
+static void
+headless_buffer_ring_fini(struct headless_buffer_ring *ring)
+{
+	struct headless_buffer *buffer;
+	int i;
+
+	for (i = 0; i < ring->n_buffers; i++) {
+		buffer = ring->buffers[i];
+		ring->buffers[i] = NULL;
+		if (!buffer)
+			continue;
+
+		if (buffer->held)
+			buffer->output = NULL;
+		else
+			headless_buffer_destroy(buffer);
+	}
+
+	if (ring->scratch) {
+		headless_buffer_destroy(ring->scratch);
+		ring->scratch = NULL;
+	}
+
+	ring->n_buffers = 0;
+	ring->current = NULL;
+}
+
+static int
+headless_buffer_ring_init(struct headless_buffer_ring *ring,
+			  struct headless_output *output, const char *name,
+			  int n_buffers)
+{
+	int i;
+
+	assert(n_buffers <= HEADLESS_MAX_BUFFERS);
+
+	memset(ring, 0, sizeof *ring);
+	ring->n_buffers = n_buffers;
+
+	for (i = 0; i < n_buffers; i++) {
+		ring->buffers[i] = headless_buffer_create(output, name, true);
+		if (!ring->buffers[i])
+			goto err;
+	}
+
+	ring->scratch = headless_buffer_create(output, name, false);
+	if (!ring->scratch)
+		goto err;
+
+	ring->current = ring->buffers[0];
+
+	return 0;
+
+err:
+	weston_log("Cannot allocate the buffers of output %s\n",
+		   output->base.name);
+	headless_buffer_ring_fini(ring);
+	return -1;
+}
+
+/* Pick the buffer of the next frame, and repaint in it what changed since
+ * it was last rendered to. */
+static void
+headless_buffer_ring_begin_frame(struct headless_buffer_ring *ring,
+				 struct headless_output *output)
+{
+	struct headless_buffer *buffer = NULL;
+	int i;
+
+	/* The most recent free buffer has the least to catch up on. */
+	for (i = 0; i < ring->n_buffers; i++) {
+		struct headless_buffer *b = ring->buffers[i];
+
+		if (!b->held && (!buffer || b->seq > buffer->seq))
+			buffer = b;
+	}
+	if (!buffer)
+		buffer = ring->scratch;
+
+	ring->current = buffer;
+	pixman_renderer_output_set_buffer(&output->base, buffer->image);
+	pixman_renderer_output_set_hw_extra_damage(&output->base,
+						   &buffer->stale);
+}
+
+static void
+headless_buffer_ring_end_frame(struct headless_buffer_ring *ring,
+			       pixman_region32_t *damage)
+{
+	struct headless_buffer *b;
+	int i;
+
+	ring->seq++;
+
+	for (i = 0; i <= ring->n_buffers; i++) {
+		b = i < ring->n_buffers ? ring->buffers[i] : ring->scratch;
+
+		if (b == ring->current)
+			pixman_region32_clear(&b->stale);
+		else
+			pixman_region32_union(&b->stale, &b->stale, damage);
+	}
+	ring->current->seq = ring->seq;
+}
+
+static void
+headless_export_disconnect(struct headless_export *export)
+{
+	struct headless_buffer_ring *ring = &export->output->ring;
+	int i;
+
+	if (export->client_fd < 0)
+		return;
+
+	wl_event_source_remove(export->client_source);
+	close(export->client_fd);
+	export->client_fd = -1;
+
+	for (i = 0; i < ring->n_buffers; i++)
+		ring->buffers[i]->held = false;
+	export->behind = false;
+
+	weston_log("Output export consumer of %s disconnected after %llu "
+		   "frames, %llu repaints not sent\n",
+		   export->output->base.name,
+		   (unsigned long long)export->frames_sent,
+		   (unsigned long long)export->frames_not_sent);
+}
+
+static int
+headless_export_send_buffers(struct headless_export *export)
+{
+	struct headless_buffer_ring *ring = &export->output->ring;
+	struct weston_mode *mode = export->output->base.current_mode;
+	struct weston_output_export_buffers msg = {
+		.type = WESTON_OUTPUT_EXPORT_BUFFERS,
+		.version = WESTON_OUTPUT_EXPORT_VERSION,
+		.format = WESTON_OUTPUT_EXPORT_FORMAT_XRGB8888,
+		.width = mode->width,
+		.height = mode->height,
+		.stride = ring->buffers[0]->stride,
+		.size = ring->buffers[0]->size,
+		.n_buffers = ring->n_buffers,
+	};
+	char control[CMSG_SPACE(sizeof(int) * HEADLESS_MAX_BUFFERS)];
+	struct iovec iov = { &msg, sizeof msg };
+	struct msghdr hdr;
+	struct cmsghdr *cmsg;
+	int *fds;
+	ssize_t len;
+	int i;
+
+	memset(control, 0, sizeof control);
+	memset(&hdr, 0, sizeof hdr);
+	hdr.msg_iov = &iov;
+	hdr.msg_iovlen = 1;
+	hdr.msg_control = control;
+	hdr.msg_controllen = CMSG_SPACE(sizeof(int) * ring->n_buffers);
+
+	cmsg = CMSG_FIRSTHDR(&hdr);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int) * ring->n_buffers);
+	fds = (int *)CMSG_DATA(cmsg);
+	for (i = 0; i < ring->n_buffers; i++)
+		fds[i] = ring->buffers[i]->fd;
+
+	do {
+		len = sendmsg(export->client_fd, &hdr, MSG_NOSIGNAL);
+	} while (len < 0 && errno == EINTR);
+
+	return len == sizeof msg ? 0 : -1;
+}
+
+/* Bring the consumer up to date, if it can take a frame */
+static void
+headless_export_send_frame(struct headless_export *export,
+			   const struct timespec *time)
+{
+	struct {
+		struct weston_output_export_frame frame;
+		struct weston_output_export_rect rects[WESTON_OUTPUT_EXPORT_MAX_RECTS];
+	} msg;
+	struct headless_buffer_ring *ring = &export->output->ring;
+	pixman_region32_t transformed;
+	pixman_box32_t *boxes;
+	size_t len;
+	ssize_t ret;
+	int i, n;
+
+	if (export->client_fd < 0 ||
+	    !pixman_region32_not_empty(&export->pending))
+		return;
+
+	if (ring->current == ring->scratch) {
+		export->behind = true;
+		export->frames_not_sent++;
+		return;
+	}
+
+	pixman_region32_init(&transformed);
+	headless_output_buffer_damage(export->output, &export->pending,
+				      &transformed);
+
+	boxes = pixman_region32_rectangles(&transformed, &n);
+	if (n > WESTON_OUTPUT_EXPORT_MAX_RECTS) {
+		boxes = pixman_region32_extents(&transformed);
+		n = 1;
+	}
+
+	memset(&msg.frame, 0, sizeof msg.frame);
+	msg.frame.type = WESTON_OUTPUT_EXPORT_FRAME;
+	for (i = 0; ring->buffers[i] != ring->current; i++)
+		;
+	msg.frame.buffer = i;
+	msg.frame.seq = ring->seq;
+	msg.frame.time = timespec_to_nsec(time);
+	msg.frame.n_rects = n;
+	for (i = 0; i < n; i++) {
+		msg.rects[i].x = boxes[i].x1;
+		msg.rects[i].y = boxes[i].y1;
+		msg.rects[i].width = boxes[i].x2 - boxes[i].x1;
+		msg.rects[i].height = boxes[i].y2 - boxes[i].y1;
+	}
+
+	pixman_region32_fini(&transformed);
+
+	len = sizeof msg.frame + n * sizeof msg.rects[0];
+	do {
+		ret = send(export->client_fd, &msg, len,
+			   MSG_NOSIGNAL | MSG_DONTWAIT);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret < 0 && errno == EAGAIN) {
+		/* Send it again when the consumer catches up. */
+		wl_event_source_fd_update(export->client_source,
+					  WL_EVENT_READABLE |
+					  WL_EVENT_WRITABLE);
+		export->behind = true;
+		export->frames_not_sent++;
+		return;
+	}
+
+	if (ret != (ssize_t)len) {
+		headless_export_disconnect(export);
+		return;
+	}
+
+	ring->current->held = true;
+	export->behind = false;
+	export->frames_sent++;
+	pixman_region32_clear(&export->pending);
+}
+
+static int
+headless_export_client_data(int fd, uint32_t mask, void *data)
+{
+	struct headless_export *export = data;
+	struct headless_buffer_ring *ring = &export->output->ring;
+	struct weston_output_export_release msg;
+	ssize_t len;
+
+	if (mask & WL_EVENT_WRITABLE)
+		wl_event_source_fd_update(export->client_source,
+					  WL_EVENT_READABLE);
+
+	if (mask & WL_EVENT_READABLE) {
+		while ((len = recv(fd, &msg, sizeof msg, MSG_DONTWAIT)) > 0) {
+			if (len != sizeof msg ||
+			    msg.type != WESTON_OUTPUT_EXPORT_RELEASE ||
+			    msg.buffer >= (uint32_t)ring->n_buffers) {
+				weston_log("Output export: invalid message "
+					   "from consumer\n");
+				headless_export_disconnect(export);
+				return 0;
+			}
+
+			ring->buffers[msg.buffer]->held = false;
+		}
+
+		if (len == 0 || errno != EAGAIN) {
+			headless_export_disconnect(export);
+			return 0;
+		}
+	} else if (mask & (WL_EVENT_HANGUP | WL_EVENT_ERROR)) {
+		headless_export_disconnect(export);
+		return 0;
+	}
+
+	/* A repaint, even with no damage, renders the frame the consumer
+	 * missed into a buffer it can take. */
+	if (export->behind)
+		weston_output_schedule_repaint(&export->output->base);
+
+	return 0;
+}
+
+static int
+headless_export_accept(int fd, uint32_t mask, void *data)
+{
+	struct headless_export *export = data;
+	struct wl_event_loop *loop;
+	int client_fd;
+
+	client_fd = accept4(fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+	if (client_fd < 0)
+		return 0;
+
+	if (export->client_fd >= 0) {
+		weston_log("Output export of %s already has a consumer\n",
+			   export->output->base.name);
+		close(client_fd);
+		return 0;
+	}
+
+	export->client_fd = client_fd;
+	if (headless_export_send_buffers(export) < 0) {
+		close(client_fd);
+		export->client_fd = -1;
+		return 0;
+	}
+
+	loop = wl_display_get_event_loop(
+			export->output->base.compositor->wl_display);
+	export->client_source =
+		wl_event_loop_add_fd(loop, client_fd, WL_EVENT_READABLE,
+				     headless_export_client_data, export);
+
+	export->frames_sent = 0;
+	export->frames_not_sent = 0;
+	pixman_region32_copy(&export->pending, &export->output->base.region);
+	export->behind = true;
+	weston_output_schedule_repaint(&export->output->base);
+
+	return 0;
+}
+
+static int
+headless_export_listen(struct headless_export *export)
+{
+	struct sockaddr_un addr;
+	struct stat st;
+	int fd;
+
+	memset(&addr, 0, sizeof addr);
+	addr.sun_family = AF_UNIX;
+	if (strlen(export->socket_path) >= sizeof addr.sun_path) {
+		weston_log("Output export socket path %s is too long\n",
+			   export->socket_path);
+		return -1;
+	}
+	strcpy(addr.sun_path, export->socket_path);
+
+	/* A socket left behind by a previous run */
+	if (lstat(export->socket_path, &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(export->socket_path);
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if (fd < 0)
+		return -1;
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof addr) < 0 ||
+	    listen(fd, 1) < 0) {
+		weston_log("Cannot listen on output export socket %s: %s\n",
+			   export->socket_path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/* The consumer is disconnected, so that the buffers can be freed. */
+static void
+headless_export_destroy(struct headless_export *export)
+{
+	headless_export_disconnect(export);
+
+	if (export->listen_source)
+		wl_event_source_remove(export->listen_source);
+	if (export->listen_fd >= 0) {
+		close(export->listen_fd);
+		unlink(export->socket_path);
+	}
+
+	pixman_region32_fini(&export->pending);
+	free(export);
+}
+
+static struct headless_export *
+headless_export_create(struct headless_output *output)
+{
+	struct weston_compositor *compositor = output->base.compositor;
+	struct headless_export *export;
+	struct wl_event_loop *loop;
+
+	export = zalloc(sizeof *export);
+	if (!export)
+		return NULL;
+
+	export->output = output;
+	export->socket_path = output->export_path;
+	export->listen_fd = -1;
+	export->client_fd = -1;
+	pixman_region32_init(&export->pending);
+
+	export->listen_fd = headless_export_listen(export);
+	if (export->listen_fd < 0)
+		goto err;
+
+	loop = wl_display_get_event_loop(compositor->wl_display);
+	export->listen_source =
+		wl_event_loop_add_fd(loop, export->listen_fd, WL_EVENT_READABLE,
+				     headless_export_accept, export);
+	if (!export->listen_source)
+		goto err;
+
+	return export;
+
+err:
+	weston_log("Cannot export output %s\n", output->base.name);
+	headless_export_destroy(export);
+	return NULL;
+}
+
+static void
+headless_export_end_frame(struct headless_export *export,
+			  pixman_region32_t *damage,
+			  const struct timespec *time)
+{
+	if (export->client_fd >= 0)
+		pixman_region32_union(&export->pending,
+				      &export->pending, damage);
+
+	headless_export_send_frame(export, time);
+}
+
+/* Hand the frame over to the plugin with everything that changed since
+ * the last frame it got. Frames in the scratch buffer are not handed
+ * over; their damage goes with the next one. */
+static void
+headless_virtual_output_end_frame(struct headless_output *output,
+				  pixman_region32_t *damage)
+{
+	struct headless_buffer *buffer = output->ring.current;
+	pixman_region32_t transformed;
+	int fd, ret;
+
+	pixman_region32_union(&output->unsent, &output->unsent, damage);
+
+	if (buffer == output->ring.scratch || !output->submit_frame)
+		goto finish;
+
+	fd = fcntl(buffer->fd, F_DUPFD_CLOEXEC, 0);
+	if (fd < 0)
+		goto finish;
+
+	pixman_region32_init(&transformed);
+	headless_output_buffer_damage(output, &output->unsent, &transformed);
+
+	buffer->held = true;
+	ret = output->submit_frame(&output->base, fd, buffer->stride,
+				   &transformed,
+				   (struct weston_headless_virtual_buffer *)buffer);
+	pixman_region32_fini(&transformed);
+
+	if (ret < 0) {
+		buffer->held = false;
+		close(fd);
+		goto finish;
+	}
+
+	pixman_region32_clear(&output->unsent);
+	return;
+
+finish:
+	headless_output_schedule_finish_frame(output);
 }
 
 static int
@@ -107,13 +841,34 @@ headless_output_repaint(struct weston_output *output_base,
 {
 	struct headless_output *output = to_headless_output(output_base);
 	struct weston_compositor *ec = output->base.compositor;
+	bool use_ring = output->is_virtual || output->export;
+	struct timespec now;
+
+	if (use_ring)
+		headless_buffer_ring_begin_frame(&output->ring, output);
 
 	ec->renderer->repaint_output(&output->base, damage);
 
 	pixman_region32_subtract(&ec->primary_plane.damage,
 				 &ec->primary_plane.damage, damage);
 
-	wl_event_source_timer_update(output->finish_frame_timer, 16);
+	if (use_ring)
+		headless_buffer_ring_end_frame(&output->ring, damage);
+
+	/* The plugin finishes the frames it is handed. */
+	if (output->is_virtual) {
+		headless_virtual_output_end_frame(output, damage);
+		return 0;
+	}
+
+	headless_output_schedule_finish_frame(output);
+
+	if (output->export) {
+		weston_compositor_read_presentation_clock(ec, &now);
+		headless_export_end_frame(output->export, damage,
+					  output->refresh_nsec ?
+					  &output->pending_vblank : &now);
+	}
 
 	return 0;
 }
@@ -128,8 +883,21 @@ headless_output_disable(struct weston_output *base)
 		return 0;
 
 	wl_event_source_remove(output->finish_frame_timer);
+	if (output->finish_frame_idle) {
+		wl_event_source_remove(output->finish_frame_idle);
+		output->finish_frame_idle = NULL;
+	}
 
-	if (b->use_pixman) {
+	if (output->is_virtual) {
+		pixman_renderer_output_destroy(&output->base);
+		headless_buffer_ring_fini(&output->ring);
+		pixman_region32_clear(&output->unsent);
+	} else if (output->export) {
+		pixman_renderer_output_destroy(&output->base);
+		headless_export_destroy(output->export);
+		output->export = NULL;
+		headless_buffer_ring_fini(&output->ring);
+	} else if (b->use_pixman) {
 		pixman_renderer_output_destroy(&output->base);
 		pixman_image_unref(output->image);
 		free(output->image_buf);
@@ -146,6 +914,8 @@ headless_output_destroy(struct weston_output *base)
 	headless_output_disable(&output->base);
 	weston_output_release(&output->base);
 
+	pixman_region32_fini(&output->unsent);
+	free(output->export_path);
 	free(output);
 }
 
@@ -160,7 +930,47 @@ headless_output_enable(struct weston_output *base)
 	output->finish_frame_timer =
 		wl_event_loop_add_timer(loop, finish_frame_handler, output);
 
-	if (b->use_pixman) {
+	/* Frames the plugin is not handed are finished at the mode rate. */
+	if (output->is_virtual)
+		output->refresh = output->base.current_mode->refresh;
+
+	if (output->refresh > 0)
+		output->refresh_nsec = millihz_to_nsec(output->refresh);
+	else
+		output->refresh_nsec = 0;
+	weston_compositor_read_presentation_clock(b->compositor,
+						  &output->vblank_base);
+	output->base.msc = 0;
+
+	if (output->is_virtual) {
+		if (headless_buffer_ring_init(&output->ring, output,
+					      "weston-virtual-output",
+					      HEADLESS_VIRTUAL_BUFFERS) < 0)
+			goto err_malloc;
+
+		/* The buffers are plain memory, render to them directly. */
+		if (pixman_renderer_output_create(&output->base, 0) < 0)
+			goto err_ring;
+
+		pixman_renderer_output_set_buffer(&output->base,
+						  output->ring.current->image);
+	} else if (b->use_pixman && output->export_path) {
+		if (headless_buffer_ring_init(&output->ring, output,
+					      "weston-output-export",
+					      output->export_buffers) < 0)
+			goto err_malloc;
+
+		output->export = headless_export_create(output);
+		if (!output->export)
+			goto err_ring;
+
+		/* The buffers are plain memory, render to them directly. */
+		if (pixman_renderer_output_create(&output->base, 0) < 0)
+			goto err_export;
+
+		pixman_renderer_output_set_buffer(&output->base,
+						  output->ring.current->image);
+	} else if (b->use_pixman) {
 		output->image_buf = malloc(output->base.current_mode->width *
 					   output->base.current_mode->height * 4);
 		if (!output->image_buf)
@@ -182,6 +992,12 @@ headless_output_enable(struct weston_output *base)
 
 	return 0;
 
+err_export:
+	headless_export_destroy(output->export);
+	output->export = NULL;
+err_ring:
+	headless_buffer_ring_fini(&output->ring);
+	goto err_malloc;
 err_renderer:
 	pixman_image_unref(output->image);
 	free(output->image_buf);
@@ -220,7 +1036,8 @@ headless_output_set_size(struct weston_output *base,
 		WL_OUTPUT_MODE_CURRENT | WL_OUTPUT_MODE_PREFERRED;
 	output->mode.width = output_width;
 	output->mode.height = output_height;
-	output->mode.refresh = 60000;
+	/* No refresh rate at all when unthrottled */
+	output->mode.refresh = MAX(output->refresh, 0);
 	wl_list_insert(&output->base.mode_list, &output->mode.link);
 
 	output->base.current_mode = &output->mode;
@@ -235,9 +1052,46 @@ headless_output_set_size(struct weston_output *base,
 	return 0;
 }
 
+static int
+headless_output_set_refresh(struct weston_output *base, int refresh)
+{
+	struct headless_output *output = to_headless_output(base);
+	struct headless_backend *b = to_headless_backend(base->compositor);
+
+	if (output->base.enabled ||
+	    (refresh < 0 && refresh != WESTON_HEADLESS_REFRESH_UNTHROTTLED))
+		return -1;
+
+	output->refresh = refresh ? refresh : b->refresh;
+	output->mode.refresh = MAX(output->refresh, 0);
+
+	return 0;
+}
+
+static int
+headless_output_set_export(struct weston_output *base,
+			   const char *socket_path, int n_buffers)
+{
+	struct headless_output *output = to_headless_output(base);
+	struct headless_backend *b = to_headless_backend(base->compositor);
+
+	if (output->base.enabled || !b->use_pixman ||
+	    n_buffers < 2 || n_buffers > HEADLESS_MAX_BUFFERS)
+		return -1;
+
+	free(output->export_path);
+	output->export_path = strdup(socket_path);
+	if (!output->export_path)
+		return -1;
+	output->export_buffers = n_buffers;
+
+	return 0;
+}
+
 static struct weston_output *
 headless_output_create(struct weston_compositor *compositor, const char *name)
 {
+	struct headless_backend *b = to_headless_backend(compositor);
 	struct headless_output *output;
 
 	/* name can't be NULL. */
@@ -249,6 +1103,9 @@ headless_output_create(struct weston_compositor *compositor, const char *name)
 
 	weston_output_init(&output->base, compositor, name);
 
+	output->refresh = b->refresh;
+	pixman_region32_init(&output->unsent);
+
 	output->base.destroy = headless_output_destroy;
 	output->base.disable = headless_output_disable;
 	output->base.enable = headless_output_enable;
@@ -259,6 +1116,64 @@ headless_output_create(struct weston_compositor *compositor, const char *name)
 	return &output->base;
 }
 
+static struct weston_output *
+headless_virtual_output_create(struct weston_compositor *compositor,
+			       char *name)
+{
+	struct headless_output *output;
+
+	output = zalloc(sizeof *output);
+	if (!output)
+		return NULL;
+
+	weston_output_init(&output->base, compositor, name);
+
+	output->is_virtual = true;
+	pixman_region32_init(&output->unsent);
+
+	output->base.destroy = headless_output_destroy;
+	output->base.disable = headless_output_disable;
+	output->base.enable = headless_output_enable;
+	output->base.attach_head = NULL;
+	output->base.start_repaint_loop = headless_output_start_repaint_loop;
+	output->base.repaint = headless_output_repaint;
+
+	weston_compositor_add_pending_output(&output->base, compositor);
+
+	return &output->base;
+}
+
+static void
+headless_virtual_output_set_submit_frame_cb(struct weston_output *base,
+					    weston_headless_submit_frame_cb cb)
+{
+	struct headless_output *output = to_headless_output(base);
+
+	output->submit_frame = cb;
+}
+
+static void
+headless_virtual_output_buffer_released(struct weston_headless_virtual_buffer *handle)
+{
+	struct headless_buffer *buffer = (struct headless_buffer *)handle;
+
+	if (!buffer->output) {
+		headless_buffer_destroy(buffer);
+		return;
+	}
+
+	buffer->held = false;
+}
+
+static void
+headless_virtual_output_finish_frame(struct weston_output *base,
+				     struct timespec *stamp,
+				     uint32_t presented_flags)
+{
+	base->msc++;
+	weston_output_finish_frame(base, stamp, presented_flags);
+}
+
 static int
 headless_head_create(struct weston_compositor *compositor,
 		     const char *name)
@@ -311,6 +1226,18 @@ static const struct weston_windowed_output_api api = {
 	headless_head_create,
 };
 
+static const struct weston_headless_output_api headless_api = {
+	headless_output_set_refresh,
+	headless_output_set_export,
+};
+
+static const struct weston_headless_virtual_output_api virtual_output_api = {
+	headless_virtual_output_create,
+	headless_virtual_output_set_submit_frame_cb,
+	headless_virtual_output_buffer_released,
+	headless_virtual_output_finish_frame,
+};
+
 static struct headless_backend *
 headless_backend_create(struct weston_compositor *compositor,
 			struct weston_headless_backend_config *config)
@@ -318,6 +1245,13 @@ headless_backend_create(struct weston_compositor *compositor,
 	struct headless_backend *b;
 	int ret;
 
+	if (config->refresh < 0 &&
+	    config->refresh != WESTON_HEADLESS_REFRESH_UNTHROTTLED) {
+		weston_log("Invalid headless refresh rate %d mHz\n",
+			   config->refresh);
+		return NULL;
+	}
+
 	b = zalloc(sizeof *b);
 	if (b == NULL)
 		return NULL;
@@ -332,6 +1266,7 @@ headless_backend_create(struct weston_compositor *compositor,
 	b->base.create_output = headless_output_create;
 
 	b->use_pixman = config->use_pixman;
+	b->refresh = config->refresh ? config->refresh : 60000;
 	if (b->use_pixman) {
 		pixman_renderer_init(compositor);
 	}
@@ -347,6 +1282,26 @@ headless_backend_create(struct weston_compositor *compositor,
 		goto err_input;
 	}
 
+	ret = weston_plugin_api_register(compositor,
+					 WESTON_HEADLESS_OUTPUT_API_NAME,
+					 &headless_api, sizeof(headless_api));
+	if (ret < 0) {
+		weston_log("Failed to register headless output API.\n");
+		goto err_input;
+	}
+
+	/* Virtual outputs are rendered into shared memory by pixman. */
+	if (b->use_pixman) {
+		ret = weston_plugin_api_register(compositor,
+					WESTON_HEADLESS_VIRTUAL_OUTPUT_API_NAME,
+					&virtual_output_api,
+					sizeof(virtual_output_api));
+		if (ret < 0) {
+			weston_log("Failed to register virtual output API.\n");
+			goto err_input;
+		}
+	}
+
 	return b;
 
 err_input:
@@ -34,15 +34,126 @@ extern "C" {
 
 #include "compositor.h"
 
-#define WESTON_HEADLESS_BACKEND_CONFIG_VERSION 2
+#define WESTON_HEADLESS_BACKEND_CONFIG_VERSION 3
+
+/** Refresh rate of an output that finishes each frame as soon as it has
+ * been rendered, for measuring throughput. */
+#define WESTON_HEADLESS_REFRESH_UNTHROTTLED -1
 
 struct weston_headless_backend_config {
 	struct weston_backend_config base;
 
 	/** Whether to use the pixman renderer instead of the OpenGL ES renderer. */
 	int use_pixman;
+
+	/** Refresh rate of new outputs in mHz, 0 for 60 Hz, or
+	 * WESTON_HEADLESS_REFRESH_UNTHROTTLED. */
+	int refresh;
+};
+
+#define WESTON_HEADLESS_OUTPUT_API_NAME "weston_headless_output_api_v1"
+
+struct weston_headless_output_api {
+	/** Set the refresh rate of an output before enabling it.
+	 *
+	 * \param output  An output of the headless backend.
+	 * \param refresh Refresh rate in mHz, 0 for the backend default, or
+	 *                WESTON_HEADLESS_REFRESH_UNTHROTTLED.
+	 *
+	 * Frames are presented on a virtual vblank of this rate, with exact
+	 * timestamps and a media stream counter.
+	 *
+	 * Returns 0 on success, -1 on failure.
+	 */
+	int (*set_refresh)(struct weston_output *output, int refresh);
+
+	/** Export the contents of an output, before enabling it.
+	 *
+	 * \param output      An output of the headless backend, which must
+	 *                    use the pixman renderer.
+	 * \param socket_path Path of the Unix socket to listen on.
+	 * \param n_buffers   Number of buffers in the ring, 2 to 8.
+	 *
+	 * The output is rendered straight into a ring of shared memory
+	 * buffers, handed to a consumer process with the damage of each
+	 * frame, following the protocol described in output-export.h.
+	 *
+	 * Returns 0 on success, -1 on failure.
+	 */
+	int (*set_export)(struct weston_output *output,
+			  const char *socket_path, int n_buffers);
 };
 
+static inline const struct weston_headless_output_api *
+weston_headless_output_get_api(struct weston_compositor *compositor)
+{
+	const void *api;
+	api = weston_plugin_api_get(compositor, WESTON_HEADLESS_OUTPUT_API_NAME,
+				    sizeof(struct weston_headless_output_api));
+
+	return (const struct weston_headless_output_api *)api;
+}
+
+#define WESTON_HEADLESS_VIRTUAL_OUTPUT_API_NAME "weston_headless_virtual_output_api_v1"
+
+/** A frame buffer of a virtual output, lent to the plugin. */
+struct weston_headless_virtual_buffer;
+
+/** Hand a frame over to the plugin.
+ *
+ * \param output The virtual output.
+ * \param fd     Shared memory file of the frame, in XRGB8888, owned by the
+ *               plugin on success.
+ * \param stride Stride of the frame in bytes.
+ * \param damage What changed since the previous frame handed over, in
+ *               buffer coordinates. It may be empty.
+ * \param buffer The buffer, to be passed to buffer_released() once the
+ *               plugin is done reading it.
+ *
+ * Returns 0 on success, then the plugin calls finish_frame() when the
+ * frame is presented. On failure, the frame is finished by the backend.
+ */
+typedef int (*weston_headless_submit_frame_cb)(struct weston_output *output,
+					       int fd, int stride,
+					       pixman_region32_t *damage,
+					       struct weston_headless_virtual_buffer *buffer);
+
+/** Virtual outputs of the headless backend, rendered by the pixman renderer
+ * into shared memory for a plugin, such as remoting, instead of a head. */
+struct weston_headless_virtual_output_api {
+	/** Create a virtual output. Its mode is set by the caller before it
+	 * is enabled, and it has no head until the caller attaches one.
+	 *
+	 * Returns the output, or NULL on failure.
+	 */
+	struct weston_output *(*create_output)(struct weston_compositor *c,
+					       char *name);
+
+	/** Set the callback that receives the frames of an output. */
+	void (*set_submit_frame_cb)(struct weston_output *output,
+				    weston_headless_submit_frame_cb cb);
+
+	/** Give a buffer back to the backend. It is not rendered to while
+	 * the plugin holds it. */
+	void (*buffer_released)(struct weston_headless_virtual_buffer *buffer);
+
+	/** Report the presentation of the last frame submitted. */
+	void (*finish_frame)(struct weston_output *output,
+			     struct timespec *stamp,
+			     uint32_t presented_flags);
+};
+
+static inline const struct weston_headless_virtual_output_api *
+weston_headless_virtual_output_get_api(struct weston_compositor *compositor)
+{
+	const void *api;
+	api = weston_plugin_api_get(compositor,
+				    WESTON_HEADLESS_VIRTUAL_OUTPUT_API_NAME,
+				    sizeof(struct weston_headless_virtual_output_api));
+
+	return (const struct weston_headless_virtual_output_api *)api;
+}
+
 #ifdef  __cplusplus
 }
 #endif
@@ -26,10 +26,16 @@
 #include "config.h"
 
 #include <assert.h>
+#include <inttypes.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 #include <linux/input.h>
 
 #if HAVE_FREERDP_VERSION_H
@@ -101,11 +107,18 @@
 #include "compositor.h"
 #include "compositor-rdp.h"
 #include "pixman-renderer.h"
+#include "weston-debug.h"
 
 #define MAX_FREERDP_FDS 32
 #define DEFAULT_AXIS_STEP_DISTANCE 10
 #define RDP_MODE_FREQ 60 * 1000
 
+/* Size of the tiles whose content is hashed to skip unchanged pixels */
+#define RDP_TILE_SIZE 64
+
+#define rdp_debug(b, ...) \
+	weston_debug_scope_printf((b)->debug, __VA_ARGS__)
+
 #if FREERDP_VERSION_MAJOR >= 2 && defined(PIXEL_FORMAT_BGRA32) && !defined(PIXEL_FORMAT_B8G8R8A8)
 	/* The RDP API is truly wonderful: the pixel format definition changed
 	 * from BGRA32 to B8G8R8A8, but some versions ship with a definition of
@@ -131,6 +144,8 @@ struct rdp_backend {
 	char *rdp_key;
 	int tls_enabled;
 	int no_clients_resize;
+
+	struct weston_debug_scope *debug;
 };
 
 enum peer_item_flags {
@@ -155,9 +170,62 @@ struct rdp_output {
 	struct wl_event_source *finish_frame_timer;
 	pixman_image_t *shadow_surface;
 
+	/* Hash of the content of each tile of the shadow surface, 0 when
+	 * it has changed since it was last computed */
+	uint64_t *tile_hash;
+	int tiles_x, tiles_y;
+
 	struct wl_list peers;
 };
 
+/* Frames a peer may have unacknowledged, if it does not say */
+#define RDP_MAX_UNACKED_FRAMES 2
+
+/* Number of RFX encoding jobs of a peer: one being encoded, and the next
+ * frame waiting for the encoder. */
+#define RDP_ENCODE_JOBS 2
+
+struct rdp_encode_job {
+	struct wl_list link;	/* rdp_encoder::free_jobs or done_jobs */
+	uint64_t generation;
+	pixman_region32_t damage;
+
+	/* Copy of the damage extents of the output */
+	uint32_t *data;
+	size_t size;
+	int stride;
+
+	wStream *stream;
+	RFX_RECT *rfx_rects;
+	uint64_t encode_nsec;
+};
+
+/* Encodes the RFX updates of a peer on a thread of its own, so that
+ * encoding is pipelined with the repaint of the next frame, and a slow
+ * peer does not hold up the compositor or the other peers. */
+struct rdp_encoder {
+	struct rdp_peer_context *context;
+	RFX_CONTEXT *rfx_context;
+
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int notify_fd;
+	struct wl_event_source *notify_source;
+
+	/* Protected by mutex */
+	bool destroying;
+	uint64_t generation;
+	bool reset;
+	int reset_width, reset_height;
+	struct rdp_encode_job *pending;
+	struct wl_list free_jobs;
+	struct wl_list done_jobs;
+	uint32_t frames_dropped;
+
+	struct rdp_encode_job jobs[RDP_ENCODE_JOBS];
+};
+
 struct rdp_peer_context {
 	rdpContext _p;
 
@@ -167,6 +235,29 @@ struct rdp_peer_context {
 	wStream *encode_stream;
 	RFX_RECT *rfx_rects;
 	NSC_CONTEXT *nsc_context;
+	struct rdp_encoder *encoder;
+
+	/* Hash of the content the peer was last sent for each tile, 0 when
+	 * unknown */
+	uint64_t *tile_sent;
+	int tiles_x, tiles_y;
+
+	/* Flow control: frames are sent while fewer than max_unacked of
+	 * them are waiting for an acknowledgement, damage is held back
+	 * in pending_damage otherwise. max_unacked is 0 for peers that do
+	 * not acknowledge frames. */
+	uint32_t frame_id;
+	uint32_t acked_frame_id;
+	uint32_t max_unacked;
+	pixman_region32_t pending_damage;
+	uint32_t frames_held;
+
+	/* Totals of what was encoded, and of what was skipped */
+	struct {
+		uint64_t pixels;
+		uint64_t bytes;
+		uint64_t nsec;
+	} encoded, skipped;
 
 	struct rdp_peers_item item;
 };
@@ -190,46 +281,109 @@ to_rdp_backend(struct weston_compositor *base)
 	return container_of(base->backend, struct rdp_backend, base);
 }
 
+static uint64_t
+region_area(pixman_region32_t *region)
+{
+	pixman_box32_t *rects;
+	uint64_t area = 0;
+	int nrects, i;
+
+	rects = pixman_region32_rectangles(region, &nrects);
+	for (i = 0; i < nrects; i++)
+		area += (uint64_t)(rects[i].x2 - rects[i].x1) *
+			(rects[i].y2 - rects[i].y1);
+
+	return area;
+}
+
+static uint64_t
+monotonic_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return timespec_to_nsec(&ts);
+}
+
 static void
-rdp_peer_refresh_rfx(pixman_region32_t *damage, pixman_image_t *image, freerdp_peer *peer)
+rdp_peer_account_encode(RdpPeerContext *context, uint64_t pixels,
+			uint64_t bytes, uint64_t nsec)
+{
+	context->encoded.pixels += pixels;
+	context->encoded.bytes += bytes;
+	context->encoded.nsec += nsec;
+}
+
+/* Frames are numbered so that peers acknowledging them can be sent
+ * updates only as fast as they consume them. */
+static void
+rdp_peer_begin_frame(freerdp_peer *peer, SURFACE_FRAME_MARKER *marker)
 {
-	int width, height, nrects, i;
-	pixman_box32_t *region, *rects;
-	uint32_t *ptr;
-	RFX_RECT *rfxRect;
-	rdpUpdate *update = peer->update;
-	SURFACE_BITS_COMMAND cmd;
 	RdpPeerContext *context = (RdpPeerContext *)peer->context;
 
-	Stream_Clear(context->encode_stream);
-	Stream_SetPosition(context->encode_stream, 0);
+	marker->frameId = ++context->frame_id;
+	marker->frameAction = SURFACECMD_FRAMEACTION_BEGIN;
+	peer->update->SurfaceFrameMarker(peer->context, marker);
+}
 
-	width = (damage->extents.x2 - damage->extents.x1);
-	height = (damage->extents.y2 - damage->extents.y1);
+static void
+rdp_peer_end_frame(freerdp_peer *peer, SURFACE_FRAME_MARKER *marker)
+{
+	marker->frameAction = SURFACECMD_FRAMEACTION_END;
+	peer->update->SurfaceFrameMarker(peer->context, marker);
+}
 
+static void
+rdp_peer_send_surface_bits(freerdp_peer *peer, const pixman_box32_t *extents,
+			   UINT32 codec_id, wStream *stream)
+{
+	rdpUpdate *update = peer->update;
+	SURFACE_BITS_COMMAND cmd;
+	SURFACE_FRAME_MARKER marker;
+
+	memset(&cmd, 0, sizeof(cmd));
 #ifdef HAVE_SKIP_COMPRESSION
 	cmd.skipCompression = TRUE;
-#else
-	memset(&cmd, 0, sizeof(*cmd));
 #endif
-	cmd.destLeft = damage->extents.x1;
-	cmd.destTop = damage->extents.y1;
-	cmd.destRight = damage->extents.x2;
-	cmd.destBottom = damage->extents.y2;
+	cmd.destLeft = extents->x1;
+	cmd.destTop = extents->y1;
+	cmd.destRight = extents->x2;
+	cmd.destBottom = extents->y2;
 	SURFACE_BPP(cmd) = 32;
-	SURFACE_CODECID(cmd) = peer->settings->RemoteFxCodecId;
-	SURFACE_WIDTH(cmd) = width;
-	SURFACE_HEIGHT(cmd) = height;
+	SURFACE_CODECID(cmd) = codec_id;
+	SURFACE_WIDTH(cmd) = extents->x2 - extents->x1;
+	SURFACE_HEIGHT(cmd) = extents->y2 - extents->y1;
+	SURFACE_BITMAP_DATA_LEN(cmd) = Stream_GetPosition(stream);
+	SURFACE_BITMAP_DATA(cmd) = Stream_Buffer(stream);
 
-	ptr = pixman_image_get_data(image) + damage->extents.x1 +
-				damage->extents.y1 * (pixman_image_get_stride(image) / sizeof(uint32_t));
+	rdp_peer_begin_frame(peer, &marker);
+	update->SurfaceBits(update->context, &cmd);
+	rdp_peer_end_frame(peer, &marker);
+}
+
+/* Encode the damage into stream. ptr points to the pixel at the top left
+ * corner of the damage extents. */
+static void
+rdp_encode_rfx(RFX_CONTEXT *rfx_context, wStream *stream, RFX_RECT **rfx_rects,
+	       pixman_region32_t *damage, uint32_t *ptr, int stride)
+{
+	int width, height, nrects, i;
+	pixman_box32_t *region, *rects;
+	RFX_RECT *rfxRect;
+
+	Stream_Clear(stream);
+	Stream_SetPosition(stream, 0);
+
+	width = (damage->extents.x2 - damage->extents.x1);
+	height = (damage->extents.y2 - damage->extents.y1);
 
 	rects = pixman_region32_rectangles(damage, &nrects);
-	context->rfx_rects = realloc(context->rfx_rects, nrects * sizeof *rfxRect);
+	*rfx_rects = realloc(*rfx_rects, nrects * sizeof *rfxRect);
 
 	for (i = 0; i < nrects; i++) {
 		region = &rects[i];
-		rfxRect = &context->rfx_rects[i];
+		rfxRect = &(*rfx_rects)[i];
 
 		rfxRect->x = (region->x1 - damage->extents.x1);
 		rfxRect->y = (region->y1 - damage->extents.y1);
@@ -237,15 +391,339 @@ rdp_peer_refresh_rfx(pixman_region32_t *damage, pixman_image_t *image, freerdp_p
 		rfxRect->height = (region->y2 - region->y1);
 	}
 
-	rfx_compose_message(context->rfx_context, context->encode_stream, context->rfx_rects, nrects,
-			(BYTE *)ptr, width, height,
-			pixman_image_get_stride(image)
-	);
+	rfx_compose_message(rfx_context, stream, *rfx_rects, nrects,
+			(BYTE *)ptr, width, height, stride);
+}
 
-	SURFACE_BITMAP_DATA_LEN(cmd) = Stream_GetPosition(context->encode_stream);
-	SURFACE_BITMAP_DATA(cmd) = Stream_Buffer(context->encode_stream);
+static void *
+rdp_encoder_thread(void *data)
+{
+	struct rdp_encoder *encoder = data;
+	struct rdp_encode_job *job;
+	uint64_t one = 1;
 
-	update->SurfaceBits(update->context, &cmd);
+	pthread_mutex_lock(&encoder->mutex);
+
+	while (!encoder->destroying) {
+		if (!encoder->pending) {
+			pthread_cond_wait(&encoder->cond, &encoder->mutex);
+			continue;
+		}
+
+		job = encoder->pending;
+		encoder->pending = NULL;
+
+		if (encoder->reset) {
+			RFX_RESET(encoder->rfx_context,
+				  encoder->reset_width, encoder->reset_height);
+			encoder->reset = false;
+		}
+
+		pthread_mutex_unlock(&encoder->mutex);
+
+		job->encode_nsec = monotonic_nsec();
+		rdp_encode_rfx(encoder->rfx_context, job->stream,
+			       &job->rfx_rects, &job->damage, job->data,
+			       job->stride);
+		job->encode_nsec = monotonic_nsec() - job->encode_nsec;
+
+		pthread_mutex_lock(&encoder->mutex);
+
+		wl_list_insert(encoder->done_jobs.prev, &job->link);
+		if (write(encoder->notify_fd, &one, sizeof one) < 0)
+			weston_log("failed to wake up the compositor: %m\n");
+	}
+
+	pthread_mutex_unlock(&encoder->mutex);
+
+	return NULL;
+}
+
+/* Send the encoded frames, in order. Called on the compositor thread. */
+static void
+rdp_encoder_flush(struct rdp_encoder *encoder)
+{
+	struct rdp_peers_item *item = &encoder->context->item;
+	struct rdp_encode_job *job, *tmp;
+	struct wl_list done;
+	uint64_t generation;
+
+	wl_list_init(&done);
+
+	pthread_mutex_lock(&encoder->mutex);
+	wl_list_insert_list(&done, &encoder->done_jobs);
+	wl_list_init(&encoder->done_jobs);
+	generation = encoder->generation;
+	pthread_mutex_unlock(&encoder->mutex);
+
+	wl_list_for_each(job, &done, link) {
+		/* Frames encoded before a reset are of no use anymore. */
+		if (job->generation != generation ||
+		    !(item->flags & RDP_PEER_OUTPUT_ENABLED))
+			continue;
+
+		rdp_peer_send_surface_bits(item->peer, &job->damage.extents,
+					   item->peer->settings->RemoteFxCodecId,
+					   job->stream);
+		rdp_peer_account_encode(encoder->context,
+					region_area(&job->damage),
+					Stream_GetPosition(job->stream),
+					job->encode_nsec);
+	}
+
+	pthread_mutex_lock(&encoder->mutex);
+	wl_list_for_each_safe(job, tmp, &done, link)
+		wl_list_insert(&encoder->free_jobs, &job->link);
+	pthread_mutex_unlock(&encoder->mutex);
+}
+
+static int
+rdp_encoder_notify(int fd, uint32_t mask, void *data)
+{
+	struct rdp_encoder *encoder = data;
+	uint64_t count;
+
+	if (read(fd, &count, sizeof count) != sizeof count)
+		return 0;
+
+	rdp_encoder_flush(encoder);
+
+	return 0;
+}
+
+/* Copy the damage extents of image into job, so that the output can be
+ * repainted while the job is encoded. */
+static int
+rdp_encode_job_copy(struct rdp_encode_job *job, pixman_image_t *image)
+{
+	pixman_box32_t *extents = &job->damage.extents;
+	int width = extents->x2 - extents->x1;
+	int height = extents->y2 - extents->y1;
+	int src_stride = pixman_image_get_stride(image);
+	const uint8_t *src;
+	uint8_t *dst;
+	size_t size;
+	void *data;
+	int y;
+
+	job->stride = width * 4;
+	size = (size_t)job->stride * height;
+	if (size > job->size) {
+		data = realloc(job->data, size);
+		if (!data)
+			return -1;
+		job->data = data;
+		job->size = size;
+	}
+
+	src = (const uint8_t *)pixman_image_get_data(image) +
+	      extents->y1 * src_stride + extents->x1 * 4;
+	dst = (uint8_t *)job->data;
+	for (y = 0; y < height; y++, src += src_stride, dst += job->stride)
+		memcpy(dst, src, job->stride);
+
+	return 0;
+}
+
+/* Queue the damage of a frame for encoding. If the previous frame is
+ * still waiting for the encoder, this one replaces it and both damages
+ * are encoded together, so that a slow encoder drops frames instead of
+ * falling behind. Returns -1 if the frame could not be queued, in which
+ * case the previous frame is dropped as well, and damage is set to what
+ * both of them covered. */
+static int
+rdp_encoder_queue(struct rdp_encoder *encoder, pixman_region32_t *damage,
+		  pixman_image_t *image)
+{
+	struct rdp_encode_job *job;
+	int ret;
+
+	/* Send what is ready first, which also frees its job. */
+	rdp_encoder_flush(encoder);
+
+	pthread_mutex_lock(&encoder->mutex);
+
+	job = encoder->pending;
+	if (job) {
+		pixman_region32_union(&job->damage, &job->damage, damage);
+		encoder->frames_dropped++;
+	} else {
+		/* At most one job is being encoded and none is done. */
+		assert(!wl_list_empty(&encoder->free_jobs));
+		job = container_of(encoder->free_jobs.next,
+				   struct rdp_encode_job, link);
+		wl_list_remove(&job->link);
+		pixman_region32_copy(&job->damage, damage);
+		job->generation = encoder->generation;
+	}
+
+	ret = rdp_encode_job_copy(job, image);
+	if (ret < 0) {
+		weston_log("failed to allocate an RFX encoding job\n");
+		pixman_region32_copy(damage, &job->damage);
+		encoder->pending = NULL;
+		wl_list_insert(&encoder->free_jobs, &job->link);
+	} else {
+		encoder->pending = job;
+		pthread_cond_signal(&encoder->cond);
+	}
+
+	pthread_mutex_unlock(&encoder->mutex);
+
+	return ret;
+}
+
+/* Forget the queued frames and reset the RFX context before the next one.
+ * The reset happens on the encoder thread, which owns the context. */
+static void
+rdp_encoder_reset(struct rdp_encoder *encoder, int width, int height)
+{
+	pthread_mutex_lock(&encoder->mutex);
+
+	encoder->generation++;
+	if (encoder->pending) {
+		wl_list_insert(&encoder->free_jobs, &encoder->pending->link);
+		encoder->pending = NULL;
+	}
+	encoder->reset = true;
+	encoder->reset_width = width;
+	encoder->reset_height = height;
+
+	pthread_mutex_unlock(&encoder->mutex);
+}
+
+static void
+rdp_encoder_destroy(struct rdp_encoder *encoder)
+{
+	struct rdp_encode_job *job;
+	int i;
+
+	if (!encoder)
+		return;
+
+	pthread_mutex_lock(&encoder->mutex);
+	encoder->destroying = true;
+	pthread_cond_signal(&encoder->cond);
+	pthread_mutex_unlock(&encoder->mutex);
+
+	pthread_join(encoder->thread, NULL);
+
+	if (encoder->frames_dropped)
+		weston_log("RDP peer %p: %u frames merged while encoding\n",
+			   encoder->context->item.peer,
+			   encoder->frames_dropped);
+
+	wl_event_source_remove(encoder->notify_source);
+	close(encoder->notify_fd);
+
+	for (i = 0; i < RDP_ENCODE_JOBS; i++) {
+		job = &encoder->jobs[i];
+		pixman_region32_fini(&job->damage);
+		Stream_Free(job->stream, TRUE);
+		free(job->rfx_rects);
+		free(job->data);
+	}
+
+	pthread_cond_destroy(&encoder->cond);
+	pthread_mutex_destroy(&encoder->mutex);
+	free(encoder);
+}
+
+/* Create the RFX encoding thread of a peer, which then owns the peer's
+ * RFX context. */
+static struct rdp_encoder *
+rdp_encoder_create(RdpPeerContext *context, struct wl_event_loop *loop)
+{
+	struct rdp_encoder *encoder;
+	struct rdp_encode_job *job;
+	sigset_t mask, old_mask;
+	int i, ret;
+
+	encoder = zalloc(sizeof *encoder);
+	if (!encoder)
+		return NULL;
+
+	encoder->context = context;
+	encoder->rfx_context = context->rfx_context;
+	wl_list_init(&encoder->free_jobs);
+	wl_list_init(&encoder->done_jobs);
+
+	for (i = 0; i < RDP_ENCODE_JOBS; i++) {
+		job = &encoder->jobs[i];
+		pixman_region32_init(&job->damage);
+		job->stream = Stream_New(NULL, 65536);
+		if (!job->stream)
+			goto err_jobs;
+		wl_list_insert(&encoder->free_jobs, &job->link);
+	}
+
+	encoder->notify_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (encoder->notify_fd < 0)
+		goto err_jobs;
+
+	encoder->notify_source =
+		wl_event_loop_add_fd(loop, encoder->notify_fd,
+				     WL_EVENT_READABLE,
+				     rdp_encoder_notify, encoder);
+	if (!encoder->notify_source)
+		goto err_fd;
+
+	pthread_mutex_init(&encoder->mutex, NULL);
+	pthread_cond_init(&encoder->cond, NULL);
+
+	/* Keep signals for the compositor thread. */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+	ret = pthread_create(&encoder->thread, NULL,
+			     rdp_encoder_thread, encoder);
+	pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+	if (ret != 0)
+		goto err_thread;
+
+	return encoder;
+
+err_thread:
+	pthread_cond_destroy(&encoder->cond);
+	pthread_mutex_destroy(&encoder->mutex);
+	wl_event_source_remove(encoder->notify_source);
+err_fd:
+	close(encoder->notify_fd);
+err_jobs:
+	for (i = 0; i < RDP_ENCODE_JOBS; i++) {
+		job = &encoder->jobs[i];
+		pixman_region32_fini(&job->damage);
+		if (job->stream)
+			Stream_Free(job->stream, TRUE);
+	}
+	free(encoder);
+	return NULL;
+}
+
+static int
+rdp_peer_refresh_rfx(pixman_region32_t *damage, pixman_image_t *image, freerdp_peer *peer)
+{
+	RdpPeerContext *context = (RdpPeerContext *)peer->context;
+	uint32_t *ptr;
+	uint64_t start;
+
+	if (context->encoder)
+		return rdp_encoder_queue(context->encoder, damage, image);
+
+	ptr = pixman_image_get_data(image) + damage->extents.x1 +
+				damage->extents.y1 * (pixman_image_get_stride(image) / sizeof(uint32_t));
+
+	start = monotonic_nsec();
+	rdp_encode_rfx(context->rfx_context, context->encode_stream,
+		       &context->rfx_rects, damage, ptr,
+		       pixman_image_get_stride(image));
+	rdp_peer_account_encode(context, region_area(damage),
+				Stream_GetPosition(context->encode_stream),
+				monotonic_nsec() - start);
+	rdp_peer_send_surface_bits(peer, &damage->extents,
+				   peer->settings->RemoteFxCodecId,
+				   context->encode_stream);
+
+	return 0;
 }
 
 
@@ -254,9 +732,8 @@ rdp_peer_refresh_nsc(pixman_region32_t *damage, pixman_image_t *image, freerdp_p
 {
 	int width, height;
 	uint32_t *ptr;
-	rdpUpdate *update = peer->update;
-	SURFACE_BITS_COMMAND cmd;
 	RdpPeerContext *context = (RdpPeerContext *)peer->context;
+	uint64_t start;
 
 	Stream_Clear(context->encode_stream);
 	Stream_SetPosition(context->encode_stream, 0);
@@ -264,32 +741,20 @@ rdp_peer_refresh_nsc(pixman_region32_t *damage, pixman_image_t *image, freerdp_p
 	width = (damage->extents.x2 - damage->extents.x1);
 	height = (damage->extents.y2 - damage->extents.y1);
 
-#ifdef HAVE_SKIP_COMPRESSION
-	cmd.skipCompression = TRUE;
-#else
-	memset(cmd, 0, sizeof(*cmd));
-#endif
-
-	cmd.destLeft = damage->extents.x1;
-	cmd.destTop = damage->extents.y1;
-	cmd.destRight = damage->extents.x2;
-	cmd.destBottom = damage->extents.y2;
-	SURFACE_BPP(cmd) = 32;
-	SURFACE_CODECID(cmd) = peer->settings->NSCodecId;
-	SURFACE_WIDTH(cmd) = width;
-	SURFACE_HEIGHT(cmd) = height;
-
 	ptr = pixman_image_get_data(image) + damage->extents.x1 +
 				damage->extents.y1 * (pixman_image_get_stride(image) / sizeof(uint32_t));
 
+	start = monotonic_nsec();
 	nsc_compose_message(context->nsc_context, context->encode_stream, (BYTE *)ptr,
 			width, height,
 			pixman_image_get_stride(image));
+	rdp_peer_account_encode(context, (uint64_t)width * height,
+				Stream_GetPosition(context->encode_stream),
+				monotonic_nsec() - start);
 
-	SURFACE_BITMAP_DATA_LEN(cmd) = Stream_GetPosition(context->encode_stream);
-	SURFACE_BITMAP_DATA(cmd) = Stream_Buffer(context->encode_stream);
-
-	update->SurfaceBits(update->context, &cmd);
+	rdp_peer_send_surface_bits(peer, &damage->extents,
+				   peer->settings->NSCodecId,
+				   context->encode_stream);
 }
 
 static void
@@ -315,14 +780,15 @@ rdp_peer_refresh_raw(pixman_region32_t *region, pixman_image_t *image, freerdp_p
 	pixman_box32_t *rect, subrect;
 	int nrects, i;
 	int heightIncrement, remainingHeight, top;
+	uint64_t start, area;
 
 	rect = pixman_region32_rectangles(region, &nrects);
 	if (!nrects)
 		return;
 
-	marker.frameId++;
-	marker.frameAction = SURFACECMD_FRAMEACTION_BEGIN;
-	update->SurfaceFrameMarker(peer->context, &marker);
+	start = monotonic_nsec();
+
+	rdp_peer_begin_frame(peer, &marker);
 
 	memset(&cmd, 0, sizeof(cmd));
 	SURFACE_BPP(cmd) = 32;
@@ -360,8 +826,240 @@ rdp_peer_refresh_raw(pixman_region32_t *region, pixman_image_t *image, freerdp_p
 		}
 	}
 
-	marker.frameAction = SURFACECMD_FRAMEACTION_END;
-	update->SurfaceFrameMarker(peer->context, &marker);
+	rdp_peer_end_frame(peer, &marker);
+
+	area = region_area(region);
+	rdp_peer_account_encode((RdpPeerContext *)peer->context, area, area * 4,
+				monotonic_nsec() - start);
+}
+
+#define RDP_HASH_PRIME1 0x9e3779b185ebca87ull
+#define RDP_HASH_PRIME2 0xc2b2ae3d27d4eb4full
+#define RDP_HASH_PRIME3 0x165667b19e3779f9ull
+
+static inline uint64_t
+rdp_hash_round(uint64_t hash, uint64_t v)
+{
+	hash += v * RDP_HASH_PRIME2;
+	hash = (hash << 31) | (hash >> 33);
+	return hash * RDP_HASH_PRIME1;
+}
+
+static uint64_t
+rdp_tile_hash(pixman_image_t *image, int tx, int ty)
+{
+	int stride = pixman_image_get_stride(image);
+	int x1 = tx * RDP_TILE_SIZE;
+	int y1 = ty * RDP_TILE_SIZE;
+	int x2 = MIN(x1 + RDP_TILE_SIZE, pixman_image_get_width(image));
+	int y2 = MIN(y1 + RDP_TILE_SIZE, pixman_image_get_height(image));
+	const uint8_t *row;
+	uint64_t hash = RDP_HASH_PRIME3;
+	uint64_t v;
+	int x, y;
+
+	/* Multiply and rotate each 64-bit word in, in the way of xxHash, so
+	 * that every bit of a word reaches the whole hash. The extra 32-bit
+	 * pixel of an odd width tile is folded in last. */
+	row = (const uint8_t *)pixman_image_get_data(image) +
+	      y1 * stride + x1 * 4;
+	for (y = y1; y < y2; y++, row += stride) {
+		for (x = 0; x + 2 <= x2 - x1; x += 2) {
+			memcpy(&v, row + x * 4, sizeof v);
+			hash = rdp_hash_round(hash, v);
+		}
+		if (x < x2 - x1) {
+			uint32_t p;
+
+			memcpy(&p, row + x * 4, sizeof p);
+			hash = rdp_hash_round(hash, p);
+		}
+	}
+
+	hash ^= hash >> 33;
+	hash *= RDP_HASH_PRIME2;
+	hash ^= hash >> 29;
+	hash *= RDP_HASH_PRIME3;
+	hash ^= hash >> 32;
+
+	/* 0 stands for an unknown hash */
+	return hash ? hash : 1;
+}
+
+static uint64_t
+rdp_output_get_tile_hash(struct rdp_output *output, int tx, int ty)
+{
+	uint64_t *hash = &output->tile_hash[ty * output->tiles_x + tx];
+
+	if (!*hash)
+		*hash = rdp_tile_hash(output->shadow_surface, tx, ty);
+
+	return *hash;
+}
+
+static int
+rdp_output_init_tiles(struct rdp_output *output, int width, int height)
+{
+	int tiles_x = (width + RDP_TILE_SIZE - 1) / RDP_TILE_SIZE;
+	int tiles_y = (height + RDP_TILE_SIZE - 1) / RDP_TILE_SIZE;
+	uint64_t *tile_hash;
+
+	tile_hash = calloc(tiles_x * tiles_y, sizeof *tile_hash);
+	if (!tile_hash)
+		return -1;
+
+	free(output->tile_hash);
+	output->tile_hash = tile_hash;
+	output->tiles_x = tiles_x;
+	output->tiles_y = tiles_y;
+
+	return 0;
+}
+
+/* Forget the hashes of the tiles touched by damage. They are computed
+ * again when a peer needs them. */
+static void
+rdp_output_invalidate_tiles(struct rdp_output *output, pixman_region32_t *damage)
+{
+	pixman_box32_t *rects;
+	int nrects, i, tx, ty;
+
+	rects = pixman_region32_rectangles(damage, &nrects);
+	for (i = 0; i < nrects; i++) {
+		for (ty = rects[i].y1 / RDP_TILE_SIZE;
+		     ty <= (rects[i].y2 - 1) / RDP_TILE_SIZE && ty < output->tiles_y;
+		     ty++) {
+			for (tx = rects[i].x1 / RDP_TILE_SIZE;
+			     tx <= (rects[i].x2 - 1) / RDP_TILE_SIZE && tx < output->tiles_x;
+			     tx++)
+				output->tile_hash[ty * output->tiles_x + tx] = 0;
+		}
+	}
+}
+
+/* Forget what the peer was sent, so that the next update of each tile is
+ * sent in full. */
+static void
+rdp_peer_reset_tiles(RdpPeerContext *context)
+{
+	free(context->tile_sent);
+	context->tile_sent = NULL;
+	context->tiles_x = 0;
+	context->tiles_y = 0;
+}
+
+/* Remove from region the tiles that already have the same content on the
+ * peer. */
+static void
+rdp_peer_skip_unchanged_tiles(RdpPeerContext *context,
+			      struct rdp_output *output,
+			      pixman_region32_t *region)
+{
+	struct rdp_backend *b = context->rdpBackend;
+	pixman_region32_t skipped;
+	pixman_box32_t *extents = pixman_region32_extents(region);
+	pixman_box32_t tile;
+	uint64_t hash, area;
+	int tx, ty, n_tiles = 0, n_skipped = 0;
+
+	if (context->tiles_x != output->tiles_x ||
+	    context->tiles_y != output->tiles_y) {
+		rdp_peer_reset_tiles(context);
+		context->tile_sent = calloc(output->tiles_x * output->tiles_y,
+					    sizeof *context->tile_sent);
+		if (!context->tile_sent)
+			return;
+		context->tiles_x = output->tiles_x;
+		context->tiles_y = output->tiles_y;
+	}
+
+	pixman_region32_init(&skipped);
+
+	for (ty = extents->y1 / RDP_TILE_SIZE;
+	     ty * RDP_TILE_SIZE < extents->y2 && ty < output->tiles_y; ty++) {
+		for (tx = extents->x1 / RDP_TILE_SIZE;
+		     tx * RDP_TILE_SIZE < extents->x2 && tx < output->tiles_x;
+		     tx++) {
+			tile.x1 = tx * RDP_TILE_SIZE;
+			tile.y1 = ty * RDP_TILE_SIZE;
+			tile.x2 = tile.x1 + RDP_TILE_SIZE;
+			tile.y2 = tile.y1 + RDP_TILE_SIZE;
+			if (pixman_region32_contains_rectangle(region, &tile) ==
+			    PIXMAN_REGION_OUT)
+				continue;
+
+			n_tiles++;
+			hash = rdp_output_get_tile_hash(output, tx, ty);
+			if (context->tile_sent[ty * output->tiles_x + tx] == hash) {
+				pixman_region32_union_rect(&skipped, &skipped,
+							   tile.x1, tile.y1,
+							   RDP_TILE_SIZE,
+							   RDP_TILE_SIZE);
+				n_skipped++;
+			}
+		}
+	}
+
+	if (n_skipped) {
+		pixman_region32_intersect(&skipped, &skipped, region);
+		pixman_region32_subtract(region, region, &skipped);
+
+		/* What skipping saved is estimated from what encoding the
+		 * same amount of pixels has cost on average. */
+		area = region_area(&skipped);
+		context->skipped.pixels += area;
+		if (context->encoded.pixels) {
+			context->skipped.bytes += (double)area *
+				context->encoded.bytes / context->encoded.pixels;
+			context->skipped.nsec += (double)area *
+				context->encoded.nsec / context->encoded.pixels;
+		}
+	}
+
+	if (weston_debug_scope_is_enabled(b->debug))
+		rdp_debug(b, "peer %p: %d of %d tiles unchanged; saved "
+			  "%" PRIu64 " pixels, ~%" PRIu64 " bytes, "
+			  "~%" PRIu64 " us so far (encoded %" PRIu64 " pixels, "
+			  "%" PRIu64 " bytes, %" PRIu64 " us)\n",
+			  context->item.peer, n_skipped, n_tiles,
+			  context->skipped.pixels, context->skipped.bytes,
+			  context->skipped.nsec / 1000,
+			  context->encoded.pixels, context->encoded.bytes,
+			  context->encoded.nsec / 1000);
+
+	pixman_region32_fini(&skipped);
+}
+
+/* Remember the content of the tiles touched by region as sent to the
+ * peer. */
+static void
+rdp_peer_mark_tiles_sent(RdpPeerContext *context, struct rdp_output *output,
+			 pixman_region32_t *region)
+{
+	pixman_box32_t *extents = pixman_region32_extents(region);
+	pixman_box32_t tile;
+	int tx, ty;
+
+	if (!context->tile_sent)
+		return;
+
+	for (ty = extents->y1 / RDP_TILE_SIZE;
+	     ty * RDP_TILE_SIZE < extents->y2 && ty < output->tiles_y; ty++) {
+		for (tx = extents->x1 / RDP_TILE_SIZE;
+		     tx * RDP_TILE_SIZE < extents->x2 && tx < output->tiles_x;
+		     tx++) {
+			tile.x1 = tx * RDP_TILE_SIZE;
+			tile.y1 = ty * RDP_TILE_SIZE;
+			tile.x2 = tile.x1 + RDP_TILE_SIZE;
+			tile.y2 = tile.y1 + RDP_TILE_SIZE;
+			if (pixman_region32_contains_rectangle(region, &tile) ==
+			    PIXMAN_REGION_OUT)
+				continue;
+
+			context->tile_sent[ty * output->tiles_x + tx] =
+				rdp_output_get_tile_hash(output, tx, ty);
+		}
+	}
 }
 
 static void
@@ -370,13 +1068,74 @@ rdp_peer_refresh_region(pixman_region32_t *region, freerdp_peer *peer)
 	RdpPeerContext *context = (RdpPeerContext *)peer->context;
 	struct rdp_output *output = context->rdpBackend->output;
 	rdpSettings *settings = peer->settings;
+	pixman_region32_t changed;
+	int ret = 0;
+
+	pixman_region32_init(&changed);
+	pixman_region32_copy(&changed, region);
+	rdp_peer_skip_unchanged_tiles(context, output, &changed);
+
+	if (pixman_region32_not_empty(&changed)) {
+		if (settings->RemoteFxCodec)
+			ret = rdp_peer_refresh_rfx(&changed, output->shadow_surface, peer);
+		else if (settings->NSCodec)
+			rdp_peer_refresh_nsc(&changed, output->shadow_surface, peer);
+		else
+			rdp_peer_refresh_raw(&changed, output->shadow_surface, peer);
+	}
 
-	if (settings->RemoteFxCodec)
-		rdp_peer_refresh_rfx(region, output->shadow_surface, peer);
-	else if (settings->NSCodec)
-		rdp_peer_refresh_nsc(region, output->shadow_surface, peer);
-	else
-		rdp_peer_refresh_raw(region, output->shadow_surface, peer);
+	/* A frame that could not be queued also took the frame it was
+	 * merged with along, whose tiles were already marked: forget
+	 * them all, and hold the damage of both back for the next update,
+	 * as for a lagging peer. */
+	if (ret < 0) {
+		rdp_peer_reset_tiles(context);
+		pixman_region32_union(&context->pending_damage,
+				      &context->pending_damage, &changed);
+	} else {
+		rdp_peer_mark_tiles_sent(context, output, &changed);
+	}
+
+	pixman_region32_fini(&changed);
+}
+
+static bool
+rdp_peer_can_send(RdpPeerContext *context)
+{
+	return context->max_unacked == 0 ||
+	       context->frame_id - context->acked_frame_id < context->max_unacked;
+}
+
+/* Send damage to a peer, or hold it back until the peer has caught up.
+ * A lagging peer then gets the damage of several frames in one update,
+ * at the rate it acknowledges them. */
+static void
+rdp_peer_update_region(pixman_region32_t *region, freerdp_peer *peer)
+{
+	RdpPeerContext *context = (RdpPeerContext *)peer->context;
+	struct rdp_backend *b = context->rdpBackend;
+	pixman_region32_t damage;
+
+	pixman_region32_union(&context->pending_damage,
+			      &context->pending_damage, region);
+
+	if (!rdp_peer_can_send(context)) {
+		context->frames_held++;
+		rdp_debug(b, "peer %p: %u frames unacknowledged, holding back "
+			  "damage (%u frames held so far)\n", peer,
+			  context->frame_id - context->acked_frame_id,
+			  context->frames_held);
+		return;
+	}
+
+	/* What fails to be sent goes back to pending_damage. */
+	pixman_region32_init(&damage);
+	pixman_region32_copy(&damage, &context->pending_damage);
+	pixman_region32_fini(&context->pending_damage);
+	pixman_region32_init(&context->pending_damage);
+
+	rdp_peer_refresh_region(&damage, peer);
+	pixman_region32_fini(&damage);
 }
 
 static void
@@ -398,13 +1157,14 @@ rdp_output_repaint(struct weston_output *output_base, pixman_region32_t *damage,
 
 	pixman_renderer_output_set_buffer(output_base, output->shadow_surface);
 	ec->renderer->repaint_output(&output->base, damage);
+	rdp_output_invalidate_tiles(output, damage);
 
 	if (pixman_region32_not_empty(damage)) {
 		wl_list_for_each(outputPeer, &output->peers, link) {
 			if ((outputPeer->flags & RDP_PEER_ACTIVATED) &&
 					(outputPeer->flags & RDP_PEER_OUTPUT_ENABLED))
 			{
-				rdp_peer_refresh_region(damage, outputPeer->peer);
+				rdp_peer_update_region(damage, outputPeer->peer);
 			}
 		}
 	}
@@ -488,6 +1248,12 @@ rdp_switch_mode(struct weston_output *output, struct weston_mode *target_mode)
 	pixman_image_unref(rdpOutput->shadow_surface);
 	rdpOutput->shadow_surface = new_shadow_buffer;
 
+	/* Tiles left out of a smaller grid are never skipped. */
+	if (rdp_output_init_tiles(rdpOutput, target_mode->width,
+				  target_mode->height) < 0)
+		memset(rdpOutput->tile_hash, 0, rdpOutput->tiles_x *
+		       rdpOutput->tiles_y * sizeof *rdpOutput->tile_hash);
+
 	wl_list_for_each(rdpPeer, &rdpOutput->peers, link) {
 		settings = rdpPeer->peer->settings;
 		if (settings->DesktopWidth == (UINT32)target_mode->width &&
@@ -565,8 +1331,16 @@ rdp_output_enable(struct weston_output *base)
 		return -1;
 	}
 
+	if (rdp_output_init_tiles(output, output->base.current_mode->width,
+				  output->base.current_mode->height) < 0) {
+		pixman_image_unref(output->shadow_surface);
+		return -1;
+	}
+
 	if (pixman_renderer_output_create(&output->base,
 					  PIXMAN_RENDERER_OUTPUT_USE_SHADOW) < 0) {
+		free(output->tile_hash);
+		output->tile_hash = NULL;
 		pixman_image_unref(output->shadow_surface);
 		return -1;
 	}
@@ -590,6 +1364,8 @@ rdp_output_disable(struct weston_output *base)
 
 	pixman_image_unref(output->shadow_surface);
 	pixman_renderer_output_destroy(&output->base);
+	free(output->tile_hash);
+	output->tile_hash = NULL;
 
 	wl_event_source_remove(output->finish_frame_timer);
 	b->output = NULL;
@@ -670,6 +1446,8 @@ rdp_destroy(struct weston_compositor *ec)
 
 	freerdp_listener_free(b->listener);
 
+	weston_debug_scope_destroy(b->debug);
+
 	free(b->server_cert);
 	free(b->server_key);
 	free(b->rdp_key);
@@ -721,6 +1499,7 @@ rdp_peer_context_new(freerdp_peer* client, RdpPeerContext* context)
 {
 	context->item.peer = client;
 	context->item.flags = RDP_PEER_OUTPUT_ENABLED;
+	pixman_region32_init(&context->pending_damage);
 
 #if FREERDP_VERSION_MAJOR == 1 && FREERDP_VERSION_MINOR == 1
 	context->rfx_context = rfx_context_new();
@@ -775,6 +1554,9 @@ rdp_peer_context_free(freerdp_peer* client, RdpPeerContext* context)
 		 * but it would crash on reconnect */
 	}
 
+	rdp_encoder_destroy(context->encoder);
+	rdp_peer_reset_tiles(context);
+	pixman_region32_fini(&context->pending_damage);
 	Stream_Free(context->encode_stream, TRUE);
 	nsc_context_free(context->nsc_context);
 	rfx_context_free(context->rfx_context);
@@ -1001,7 +1783,18 @@ xf_peer_activate(freerdp_peer* client)
 	}
 
 	weston_output = &output->base;
-	RFX_RESET(peerCtx->rfx_context, weston_output->width, weston_output->height);
+	rdp_peer_reset_tiles(peerCtx);
+
+	/* Frames sent before the (re)activation will not be acknowledged. */
+	peerCtx->acked_frame_id = peerCtx->frame_id;
+#ifdef HAVE_SURFACE_FRAME_ACKNOWLEDGE
+	peerCtx->max_unacked = settings->FrameAcknowledge;
+#endif
+	if (peerCtx->encoder)
+		rdp_encoder_reset(peerCtx->encoder,
+				  weston_output->width, weston_output->height);
+	else
+		RFX_RESET(peerCtx->rfx_context, weston_output->width, weston_output->height);
 	NSC_RESET(peerCtx->nsc_context, weston_output->width, weston_output->height);
 
 	if (peersItem->flags & RDP_PEER_ACTIVATED)
@@ -1066,7 +1859,7 @@ xf_peer_activate(freerdp_peer* client)
 	box.y2 = output->base.height;
 	pixman_region32_init_with_extents(&damage, &box);
 
-	rdp_peer_refresh_region(&damage, client);
+	rdp_peer_update_region(&damage, client);
 
 	pixman_region32_fini(&damage);
 
@@ -1177,7 +1970,9 @@ xf_input_synchronize_event(rdpInput *input, UINT32 flags)
 	box.y2 = output->base.height;
 	pixman_region32_init_with_extents(&damage, &box);
 
-	rdp_peer_refresh_region(&damage, client);
+	/* The peer asks for everything, not only what changed. */
+	rdp_peer_reset_tiles(peerCtx);
+	rdp_peer_update_region(&damage, client);
 
 	pixman_region32_fini(&damage);
 	FREERDP_CB_RETURN(TRUE);
@@ -1243,9 +2038,40 @@ xf_suppress_output(rdpContext *context, BYTE allow, const RECTANGLE_16 *area)
 	else
 		peerContext->item.flags &= (~RDP_PEER_OUTPUT_ENABLED);
 
+	/* Updates are not sent while suppressed. */
+	rdp_peer_reset_tiles(peerContext);
+
 	FREERDP_CB_RETURN(TRUE);
 }
 
+#ifdef HAVE_SURFACE_FRAME_ACKNOWLEDGE
+static BOOL
+xf_surface_frame_acknowledge(rdpContext *context, UINT32 frameId)
+{
+	RdpPeerContext *peerContext = (RdpPeerContext *)context;
+	freerdp_peer *client = context->peer;
+
+	/* Ignore acknowledgements of frames never sent. */
+	if (frameId - peerContext->acked_frame_id >
+	    peerContext->frame_id - peerContext->acked_frame_id)
+		return TRUE;
+
+	peerContext->acked_frame_id = frameId;
+
+	if (pixman_region32_not_empty(&peerContext->pending_damage) &&
+	    (peerContext->item.flags & RDP_PEER_ACTIVATED) &&
+	    (peerContext->item.flags & RDP_PEER_OUTPUT_ENABLED)) {
+		pixman_region32_t damage;
+
+		pixman_region32_init(&damage);
+		rdp_peer_update_region(&damage, client);
+		pixman_region32_fini(&damage);
+	}
+
+	return TRUE;
+}
+#endif
+
 static int
 rdp_peer_init(freerdp_peer *client, struct rdp_backend *b)
 {
@@ -1265,6 +2091,11 @@ rdp_peer_init(freerdp_peer *client, struct rdp_backend *b)
 	peerCtx = (RdpPeerContext *) client->context;
 	peerCtx->rdpBackend = b;
 
+	loop = wl_display_get_event_loop(b->compositor->wl_display);
+	peerCtx->encoder = rdp_encoder_create(peerCtx, loop);
+	if (!peerCtx->encoder)
+		weston_log("failed to start the RFX encoder, encoding on the compositor thread\n");
+
 	settings = client->settings;
 	/* configure security settings */
 	if (b->rdp_key)
@@ -1290,12 +2121,20 @@ rdp_peer_init(freerdp_peer *client, struct rdp_backend *b)
 	settings->NSCodec = TRUE;
 	settings->FrameMarkerCommandEnabled = TRUE;
 	settings->SurfaceFrameMarkerEnabled = TRUE;
+#ifdef HAVE_SURFACE_FRAME_ACKNOWLEDGE
+	/* Replaced by what the client supports, 0 if it does not
+	 * acknowledge frames at all. */
+	settings->FrameAcknowledge = RDP_MAX_UNACKED_FRAMES;
+#endif
 
 	client->Capabilities = xf_peer_capabilities;
 	client->PostConnect = xf_peer_post_connect;
 	client->Activate = xf_peer_activate;
 
 	client->update->SuppressOutput = (pSuppressOutput)xf_suppress_output;
+#ifdef HAVE_SURFACE_FRAME_ACKNOWLEDGE
+	client->update->SurfaceFrameAcknowledge = xf_surface_frame_acknowledge;
+#endif
 
 	input = client->input;
 	input->SynchronizeEvent = xf_input_synchronize_event;
@@ -1309,7 +2148,6 @@ rdp_peer_init(freerdp_peer *client, struct rdp_backend *b)
 		goto error_initialize;
 	}
 
-	loop = wl_display_get_event_loop(b->compositor->wl_display);
 	for (i = 0; i < rcount; i++) {
 		fd = (int)(long)(rfds[i]);
 
@@ -1363,6 +2201,10 @@ rdp_backend_create(struct weston_compositor *compositor,
 	b->rdp_key = config->rdp_key ? strdup(config->rdp_key) : NULL;
 	b->no_clients_resize = config->no_clients_resize;
 
+	b->debug = weston_compositor_add_debug_scope(compositor, "rdp-backend",
+						     "Debug messages from RDP backend\n",
+						     NULL, NULL);
+
 	compositor->backend = &b->base;
 
 	/* activate TLS only if certificate/key are available */
@@ -1428,6 +2270,7 @@ err_output:
 err_compositor:
 	weston_compositor_shutdown(compositor);
 err_free_strings:
+	weston_debug_scope_destroy(b->debug);
 	free(b->rdp_key);
 	free(b->server_cert);
 	free(b->server_key);
@@ -55,6 +55,7 @@
 #include "shared/cairo-util.h"
 #include "shared/timespec-util.h"
 #include "fullscreen-shell-unstable-v1-client-protocol.h"
+#include "linux-dmabuf-unstable-v1-client-protocol.h"
 #include "xdg-shell-client-protocol.h"
 #include "presentation-time-server-protocol.h"
 #include "linux-dmabuf.h"
@@ -70,10 +71,13 @@ struct wayland_backend {
 		struct wl_display *wl_display;
 		struct wl_registry *registry;
 		struct wl_compositor *compositor;
+		struct wl_subcompositor *subcompositor;
 		struct wl_shell *shell;
 		struct xdg_wm_base *wm_base;
 		struct zwp_fullscreen_shell_v1 *fshell;
 		struct wl_shm *shm;
+		struct zwp_linux_dmabuf_v1 *linux_dmabuf;
+		struct wl_array dmabuf_formats; /**< wayland_dmabuf_format */
 
 		struct wl_list output_list;
 
@@ -84,6 +88,7 @@ struct wayland_backend {
 	bool use_pixman;
 	bool sprawl_across_outputs;
 	bool fullscreen;
+	bool forward_subsurfaces;
 
 	struct theme *theme;
 	cairo_device_t *frame_device;
@@ -127,14 +132,60 @@ struct wayland_output {
 
 	struct {
 		struct wl_list buffers;
-		struct wl_list free_buffers;
+		struct wl_list free_buffers;	/**< most recently released first */
+		uint32_t generation;		/**< bumped on resize */
+		bool damage_all;		/**< on the next attach */
 	} shm;
 
+	/* See wayland_output_assign_planes() */
+	struct {
+		bool enabled;
+		struct weston_plane plane;
+		struct wl_surface *surface;
+		struct wl_subsurface *subsurface;
+		struct wl_surface *parent;	/**< of the sub-surface */
+		int32_t x, y;
+
+		struct weston_view *view;	/**< in this repaint */
+		struct wayland_forward_buffer *next;
+		pixman_region32_t damage;	/**< in buffer coords */
+
+		struct wayland_forward_buffer *attached;
+		struct weston_surface *copy_surface;
+		struct wl_list buffers;		/**< wayland_forward_buffer */
+	} forward;
+
 	struct weston_mode mode;
 
 	struct wl_callback *frame_cb;
 };
 
+struct wayland_dmabuf_format {
+	uint32_t format;
+	uint64_t modifier;
+};
+
+/* A client buffer as given to the parent: the same dmabuf, or a copy of
+ * a wl_shm buffer */
+struct wayland_forward_buffer {
+	struct wayland_output *output;	/**< NULL once orphaned */
+	struct wl_list link;
+	struct wl_buffer *proxy;
+	bool busy;			/**< until the parent releases it */
+
+	/* dmabuf: the client buffer, referenced while busy */
+	struct weston_buffer *buffer;
+	struct wl_listener buffer_destroy_listener;
+	struct weston_buffer_reference ref;
+
+	/* wl_shm copies */
+	void *data;
+	size_t size;
+	int32_t width, height, stride;
+	uint32_t format;
+	pixman_region32_t stale;	/**< not copied yet */
+};
+
 struct wayland_parent_output {
 	struct wayland_backend *backend;	/**< convenience */
 	struct wayland_head *head;
@@ -174,6 +225,8 @@ struct wayland_shm_buffer {
 	struct wl_buffer *buffer;
 	void *data;
 	size_t size;
+	int width, height, stride;
+	uint32_t generation;
 	pixman_region32_t damage;		/**< in global coords */
 	int frame_damaged;
 
@@ -215,6 +268,10 @@ struct wayland_input {
 	struct weston_pointer_axis_event vert, horiz;
 };
 
+/* Released buffers kept per output, so that a resize back and forth does
+ * not reallocate them. */
+#define WAYLAND_SHM_POOL_SIZE 3
+
 struct gl_renderer_interface *gl_renderer;
 
 static inline struct wayland_head *
@@ -255,9 +312,18 @@ static void
 buffer_release(void *data, struct wl_buffer *buffer)
 {
 	struct wayland_shm_buffer *sb = data;
+	struct wl_list *free_buffers;
 
 	if (sb->output) {
-		wl_list_insert(&sb->output->shm.free_buffers, &sb->free_link);
+		free_buffers = &sb->output->shm.free_buffers;
+		wl_list_insert(free_buffers, &sb->free_link);
+
+		/* Trim the least recently used */
+		if (wl_list_length(free_buffers) > WAYLAND_SHM_POOL_SIZE)
+			wayland_shm_buffer_destroy(
+				container_of(free_buffers->prev,
+					     struct wayland_shm_buffer,
+					     free_link));
 	} else {
 		wayland_shm_buffer_destroy(sb);
 	}
@@ -267,6 +333,26 @@ static const struct wl_buffer_listener buffer_listener = {
 	buffer_release
 };
 
+/* The interior of the buffer, where the renderer draws */
+static pixman_image_t *
+wayland_shm_buffer_create_image(struct wayland_shm_buffer *sb)
+{
+	struct wayland_output *output = sb->output;
+	int32_t fx, fy;
+
+	fx = 0;
+	fy = 0;
+	if (output->frame)
+		frame_interior(output->frame, &fx, &fy, 0, 0);
+
+	return pixman_image_create_bits(PIXMAN_a8r8g8b8,
+					output->base.current_mode->width,
+					output->base.current_mode->height,
+					(uint32_t *)((unsigned char *)sb->data +
+						     fy * sb->stride) + fx,
+					sb->stride);
+}
+
 static struct wayland_shm_buffer *
 wayland_output_get_shm_buffer(struct wayland_output *output)
 {
@@ -277,19 +363,9 @@ wayland_output_get_shm_buffer(struct wayland_output *output)
 
 	struct wl_shm_pool *pool;
 	int width, height, stride;
-	int32_t fx, fy;
 	int fd;
 	unsigned char *data;
 
-	if (!wl_list_empty(&output->shm.free_buffers)) {
-		sb = container_of(output->shm.free_buffers.next,
-				  struct wayland_shm_buffer, free_link);
-		wl_list_remove(&sb->free_link);
-		wl_list_init(&sb->free_link);
-
-		return sb;
-	}
-
 	if (output->frame) {
 		width = frame_width(output->frame);
 		height = frame_height(output->frame);
@@ -298,6 +374,26 @@ wayland_output_get_shm_buffer(struct wayland_output *output)
 		height = output->base.current_mode->height;
 	}
 
+	wl_list_for_each(sb, &output->shm.free_buffers, free_link) {
+		if (sb->width != width || sb->height != height)
+			continue;
+
+		wl_list_remove(&sb->free_link);
+		wl_list_init(&sb->free_link);
+
+		/* Pooled across a resize: nothing in it is valid, and the
+		 * frame may have moved the interior. */
+		if (sb->generation != output->shm.generation) {
+			sb->generation = output->shm.generation;
+			pixman_region32_copy(&sb->damage, &output->base.region);
+			sb->frame_damaged = 1;
+			pixman_image_unref(sb->pm_image);
+			sb->pm_image = wayland_shm_buffer_create_image(sb);
+		}
+
+		return sb;
+	}
+
 	stride = cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32, width);
 
 	fd = os_create_anonymous_file(height * stride);
@@ -331,6 +427,10 @@ wayland_output_get_shm_buffer(struct wayland_output *output)
 
 	sb->data = data;
 	sb->size = height * stride;
+	sb->width = width;
+	sb->height = height;
+	sb->stride = stride;
+	sb->generation = output->shm.generation;
 
 	pool = wl_shm_create_pool(shm, fd, sb->size);
 
@@ -347,15 +447,7 @@ wayland_output_get_shm_buffer(struct wayland_output *output)
 	sb->c_surface =
 		cairo_image_surface_create_for_data(data, CAIRO_FORMAT_ARGB32,
 						    width, height, stride);
-
-	fx = 0;
-	fy = 0;
-	if (output->frame)
-		frame_interior(output->frame, &fx, &fy, 0, 0);
-	sb->pm_image =
-		pixman_image_create_bits(PIXMAN_a8r8g8b8, width, height,
-					 (uint32_t *)(data + fy * stride) + fx,
-					 stride);
+	sb->pm_image = wayland_shm_buffer_create_image(sb);
 
 	return sb;
 }
@@ -501,6 +593,573 @@ wayland_output_start_repaint_loop(struct weston_output *output_base)
 	wl_display_flush(wb->parent.wl_display);
 }
 
+/* Sub-surface forwarding
+ *
+ * When enabled, the top-most view of an output that nothing covers, and
+ * that the parent can show as is, goes to a plane of its own: a
+ * sub-surface of the output's parent surface. A dmabuf is re-imported in
+ * the parent, which then scans out or samples the client's memory. The
+ * fds of a wl_shm buffer cannot be recovered, so its damage is copied to
+ * a parent shm buffer instead of being composited into the output.
+ */
+
+static void
+wayland_forward_buffer_destroy(struct wayland_forward_buffer *fb)
+{
+	if (fb->buffer)
+		wl_list_remove(&fb->buffer_destroy_listener.link);
+	weston_buffer_reference(&fb->ref, NULL);
+
+	if (fb->proxy)
+		wl_buffer_destroy(fb->proxy);
+	if (fb->data)
+		munmap(fb->data, fb->size);
+	pixman_region32_fini(&fb->stale);
+
+	wl_list_remove(&fb->link);
+	free(fb);
+}
+
+static void
+forward_buffer_release(void *data, struct wl_buffer *buffer)
+{
+	struct wayland_forward_buffer *fb = data;
+
+	fb->busy = false;
+	weston_buffer_reference(&fb->ref, NULL);
+
+	/* Orphaned when the output or the client buffer went away */
+	if (!fb->output || (!fb->data && !fb->buffer))
+		wayland_forward_buffer_destroy(fb);
+}
+
+static const struct wl_buffer_listener forward_buffer_listener = {
+	forward_buffer_release
+};
+
+static void
+forward_buffer_handle_buffer_destroy(struct wl_listener *listener,
+				     void *data)
+{
+	struct wayland_forward_buffer *fb =
+		container_of(listener, struct wayland_forward_buffer,
+			     buffer_destroy_listener);
+
+	wl_list_remove(&fb->buffer_destroy_listener.link);
+	fb->buffer = NULL;
+
+	if (!fb->busy)
+		wayland_forward_buffer_destroy(fb);
+}
+
+static struct wayland_forward_buffer *
+wayland_forward_buffer_create(struct wayland_output *output)
+{
+	struct wayland_forward_buffer *fb;
+
+	fb = zalloc(sizeof *fb);
+	if (!fb)
+		return NULL;
+
+	fb->output = output;
+	pixman_region32_init(&fb->stale);
+	wl_list_insert(&output->forward.buffers, &fb->link);
+
+	return fb;
+}
+
+static bool
+wayland_backend_parent_has_dmabuf_format(struct wayland_backend *b,
+					 uint32_t format, uint64_t modifier)
+{
+	struct wayland_dmabuf_format *f;
+
+	wl_array_for_each(f, &b->parent.dmabuf_formats) {
+		if (f->format != format)
+			continue;
+		if (f->modifier == modifier ||
+		    (f->modifier == DRM_FORMAT_MOD_INVALID &&
+		     modifier == DRM_FORMAT_MOD_LINEAR))
+			return true;
+	}
+
+	return false;
+}
+
+/* The parent's wl_buffer for a client dmabuf, kept while both exist */
+static struct wayland_forward_buffer *
+wayland_output_get_dmabuf_proxy(struct wayland_output *output,
+				struct weston_buffer *buffer,
+				struct linux_dmabuf_buffer *dmabuf)
+{
+	struct wayland_backend *b =
+		to_wayland_backend(output->base.compositor);
+	struct dmabuf_attributes *attr = &dmabuf->attributes;
+	struct zwp_linux_buffer_params_v1 *params;
+	struct wayland_forward_buffer *fb;
+	int i;
+
+	wl_list_for_each(fb, &output->forward.buffers, link)
+		if (fb->buffer == buffer)
+			return fb;
+
+	if (!wayland_backend_parent_has_dmabuf_format(b, attr->format,
+						      attr->modifier[0]))
+		return NULL;
+
+	fb = wayland_forward_buffer_create(output);
+	if (!fb)
+		return NULL;
+
+	params = zwp_linux_dmabuf_v1_create_params(b->parent.linux_dmabuf);
+	for (i = 0; i < attr->n_planes; i++)
+		zwp_linux_buffer_params_v1_add(params, attr->fd[i], i,
+					       attr->offset[i],
+					       attr->stride[i],
+					       attr->modifier[i] >> 32,
+					       attr->modifier[i] & 0xffffffff);
+	fb->proxy = zwp_linux_buffer_params_v1_create_immed(params,
+							    attr->width,
+							    attr->height,
+							    attr->format,
+							    attr->flags);
+	zwp_linux_buffer_params_v1_destroy(params);
+	wl_buffer_add_listener(fb->proxy, &forward_buffer_listener, fb);
+
+	fb->buffer = buffer;
+	fb->buffer_destroy_listener.notify =
+		forward_buffer_handle_buffer_destroy;
+	wl_signal_add(&buffer->destroy_signal, &fb->buffer_destroy_listener);
+
+	return fb;
+}
+
+/* A parent shm buffer holding a copy of the client buffer, brought up to
+ * date with the damage it missed. */
+static struct wayland_forward_buffer *
+wayland_output_get_shm_copy(struct wayland_output *output,
+			    struct weston_surface *surface,
+			    struct wl_shm_buffer *shm_buffer,
+			    pixman_region32_t *damage)
+{
+	struct wayland_backend *b =
+		to_wayland_backend(output->base.compositor);
+	struct wayland_forward_buffer *fb, *copy = NULL;
+	uint32_t format = wl_shm_buffer_get_format(shm_buffer);
+	int32_t width = wl_shm_buffer_get_width(shm_buffer);
+	int32_t height = wl_shm_buffer_get_height(shm_buffer);
+	int32_t src_stride = wl_shm_buffer_get_stride(shm_buffer);
+	struct wl_shm_pool *pool;
+	pixman_box32_t *rects;
+	uint8_t *src;
+	int fd, i, n, y;
+
+	/* The copies are of another surface. */
+	if (output->forward.copy_surface != surface) {
+		wl_list_for_each(fb, &output->forward.buffers, link)
+			if (fb->data)
+				pixman_region32_union_rect(&fb->stale,
+							   &fb->stale, 0, 0,
+							   fb->width,
+							   fb->height);
+		output->forward.copy_surface = surface;
+	}
+
+	/* Nothing new since the last copy */
+	if (output->forward.attached && output->forward.attached->data &&
+	    output->forward.attached->width == width &&
+	    output->forward.attached->height == height &&
+	    output->forward.attached->format == format &&
+	    !pixman_region32_not_empty(damage))
+		return output->forward.attached;
+
+	wl_list_for_each(fb, &output->forward.buffers, link) {
+		if (!fb->data)
+			continue;
+
+		if (fb->width != width || fb->height != height ||
+		    fb->format != format) {
+			/* A previous size, no longer of any use */
+			pixman_region32_clear(&fb->stale);
+			continue;
+		}
+
+		pixman_region32_union(&fb->stale, &fb->stale, damage);
+		if (!fb->busy && !copy)
+			copy = fb;
+	}
+
+	if (!copy) {
+		copy = wayland_forward_buffer_create(output);
+		if (!copy)
+			return NULL;
+
+		copy->width = width;
+		copy->height = height;
+		copy->stride = width * 4;
+		copy->format = format;
+		copy->size = (size_t)copy->stride * height;
+
+		fd = os_create_anonymous_file(copy->size);
+		if (fd < 0) {
+			wayland_forward_buffer_destroy(copy);
+			return NULL;
+		}
+
+		copy->data = mmap(NULL, copy->size, PROT_READ | PROT_WRITE,
+				  MAP_SHARED, fd, 0);
+		if (copy->data == MAP_FAILED) {
+			copy->data = NULL;
+			close(fd);
+			wayland_forward_buffer_destroy(copy);
+			return NULL;
+		}
+
+		pool = wl_shm_create_pool(b->parent.shm, fd, copy->size);
+		copy->proxy = wl_shm_pool_create_buffer(pool, 0, width, height,
+							copy->stride, format);
+		wl_buffer_add_listener(copy->proxy, &forward_buffer_listener,
+				       copy);
+		wl_shm_pool_destroy(pool);
+		close(fd);
+
+		pixman_region32_union_rect(&copy->stale, &copy->stale,
+					   0, 0, width, height);
+	}
+
+	rects = pixman_region32_rectangles(&copy->stale, &n);
+	wl_shm_buffer_begin_access(shm_buffer);
+	src = wl_shm_buffer_get_data(shm_buffer);
+	for (i = 0; i < n; i++) {
+		int32_t x1 = MAX(rects[i].x1, 0);
+		int32_t x2 = MIN(rects[i].x2, width);
+
+		if (x1 >= x2)
+			continue;
+
+		for (y = MAX(rects[i].y1, 0); y < MIN(rects[i].y2, height); y++)
+			memcpy((uint8_t *)copy->data + y * copy->stride + x1 * 4,
+			       src + y * src_stride + x1 * 4, (x2 - x1) * 4);
+	}
+	wl_shm_buffer_end_access(shm_buffer);
+	pixman_region32_clear(&copy->stale);
+
+	return copy;
+}
+
+/* Whether the view would show the same as a sub-surface: untransformed,
+ * opaque, and within the output. */
+static bool
+wayland_output_view_fits_subsurface(struct wayland_output *output,
+				    struct weston_view *ev)
+{
+	struct weston_buffer_viewport *vp = &ev->surface->buffer_viewport;
+	pixman_box32_t *box = pixman_region32_extents(&ev->transform.boundingbox);
+
+	/* Positions in the parent surface are output pixels. */
+	if (output->base.current_scale != 1 ||
+	    output->base.transform != WL_OUTPUT_TRANSFORM_NORMAL)
+		return false;
+
+	if (ev->transform.enabled || ev->alpha != 1.0f ||
+	    ev->geometry.x != (int32_t)ev->geometry.x ||
+	    ev->geometry.y != (int32_t)ev->geometry.y)
+		return false;
+
+	/* No scaling, cropping nor rotation of the buffer */
+	if (vp->buffer.transform != WL_OUTPUT_TRANSFORM_NORMAL ||
+	    vp->buffer.scale != 1 ||
+	    vp->buffer.src_width != wl_fixed_from_int(-1) ||
+	    vp->surface.width != -1)
+		return false;
+
+	if (pixman_region32_contains_rectangle(&output->base.region,
+					       box) != PIXMAN_REGION_IN ||
+	    pixman_region32_contains_rectangle(&ev->transform.opaque,
+					       box) != PIXMAN_REGION_IN)
+		return false;
+
+	return true;
+}
+
+/* Get the buffer of the view to the parent. The damage is in surface
+ * coordinates, which are those of the buffer here. */
+static struct wayland_forward_buffer *
+wayland_output_prepare_forward(struct wayland_output *output,
+			       struct weston_view *ev,
+			       pixman_region32_t *damage)
+{
+	struct wayland_backend *b =
+		to_wayland_backend(output->base.compositor);
+	struct weston_buffer *buffer = ev->surface->buffer_ref.buffer;
+	struct linux_dmabuf_buffer *dmabuf;
+	struct wl_shm_buffer *shm_buffer;
+	uint32_t format;
+
+	if (!buffer)
+		return NULL;
+
+	shm_buffer = wl_shm_buffer_get(buffer->resource);
+	if (shm_buffer) {
+		format = wl_shm_buffer_get_format(shm_buffer);
+		if (!b->parent.shm ||
+		    (format != WL_SHM_FORMAT_ARGB8888 &&
+		     format != WL_SHM_FORMAT_XRGB8888))
+			return NULL;
+
+		return wayland_output_get_shm_copy(output, ev->surface,
+						   shm_buffer, damage);
+	}
+
+	dmabuf = linux_dmabuf_buffer_get(buffer->resource);
+	if (dmabuf && b->parent.linux_dmabuf)
+		return wayland_output_get_dmabuf_proxy(output, buffer, dmabuf);
+
+	return NULL;
+}
+
+static bool
+region_intersects(pixman_region32_t *region, pixman_region32_t *other)
+{
+	pixman_region32_t tmp;
+	bool ret;
+
+	pixman_region32_init(&tmp);
+	pixman_region32_intersect(&tmp, region, other);
+	ret = pixman_region32_not_empty(&tmp);
+	pixman_region32_fini(&tmp);
+
+	return ret;
+}
+
+static void
+wayland_output_assign_planes(struct weston_output *output_base,
+			     void *repaint_data)
+{
+	struct wayland_output *output = to_wayland_output(output_base);
+	struct weston_compositor *ec = output_base->compositor;
+	pixman_region32_t *damage = &output->forward.damage;
+	struct wayland_forward_buffer *fb = NULL;
+	struct weston_view *ev;
+	pixman_region32_t above;
+	bool candidate;
+
+	output->forward.view = NULL;
+	output->forward.next = NULL;
+	pixman_region32_init(&above);
+
+	wl_list_for_each(ev, &ec->view_list, link) {
+		if (!(ev->output_mask & (1u << output_base->id)))
+			continue;
+
+		candidate = wayland_output_view_fits_subsurface(output, ev);
+
+		/* Hold on to client buffers that may be forwarded later. */
+		ev->surface->keep_buffer = candidate;
+
+		if (!output->forward.view && candidate &&
+		    !region_intersects(&above, &ev->transform.boundingbox)) {
+			/* What another output's repaint flushed to the
+			 * plane, and what is still pending */
+			pixman_region32_copy(damage,
+					     &output->forward.plane.damage);
+			pixman_region32_translate(damage, -ev->geometry.x,
+						  -ev->geometry.y);
+			pixman_region32_union(damage, damage,
+					      &ev->surface->damage);
+			pixman_region32_intersect_rect(damage, damage, 0, 0,
+						       ev->surface->width,
+						       ev->surface->height);
+
+			fb = wayland_output_prepare_forward(output, ev, damage);
+			if (fb) {
+				output->forward.view = ev;
+				output->forward.next = fb;
+			}
+		}
+
+		if (ev == output->forward.view) {
+			weston_view_move_to_plane(ev, &output->forward.plane);
+			ev->psf_flags = fb->data ? 0 :
+				WP_PRESENTATION_FEEDBACK_KIND_ZERO_COPY;
+		} else {
+			weston_view_move_to_plane(ev, &ec->primary_plane);
+			ev->psf_flags = 0;
+		}
+
+		/* Only a view that nothing overlaps can go on top. */
+		pixman_region32_union(&above, &above,
+				      &ev->transform.boundingbox);
+	}
+
+	if (!output->forward.view || !output->forward.next->data)
+		output->forward.copy_surface = NULL;
+
+	pixman_region32_fini(&above);
+}
+
+/* Update the sub-surface, before the output surface is committed. The
+ * sub-surface is synchronized, so that both show up together. */
+static void
+wayland_output_commit_forward(struct wayland_output *output)
+{
+	struct wayland_backend *b =
+		to_wayland_backend(output->base.compositor);
+	struct wayland_forward_buffer *fb = output->forward.next;
+	struct weston_view *ev = output->forward.view;
+	struct wl_surface *surface;
+	struct wl_region *region;
+	pixman_box32_t *rects;
+	int32_t x, y;
+	int i, n;
+
+	if (!output->forward.enabled)
+		return;
+
+	/* The damage is sent along below, if any. */
+	pixman_region32_clear(&output->forward.plane.damage);
+
+	if (!output->forward.view && !output->forward.attached)
+		return;
+
+	/* The output surface is new after a mode switch. */
+	if (output->forward.surface &&
+	    output->forward.parent != output->parent.surface) {
+		wl_subsurface_destroy(output->forward.subsurface);
+		wl_surface_destroy(output->forward.surface);
+		output->forward.surface = NULL;
+		output->forward.attached = NULL;
+	}
+
+	if (!output->forward.surface) {
+		if (!ev)
+			return;
+
+		surface = wl_compositor_create_surface(b->parent.compositor);
+		output->forward.surface = surface;
+		output->forward.parent = output->parent.surface;
+		output->forward.subsurface =
+			wl_subcompositor_get_subsurface(b->parent.subcompositor,
+							surface,
+							output->parent.surface);
+
+		/* Input goes to the output surface below. */
+		region = wl_compositor_create_region(b->parent.compositor);
+		wl_surface_set_input_region(surface, region);
+		wl_region_destroy(region);
+	}
+	surface = output->forward.surface;
+
+	if (!ev) {
+		wl_surface_attach(surface, NULL, 0, 0);
+		wl_surface_commit(surface);
+		output->forward.attached = NULL;
+		return;
+	}
+
+	x = ev->geometry.x - output->base.x;
+	y = ev->geometry.y - output->base.y;
+	if (output->frame) {
+		int32_t ix, iy;
+
+		frame_interior(output->frame, &ix, &iy, NULL, NULL);
+		x += ix;
+		y += iy;
+	}
+	if (x != output->forward.x || y != output->forward.y ||
+	    !output->forward.attached) {
+		wl_subsurface_set_position(output->forward.subsurface, x, y);
+		output->forward.x = x;
+		output->forward.y = y;
+	}
+
+	if (fb == output->forward.attached &&
+	    !pixman_region32_not_empty(&output->forward.damage)) {
+		wl_surface_commit(surface);
+		return;
+	}
+
+	wl_surface_attach(surface, fb->proxy, 0, 0);
+	if (fb != output->forward.attached) {
+		pixman_region32_fini(&output->forward.damage);
+		pixman_region32_init_rect(&output->forward.damage, 0, 0,
+					  ev->surface->width,
+					  ev->surface->height);
+	}
+	rects = pixman_region32_rectangles(&output->forward.damage, &n);
+	for (i = 0; i < n; i++) {
+		if (wl_surface_get_version(surface) >=
+		    WL_SURFACE_DAMAGE_BUFFER_SINCE_VERSION)
+			wl_surface_damage_buffer(surface, rects[i].x1,
+						 rects[i].y1,
+						 rects[i].x2 - rects[i].x1,
+						 rects[i].y2 - rects[i].y1);
+		else
+			wl_surface_damage(surface, rects[i].x1, rects[i].y1,
+					  rects[i].x2 - rects[i].x1,
+					  rects[i].y2 - rects[i].y1);
+	}
+	wl_surface_commit(surface);
+
+	/* The client buffer is ours until the parent releases the proxy. */
+	if (!fb->data)
+		weston_buffer_reference(&fb->ref, fb->buffer);
+	fb->busy = true;
+	output->forward.attached = fb;
+}
+
+static void
+wayland_output_init_forward(struct wayland_output *output)
+{
+	struct wayland_backend *b =
+		to_wayland_backend(output->base.compositor);
+
+	wl_list_init(&output->forward.buffers);
+	pixman_region32_init(&output->forward.damage);
+
+	if (!b->forward_subsurfaces || !b->parent.subcompositor)
+		return;
+
+	weston_plane_init(&output->forward.plane, b->compositor, 0, 0);
+	weston_compositor_stack_plane(b->compositor, &output->forward.plane,
+				      &b->compositor->primary_plane);
+	output->forward.enabled = true;
+	output->base.assign_planes = wayland_output_assign_planes;
+}
+
+static void
+wayland_output_fini_forward(struct wayland_output *output)
+{
+	struct wayland_forward_buffer *fb, *next;
+
+	wl_list_for_each_safe(fb, next, &output->forward.buffers, link) {
+		/* Those the parent holds go when it releases them. */
+		if (fb->busy) {
+			fb->output = NULL;
+			wl_list_remove(&fb->link);
+			wl_list_init(&fb->link);
+		} else {
+			wayland_forward_buffer_destroy(fb);
+		}
+	}
+
+	if (output->forward.surface) {
+		wl_subsurface_destroy(output->forward.subsurface);
+		wl_surface_destroy(output->forward.surface);
+		output->forward.surface = NULL;
+	}
+
+	if (output->forward.enabled) {
+		weston_plane_release(&output->forward.plane);
+		output->forward.enabled = false;
+	}
+
+	output->forward.attached = NULL;
+	output->forward.next = NULL;
+	output->forward.view = NULL;
+	pixman_region32_fini(&output->forward.damage);
+}
+
 #ifdef ENABLE_EGL
 static int
 wayland_output_repaint_gl(struct weston_output *output_base,
@@ -513,6 +1172,7 @@ wayland_output_repaint_gl(struct weston_output *output_base,
 	output->frame_cb = wl_surface_frame(output->parent.surface);
 	wl_callback_add_listener(output->frame_cb, &frame_listener, output);
 
+	wayland_output_commit_forward(output);
 	wayland_output_update_gl_border(output);
 
 	ec->renderer->repaint_output(&output->base, damage);
@@ -563,55 +1223,80 @@ wayland_output_update_shm_border(struct wayland_shm_buffer *buffer)
 	cairo_destroy(cr);
 }
 
+/* Attach the buffer, damaging what changed since the previous one: the
+ * output damage of this frame, and the border if it was redrawn. The
+ * buffer itself may have been more out of date, but that is only ours
+ * to repaint. */
 static void
-wayland_shm_buffer_attach(struct wayland_shm_buffer *sb)
+wayland_shm_buffer_attach(struct wayland_shm_buffer *sb,
+			  pixman_region32_t *output_damage,
+			  bool border_damaged)
 {
+	struct wayland_output *output = sb->output;
+	struct wl_surface *surface = output->parent.surface;
 	pixman_region32_t damage;
 	pixman_box32_t *rects;
 	int32_t ix, iy, iwidth, iheight, fwidth, fheight;
 	int i, n;
 
 	pixman_region32_init(&damage);
-	pixman_region32_copy(&damage, &sb->damage);
-	pixman_region32_translate(&damage, -sb->output->base.x,
-				  -sb->output->base.y);
-
-	weston_transformed_region(sb->output->base.width,
-				  sb->output->base.height,
-				  sb->output->base.transform,
-				  sb->output->base.current_scale,
-				  &damage, &damage);
-
-	if (sb->output->frame) {
-		frame_interior(sb->output->frame, &ix, &iy, &iwidth, &iheight);
-		fwidth = frame_width(sb->output->frame);
-		fheight = frame_height(sb->output->frame);
-
-		pixman_region32_translate(&damage, ix, iy);
-
-		if (sb->frame_damaged) {
-			pixman_region32_union_rect(&damage, &damage,
-						   0, 0, fwidth, iy);
-			pixman_region32_union_rect(&damage, &damage,
-						   0, iy, ix, iheight);
-			pixman_region32_union_rect(&damage, &damage,
-						   ix + iwidth, iy,
-						   fwidth - (ix + iwidth), iheight);
-			pixman_region32_union_rect(&damage, &damage,
-						   0, iy + iheight,
-						   fwidth, fheight - (iy + iheight));
+
+	if (output->shm.damage_all) {
+		pixman_region32_init_rect(&damage, 0, 0,
+					  sb->width, sb->height);
+		output->shm.damage_all = false;
+	} else {
+		pixman_region32_copy(&damage, output_damage);
+		pixman_region32_translate(&damage, -output->base.x,
+					  -output->base.y);
+
+		weston_transformed_region(output->base.width,
+					  output->base.height,
+					  output->base.transform,
+					  output->base.current_scale,
+					  &damage, &damage);
+
+		if (output->frame) {
+			frame_interior(output->frame,
+				       &ix, &iy, &iwidth, &iheight);
+			fwidth = frame_width(output->frame);
+			fheight = frame_height(output->frame);
+
+			pixman_region32_translate(&damage, ix, iy);
+
+			if (border_damaged) {
+				pixman_region32_union_rect(&damage, &damage,
+							   0, 0, fwidth, iy);
+				pixman_region32_union_rect(&damage, &damage,
+							   0, iy, ix, iheight);
+				pixman_region32_union_rect(&damage, &damage,
+							   ix + iwidth, iy,
+							   fwidth - (ix + iwidth),
+							   iheight);
+				pixman_region32_union_rect(&damage, &damage,
+							   0, iy + iheight,
+							   fwidth,
+							   fheight - (iy + iheight));
+			}
 		}
 	}
 
 	rects = pixman_region32_rectangles(&damage, &n);
-	wl_surface_attach(sb->output->parent.surface, sb->buffer, 0, 0);
-	for (i = 0; i < n; ++i)
-		wl_surface_damage(sb->output->parent.surface, rects[i].x1,
-				  rects[i].y1, rects[i].x2 - rects[i].x1,
-				  rects[i].y2 - rects[i].y1);
+	wl_surface_attach(surface, sb->buffer, 0, 0);
+	for (i = 0; i < n; ++i) {
+		if (wl_surface_get_version(surface) >=
+		    WL_SURFACE_DAMAGE_BUFFER_SINCE_VERSION)
+			wl_surface_damage_buffer(surface, rects[i].x1,
+						 rects[i].y1,
+						 rects[i].x2 - rects[i].x1,
+						 rects[i].y2 - rects[i].y1);
+		else
+			wl_surface_damage(surface, rects[i].x1, rects[i].y1,
+					  rects[i].x2 - rects[i].x1,
+					  rects[i].y2 - rects[i].y1);
+	}
 
-	if (sb->output->frame)
-		pixman_region32_fini(&damage);
+	pixman_region32_fini(&damage);
 }
 
 static int
@@ -623,23 +1308,32 @@ wayland_output_repaint_pixman(struct weston_output *output_base,
 	struct wayland_backend *b =
 		to_wayland_backend(output->base.compositor);
 	struct wayland_shm_buffer *sb;
+	bool border_damaged = false;
 
-	if (output->frame) {
-		if (frame_status(output->frame) & FRAME_STATUS_REPAINT)
-			wl_list_for_each(sb, &output->shm.buffers, link)
-				sb->frame_damaged = 1;
+	if (output->frame &&
+	    frame_status(output->frame) & FRAME_STATUS_REPAINT) {
+		wl_list_for_each(sb, &output->shm.buffers, link)
+			sb->frame_damaged = 1;
+		frame_status_clear(output->frame, FRAME_STATUS_REPAINT);
+		border_damaged = true;
 	}
 
 	wl_list_for_each(sb, &output->shm.buffers, link)
 		pixman_region32_union(&sb->damage, &sb->damage, damage);
 
 	sb = wayland_output_get_shm_buffer(output);
+	if (!sb)
+		return -1;
 
+	/* Only the new damage is rendered, the shadow copy brings the
+	 * rest of the buffer up to date. */
 	wayland_output_update_shm_border(sb);
 	pixman_renderer_output_set_buffer(output_base, sb->pm_image);
-	b->compositor->renderer->repaint_output(output_base, &sb->damage);
+	pixman_renderer_output_set_hw_extra_damage(output_base, &sb->damage);
+	b->compositor->renderer->repaint_output(output_base, damage);
 
-	wayland_shm_buffer_attach(sb);
+	wayland_shm_buffer_attach(sb, damage, border_damaged);
+	wayland_output_commit_forward(output);
 
 	output->frame_cb = wl_surface_frame(output->parent.surface);
 	wl_callback_add_listener(output->frame_cb, &frame_listener, output);
@@ -711,6 +1405,7 @@ wayland_output_disable(struct weston_output *base)
 	}
 
 	wayland_output_destroy_shm_buffers(output);
+	wayland_output_fini_forward(output);
 
 	wayland_backend_destroy_output_surface(output);
 
@@ -874,7 +1569,9 @@ wayland_output_resize_surface(struct wayland_output *output)
 	}
 #endif
 
-	wayland_output_destroy_shm_buffers(output);
+	/* Buffers of the old size are pooled, in case it comes back. */
+	output->shm.generation++;
+	output->shm.damage_all = true;
 }
 
 static int
@@ -1072,7 +1769,7 @@ wayland_output_switch_mode(struct weston_output *output_base,
 		wl_compositor_create_surface(b->parent.compositor);
 	wl_surface_set_user_data(output->parent.surface, output);
 
-	/* Blow the old buffers because we changed size/surfaces */
+	/* The old buffers do not fit the new size and surface */
 	wayland_output_resize_surface(output);
 
 	mode_status = wayland_output_fullscreen_shell_mode_feedback(output, mode);
@@ -1235,6 +1932,10 @@ wayland_output_enable(struct weston_output *base)
 
 	wl_list_init(&output->shm.buffers);
 	wl_list_init(&output->shm.free_buffers);
+	output->shm.damage_all = true;
+
+	output->base.assign_planes = NULL;
+	wayland_output_init_forward(output);
 
 	if (b->use_pixman) {
 		if (wayland_output_init_pixman_renderer(output) < 0)
@@ -1251,7 +1952,6 @@ wayland_output_enable(struct weston_output *base)
 	}
 
 	output->base.start_repaint_loop = wayland_output_start_repaint_loop;
-	output->base.assign_planes = NULL;
 	output->base.set_backlight = NULL;
 	output->base.set_dpms = NULL;
 	output->base.switch_mode = wayland_output_switch_mode;
@@ -1284,6 +1984,7 @@ wayland_output_enable(struct weston_output *base)
 	return 0;
 
 err_output:
+	wayland_output_fini_forward(output);
 	wayland_backend_destroy_output_surface(output);
 
 	return -1;
@@ -2537,6 +3238,43 @@ static const struct xdg_wm_base_listener xdg_shell_listener = {
 	xdg_shell_ping,
 };
 
+static void
+wayland_backend_add_dmabuf_format(struct wayland_backend *b,
+				  uint32_t format, uint64_t modifier)
+{
+	struct wayland_dmabuf_format *f;
+
+	f = wl_array_add(&b->parent.dmabuf_formats, sizeof *f);
+	if (!f)
+		return;
+
+	f->format = format;
+	f->modifier = modifier;
+}
+
+static void
+linux_dmabuf_format(void *data, struct zwp_linux_dmabuf_v1 *linux_dmabuf,
+		    uint32_t format)
+{
+	wayland_backend_add_dmabuf_format(data, format,
+					  DRM_FORMAT_MOD_INVALID);
+}
+
+static void
+linux_dmabuf_modifier(void *data, struct zwp_linux_dmabuf_v1 *linux_dmabuf,
+		      uint32_t format, uint32_t modifier_hi,
+		      uint32_t modifier_lo)
+{
+	wayland_backend_add_dmabuf_format(data, format,
+					  ((uint64_t)modifier_hi << 32) |
+					  modifier_lo);
+}
+
+static const struct zwp_linux_dmabuf_v1_listener linux_dmabuf_listener = {
+	linux_dmabuf_format,
+	linux_dmabuf_modifier,
+};
+
 static void
 registry_handle_global(void *data, struct wl_registry *registry, uint32_t name,
 		       const char *interface, uint32_t version)
@@ -2569,6 +3307,19 @@ registry_handle_global(void *data, struct wl_registry *registry, uint32_t name,
 	} else if (strcmp(interface, "wl_shm") == 0) {
 		b->parent.shm =
 			wl_registry_bind(registry, name, &wl_shm_interface, 1);
+	} else if (strcmp(interface, "wl_subcompositor") == 0) {
+		b->parent.subcompositor =
+			wl_registry_bind(registry, name,
+					 &wl_subcompositor_interface, 1);
+	} else if (strcmp(interface, "zwp_linux_dmabuf_v1") == 0 &&
+		   version >= 2) {
+		/* create_immed is needed, forwarding cannot wait. */
+		b->parent.linux_dmabuf =
+			wl_registry_bind(registry, name,
+					 &zwp_linux_dmabuf_v1_interface,
+					 MIN(version, 3));
+		zwp_linux_dmabuf_v1_add_listener(b->parent.linux_dmabuf,
+						 &linux_dmabuf_listener, b);
 	}
 }
 
@@ -2638,6 +3389,13 @@ wayland_destroy(struct weston_compositor *ec)
 	if (b->parent.fshell)
 		zwp_fullscreen_shell_v1_release(b->parent.fshell);
 
+	if (b->parent.subcompositor)
+		wl_subcompositor_destroy(b->parent.subcompositor);
+
+	if (b->parent.linux_dmabuf)
+		zwp_linux_dmabuf_v1_destroy(b->parent.linux_dmabuf);
+	wl_array_release(&b->parent.dmabuf_formats);
+
 	if (b->parent.compositor)
 		wl_compositor_destroy(b->parent.compositor);
 
@@ -2738,6 +3496,7 @@ wayland_backend_create(struct weston_compositor *compositor,
 
 	wl_list_init(&b->parent.output_list);
 	wl_list_init(&b->input_list);
+	wl_array_init(&b->parent.dmabuf_formats);
 	b->parent.registry = wl_display_get_registry(b->parent.wl_display);
 	wl_registry_add_listener(b->parent.registry, &registry_listener, b);
 	wl_display_roundtrip(b->parent.wl_display);
@@ -2750,6 +3509,7 @@ wayland_backend_create(struct weston_compositor *compositor,
 	b->use_pixman = true;
 #endif
 	b->fullscreen = new_config->fullscreen;
+	b->forward_subsurfaces = new_config->forward_subsurfaces;
 
 	if (!b->use_pixman) {
 		gl_renderer = weston_load_module("gl-renderer.so",
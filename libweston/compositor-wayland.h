@@ -34,7 +34,7 @@ extern "C" {
 
 #include <stdint.h>
 
-#define WESTON_WAYLAND_BACKEND_CONFIG_VERSION 2
+#define WESTON_WAYLAND_BACKEND_CONFIG_VERSION 3
 
 struct weston_wayland_backend_config {
 	struct weston_backend_config base;
@@ -44,6 +44,11 @@ struct weston_wayland_backend_config {
 	bool fullscreen;
 	char *cursor_theme;
 	int cursor_size;
+
+	/** Show the top-most view of an output, when opaque and not
+	 * transformed, as a sub-surface of the output in the parent
+	 * compositor instead of compositing it. */
+	bool forward_subsurfaces;
 };
 
 #ifdef  __cplusplus
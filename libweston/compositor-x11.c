@@ -88,6 +88,7 @@ struct x11_backend {
 	struct xkb_keymap	*xkb_keymap;
 	unsigned int		 has_xkb;
 	uint8_t			 xkb_event_base;
+	uint8_t			 shm_event_base;
 	int			 fullscreen;
 	int			 no_input;
 	int			 use_pixman;
@@ -123,6 +124,12 @@ struct x11_head {
 	struct weston_head	base;
 };
 
+struct x11_shm_buffer {
+	xcb_shm_seg_t		segment;
+	pixman_image_t	       *hw_surface;
+	void		       *buf;
+};
+
 struct x11_output {
 	struct weston_output	base;
 
@@ -132,10 +139,9 @@ struct x11_output {
 	struct wl_event_source *finish_frame_timer;
 
 	xcb_gc_t		gc;
-	xcb_shm_seg_t		segment;
-	pixman_image_t	       *hw_surface;
-	int			shm_id;
-	void		       *buf;
+	struct x11_shm_buffer	shm;
+	bool			frame_pending;
+	unsigned int		put_sequence;	/* of the last put */
 	uint8_t			depth;
 	float			scale;
 	bool			resize_pending;
@@ -428,58 +434,59 @@ x11_output_repaint_gl(struct weston_output *output_base,
 	return 0;
 }
 
+/* Damage with more rectangles is put as its bounding box. */
+#define X11_SHM_MAX_RECTS 32
+
 static void
-set_clip_for_output(struct weston_output *output_base, pixman_region32_t *region)
+x11_output_put_damage(struct x11_output *output, struct x11_shm_buffer *sb,
+		      pixman_region32_t *damage)
 {
-	struct x11_output *output = to_x11_output(output_base);
-	struct weston_compositor *ec = output->base.compositor;
-	struct x11_backend *b = to_x11_backend(ec);
-	pixman_region32_t transformed_region;
+	struct x11_backend *b = to_x11_backend(output->base.compositor);
+	struct weston_output *output_base = &output->base;
+	int width = pixman_image_get_width(sb->hw_surface);
+	int height = pixman_image_get_height(sb->hw_surface);
+	pixman_region32_t region;
 	pixman_box32_t *rects;
-	xcb_rectangle_t *output_rects;
 	xcb_void_cookie_t cookie;
 	int nrects, i;
-	xcb_generic_error_t *err;
 
-	pixman_region32_init(&transformed_region);
-	pixman_region32_copy(&transformed_region, region);
-	pixman_region32_translate(&transformed_region,
-				  -output_base->x, -output_base->y);
+	pixman_region32_init(&region);
+	pixman_region32_intersect(&region, damage, &output_base->region);
+	pixman_region32_translate(&region, -output_base->x, -output_base->y);
 	weston_transformed_region(output_base->width, output_base->height,
 				  output_base->transform,
 				  output_base->current_scale,
-				  &transformed_region, &transformed_region);
-
-	rects = pixman_region32_rectangles(&transformed_region, &nrects);
-	output_rects = calloc(nrects, sizeof(xcb_rectangle_t));
+				  &region, &region);
+	pixman_region32_intersect_rect(&region, &region, 0, 0, width, height);
 
-	if (output_rects == NULL) {
-		pixman_region32_fini(&transformed_region);
-		return;
+	rects = pixman_region32_rectangles(&region, &nrects);
+	if (nrects > X11_SHM_MAX_RECTS) {
+		rects = pixman_region32_extents(&region);
+		nrects = 1;
 	}
 
+	/* The puts are not checked, so that they do not cost a round trip
+	 * each. Only the last one asks for a completion event, which ends
+	 * the frame, or fails with an X error that ends it instead, see
+	 * x11_backend_handle_error(). */
 	for (i = 0; i < nrects; i++) {
-		output_rects[i].x = rects[i].x1;
-		output_rects[i].y = rects[i].y1;
-		output_rects[i].width = rects[i].x2 - rects[i].x1;
-		output_rects[i].height = rects[i].y2 - rects[i].y1;
+		cookie = xcb_shm_put_image(b->conn, output->window, output->gc,
+					   width, height,
+					   rects[i].x1, rects[i].y1,
+					   rects[i].x2 - rects[i].x1,
+					   rects[i].y2 - rects[i].y1,
+					   rects[i].x1, rects[i].y1,
+					   output->depth,
+					   XCB_IMAGE_FORMAT_Z_PIXMAP,
+					   i == nrects - 1, sb->segment, 0);
+		output->put_sequence = cookie.sequence;
 	}
 
-	pixman_region32_fini(&transformed_region);
+	output->frame_pending = nrects > 0;
 
-	cookie = xcb_set_clip_rectangles_checked(b->conn, XCB_CLIP_ORDERING_UNSORTED,
-					output->gc,
-					0, 0, nrects,
-					output_rects);
-	err = xcb_request_check(b->conn, cookie);
-	if (err != NULL) {
-		weston_log("Failed to set clip rects, err: %d\n", err->error_code);
-		free(err);
-	}
-	free(output_rects);
+	pixman_region32_fini(&region);
 }
 
-
 static int
 x11_output_repaint_shm(struct weston_output *output_base,
 		       pixman_region32_t *damage,
@@ -488,30 +495,23 @@ x11_output_repaint_shm(struct weston_output *output_base,
 	struct x11_output *output = to_x11_output(output_base);
 	struct weston_compositor *ec = output->base.compositor;
 	struct x11_backend *b = to_x11_backend(ec);
-	xcb_void_cookie_t cookie;
-	xcb_generic_error_t *err;
+	struct x11_shm_buffer *sb = &output->shm;
 
-	pixman_renderer_output_set_buffer(output_base, output->hw_surface);
+	/* The previous frame has completed, so the server is done reading
+	 * the segment. */
+	pixman_renderer_output_set_buffer(output_base, sb->hw_surface);
 	ec->renderer->repaint_output(output_base, damage);
 
 	pixman_region32_subtract(&ec->primary_plane.damage,
 				 &ec->primary_plane.damage, damage);
-	set_clip_for_output(output_base, damage);
-	cookie = xcb_shm_put_image_checked(b->conn, output->window, output->gc,
-					pixman_image_get_width(output->hw_surface),
-					pixman_image_get_height(output->hw_surface),
-					0, 0,
-					pixman_image_get_width(output->hw_surface),
-					pixman_image_get_height(output->hw_surface),
-					0, 0, output->depth, XCB_IMAGE_FORMAT_Z_PIXMAP,
-					0, output->segment, 0);
-	err = xcb_request_check(b->conn, cookie);
-	if (err != NULL) {
-		weston_log("Failed to put shm image, err: %d\n", err->error_code);
-		free(err);
-	}
 
-	wl_event_source_timer_update(output->finish_frame_timer, 10);
+	x11_output_put_damage(output, sb, damage);
+	xcb_flush(b->conn);
+
+	/* Nothing to put, so no completion event to wait for. */
+	if (!output->frame_pending)
+		wl_event_source_timer_update(output->finish_frame_timer, 10);
+
 	return 0;
 }
 
@@ -528,21 +528,30 @@ finish_frame_handler(void *data)
 }
 
 static void
-x11_output_deinit_shm(struct x11_backend *b, struct x11_output *output)
+x11_shm_buffer_fini(struct x11_backend *b, struct x11_shm_buffer *sb)
 {
 	xcb_void_cookie_t cookie;
 	xcb_generic_error_t *err;
-	xcb_free_gc(b->conn, output->gc);
 
-	pixman_image_unref(output->hw_surface);
-	output->hw_surface = NULL;
-	cookie = xcb_shm_detach_checked(b->conn, output->segment);
+	if (!sb->hw_surface)
+		return;
+
+	pixman_image_unref(sb->hw_surface);
+	sb->hw_surface = NULL;
+	cookie = xcb_shm_detach_checked(b->conn, sb->segment);
 	err = xcb_request_check(b->conn, cookie);
 	if (err) {
 		weston_log("xcb_shm_detach failed, error %d\n", err->error_code);
 		free(err);
 	}
-	shmdt(output->buf);
+	shmdt(sb->buf);
+}
+
+static void
+x11_output_deinit_shm(struct x11_backend *b, struct x11_output *output)
+{
+	xcb_free_gc(b->conn, output->gc);
+	x11_shm_buffer_fini(b, &output->shm);
 }
 
 static void
@@ -695,6 +704,48 @@ get_depth_of_visual(xcb_screen_t *screen,
 	return 0;
 }
 
+static int
+x11_shm_buffer_init(struct x11_backend *b, struct x11_shm_buffer *sb,
+		    pixman_format_code_t pixman_format,
+		    int width, int height, int bitsperpixel)
+{
+	xcb_void_cookie_t cookie;
+	xcb_generic_error_t *err;
+	int shm_id;
+
+	/* Create SHM segment and attach it */
+	shm_id = shmget(IPC_PRIVATE, width * height * (bitsperpixel / 8), IPC_CREAT | S_IRWXU);
+	if (shm_id == -1) {
+		weston_log("x11shm: failed to allocate SHM segment\n");
+		return -1;
+	}
+	sb->buf = shmat(shm_id, NULL, 0 /* read/write */);
+	if (-1 == (long)sb->buf) {
+		weston_log("x11shm: failed to attach SHM segment\n");
+		shmctl(shm_id, IPC_RMID, NULL);
+		return -1;
+	}
+	sb->segment = xcb_generate_id(b->conn);
+	cookie = xcb_shm_attach_checked(b->conn, sb->segment, shm_id, 1);
+	err = xcb_request_check(b->conn, cookie);
+	if (err) {
+		weston_log("x11shm: xcb_shm_attach error %d, op code %d, resource id %d\n",
+			   err->error_code, err->major_code, err->minor_code);
+		free(err);
+		shmdt(sb->buf);
+		shmctl(shm_id, IPC_RMID, NULL);
+		return -1;
+	}
+
+	shmctl(shm_id, IPC_RMID, NULL);
+
+	/* Now create pixman image */
+	sb->hw_surface = pixman_image_create_bits(pixman_format, width, height, sb->buf,
+		width * (bitsperpixel / 8));
+
+	return 0;
+}
+
 static int
 x11_output_init_shm(struct x11_backend *b, struct x11_output *output,
 	int width, int height)
@@ -702,8 +753,6 @@ x11_output_init_shm(struct x11_backend *b, struct x11_output *output,
 	xcb_visualtype_t *visual_type;
 	xcb_screen_t *screen;
 	xcb_format_iterator_t fmt;
-	xcb_void_cookie_t cookie;
-	xcb_generic_error_t *err;
 	const xcb_query_extension_reply_t *ext;
 	int bitsperpixel = 0;
 	pixman_format_code_t pixman_format;
@@ -716,6 +765,7 @@ x11_output_init_shm(struct x11_backend *b, struct x11_output *output,
 		errno = ENOENT;
 		return -1;
 	}
+	b->shm_event_base = ext->first_event;
 
 	screen = x11_compositor_get_default_screen(b);
 	visual_type = find_visual_by_id(screen, screen->root_visual);
@@ -762,32 +812,9 @@ x11_output_init_shm(struct x11_backend *b, struct x11_output *output,
 	}
 
 
-	/* Create SHM segment and attach it */
-	output->shm_id = shmget(IPC_PRIVATE, width * height * (bitsperpixel / 8), IPC_CREAT | S_IRWXU);
-	if (output->shm_id == -1) {
-		weston_log("x11shm: failed to allocate SHM segment\n");
-		return -1;
-	}
-	output->buf = shmat(output->shm_id, NULL, 0 /* read/write */);
-	if (-1 == (long)output->buf) {
-		weston_log("x11shm: failed to attach SHM segment\n");
-		return -1;
-	}
-	output->segment = xcb_generate_id(b->conn);
-	cookie = xcb_shm_attach_checked(b->conn, output->segment, output->shm_id, 1);
-	err = xcb_request_check(b->conn, cookie);
-	if (err) {
-		weston_log("x11shm: xcb_shm_attach error %d, op code %d, resource id %d\n",
-			   err->error_code, err->major_code, err->minor_code);
-		free(err);
+	if (x11_shm_buffer_init(b, &output->shm, pixman_format,
+				width, height, bitsperpixel) < 0)
 		return -1;
-	}
-
-	shmctl(output->shm_id, IPC_RMID, NULL);
-
-	/* Now create pixman image */
-	output->hw_surface = pixman_image_create_bits(pixman_format, width, height, output->buf,
-		width * (bitsperpixel / 8));
 
 	output->gc = xcb_generate_id(b->conn);
 	xcb_create_gc(b->conn, output->gc, output->window, 0, NULL);
@@ -1019,6 +1046,9 @@ x11_output_enable(struct weston_output *base)
 		x11_output_wait_for_map(b, output);
 
 	if (b->use_pixman) {
+		/* A resize keeps the frame in flight, whose completion
+		 * event finishes it. */
+		output->frame_pending = false;
 		if (x11_output_init_shm(b, output,
 					output->base.current_mode->width,
 					output->base.current_mode->height) < 0) {
@@ -1445,6 +1475,48 @@ x11_backend_next_event(struct x11_backend *b,
 	return *event != NULL;
 }
 
+static void
+x11_output_shm_completion(struct x11_backend *b,
+			  xcb_shm_completion_event_t *completion)
+{
+	struct x11_output *output;
+	struct timespec ts;
+
+	output = x11_backend_find_output(b, completion->drawable);
+	if (!output || !output->frame_pending)
+		return;
+
+	/* The X server is done reading the buffer; that is as close to
+	 * presentation as the core protocol lets us know. */
+	output->frame_pending = false;
+	weston_compositor_read_presentation_clock(output->base.compositor, &ts);
+	weston_output_finish_frame(&output->base, &ts, 0);
+}
+
+/* A failed request sends no reply or completion event, so a frame whose
+ * last put fails has to be finished here, or the output stalls. */
+static void
+x11_backend_handle_error(struct x11_backend *b, xcb_generic_error_t *error)
+{
+	struct x11_output *output;
+	struct timespec ts;
+
+	wl_list_for_each(output, &b->compositor->output_list, base.link) {
+		if (!output->frame_pending ||
+		    output->put_sequence != error->full_sequence)
+			continue;
+
+		weston_log("x11 backend: putting the frame of %s failed, "
+			   "X error %u\n", output->base.name,
+			   error->error_code);
+		output->frame_pending = false;
+		weston_compositor_read_presentation_clock(b->compositor, &ts);
+		weston_output_finish_frame(&output->base, &ts,
+					   WP_PRESENTATION_FEEDBACK_INVALID);
+		return;
+	}
+}
+
 static int
 x11_backend_handle_event(int fd, uint32_t mask, void *data)
 {
@@ -1655,6 +1727,13 @@ x11_backend_handle_event(int fd, uint32_t mask, void *data)
 			break;
 
 		default:
+			if (response_type == 0)
+				x11_backend_handle_error(b,
+					(xcb_generic_error_t *) event);
+			else if (b->shm_event_base &&
+				 response_type == b->shm_event_base + XCB_SHM_COMPLETION)
+				x11_output_shm_completion(b,
+					(xcb_shm_completion_event_t *) event);
 			break;
 		}
 
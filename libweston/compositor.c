@@ -33,6 +33,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <stdarg.h>
 #include <assert.h>
@@ -53,6 +54,7 @@
 #include <errno.h>
 
 #include "timeline.h"
+#include "latency.h"
 
 #include "compositor.h"
 #include "weston-debug.h"
@@ -67,9 +69,19 @@
 #include "version.h"
 #include "plugin-registry.h"
 #include "pixel-formats.h"
+#include "pick-grid.h"
 
 #define DEFAULT_REPAINT_WINDOW 7 /* milliseconds */
 
+/* The adaptive repaint window covers this percentile of the recent repaint
+ * durations plus a safety margin of a quarter of it, but at least
+ * ADAPTIVE_REPAINT_MARGIN. Windows below one millisecond are pointless as
+ * the repaint timer has millisecond resolution.
+ */
+#define ADAPTIVE_REPAINT_PERCENTILE 95
+#define ADAPTIVE_REPAINT_MARGIN 500000 /* nanoseconds */
+#define ADAPTIVE_REPAINT_MIN_WINDOW 1000000 /* nanoseconds */
+
 static void
 weston_output_update_matrix(struct weston_output *output);
 
@@ -1157,6 +1169,8 @@ weston_view_assign_output(struct weston_view *ev)
 	pixman_region32_fini(&region);
 
 	weston_view_set_output(ev, new_output);
+	if (ev->output_mask != mask)
+		ec->culled_views_dirty = true;
 	ev->output_mask = mask;
 
 	weston_surface_assign_output(ev->surface);
@@ -1332,6 +1346,32 @@ get_view_layer(struct weston_view *view)
 	return view->layer_link.layer;
 }
 
+/* Move the view to its new bounding box in the pick grid, so that a
+ * view moving every frame, such as the cursor, does not rebuild the whole
+ * grid. View list changes still do.
+ */
+static void
+weston_view_move_in_pick_grid(struct weston_view *view)
+{
+	struct weston_compositor *compositor = view->surface->compositor;
+	struct weston_pick_grid *grid = compositor->pick_grid;
+	pixman_box32_t *box;
+
+	if (!grid || compositor->pick_grid_dirty)
+		return;
+
+	if (view->pick_grid_index >= grid->n_entries ||
+	    grid->entries[view->pick_grid_index].data != view) {
+		compositor->pick_grid_dirty = true;
+		return;
+	}
+
+	box = pixman_region32_extents(&view->transform.boundingbox);
+	if (weston_pick_grid_move(grid, view->pick_grid_index,
+				  box->x1, box->y1, box->x2, box->y2) < 0)
+		compositor->pick_grid_dirty = true;
+}
+
 WL_EXPORT void
 weston_view_update_transform(struct weston_view *view)
 {
@@ -1388,6 +1428,8 @@ weston_view_update_transform(struct weston_view *view)
 
 	weston_view_assign_output(view);
 
+	weston_view_move_in_pick_grid(view);
+
 	wl_signal_emit(&view->surface->compositor->transform_signal,
 		       view->surface);
 }
@@ -1843,38 +1885,107 @@ weston_compositor_get_time(struct timespec *time)
 	clock_gettime(CLOCK_REALTIME, time);
 }
 
+static bool
+weston_view_accepts_input_at(struct weston_view *view,
+			     wl_fixed_t x, wl_fixed_t y,
+			     wl_fixed_t *vx, wl_fixed_t *vy)
+{
+	wl_fixed_t view_x, view_y;
+	int view_ix, view_iy;
+	int ix = wl_fixed_to_int(x);
+	int iy = wl_fixed_to_int(y);
+
+	if (!pixman_region32_contains_point(&view->transform.boundingbox,
+					    ix, iy, NULL))
+		return false;
+
+	weston_view_from_global_fixed(view, x, y, &view_x, &view_y);
+	view_ix = wl_fixed_to_int(view_x);
+	view_iy = wl_fixed_to_int(view_y);
+
+	if (!pixman_region32_contains_point(&view->surface->input,
+					    view_ix, view_iy, NULL))
+		return false;
+
+	if (view->geometry.scissor_enabled &&
+	    !pixman_region32_contains_point(&view->geometry.scissor,
+					    view_ix, view_iy, NULL))
+		return false;
+
+	*vx = view_x;
+	*vy = view_y;
+	return true;
+}
+
+/* Re-index the view bounding boxes if the view list changed since the
+ * last pick. Returns false if the grid
+ * cannot be used, in which case picking falls back to walking the
+ * view list.
+ */
+static bool
+weston_compositor_update_pick_grid(struct weston_compositor *compositor)
+{
+	struct weston_pick_grid *grid = compositor->pick_grid;
+	struct weston_view *view;
+	pixman_box32_t *box;
+
+	if (!grid)
+		return false;
+
+	if (!compositor->pick_grid_dirty)
+		return true;
+
+	weston_pick_grid_clear(grid);
+
+	wl_list_for_each(view, &compositor->view_list, link) {
+		box = pixman_region32_extents(&view->transform.boundingbox);
+		view->pick_grid_index = grid->n_entries;
+		if (weston_pick_grid_add(grid, box->x1, box->y1,
+					 box->x2, box->y2, view) < 0)
+			return false;
+	}
+
+	if (weston_pick_grid_build(grid) < 0)
+		return false;
+
+	compositor->pick_grid_dirty = false;
+	return true;
+}
+
 WL_EXPORT struct weston_view *
 weston_compositor_pick_view(struct weston_compositor *compositor,
 			    wl_fixed_t x, wl_fixed_t y,
 			    wl_fixed_t *vx, wl_fixed_t *vy)
 {
 	struct weston_view *view;
-	wl_fixed_t view_x, view_y;
-	int view_ix, view_iy;
+	const uint32_t *candidates;
+	uint32_t count, i;
 	int ix = wl_fixed_to_int(x);
 	int iy = wl_fixed_to_int(y);
 
-	wl_list_for_each(view, &compositor->view_list, link) {
-		if (!pixman_region32_contains_point(
-				&view->transform.boundingbox, ix, iy, NULL))
-			continue;
+	if (weston_compositor_update_pick_grid(compositor)) {
+		struct weston_pick_grid *grid = compositor->pick_grid;
 
-		weston_view_from_global_fixed(view, x, y, &view_x, &view_y);
-		view_ix = wl_fixed_to_int(view_x);
-		view_iy = wl_fixed_to_int(view_y);
-
-		if (!pixman_region32_contains_point(&view->surface->input,
-						    view_ix, view_iy, NULL))
-			continue;
+		/* Candidates come in view_list order, so the first view
+		 * accepting the point is the top-most one, same as below.
+		 */
+		candidates = weston_pick_grid_lookup(grid, ix, iy, &count);
+		for (i = 0; i < count; i++) {
+			struct weston_pick_grid_entry *entry =
+				&grid->entries[candidates[i]];
 
-		if (view->geometry.scissor_enabled &&
-		    !pixman_region32_contains_point(&view->geometry.scissor,
-						    view_ix, view_iy, NULL))
-			continue;
+			if (!weston_pick_grid_entry_contains(entry, ix, iy))
+				continue;
 
-		*vx = view_x;
-		*vy = view_y;
-		return view;
+			view = entry->data;
+			if (weston_view_accepts_input_at(view, x, y, vx, vy))
+				return view;
+		}
+	} else {
+		wl_list_for_each(view, &compositor->view_list, link) {
+			if (weston_view_accepts_input_at(view, x, y, vx, vy))
+				return view;
+		}
 	}
 
 	*vx = wl_fixed_from_int(-1000000);
@@ -1910,6 +2021,7 @@ weston_view_unmap(struct weston_view *view)
 	wl_list_remove(&view->link);
 	wl_list_init(&view->link);
 	view->output_mask = 0;
+	weston_compositor_view_list_dirty(view->surface->compositor);
 	weston_surface_assign_output(view->surface);
 
 	if (weston_surface_is_mapped(view->surface))
@@ -1939,6 +2051,10 @@ weston_surface_unmap(struct weston_surface *surface)
 	wl_list_for_each(view, &surface->views, surface_link)
 		weston_view_unmap(view);
 	surface->output = NULL;
+
+	/* A response of the unmapped surface is never presented. */
+	surface->latency_input_time = (struct timespec) { 0 };
+	surface->latency_commit_time = (struct timespec) { 0 };
 }
 
 static void
@@ -1965,6 +2081,8 @@ weston_view_destroy(struct weston_view *view)
 
 	wl_list_remove(&view->link);
 	weston_layer_entry_remove(&view->layer_link);
+	view->surface->compositor->pick_grid_dirty = true;
+	view->surface->compositor->culled_views_dirty = true;
 
 	pixman_region32_fini(&view->clip);
 	pixman_region32_fini(&view->geometry.scissor);
@@ -2011,6 +2129,7 @@ weston_surface_destroy(struct weston_surface *surface)
 		wl_resource_destroy(cb->resource);
 
 	weston_presentation_feedback_discard_list(&surface->feedback_list);
+	weston_surface_latency_release(surface);
 
 	wl_list_for_each_safe(constraint, next_constraint,
 			      &surface->pointer_constraints,
@@ -2161,9 +2280,12 @@ surface_flush_damage(struct weston_surface *surface)
 	pixman_region32_clear(&surface->damage);
 }
 
+/* Add the surface damage of a view to the damage of its plane, minus the
+ * opaque region above it, if any.
+ */
 static void
-view_accumulate_damage(struct weston_view *view,
-		       pixman_region32_t *opaque)
+view_damage_plane(struct weston_view *view,
+		  pixman_region32_t *opaque)
 {
 	pixman_region32_t damage;
 
@@ -2181,14 +2303,39 @@ view_accumulate_damage(struct weston_view *view,
 
 	pixman_region32_intersect(&damage, &damage,
 				  &view->transform.boundingbox);
-	pixman_region32_subtract(&damage, &damage, opaque);
+	if (opaque)
+		pixman_region32_subtract(&damage, &damage, opaque);
 	pixman_region32_union(&view->plane->damage,
 			      &view->plane->damage, &damage);
 	pixman_region32_fini(&damage);
+}
+
+static void
+view_accumulate_damage(struct weston_view *view,
+		       pixman_region32_t *opaque)
+{
+	view_damage_plane(view, opaque);
 	pixman_region32_copy(&view->clip, opaque);
 	pixman_region32_union(opaque, opaque, &view->transform.opaque);
 }
 
+static void
+surface_flush_damage_and_release(struct weston_surface *surface)
+{
+	surface_flush_damage(surface);
+
+	/* Both the renderer and the backend have seen the buffer
+	 * by now. If renderer needs the buffer, it has its own
+	 * reference set. If the backend wants to keep the buffer
+	 * around for migrating the surface into a non-primary plane
+	 * later, keep_buffer is true. Otherwise, drop the core
+	 * reference now, and allow early buffer release. This enables
+	 * clients to use single-buffering.
+	 */
+	if (!surface->keep_buffer)
+		weston_buffer_reference(&surface->buffer_ref, NULL);
+}
+
 static void
 compositor_accumulate_damage(struct weston_compositor *ec)
 {
@@ -2224,19 +2371,135 @@ compositor_accumulate_damage(struct weston_compositor *ec)
 			continue;
 		ev->surface->touched = true;
 
-		surface_flush_damage(ev->surface);
+		surface_flush_damage_and_release(ev->surface);
+	}
+}
 
-		/* Both the renderer and the backend have seen the buffer
-		 * by now. If renderer needs the buffer, it has its own
-		 * reference set. If the backend wants to keep the buffer
-		 * around for migrating the surface into a non-primary plane
-		 * later, keep_buffer is true. Otherwise, drop the core
-		 * reference now, and allow early buffer release. This enables
-		 * clients to use single-buffering.
-		 */
-		if (!ev->surface->keep_buffer)
-			weston_buffer_reference(&ev->surface->buffer_ref, NULL);
+/* Sort the views of view_list into the culled view arrays of the outputs
+ * they overlap, keeping the stacking order. Views on no output at all go
+ * to the compositor's unassigned_views, so their damage still gets flushed
+ * and their buffers released on repaint.
+ */
+static bool
+weston_compositor_update_culled_views(struct weston_compositor *ec)
+{
+	struct weston_output *output;
+	struct weston_view *view, **p;
+
+	if (!ec->culled_views_dirty)
+		return true;
+
+	wl_list_for_each(output, &ec->output_list, link)
+		output->culled_views.size = 0;
+	ec->unassigned_views.size = 0;
+
+	wl_list_for_each(view, &ec->view_list, link) {
+		if (view->output_mask == 0) {
+			p = wl_array_add(&ec->unassigned_views, sizeof *p);
+			if (!p)
+				return false;
+			*p = view;
+			continue;
+		}
+
+		wl_list_for_each(output, &ec->output_list, link) {
+			if (!(view->output_mask & (1u << output->id)))
+				continue;
+
+			p = wl_array_add(&output->culled_views, sizeof *p);
+			if (!p)
+				return false;
+			*p = view;
+		}
+	}
+
+	ec->culled_views_dirty = false;
+	return true;
+}
+
+/* A surface may have views on other outputs too. Its damage is flushed
+ * only once, so make sure those views' planes have seen it first.
+ */
+static void
+surface_damage_unculled_views(struct weston_surface *surface,
+			      uint32_t output_bit)
+{
+	struct weston_view *view;
+
+	if (surface->views.next == surface->views.prev)
+		return;
+
+	wl_list_for_each(view, &surface->views, surface_link) {
+		if (!weston_view_is_mapped(view) || !view->plane)
+			continue;
+		if (view->output_mask & output_bit)
+			continue;
+
+		view_damage_plane(view, NULL);
+	}
+}
+
+static void
+output_flush_culled_views(struct weston_view **views, size_t n_views,
+			  uint32_t output_bit)
+{
+	size_t i;
+
+	for (i = 0; i < n_views; i++) {
+		struct weston_surface *surface = views[i]->surface;
+
+		if (surface->touched)
+			continue;
+		surface->touched = true;
+
+		surface_damage_unculled_views(surface, output_bit);
+		surface_flush_damage_and_release(surface);
+	}
+}
+
+/* Like compositor_accumulate_damage(), but only for the views overlapping
+ * the given output, as sorted by weston_compositor_update_culled_views().
+ */
+static void
+output_accumulate_damage(struct weston_output *output)
+{
+	struct weston_compositor *ec = output->compositor;
+	struct weston_view **views = output->culled_views.data;
+	size_t n_views = output->culled_views.size / sizeof *views;
+	struct weston_view **unassigned = ec->unassigned_views.data;
+	size_t n_unassigned = ec->unassigned_views.size / sizeof *unassigned;
+	uint32_t output_bit = 1u << output->id;
+	struct weston_plane *plane;
+	pixman_region32_t opaque, clip;
+	size_t i;
+
+	pixman_region32_init(&clip);
+
+	wl_list_for_each(plane, &ec->plane_list, link) {
+		pixman_region32_copy(&plane->clip, &clip);
+
+		pixman_region32_init(&opaque);
+
+		for (i = 0; i < n_views; i++) {
+			if (views[i]->plane != plane)
+				continue;
+
+			view_accumulate_damage(views[i], &opaque);
+		}
+
+		pixman_region32_union(&clip, &clip, &opaque);
+		pixman_region32_fini(&opaque);
 	}
+
+	pixman_region32_fini(&clip);
+
+	for (i = 0; i < n_views; i++)
+		views[i]->surface->touched = false;
+	for (i = 0; i < n_unassigned; i++)
+		unassigned[i]->surface->touched = false;
+
+	output_flush_culled_views(views, n_views, output_bit);
+	output_flush_culled_views(unassigned, n_unassigned, output_bit);
 }
 
 static void
@@ -2354,6 +2617,8 @@ weston_compositor_build_view_list(struct weston_compositor *compositor)
 	struct weston_view *view;
 	struct weston_layer *layer;
 
+	compositor->view_list_rebuild_count++;
+
 	wl_list_for_each(layer, &compositor->layer_list, link)
 		wl_list_for_each(view, &layer->view_list.link, layer_link.link)
 			surface_stash_subsurface_views(view->surface);
@@ -2368,6 +2633,34 @@ weston_compositor_build_view_list(struct weston_compositor *compositor)
 	wl_list_for_each(layer, &compositor->layer_list, link)
 		wl_list_for_each(view, &layer->view_list.link, layer_link.link)
 			surface_free_unused_subsurface_views(view->surface);
+
+	/* Unmapping the unused sub-surface views above marks the list
+	 * dirty again, but the list built here already excludes them.
+	 */
+	compositor->view_list_needs_rebuild = false;
+	compositor->pick_grid_dirty = true;
+	compositor->culled_views_dirty = true;
+}
+
+/** Bring compositor->view_list up to date for a repaint
+ *
+ * The view list is only rebuilt from the layers when something has
+ * called weston_compositor_view_list_dirty() since the last rebuild.
+ * Otherwise only the transforms of the views already in the list are
+ * refreshed, which is a no-op for views whose geometry is not dirty.
+ */
+static void
+weston_compositor_update_view_list(struct weston_compositor *compositor)
+{
+	struct weston_view *view;
+
+	if (compositor->view_list_needs_rebuild) {
+		weston_compositor_build_view_list(compositor);
+		return;
+	}
+
+	wl_list_for_each(view, &compositor->view_list, link)
+		weston_view_update_transform(view);
 }
 
 static void
@@ -2395,6 +2688,95 @@ weston_output_take_feedback_list(struct weston_output *output,
 	wl_list_init(&surface->feedback_list);
 }
 
+/* Whether nothing of the surface can be seen on this output, after
+ * damage accumulation has computed the view clip regions. Surfaces that
+ * are also shown on other outputs, or whose views have no area on this
+ * one, are never considered occluded.
+ */
+static bool
+weston_surface_is_occluded_on_output(struct weston_surface *surface,
+				     struct weston_output *output)
+{
+	struct weston_view *view;
+	pixman_region32_t visible;
+	bool any_area = false;
+	bool occluded = true;
+
+	pixman_region32_init(&visible);
+
+	wl_list_for_each(view, &surface->views, surface_link) {
+		if (!weston_view_is_mapped(view) || !view->plane)
+			continue;
+
+		if (!(view->output_mask & (1u << output->id))) {
+			if (view->output_mask != 0) {
+				occluded = false;
+				break;
+			}
+			continue;
+		}
+
+		pixman_region32_intersect(&visible,
+					  &view->transform.boundingbox,
+					  &output->region);
+		if (!pixman_region32_not_empty(&visible))
+			continue;
+		any_area = true;
+
+		pixman_region32_subtract(&visible, &visible, &view->clip);
+		pixman_region32_subtract(&visible, &visible, &view->plane->clip);
+		if (pixman_region32_not_empty(&visible)) {
+			occluded = false;
+			break;
+		}
+	}
+
+	pixman_region32_fini(&visible);
+
+	return occluded && any_area;
+}
+
+static void
+weston_output_take_surface_frame(struct weston_output *output,
+				 struct weston_surface *surface,
+				 struct wl_list *frame_callback_list,
+				 int64_t *throttle_msec)
+{
+	int32_t interval = output->compositor->occluded_frame_interval_msec;
+	int64_t since;
+
+	/* Note: This operation is safe to do multiple times on the
+	 * same surface.
+	 */
+	if (surface->output != output)
+		return;
+
+	if (interval > 0 &&
+	    weston_surface_is_occluded_on_output(surface, output)) {
+		/* Nothing of the surface gets presented. */
+		weston_presentation_feedback_discard_list(&surface->feedback_list);
+		surface->latency_commit_time = (struct timespec) { 0 };
+
+		since = timespec_sub_to_msec(&output->frame_time,
+					     &surface->occluded_frame_time);
+		if (since >= 0 && since < interval) {
+			if (!wl_list_empty(&surface->frame_callback_list) &&
+			    interval - since < *throttle_msec)
+				*throttle_msec = interval - since;
+			return;
+		}
+
+		surface->occluded_frame_time = output->frame_time;
+	}
+
+	wl_list_insert_list(frame_callback_list,
+			    &surface->frame_callback_list);
+	wl_list_init(&surface->frame_callback_list);
+
+	weston_output_take_feedback_list(output, surface);
+	weston_output_latency_take(output, surface);
+}
+
 static int
 weston_output_repaint(struct weston_output *output, void *repaint_data)
 {
@@ -2404,6 +2786,9 @@ weston_output_repaint(struct weston_output *output, void *repaint_data)
 	struct weston_frame_callback *cb, *cnext;
 	struct wl_list frame_callback_list;
 	pixman_region32_t output_damage;
+	int64_t throttle_msec = INT64_MAX;
+	bool culled;
+	size_t i;
 	int r;
 	uint32_t frame_time_msec;
 
@@ -2412,8 +2797,9 @@ weston_output_repaint(struct weston_output *output, void *repaint_data)
 
 	TL_POINT("core_repaint_begin", TLP_OUTPUT(output), TLP_END);
 
-	/* Rebuild the surface list and update surface transforms up front. */
-	weston_compositor_build_view_list(ec);
+	/* Update the surface list and surface transforms up front. */
+	weston_compositor_update_view_list(ec);
+	culled = weston_compositor_update_culled_views(ec);
 
 	if (output->assign_planes && !output->disable_planes) {
 		output->assign_planes(output, repaint_data);
@@ -2424,21 +2810,45 @@ weston_output_repaint(struct weston_output *output, void *repaint_data)
 		}
 	}
 
+	/* Frame callbacks are collected after damage accumulation, which
+	 * computes the view clip regions used for occlusion throttling.
+	 */
 	wl_list_init(&frame_callback_list);
-	wl_list_for_each(ev, &ec->view_list, link) {
-		/* Note: This operation is safe to do multiple times on the
-		 * same surface.
+	if (culled) {
+		struct weston_view **views = output->culled_views.data;
+		struct weston_view **unassigned = ec->unassigned_views.data;
+
+		output_accumulate_damage(output);
+
+		for (i = 0; i < output->culled_views.size / sizeof *views; i++)
+			weston_output_take_surface_frame(output,
+							 views[i]->surface,
+							 &frame_callback_list,
+							 &throttle_msec);
+
+		/* Views entirely off-screen still have an output assigned,
+		 * and their clients wait for frame callbacks from it.
 		 */
-		if (ev->surface->output == output) {
-			wl_list_insert_list(&frame_callback_list,
-					    &ev->surface->frame_callback_list);
-			wl_list_init(&ev->surface->frame_callback_list);
+		for (i = 0; i < ec->unassigned_views.size / sizeof *unassigned; i++)
+			weston_output_take_surface_frame(output,
+							 unassigned[i]->surface,
+							 &frame_callback_list,
+							 &throttle_msec);
+	} else {
+		compositor_accumulate_damage(ec);
 
-			weston_output_take_feedback_list(output, ev->surface);
-		}
+		wl_list_for_each(ev, &ec->view_list, link)
+			weston_output_take_surface_frame(output, ev->surface,
+							 &frame_callback_list,
+							 &throttle_msec);
 	}
 
-	compositor_accumulate_damage(ec);
+	/* Come back for the frame callbacks held from occluded surfaces,
+	 * even if nothing else causes a repaint in the meantime.
+	 */
+	if (throttle_msec != INT64_MAX && output->occluded_frame_timer)
+		wl_event_source_timer_update(output->occluded_frame_timer,
+					     throttle_msec);
 
 	pixman_region32_init(&output_damage);
 	pixman_region32_intersect(&output_damage,
@@ -2483,6 +2893,59 @@ weston_output_schedule_repaint_reset(struct weston_output *output)
 	TL_POINT("core_repaint_exit_loop", TLP_OUTPUT(output), TLP_END);
 }
 
+static void
+weston_output_repaint_timing_add_sample(struct weston_output *output,
+					int64_t duration_nsec)
+{
+	struct weston_output_repaint_timing *rt = &output->repaint_timing;
+	int64_t sorted[WESTON_REPAINT_TIMING_SAMPLES];
+	int64_t percentile, margin;
+	unsigned int i, j;
+
+	rt->samples_nsec[rt->next_sample] = duration_nsec;
+	rt->next_sample = (rt->next_sample + 1) % WESTON_REPAINT_TIMING_SAMPLES;
+	if (rt->n_samples < WESTON_REPAINT_TIMING_SAMPLES)
+		rt->n_samples++;
+
+	/* Insertion sort, the sample window is small. */
+	for (i = 0; i < rt->n_samples; i++) {
+		int64_t v = rt->samples_nsec[i];
+
+		for (j = i; j > 0 && sorted[j - 1] > v; j--)
+			sorted[j] = sorted[j - 1];
+		sorted[j] = v;
+	}
+
+	i = (rt->n_samples * ADAPTIVE_REPAINT_PERCENTILE + 99) / 100;
+	percentile = sorted[i > 0 ? i - 1 : 0];
+
+	margin = percentile / 4;
+	if (margin < ADAPTIVE_REPAINT_MARGIN)
+		margin = ADAPTIVE_REPAINT_MARGIN;
+
+	rt->window_nsec = percentile + margin;
+	if (rt->window_nsec < ADAPTIVE_REPAINT_MIN_WINDOW)
+		rt->window_nsec = ADAPTIVE_REPAINT_MIN_WINDOW;
+}
+
+/* How long before the predicted vblank the repaint must start. */
+static int64_t
+weston_output_repaint_window_nsec(struct weston_output *output,
+				  int32_t refresh_nsec)
+{
+	struct weston_compositor *compositor = output->compositor;
+	int64_t window = output->repaint_timing.window_nsec;
+
+	if (!compositor->repaint_window_adaptive || window == 0)
+		return (int64_t)compositor->repaint_msec * 1000000;
+
+	/* Past a full refresh period we would just repaint right away. */
+	if (refresh_nsec > 0 && window > refresh_nsec)
+		window = refresh_nsec;
+
+	return window;
+}
+
 static int
 weston_output_maybe_repaint(struct weston_output *output, struct timespec *now,
 			    void *repaint_data)
@@ -2515,6 +2978,8 @@ weston_output_maybe_repaint(struct weston_output *output, struct timespec *now,
 	 * something schedules a successful repaint later. As repainting may
 	 * take some time, re-read our clock as a courtesy to the next
 	 * output. */
+	weston_compositor_read_presentation_clock(compositor,
+						  &output->repaint_timing.repaint_start);
 	ret = weston_output_repaint(output, repaint_data);
 	weston_compositor_read_presentation_clock(compositor, now);
 	if (ret != 0)
@@ -2576,6 +3041,9 @@ output_repaint_timer_handler(void *data)
 	void *repaint_data = NULL;
 	int ret = 0;
 
+	/* Let the repaint show where coalesced pointer motion went. */
+	weston_compositor_flush_pointer_motion(compositor);
+
 	weston_compositor_read_presentation_clock(compositor, &now);
 
 	if (compositor->backend->repaint_begin)
@@ -2591,6 +3059,19 @@ output_repaint_timer_handler(void *data)
 		if (compositor->backend->repaint_flush)
 			compositor->backend->repaint_flush(compositor,
 							   repaint_data);
+
+		weston_compositor_read_presentation_clock(compositor, &now);
+		wl_list_for_each(output, &compositor->output_list, link) {
+			struct weston_output_repaint_timing *rt =
+				&output->repaint_timing;
+
+			if (!output->repainted)
+				continue;
+
+			weston_output_repaint_timing_add_sample(output,
+				timespec_sub_to_nsec(&now, &rt->repaint_start));
+			rt->target_pending = rt->target_valid;
+		}
 	} else {
 		wl_list_for_each(output, &compositor->output_list, link) {
 			if (output->repainted)
@@ -2616,7 +3097,9 @@ weston_output_finish_frame(struct weston_output *output,
 			   uint32_t presented_flags)
 {
 	struct weston_compositor *compositor = output->compositor;
+	struct weston_output_repaint_timing *rt = &output->repaint_timing;
 	int32_t refresh_nsec;
+	int64_t window_nsec;
 	struct timespec now;
 	int64_t msec_rel;
 
@@ -2630,24 +3113,48 @@ weston_output_finish_frame(struct weston_output *output,
 	 * timebase to work against, so any delay just wastes time. Push a
 	 * repaint as soon as possible so we can get on with it. */
 	if (!stamp) {
+		weston_output_latency_discard(output);
 		output->next_repaint = now;
+		rt->target_valid = false;
+		rt->target_pending = false;
 		goto out;
 	}
 
 	TL_POINT("core_repaint_finished", TLP_OUTPUT(output),
 		 TLP_VBLANK(stamp), TLP_END);
 
-	refresh_nsec = millihz_to_nsec(output->current_mode->refresh);
+	/* A mode without a refresh rate has no vblank to aim for. */
+	refresh_nsec = output->current_mode->refresh ?
+		       millihz_to_nsec(output->current_mode->refresh) : 0;
+
+	/* A frame presented more than half a period after the vblank its
+	 * repaint aimed for missed its deadline.
+	 */
+	if (rt->target_pending &&
+	    !(presented_flags & WP_PRESENTATION_FEEDBACK_INVALID)) {
+		rt->frames++;
+		if (timespec_sub_to_nsec(stamp, &rt->target) > refresh_nsec / 2)
+			rt->missed_deadlines++;
+	}
+	rt->target_pending = false;
 	weston_presentation_feedback_present_list(&output->feedback_list,
 						  output, refresh_nsec, stamp,
 						  output->msc,
 						  presented_flags);
+	weston_output_latency_present(output, stamp);
 
 	output->frame_time = *stamp;
 
+	if (refresh_nsec == 0) {
+		output->next_repaint = now;
+		rt->target_valid = false;
+		goto out;
+	}
+
+	window_nsec = weston_output_repaint_window_nsec(output, refresh_nsec);
 	timespec_add_nsec(&output->next_repaint, stamp, refresh_nsec);
-	timespec_add_msec(&output->next_repaint, &output->next_repaint,
-			  -compositor->repaint_msec);
+	timespec_add_nsec(&output->next_repaint, &output->next_repaint,
+			  -window_nsec);
 	msec_rel = timespec_sub_to_msec(&output->next_repaint, &now);
 
 	if (msec_rel < -1000 || msec_rel > 1000) {
@@ -2674,11 +3181,24 @@ weston_output_finish_frame(struct weston_output *output,
 		}
 	}
 
+	timespec_add_nsec(&rt->target, &output->next_repaint, window_nsec);
+	rt->target_valid = true;
+
 out:
 	output->repaint_status = REPAINT_SCHEDULED;
 	output_repaint_timer_arm(compositor);
 }
 
+static int
+output_occluded_frame_handler(void *data)
+{
+	struct weston_output *output = data;
+
+	weston_output_schedule_repaint(output);
+
+	return 0;
+}
+
 static void
 idle_repaint(void *data)
 {
@@ -2690,17 +3210,41 @@ idle_repaint(void *data)
 	output->start_repaint_loop(output);
 }
 
+/** Request a rebuild of the compositor view list
+ *
+ * \param compositor The compositor instance
+ *
+ * The view list is built from the layers and the sub-surface stacking
+ * order, and is only rebuilt on repaint after this has been called.
+ * libweston calls this itself for layer, layer entry and sub-surface
+ * changes; shells only need it when they alter stacking in ways that
+ * bypass the weston_layer API.
+ */
+WL_EXPORT void
+weston_compositor_view_list_dirty(struct weston_compositor *compositor)
+{
+	compositor->view_list_needs_rebuild = true;
+	compositor->pick_grid_dirty = true;
+	compositor->culled_views_dirty = true;
+}
+
 WL_EXPORT void
 weston_layer_entry_insert(struct weston_layer_entry *list,
 			  struct weston_layer_entry *entry)
 {
 	wl_list_insert(&list->link, &entry->link);
 	entry->layer = list->layer;
+
+	if (entry->layer)
+		weston_compositor_view_list_dirty(entry->layer->compositor);
 }
 
 WL_EXPORT void
 weston_layer_entry_remove(struct weston_layer_entry *entry)
 {
+	if (entry->layer)
+		weston_compositor_view_list_dirty(entry->layer->compositor);
+
 	wl_list_remove(&entry->link);
 	wl_list_init(&entry->link);
 	entry->layer = NULL;
@@ -2737,6 +3281,7 @@ weston_layer_set_position(struct weston_layer *layer,
 {
 	struct weston_layer *below;
 
+	weston_compositor_view_list_dirty(layer->compositor);
 	wl_list_remove(&layer->link);
 
 	/* layer_list is ordered from top to bottom, the last layer being the
@@ -2760,6 +3305,7 @@ weston_layer_set_position(struct weston_layer *layer,
 WL_EXPORT void
 weston_layer_unset_position(struct weston_layer *layer)
 {
+	weston_compositor_view_list_dirty(layer->compositor);
 	wl_list_remove(&layer->link);
 	wl_list_init(&layer->link);
 }
@@ -2995,8 +3541,10 @@ weston_surface_commit_subsurface_order(struct weston_surface *surface)
 		wl_list_remove(&sub->parent_link);
 		wl_list_insert(&surface->subsurface_list, &sub->parent_link);
 
-		if (sub->reordered)
+		if (sub->reordered) {
+			weston_compositor_view_list_dirty(surface->compositor);
 			weston_surface_damage_subsurfaces(sub);
+		}
 	}
 }
 
@@ -3211,8 +3759,10 @@ weston_surface_commit_state(struct weston_surface *surface,
 	surface->buffer_viewport = state->buffer_viewport;
 
 	/* wl_surface.attach */
-	if (state->newly_attached)
+	if (state->newly_attached) {
 		weston_surface_attach(surface, state->buffer);
+		weston_surface_latency_commit(surface);
+	}
 	weston_surface_state_set_buffer(state, NULL);
 
 	weston_surface_build_buffer_matrix(surface,
@@ -3663,6 +4213,7 @@ subsurface_committed(struct weston_surface *surface, int32_t dx, int32_t dy)
 
 	if (!weston_surface_is_mapped(surface)) {
 		surface->is_mapped = true;
+		weston_compositor_view_list_dirty(surface->compositor);
 
 		/* Cannot call weston_view_update_transform(),
 		 * because that would call it also for the parent surface,
@@ -4000,6 +4551,7 @@ subsurface_set_desync(struct wl_client *client, struct wl_resource *resource)
 static void
 weston_subsurface_unlink_parent(struct weston_subsurface *sub)
 {
+	weston_compositor_view_list_dirty(sub->parent->compositor);
 	wl_list_remove(&sub->parent_link);
 	wl_list_remove(&sub->parent_link_pending);
 	wl_list_remove(&sub->parent_destroy_listener.link);
@@ -4066,6 +4618,8 @@ weston_subsurface_link_parent(struct weston_subsurface *sub,
 	wl_list_insert(&parent->subsurface_list, &sub->parent_link);
 	wl_list_insert(&parent->subsurface_list_pending,
 		       &sub->parent_link_pending);
+
+	weston_compositor_view_list_dirty(parent->compositor);
 }
 
 static void
@@ -5410,6 +5964,7 @@ weston_compositor_add_output(struct weston_compositor *compositor,
 	wl_list_remove(&output->link);
 	wl_list_insert(compositor->output_list.prev, &output->link);
 	output->enabled = true;
+	compositor->culled_views_dirty = true;
 
 	wl_list_for_each(head, &output->head_list, output_link)
 		weston_head_add_global(head);
@@ -5494,12 +6049,19 @@ weston_compositor_remove_output(struct weston_output *output)
 	}
 
 	weston_presentation_feedback_discard_list(&output->feedback_list);
+	weston_output_latency_discard(output);
+
+	if (output->occluded_frame_timer) {
+		wl_event_source_remove(output->occluded_frame_timer);
+		output->occluded_frame_timer = NULL;
+	}
 
 	weston_compositor_reflow_outputs(compositor, output, -output->width);
 
 	wl_list_remove(&output->link);
 	wl_list_insert(compositor->pending_output_list.prev, &output->link);
 	output->enabled = false;
+	compositor->culled_views_dirty = true;
 
 	wl_signal_emit(&compositor->output_destroyed_signal, output);
 	wl_signal_emit(&output->destroy_signal, output);
@@ -5647,6 +6209,8 @@ weston_output_init(struct weston_output *output,
 	pixman_region32_init(&output->previous_damage);
 	pixman_region32_init(&output->region);
 	wl_list_init(&output->mode_list);
+	wl_array_init(&output->culled_views);
+	wl_array_init(&output->latency_samples);
 }
 
 /** Adds weston_output object to pending output list.
@@ -5735,6 +6299,7 @@ weston_output_enable(struct weston_output *output)
 	struct weston_compositor *c = output->compositor;
 	struct weston_output *iterator;
 	struct weston_head *head;
+	struct wl_event_loop *loop;
 	char *head_names;
 	int x = 0, y = 0;
 
@@ -5798,6 +6363,11 @@ weston_output_enable(struct weston_output *output)
 		return -1;
 	}
 
+	loop = wl_display_get_event_loop(c->wl_display);
+	output->occluded_frame_timer =
+		wl_event_loop_add_timer(loop, output_occluded_frame_handler,
+					output);
+
 	weston_compositor_add_output(output->compositor, output);
 
 	head_names = weston_output_create_heads_string(output);
@@ -5945,6 +6515,8 @@ weston_output_release(struct weston_output *output)
 
 	pixman_region32_fini(&output->region);
 	pixman_region32_fini(&output->previous_damage);
+	wl_array_release(&output->culled_views);
+	weston_output_latency_release(output);
 	wl_list_remove(&output->link);
 
 	wl_list_for_each_safe(head, tmp, &output->head_list, output_link)
@@ -6554,10 +7126,14 @@ weston_compositor_print_scene_graph(struct weston_compositor *ec)
 	weston_compositor_read_presentation_clock(ec, &now);
 	fprintf(fp, "Weston scene graph at %ld.%09ld:\n\n",
 		now.tv_sec, now.tv_nsec);
+	fprintf(fp, "View list rebuilds: %u%s\n\n",
+		ec->view_list_rebuild_count,
+		ec->view_list_needs_rebuild ? " (rebuild pending)" : "");
 
 	wl_list_for_each(output, &ec->output_list, link) {
 		struct weston_head *head;
 		int head_idx = 0;
+		int32_t refresh_nsec;
 
 		fprintf(fp, "Output %d (%s):\n", output->id, output->name);
 		assert(output->enabled);
@@ -6578,6 +7154,17 @@ weston_compositor_print_scene_graph(struct weston_compositor *ec)
 			fprintf(fp, "\tnext repaint: %ld.%09ld\n",
 				output->next_repaint.tv_sec,
 				output->next_repaint.tv_nsec);
+		refresh_nsec = 0;
+		if (output->current_mode->refresh)
+			refresh_nsec =
+				millihz_to_nsec(output->current_mode->refresh);
+		fprintf(fp, "\trepaint window: %.3f ms (%s)\n",
+			weston_output_repaint_window_nsec(output,
+							  refresh_nsec) / 1e6,
+			ec->repaint_window_adaptive ? "adaptive" : "fixed");
+		fprintf(fp, "\tmissed deadlines: %" PRIu64 " of %" PRIu64
+			" frames\n", output->repaint_timing.missed_deadlines,
+			output->repaint_timing.frames);
 
 		wl_list_for_each(head, &output->head_list, output_link) {
 			fprintf(fp, "\tHead %d (%s): %sconnected\n",
@@ -6706,6 +7293,15 @@ weston_compositor_create(struct wl_display *display, void *user_data)
 	weston_pointer_gestures_init(ec);
 
 	wl_list_init(&ec->view_list);
+	ec->view_list_needs_rebuild = true;
+
+	ec->pick_grid = zalloc(sizeof *ec->pick_grid);
+	if (ec->pick_grid)
+		weston_pick_grid_init(ec->pick_grid);
+	ec->pick_grid_dirty = true;
+
+	wl_array_init(&ec->unassigned_views);
+	ec->culled_views_dirty = true;
 	wl_list_init(&ec->plane_list);
 	wl_list_init(&ec->layer_list);
 	wl_list_init(&ec->seat_list);
@@ -6749,6 +7345,7 @@ weston_compositor_create(struct wl_display *display, void *user_data)
 						  "Scene graph details\n",
 					  	  debug_scene_graph_cb,
 					  	  ec);
+	weston_compositor_latency_init(ec);
 
 	return ec;
 
@@ -7072,8 +7669,19 @@ weston_compositor_destroy(struct weston_compositor *compositor)
 
 	weston_debug_scope_destroy(compositor->debug_scene);
 	compositor->debug_scene = NULL;
+	weston_debug_scope_destroy(compositor->debug_pointer_motion);
+	compositor->debug_pointer_motion = NULL;
+	weston_debug_scope_destroy(compositor->debug_latency);
+	compositor->debug_latency = NULL;
 	weston_debug_compositor_destroy(compositor);
 
+	if (compositor->pick_grid) {
+		weston_pick_grid_release(compositor->pick_grid);
+		free(compositor->pick_grid);
+	}
+
+	wl_array_release(&compositor->unassigned_views);
+
 	free(compositor);
 }
 
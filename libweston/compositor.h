@@ -80,6 +80,10 @@ struct weston_pointer;
 struct linux_dmabuf_buffer;
 struct weston_recorder;
 struct weston_pointer_constraint;
+struct ro_anonymous_file;
+struct weston_confine_outline;
+struct weston_latency_histogram;
+struct weston_pick_grid;
 
 enum weston_keyboard_modifier {
 	MODIFIER_CTRL = (1 << 0),
@@ -199,6 +203,33 @@ struct weston_head {
 	bool non_desktop;		/**< non-desktop display, e.g. HMD */
 };
 
+#define WESTON_REPAINT_TIMING_SAMPLES 64
+
+/** Repaint duration tracking for the adaptive repaint window
+ *
+ * Durations cover weston_output_repaint() and the backend submitting
+ * the frame in repaint_flush. See weston_output_finish_frame().
+ */
+struct weston_output_repaint_timing {
+	int64_t samples_nsec[WESTON_REPAINT_TIMING_SAMPLES];
+	unsigned int n_samples;
+	unsigned int next_sample;
+
+	/** Current adaptive repaint window, 0 until the first sample */
+	int64_t window_nsec;
+
+	struct timespec repaint_start;
+
+	/** The vblank the next scheduled repaint aims for */
+	struct timespec target;
+	bool target_valid;
+	/** A repaint was done for target and awaits finish_frame */
+	bool target_pending;
+
+	uint64_t frames;
+	uint64_t missed_deadlines;
+};
+
 struct weston_output {
 	uint32_t id;
 	char *name;
@@ -243,9 +274,14 @@ struct weston_output {
 	 *  next repaint should be run */
 	struct timespec next_repaint;
 
+	struct weston_output_repaint_timing repaint_timing;
+
 	/** For cancelling the idle_repaint callback on output destruction. */
 	struct wl_event_source *idle_repaint_source;
 
+	/** Repaints for frame callbacks held back from occluded surfaces */
+	struct wl_event_source *occluded_frame_timer;
+
 	struct weston_output_zoom zoom;
 	int dirty;
 	struct wl_signal frame_signal;
@@ -257,6 +293,15 @@ struct weston_output {
 	int destroying;
 	struct wl_list feedback_list;
 
+	/** Views overlapping this output, as struct weston_view pointers
+	 *  in weston_compositor::view_list order. Only valid during repaint. */
+	struct wl_array culled_views;
+
+	/** Input responses in the frame being presented, and the input to
+	 *  presentation latency of past frames. See latency.c. */
+	struct wl_array latency_samples;
+	struct weston_latency_histogram *latency;
+
 	uint32_t transform;
 	float native_scale;
 	float current_scale;
@@ -719,6 +764,7 @@ struct weston_xkb_info {
 	struct xkb_keymap *keymap;
 	size_t keymap_size;
 	char *keymap_string;
+	struct ro_anonymous_file *keymap_rofile;
 	int32_t ref_count;
 	xkb_mod_index_t shift_mod;
 	xkb_mod_index_t caps_mod;
@@ -803,6 +849,17 @@ struct weston_seat {
 
 	struct input_method *input_method;
 	char *seat_name;
+
+	/* Pointer motion held back until the next repaint, merged, see
+	 * weston_seat_set_pointer_coalescing() */
+	bool coalesce_motion;
+	bool motion_pending;
+	bool motion_frame_pending;	/* a frame followed it */
+	struct timespec motion_time;
+	struct weston_pointer_motion_event motion;
+	uint32_t motion_merged;		/* into the pending one */
+	uint64_t motion_events_in;
+	uint64_t motion_events_out;
 };
 
 enum {
@@ -1099,6 +1156,26 @@ struct weston_compositor {
 	struct wl_list layer_list;	/* struct weston_layer::link */
 	struct wl_list view_list;	/* struct weston_view::link */
 	struct wl_list plane_list;
+
+	/* Set whenever layers, layer entries or sub-surface stacking change;
+	 * view_list is only rebuilt from the layers when this is set.
+	 */
+	bool view_list_needs_rebuild;
+	uint32_t view_list_rebuild_count;
+
+	/* Spatial index over view_list for weston_compositor_pick_view(),
+	 * rebuilt lazily when pick_grid_dirty is set. Views whose transform
+	 * changes are moved in it instead.
+	 */
+	struct weston_pick_grid *pick_grid;
+	bool pick_grid_dirty;
+
+	/* Set when weston_output::culled_views must be re-sorted from
+	 * view_list; views overlapping no output are kept here instead.
+	 */
+	bool culled_views_dirty;
+	struct wl_array unassigned_views;	/* struct weston_view * */
+
 	struct wl_list key_binding_list;
 	struct wl_list modifier_binding_list;
 	struct wl_list button_binding_list;
@@ -1141,6 +1218,21 @@ struct weston_compositor {
 
 	clockid_t presentation_clock;
 	int32_t repaint_msec;
+	/* Derive each output's repaint window from measured repaint times
+	 * instead of the fixed repaint_msec. */
+	bool repaint_window_adaptive;
+	/* Frame callbacks of surfaces hidden behind opaque views are sent
+	 * at most once per this many milliseconds; 0 disables throttling. */
+	int32_t occluded_frame_interval_msec;
+	/* Number of threads the pixman renderer composites an output
+	 * with; 0 or 1 keeps all rendering on the compositor thread. */
+	int32_t renderer_threads;
+	/* Read libinput on a thread of its own, handing the events over
+	 * to the compositor thread. */
+	bool input_thread;
+	/* Write the timeline as binary records, to be converted with
+	 * weston-timeline-convert, rather than as JSON text. */
+	bool timeline_binary;
 
 	unsigned int activate_serial;
 
@@ -1169,6 +1261,8 @@ struct weston_compositor {
 
 	struct weston_debug_compositor *weston_debug;
 	struct weston_debug_scope *debug_scene;
+	struct weston_debug_scope *debug_pointer_motion;
+	struct weston_debug_scope *debug_latency;
 };
 
 struct weston_buffer {
@@ -1333,6 +1427,9 @@ struct weston_view {
 	/* Per-surface Presentation feedback flags, controlled by backend. */
 	uint32_t psf_flags;
 
+	/* Entry of the view in weston_compositor::pick_grid, if any */
+	uint32_t pick_grid_index;
+
 	bool is_mapped;
 };
 
@@ -1387,6 +1484,9 @@ struct weston_pointer_constraint {
 	pixman_region32_t region_pending;
 	bool region_is_pending;
 
+	/* Borders of the confinement, built on demand */
+	struct weston_confine_outline *outline;
+
 	wl_fixed_t hint_x;
 	wl_fixed_t hint_y;
 	wl_fixed_t hint_x_pending;
@@ -1438,6 +1538,14 @@ struct weston_surface {
 
 	struct wl_list frame_callback_list;
 	struct wl_list feedback_list;
+	/* Last frame callback delivery while fully occluded */
+	struct timespec occluded_frame_time;
+
+	/* Oldest input not responded to, input the committed buffer
+	 * responds to, and latency histogram. See latency.c. */
+	struct timespec latency_input_time;
+	struct timespec latency_commit_time;
+	struct weston_latency_histogram *latency;
 
 	struct weston_buffer_reference buffer_ref;
 	struct weston_buffer_viewport buffer_viewport;
@@ -1610,6 +1718,9 @@ notify_axis_source(struct weston_seat *seat, uint32_t source);
 void
 notify_pointer_frame(struct weston_seat *seat);
 
+void
+weston_seat_set_pointer_coalescing(struct weston_seat *seat, bool enable);
+
 void
 notify_key(struct weston_seat *seat, const struct timespec *time, uint32_t key,
 	   enum wl_keyboard_key_state state,
@@ -1681,6 +1792,8 @@ notify_pointer_pinch(struct weston_seat *seat, uint32_t time, int cancelled,
 		     int fingers, wl_fixed_t dx, wl_fixed_t dy,
 		     wl_fixed_t scale, wl_fixed_t rotation_diff, int gesture_type);
 void
+weston_compositor_view_list_dirty(struct weston_compositor *compositor);
+void
 weston_layer_entry_insert(struct weston_layer_entry *list,
 			  struct weston_layer_entry *entry);
 void
@@ -2164,6 +2277,9 @@ noop_renderer_init(struct weston_compositor *ec);
 int
 weston_input_init(struct weston_compositor *compositor);
 
+void
+weston_compositor_flush_pointer_motion(struct weston_compositor *compositor);
+
 int
 weston_backend_init(struct weston_compositor *c,
 		    struct weston_backend_config *config_base);
@@ -0,0 +1,115 @@
+/*
+ * Copyright © 2018 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <string.h>
+
+#include "input-ring.h"
+
+void
+input_ring_init(struct input_ring *ring)
+{
+	memset(ring, 0, sizeof *ring);
+}
+
+/* Whether the producer can push no more, until the consumer releases
+ * some entries. Producer side. */
+bool
+input_ring_is_full(struct input_ring *ring)
+{
+	uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+	return ring->write_head - tail == INPUT_RING_SIZE;
+}
+
+/* Add an event, read now, to the ring. It is not seen by the consumer
+ * before input_ring_publish(). The ring must not be full. Producer side. */
+void
+input_ring_push(struct input_ring *ring, void *event)
+{
+	struct input_ring_entry *entry;
+
+	assert(!input_ring_is_full(ring));
+
+	entry = &ring->entries[ring->write_head & (INPUT_RING_SIZE - 1)];
+	entry->event = event;
+	clock_gettime(CLOCK_MONOTONIC, &entry->read_time);
+	ring->write_head++;
+}
+
+/* Hand the pushed events over. Returns true if there were any, for the
+ * consumer to be woken up. Producer side. */
+bool
+input_ring_publish(struct input_ring *ring)
+{
+	if (ring->write_head == ring->head)
+		return false;
+
+	__atomic_store_n(&ring->head, ring->write_head, __ATOMIC_RELEASE);
+	return true;
+}
+
+/* Whether the consumer made room in a full ring. If not, the next
+ * input_ring_release() returns true, for the producer to be woken up.
+ * Producer side. */
+bool
+input_ring_has_room(struct input_ring *ring)
+{
+	uint32_t tail;
+
+	__atomic_store_n(&ring->waiting, true, __ATOMIC_SEQ_CST);
+	tail = __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST);
+	if (ring->write_head - tail == INPUT_RING_SIZE)
+		return false;
+
+	__atomic_store_n(&ring->waiting, false, __ATOMIC_SEQ_CST);
+	return true;
+}
+
+/* The number of events published and not released yet. Consumer side. */
+uint32_t
+input_ring_available(struct input_ring *ring)
+{
+	return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - ring->tail;
+}
+
+/* The i-th available event, oldest first. Consumer side. */
+struct input_ring_entry *
+input_ring_entry(struct input_ring *ring, uint32_t i)
+{
+	return &ring->entries[(ring->tail + i) & (INPUT_RING_SIZE - 1)];
+}
+
+/* Give the n oldest entries back to the producer. Returns true if it
+ * waits for room, and has to be woken up. Consumer side. */
+bool
+input_ring_release(struct input_ring *ring, uint32_t n)
+{
+	__atomic_store_n(&ring->tail, ring->tail + n, __ATOMIC_SEQ_CST);
+
+	return __atomic_exchange_n(&ring->waiting, false, __ATOMIC_SEQ_CST);
+}
@@ -0,0 +1,80 @@
+/*
+ * Copyright © 2018 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef WESTON_INPUT_RING_H
+#define WESTON_INPUT_RING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#define INPUT_RING_SIZE 1024	/* events, a power of two */
+
+/** Single producer, single consumer ring of input events
+ *
+ * The producer fills entries with input_ring_push() and hands them over
+ * all at once with input_ring_publish(). The consumer goes through them
+ * with input_ring_entry() and gives their slots back with
+ * input_ring_release(). Neither side blocks: waking the other one up is
+ * left to the caller, as the return values tell.
+ */
+struct input_ring_entry {
+	void *event;
+	struct timespec read_time;
+};
+
+struct input_ring {
+	uint32_t head;		/* written by the producer */
+	uint32_t tail;		/* written by the consumer */
+	uint32_t write_head;	/* producer only, not yet published */
+	bool waiting;		/* producer waits for room */
+	struct input_ring_entry entries[INPUT_RING_SIZE];
+};
+
+void
+input_ring_init(struct input_ring *ring);
+
+bool
+input_ring_is_full(struct input_ring *ring);
+
+void
+input_ring_push(struct input_ring *ring, void *event);
+
+bool
+input_ring_publish(struct input_ring *ring);
+
+bool
+input_ring_has_room(struct input_ring *ring);
+
+uint32_t
+input_ring_available(struct input_ring *ring);
+
+struct input_ring_entry *
+input_ring_entry(struct input_ring *ring, uint32_t i);
+
+bool
+input_ring_release(struct input_ring *ring, uint32_t n);
+
+#endif
@@ -30,8 +30,8 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <string.h>
-#include <sys/mman.h>
 #include <assert.h>
 #include <unistd.h>
 #include <float.h>
@@ -42,6 +42,8 @@
 #include "shared/os-compatibility.h"
 #include "shared/timespec-util.h"
 #include "compositor.h"
+#include "weston-debug.h"
+#include "latency.h"
 #include "relative-pointer-unstable-v1-server-protocol.h"
 #include "pointer-constraints-unstable-v1-server-protocol.h"
 #include "input-timestamps-unstable-v1-server-protocol.h"
@@ -71,8 +73,23 @@ struct line {
 struct border {
 	struct line line;
 	enum motion_direction blocking_dir;
+	int order;	/* in the outline, to break ties */
+};
+
+/* Borders of the confinement region of a pointer constraint, in surface
+ * coordinates, kept until a commit changes the region. The horizontal
+ * and vertical borders are also sorted by position, so that a motion is
+ * only tested against the borders in its span. */
+struct weston_confine_outline {
+	pixman_region32_t region;
+	struct wl_array borders;
+	struct wl_array horizontal;	/* by y */
+	struct wl_array vertical;	/* by x */
 };
 
+static void
+confine_outline_destroy(struct weston_confine_outline *outline);
+
 static void
 maybe_warp_confined_pointer(struct weston_pointer_constraint *constraint);
 
@@ -529,6 +546,9 @@ pointer_send_motion(struct weston_pointer *pointer,
                                                    time);
 		wl_pointer_send_motion(resource, msecs, sx, sy);
 	}
+
+	if (pointer->focus && !wl_list_empty(resource_list))
+		weston_surface_latency_tag_input(pointer->focus->surface, time);
 }
 
 WL_EXPORT void
@@ -615,6 +635,8 @@ weston_pointer_send_button(struct weston_pointer *pointer,
                                                    time);
 		wl_pointer_send_button(resource, serial, msecs, button, state);
 	}
+
+	weston_surface_latency_tag_input(pointer->focus->surface, time);
 }
 
 static void
@@ -687,6 +709,8 @@ weston_pointer_send_axis(struct weston_pointer *pointer,
 						  event->axis);
 		}
 	}
+
+	weston_surface_latency_tag_input(pointer->focus->surface, time);
 }
 
 /** Send wl_pointer.axis_source events to focused resources.
@@ -841,6 +865,8 @@ weston_touch_send_down(struct weston_touch *touch, const struct timespec *time,
 				   touch->focus->surface->resource,
 				   touch_id, sx, sy);
 	}
+
+	weston_surface_latency_tag_input(touch->focus->surface, time);
 }
 
 static void
@@ -883,6 +909,8 @@ weston_touch_send_up(struct weston_touch *touch, const struct timespec *time,
 						   time);
 		wl_touch_send_up(resource, serial, msecs, touch_id);
 	}
+
+	weston_surface_latency_tag_input(touch->focus->surface, time);
 }
 
 static void
@@ -928,6 +956,8 @@ weston_touch_send_motion(struct weston_touch *touch,
 		wl_touch_send_motion(resource, msecs,
 				     touch_id, sx, sy);
 	}
+
+	weston_surface_latency_tag_input(touch->focus->surface, time);
 }
 
 static void
@@ -1029,6 +1059,8 @@ weston_keyboard_send_key(struct weston_keyboard *keyboard,
 						   time);
 		wl_keyboard_send_key(resource, serial, msecs, key, state);
 	}
+
+	weston_surface_latency_tag_input(keyboard->focus, time);
 };
 
 static void
@@ -1787,6 +1819,129 @@ weston_pointer_handle_output_destroy(struct wl_listener *listener, void *data)
 	weston_pointer_move_to(pointer, fx, fy);
 }
 
+/** Send the pointer motion held back by coalescing, with its frame
+ *
+ * \param seat The seat.
+ *
+ * Called before anything that must see the pointer where it is: other
+ * pointer events, keys, and output repaints.
+ */
+static void
+weston_seat_flush_pointer_motion(struct weston_seat *seat)
+{
+	struct weston_compositor *ec = seat->compositor;
+	struct weston_pointer *pointer = weston_seat_get_pointer(seat);
+	struct weston_pointer_motion_event event;
+	struct timespec time;
+	bool frame;
+
+	if (!seat->motion_pending)
+		return;
+
+	event = seat->motion;
+	time = seat->motion_time;
+	frame = seat->motion_frame_pending;
+	seat->motion_pending = false;
+	seat->motion_frame_pending = false;
+	seat->motion_events_out++;
+
+	if (weston_debug_scope_is_enabled(ec->debug_pointer_motion))
+		weston_debug_scope_printf(ec->debug_pointer_motion,
+			"%s: %u motion events sent as 1, "
+			"%" PRIu64 " as %" PRIu64 " overall\n",
+			seat->seat_name, seat->motion_merged + 1,
+			seat->motion_events_in, seat->motion_events_out);
+
+	if (!pointer)
+		return;
+
+	pointer->grab->interface->motion(pointer->grab, &time, &event);
+	if (frame)
+		pointer->grab->interface->frame(pointer->grab);
+}
+
+/** Hold pointer motion back until the next repaint
+ *
+ * \param seat The seat.
+ * \param enable Whether to coalesce its pointer motion.
+ *
+ * Pointers reporting at a high rate send far more motion than clients
+ * can use in a frame. With coalescing, consecutive motion events and
+ * their frames are merged into one, and sent before the next output
+ * repaint, or before any other input event of the seat. Relative deltas
+ * are summed, so that relative pointer clients still get all of them.
+ */
+WL_EXPORT void
+weston_seat_set_pointer_coalescing(struct weston_seat *seat, bool enable)
+{
+	if (!enable)
+		weston_seat_flush_pointer_motion(seat);
+
+	seat->coalesce_motion = enable;
+}
+
+void
+weston_compositor_flush_pointer_motion(struct weston_compositor *compositor)
+{
+	struct weston_seat *seat;
+
+	wl_list_for_each(seat, &compositor->seat_list, link)
+		weston_seat_flush_pointer_motion(seat);
+}
+
+/* Merge a motion event into the pending one, or hold it as the pending
+ * one. Returns false if it is to be handled right away. */
+static bool
+weston_seat_coalesce_motion(struct weston_seat *seat,
+			    const struct timespec *time,
+			    struct weston_pointer_motion_event *event)
+{
+	struct weston_compositor *ec = seat->compositor;
+	struct weston_pointer_motion_event *pending = &seat->motion;
+
+	if (!seat->coalesce_motion)
+		return false;
+
+	seat->motion_events_in++;
+
+	/* Repaints send the motion, so there must be some to come. */
+	if (ec->state != WESTON_COMPOSITOR_ACTIVE ||
+	    wl_list_empty(&ec->output_list)) {
+		weston_seat_flush_pointer_motion(seat);
+		seat->motion_events_out++;
+		return false;
+	}
+
+	/* Only events of the same kind add up. */
+	if (seat->motion_pending && pending->mask != event->mask)
+		weston_seat_flush_pointer_motion(seat);
+
+	if (!seat->motion_pending) {
+		*pending = *event;
+		seat->motion_pending = true;
+		seat->motion_merged = 0;
+		weston_compositor_schedule_repaint(ec);
+	} else {
+		if (event->mask & WESTON_POINTER_MOTION_ABS) {
+			pending->x = event->x;
+			pending->y = event->y;
+		}
+		if (event->mask & WESTON_POINTER_MOTION_REL) {
+			pending->dx += event->dx;
+			pending->dy += event->dy;
+		}
+		if (event->mask & WESTON_POINTER_MOTION_REL_UNACCEL) {
+			pending->dx_unaccel += event->dx_unaccel;
+			pending->dy_unaccel += event->dy_unaccel;
+		}
+		pending->time = event->time;
+		seat->motion_merged++;
+	}
+	seat->motion_time = *time;
+
+	return true;
+}
+
 WL_EXPORT void
 notify_motion(struct weston_seat *seat,
 	      const struct timespec *time,
@@ -1796,6 +1951,10 @@ notify_motion(struct weston_seat *seat,
 	struct weston_pointer *pointer = weston_seat_get_pointer(seat);
 
 	weston_compositor_wake(ec);
+
+	if (weston_seat_coalesce_motion(seat, time, event))
+		return;
+
 	pointer->grab->interface->motion(pointer->grab, time, event);
 }
 
@@ -1851,6 +2010,9 @@ notify_motion_absolute(struct weston_seat *seat, const struct timespec *time,
 		.y = y,
 	};
 
+	if (weston_seat_coalesce_motion(seat, time, &event))
+		return;
+
 	pointer->grab->interface->motion(pointer->grab, time, &event);
 }
 
@@ -1890,6 +2052,8 @@ notify_button(struct weston_seat *seat, const struct timespec *time,
 	struct weston_compositor *compositor = seat->compositor;
 	struct weston_pointer *pointer = weston_seat_get_pointer(seat);
 
+	weston_seat_flush_pointer_motion(seat);
+
 	if (state == WL_POINTER_BUTTON_STATE_PRESSED) {
 		weston_compositor_idle_inhibit(compositor);
 		if (pointer->button_count == 0) {
@@ -1922,6 +2086,7 @@ notify_axis(struct weston_seat *seat, const struct timespec *time,
 	struct weston_pointer *pointer = weston_seat_get_pointer(seat);
 
 	weston_compositor_wake(compositor);
+	weston_seat_flush_pointer_motion(seat);
 
 	if (weston_compositor_run_axis_binding(compositor, pointer,
 					       time, event))
@@ -1937,6 +2102,7 @@ notify_axis_source(struct weston_seat *seat, uint32_t source)
 	struct weston_pointer *pointer = weston_seat_get_pointer(seat);
 
 	weston_compositor_wake(compositor);
+	weston_seat_flush_pointer_motion(seat);
 
 	pointer->grab->interface->axis_source(pointer->grab, source);
 }
@@ -1949,6 +2115,12 @@ notify_pointer_frame(struct weston_seat *seat)
 
 	weston_compositor_wake(compositor);
 
+	/* The frame goes with the motion it ends. */
+	if (seat->motion_pending) {
+		seat->motion_frame_pending = true;
+		return;
+	}
+
 	pointer->grab->interface->frame(pointer->grab);
 }
 
@@ -2094,31 +2266,27 @@ WL_EXPORT void
 weston_keyboard_send_keymap(struct weston_keyboard *kbd, struct wl_resource *resource)
 {
 	struct weston_xkb_info *xkb_info = kbd->xkb_info;
-	void *area;
+	enum ro_anonymous_file_mapmode mapmode;
 	int fd;
 
-	fd = os_create_anonymous_file(xkb_info->keymap_size);
+	/* Only version 7 clients must map the keymap MAP_PRIVATE. */
+	if (wl_resource_get_version(resource) >= 7)
+		mapmode = RO_ANONYMOUS_FILE_MAPMODE_PRIVATE;
+	else
+		mapmode = RO_ANONYMOUS_FILE_MAPMODE_SHARED;
+
+	fd = os_ro_anonymous_file_get_fd(xkb_info->keymap_rofile, mapmode);
 	if (fd < 0) {
 		weston_log("creating a keymap file for %lu bytes failed: %m\n",
 			   (unsigned long) xkb_info->keymap_size);
 		return;
 	}
 
-	area = mmap(NULL, xkb_info->keymap_size, PROT_READ | PROT_WRITE,
-		    MAP_SHARED, fd, 0);
-	if (area == MAP_FAILED) {
-		weston_log("failed to mmap() %lu bytes\n",
-			   (unsigned long) xkb_info->keymap_size);
-		goto err_mmap;
-	}
-	strcpy(area, xkb_info->keymap_string);
-	munmap(area, xkb_info->keymap_size);
 	wl_keyboard_send_keymap(resource,
 				WL_KEYBOARD_KEYMAP_FORMAT_XKB_V1,
 				fd,
 				xkb_info->keymap_size);
-err_mmap:
-	close(fd);
+	os_ro_anonymous_file_put_fd(xkb_info->keymap_rofile, fd);
 }
 
 static void
@@ -2203,6 +2371,8 @@ notify_key(struct weston_seat *seat, const struct timespec *time, uint32_t key,
 	struct weston_keyboard_grab *grab = keyboard->grab;
 	uint32_t *k, *end;
 
+	weston_seat_flush_pointer_motion(seat);
+
 	if (state == WL_KEYBOARD_KEY_STATE_PRESSED) {
 		weston_compositor_idle_inhibit(compositor);
 	} else {
@@ -2257,6 +2427,8 @@ notify_pointer_focus(struct weston_seat *seat, struct weston_output *output,
 {
 	struct weston_pointer *pointer = weston_seat_get_pointer(seat);
 
+	weston_seat_flush_pointer_motion(seat);
+
 	if (output) {
 		weston_pointer_move_to(pointer,
 				       wl_fixed_from_double(x),
@@ -3260,6 +3432,7 @@ weston_xkb_info_destroy(struct weston_xkb_info *xkb_info)
 
 	xkb_keymap_unref(xkb_info->keymap);
 
+	os_ro_anonymous_file_destroy(xkb_info->keymap_rofile);
 	if (xkb_info->keymap_string)
 		free(xkb_info->keymap_string);
 	free(xkb_info);
@@ -3321,8 +3494,19 @@ weston_xkb_info_create(struct xkb_keymap *keymap)
 	}
 	xkb_info->keymap_size = strlen(xkb_info->keymap_string) + 1;
 
+	/* Shared by all the clients, when the kernel can seal it. */
+	xkb_info->keymap_rofile =
+		os_ro_anonymous_file_create(xkb_info->keymap_string,
+					    xkb_info->keymap_size);
+	if (xkb_info->keymap_rofile == NULL) {
+		weston_log("failed to create keymap file\n");
+		goto err_string;
+	}
+
 	return xkb_info;
 
+err_string:
+	free(xkb_info->keymap_string);
 err_keymap:
 	xkb_keymap_unref(xkb_info->keymap);
 	free(xkb_info);
@@ -3488,6 +3672,9 @@ weston_seat_release_pointer(struct weston_seat *seat)
 
 	seat->pointer_device_count--;
 	if (seat->pointer_device_count == 0) {
+		seat->motion_pending = false;
+		seat->motion_frame_pending = false;
+
 		weston_pointer_clear_focus(pointer);
 		weston_pointer_cancel_grab(pointer);
 
@@ -3552,7 +3739,7 @@ weston_seat_init(struct weston_seat *seat, struct weston_compositor *ec,
 	wl_signal_init(&seat->destroy_signal);
 	wl_signal_init(&seat->updated_caps_signal);
 
-	seat->global = wl_global_create(ec->wl_display, &wl_seat_interface, 5,
+	seat->global = wl_global_create(ec->wl_display, &wl_seat_interface, 7,
 					seat, bind_seat);
 
 	seat->compositor = ec;
@@ -3796,6 +3983,8 @@ weston_pointer_constraint_destroy(struct weston_pointer_constraint *constraint)
 
 	wl_resource_set_user_data(constraint->resource, NULL);
 	pixman_region32_fini(&constraint->region);
+	if (constraint->outline)
+		confine_outline_destroy(constraint->outline);
 	wl_list_remove(&constraint->link);
 	free(constraint);
 }
@@ -4002,6 +4191,7 @@ pointer_constraint_surface_committed(struct wl_listener *listener, void *data)
 	struct weston_pointer_constraint *constraint =
 		container_of(listener, struct weston_pointer_constraint,
 			     surface_commit_listener);
+	pixman_region32_t confine_region;
 
 	if (constraint->region_is_pending) {
 		constraint->region_is_pending = false;
@@ -4011,6 +4201,20 @@ pointer_constraint_surface_committed(struct wl_listener *listener, void *data)
 		pixman_region32_init(&constraint->region_pending);
 	}
 
+	/* The constraint region or the input region may have changed. */
+	if (constraint->outline) {
+		pixman_region32_init(&confine_region);
+		pixman_region32_intersect(&confine_region,
+					  &constraint->surface->input,
+					  &constraint->region);
+		if (!pixman_region32_equal(&confine_region,
+					   &constraint->outline->region)) {
+			confine_outline_destroy(constraint->outline);
+			constraint->outline = NULL;
+		}
+		pixman_region32_fini(&confine_region);
+	}
+
 	if (constraint->hint_is_pending) {
 		constraint->hint_is_pending = false;
 
@@ -4595,6 +4799,107 @@ is_border_horizontal (struct border *border)
 	return border->line.a.y == border->line.b.y;
 }
 
+/* Position of a border across its direction */
+static double
+border_position(struct border *border)
+{
+	return is_border_horizontal(border) ?
+		border->line.a.y : border->line.a.x;
+}
+
+static int
+compare_borders_position(const void *a, const void *b)
+{
+	struct border *border_a = (struct border *) a;
+	struct border *border_b = (struct border *) b;
+	double pos_a = border_position(border_a);
+	double pos_b = border_position(border_b);
+
+	if (pos_a != pos_b)
+		return pos_a < pos_b ? -1 : 1;
+
+	return border_a->order - border_b->order;
+}
+
+static void
+confine_outline_destroy(struct weston_confine_outline *outline)
+{
+	pixman_region32_fini(&outline->region);
+	wl_array_release(&outline->borders);
+	wl_array_release(&outline->horizontal);
+	wl_array_release(&outline->vertical);
+	free(outline);
+}
+
+static struct weston_confine_outline *
+confine_outline_create(pixman_region32_t *region)
+{
+	struct weston_confine_outline *outline;
+	struct border *border, *copy;
+	int order = 0;
+
+	outline = zalloc(sizeof *outline);
+	if (!outline)
+		return NULL;
+
+	pixman_region32_init(&outline->region);
+	pixman_region32_copy(&outline->region, region);
+	wl_array_init(&outline->borders);
+	wl_array_init(&outline->horizontal);
+	wl_array_init(&outline->vertical);
+
+	/*
+	 * Generate borders given the confine region we are to use. The borders
+	 * are defined to be the outer region of the allowed area. This means
+	 * top/left borders are "within" the allowed area, while bottom/right
+	 * borders are outside. This needs to be considered when clamping
+	 * confined motion vectors.
+	 */
+	region_to_outline(region, &outline->borders);
+
+	wl_array_for_each(border, &outline->borders) {
+		border->order = order++;
+
+		if (is_border_horizontal(border))
+			copy = wl_array_add(&outline->horizontal, sizeof *copy);
+		else
+			copy = wl_array_add(&outline->vertical, sizeof *copy);
+		if (!copy) {
+			confine_outline_destroy(outline);
+			return NULL;
+		}
+		*copy = *border;
+	}
+
+	qsort(outline->horizontal.data,
+	      outline->horizontal.size / sizeof *border,
+	      sizeof *border, compare_borders_position);
+	qsort(outline->vertical.data,
+	      outline->vertical.size / sizeof *border,
+	      sizeof *border, compare_borders_position);
+
+	return outline;
+}
+
+/* The outline of the confinement region, built on first use */
+static struct weston_confine_outline *
+get_confine_outline(struct weston_pointer_constraint *constraint)
+{
+	pixman_region32_t confine_region;
+
+	if (constraint->outline)
+		return constraint->outline;
+
+	pixman_region32_init(&confine_region);
+	pixman_region32_intersect(&confine_region,
+				  &constraint->surface->input,
+				  &constraint->region);
+	constraint->outline = confine_outline_create(&confine_region);
+	pixman_region32_fini(&confine_region);
+
+	return constraint->outline;
+}
+
 static bool
 is_border_blocking_directions(struct border *border,
 			      uint32_t directions)
@@ -4613,19 +4918,36 @@ is_border_blocking_directions(struct border *border,
 	return (~border->blocking_dir & directions) != directions;
 }
 
-static struct border *
-get_closest_border(struct wl_array *borders,
-		   struct line *motion,
-		   uint32_t directions)
+/* Look for a closer border among those of a sorted array that lie
+ * between from and to. Of borders at the same distance, the first in
+ * the outline wins. */
+static void
+find_closest_border(struct wl_array *sorted,
+		    double from, double to,
+		    struct line *motion,
+		    uint32_t directions,
+		    struct border **closest_border,
+		    double *closest_distance_2)
 {
-	struct border *border;
+	struct border *borders = sorted->data;
+	size_t n = sorted->size / sizeof *borders;
+	size_t lo = 0, hi = n, mid;
 	struct vec2d intersection;
 	struct vec2d delta;
 	double distance_2;
-	struct border *closest_border = NULL;
-	double closest_distance_2 = DBL_MAX;
+	size_t i;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (border_position(&borders[mid]) < from)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (i = lo; i < n && border_position(&borders[i]) <= to; i++) {
+		struct border *border = &borders[i];
 
-	wl_array_for_each(border, borders) {
 		if (!is_border_blocking_directions(border, directions))
 			continue;
 
@@ -4634,11 +4956,39 @@ get_closest_border(struct wl_array *borders,
 
 		delta = vec2d_subtract(intersection, motion->a);
 		distance_2 = delta.x*delta.x + delta.y*delta.y;
-		if (distance_2 < closest_distance_2) {
-			closest_border = border;
-			closest_distance_2 = distance_2;
+		if (distance_2 < *closest_distance_2 ||
+		    (*closest_border && distance_2 == *closest_distance_2 &&
+		     border->order < (*closest_border)->order)) {
+			*closest_border = border;
+			*closest_distance_2 = distance_2;
 		}
 	}
+}
+
+static struct border *
+get_closest_border(struct weston_confine_outline *outline,
+		   struct line *motion,
+		   uint32_t directions)
+{
+	struct border *closest_border = NULL;
+	double closest_distance_2 = DBL_MAX;
+
+	/* Parallel borders never block, and the others can only be hit
+	 * within the span of the motion. */
+	if (directions & (MOTION_DIRECTION_POSITIVE_Y |
+			  MOTION_DIRECTION_NEGATIVE_Y))
+		find_closest_border(&outline->horizontal,
+				    MIN(motion->a.y, motion->b.y),
+				    MAX(motion->a.y, motion->b.y),
+				    motion, directions,
+				    &closest_border, &closest_distance_2);
+	if (directions & (MOTION_DIRECTION_POSITIVE_X |
+			  MOTION_DIRECTION_NEGATIVE_X))
+		find_closest_border(&outline->vertical,
+				    MIN(motion->a.x, motion->b.x),
+				    MAX(motion->a.x, motion->b.x),
+				    motion, directions,
+				    &closest_border, &closest_distance_2);
 
 	return closest_border;
 }
@@ -4692,7 +5042,7 @@ get_motion_directions(struct line *motion)
 static void
 weston_pointer_clamp_event_to_region(struct weston_pointer *pointer,
 				     struct weston_pointer_motion_event *event,
-				     pixman_region32_t *region,
+				     struct weston_confine_outline *outline,
 				     wl_fixed_t *clamped_x,
 				     wl_fixed_t *clamped_y)
 {
@@ -4700,7 +5050,6 @@ weston_pointer_clamp_event_to_region(struct weston_pointer *pointer,
 	wl_fixed_t sx, sy;
 	wl_fixed_t old_sx = pointer->sx;
 	wl_fixed_t old_sy = pointer->sy;
-	struct wl_array borders;
 	struct line motion;
 	struct border *closest_border;
 	float new_x_f, new_y_f;
@@ -4709,17 +5058,6 @@ weston_pointer_clamp_event_to_region(struct weston_pointer *pointer,
 	weston_pointer_motion_to_abs(pointer, event, &x, &y);
 	weston_view_from_global_fixed(pointer->focus, x, y, &sx, &sy);
 
-	wl_array_init(&borders);
-
-	/*
-	 * Generate borders given the confine region we are to use. The borders
-	 * are defined to be the outer region of the allowed area. This means
-	 * top/left borders are "within" the allowed area, while bottom/right
-	 * borders are outside. This needs to be considered when clamping
-	 * confined motion vectors.
-	 */
-	region_to_outline(region, &borders);
-
 	motion = (struct line) {
 		.a = (struct vec2d) {
 			.x = wl_fixed_to_double(old_sx),
@@ -4733,7 +5071,7 @@ weston_pointer_clamp_event_to_region(struct weston_pointer *pointer,
 	directions = get_motion_directions(&motion);
 
 	while (directions) {
-		closest_border = get_closest_border(&borders,
+		closest_border = get_closest_border(outline,
 						    &motion,
 						    directions);
 		if (closest_border)
@@ -4747,8 +5085,6 @@ weston_pointer_clamp_event_to_region(struct weston_pointer *pointer,
 				    &new_x_f, &new_y_f);
 	*clamped_x = wl_fixed_from_double(new_x_f);
 	*clamped_y = wl_fixed_from_double(new_y_f);
-
-	wl_array_release(&borders);
 }
 
 static double
@@ -4827,22 +5163,16 @@ maybe_warp_confined_pointer(struct weston_pointer_constraint *constraint)
 	if (!is_within_constraint_region(constraint, sx, sy)) {
 		double xf = wl_fixed_to_double(sx);
 		double yf = wl_fixed_to_double(sy);
-		pixman_region32_t confine_region;
-		struct wl_array borders;
+		struct weston_confine_outline *outline;
 		struct border *border;
 		double closest_distance_2 = DBL_MAX;
 		struct border *closest_border = NULL;
 
-		wl_array_init(&borders);
-
-		pixman_region32_init(&confine_region);
-		pixman_region32_intersect(&confine_region,
-					  &constraint->view->surface->input,
-					  &constraint->region);
-		region_to_outline(&confine_region, &borders);
-		pixman_region32_fini(&confine_region);
+		outline = get_confine_outline(constraint);
+		if (!outline)
+			return;
 
-		wl_array_for_each(border, &borders) {
+		wl_array_for_each(border, &outline->borders) {
 			double distance_2;
 
 			distance_2 = point_to_border_distance_2(border, xf, yf);
@@ -4855,8 +5185,6 @@ maybe_warp_confined_pointer(struct weston_pointer_constraint *constraint)
 
 		warp_to_behind_border(closest_border, &sx, &sy);
 
-		wl_array_release(&borders);
-
 		weston_view_to_global_fixed(constraint->view, sx, sy, &x, &y);
 		weston_pointer_move_to(constraint->pointer, x, y);
 	}
@@ -4870,25 +5198,23 @@ confined_pointer_grab_pointer_motion(struct weston_pointer_grab *grab,
 	struct weston_pointer_constraint *constraint =
 		container_of(grab, struct weston_pointer_constraint, grab);
 	struct weston_pointer *pointer = grab->pointer;
-	struct weston_surface *surface;
+	struct weston_confine_outline *outline;
 	wl_fixed_t x, y;
 	wl_fixed_t old_sx = pointer->sx;
 	wl_fixed_t old_sy = pointer->sy;
-	pixman_region32_t confine_region;
 
 	assert(pointer->focus);
 	assert(pointer->focus->surface == constraint->surface);
 
-	surface = pointer->focus->surface;
+	outline = get_confine_outline(constraint);
+	if (!outline) {
+		pointer_send_relative_motion(pointer, time, event);
+		return;
+	}
 
-	pixman_region32_init(&confine_region);
-	pixman_region32_intersect(&confine_region,
-				  &surface->input,
-				  &constraint->region);
 	weston_pointer_clamp_event_to_region(pointer, event,
-					     &confine_region, &x, &y);
+					     outline, &x, &y);
 	weston_pointer_move_to(pointer, x, y);
-	pixman_region32_fini(&confine_region);
 
 	weston_view_from_global_fixed(pointer->focus, x, y,
 				      &pointer->sx, &pointer->sy);
@@ -5183,6 +5509,11 @@ weston_input_init(struct weston_compositor *compositor)
 			      NULL, bind_input_timestamps_manager))
 		return -1;
 
+	compositor->debug_pointer_motion =
+		weston_compositor_add_debug_scope(compositor, "pointer-motion",
+			"Coalescing of pointer motion, per repaint\n",
+			NULL, NULL);
+
 	return 0;
 }
 
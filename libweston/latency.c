@@ -0,0 +1,358 @@
+/*
+ * Copyright © 2018 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compositor.h"
+#include "latency.h"
+#include "weston-debug.h"
+#include "shared/helpers.h"
+#include "shared/timespec-util.h"
+
+/* Input to photon latency
+ *
+ * Input delivered to a surface tags it with the time of the event. The
+ * next commit attaching a buffer is taken as the response, and the repaint
+ * of the primary output of the surface takes it along, until the frame is
+ * presented. The latency, from the input event to the presentation, is
+ * then added to the histograms of the surface and of the output.
+ *
+ * Only the oldest input a surface has not responded to counts: events
+ * coming until the next commit are answered by the same frame.
+ */
+
+/* Bucket n counts latencies of [2^n, 2^(n+1)) microseconds, the first
+ * one from 0, the last one without bound. */
+#define LATENCY_BUCKETS 24
+
+/* Older event timestamps are not trusted, nor input left unanswered
+ * for longer. */
+#define LATENCY_MAX_NSEC NSEC_PER_SEC
+
+struct weston_latency_histogram {
+	uint64_t count;
+	uint64_t sum_usec;
+	uint64_t min_usec;
+	uint64_t max_usec;
+	uint64_t buckets[LATENCY_BUCKETS];
+};
+
+struct latency_sample {
+	struct weston_surface *surface;	/* NULL once destroyed */
+	struct timespec input_time;
+};
+
+static unsigned int
+latency_bucket(uint64_t usec)
+{
+	unsigned int n = 0;
+
+	while (usec >= 2 && n < LATENCY_BUCKETS - 1) {
+		usec >>= 1;
+		n++;
+	}
+
+	return n;
+}
+
+static void
+latency_histogram_add(struct weston_latency_histogram **histogram,
+		      uint64_t usec)
+{
+	struct weston_latency_histogram *h = *histogram;
+
+	if (!h) {
+		h = zalloc(sizeof *h);
+		if (!h)
+			return;
+		h->min_usec = UINT64_MAX;
+		*histogram = h;
+	}
+
+	h->count++;
+	h->sum_usec += usec;
+	h->min_usec = MIN(h->min_usec, usec);
+	h->max_usec = MAX(h->max_usec, usec);
+	h->buckets[latency_bucket(usec)]++;
+}
+
+/* Upper bound of the bucket holding the given percentile */
+static uint64_t
+latency_histogram_percentile(struct weston_latency_histogram *h,
+			     unsigned int percent)
+{
+	uint64_t rank = (h->count * percent + 99) / 100;
+	uint64_t seen = 0;
+	unsigned int n;
+
+	for (n = 0; n < LATENCY_BUCKETS - 1; n++) {
+		seen += h->buckets[n];
+		if (seen >= rank)
+			break;
+	}
+
+	return n < LATENCY_BUCKETS - 1 ? UINT64_C(2) << n : h->max_usec;
+}
+
+static void
+latency_histogram_print(struct weston_debug_stream *stream,
+			struct weston_latency_histogram *h)
+{
+	uint64_t from;
+	unsigned int n;
+
+	if (!h) {
+		weston_debug_stream_printf(stream, "\tno samples\n");
+		return;
+	}
+
+	weston_debug_stream_printf(stream,
+		"\t%" PRIu64 " samples, min %" PRIu64 " us, "
+		"mean %" PRIu64 " us, max %" PRIu64 " us\n",
+		h->count, h->min_usec, h->sum_usec / h->count, h->max_usec);
+	weston_debug_stream_printf(stream,
+		"\tp50 <= %" PRIu64 " us, p90 <= %" PRIu64 " us, "
+		"p99 <= %" PRIu64 " us\n",
+		latency_histogram_percentile(h, 50),
+		latency_histogram_percentile(h, 90),
+		latency_histogram_percentile(h, 99));
+
+	for (n = 0; n < LATENCY_BUCKETS; n++) {
+		if (h->buckets[n] == 0)
+			continue;
+
+		from = n > 0 ? UINT64_C(1) << n : 0;
+		if (n < LATENCY_BUCKETS - 1)
+			weston_debug_stream_printf(stream,
+				"\t\t[%" PRIu64 ", %" PRIu64 ") us: %" PRIu64 "\n",
+				from, UINT64_C(2) << n, h->buckets[n]);
+		else
+			weston_debug_stream_printf(stream,
+				"\t\t[%" PRIu64 ", inf) us: %" PRIu64 "\n",
+				from, h->buckets[n]);
+	}
+}
+
+static void
+latency_print_surface(struct weston_debug_stream *stream,
+		      struct weston_surface *surface)
+{
+	char desc[512];
+	uint32_t surface_id = 0;
+	pid_t pid = 0;
+
+	if (surface->resource) {
+		wl_client_get_credentials(
+			wl_resource_get_client(surface->resource),
+			&pid, NULL, NULL);
+		surface_id = wl_resource_get_id(surface->resource);
+	}
+
+	if (!surface->get_label ||
+	    surface->get_label(surface, desc, sizeof(desc)) < 0)
+		strcpy(desc, "[no description available]");
+
+	weston_debug_stream_printf(stream,
+		"Surface (role %s, PID %d, surface ID %u, %s):\n",
+		surface->role_name, pid, surface_id, desc);
+	latency_histogram_print(stream, surface->latency);
+}
+
+/*
+ * Called when the 'input-latency' debug scope is bound by a client. This
+ * one-shot scope prints the latency histograms of the outputs and of the
+ * mapped surfaces, and then terminates the stream.
+ */
+static void
+latency_debug_cb(struct weston_debug_stream *stream, void *data)
+{
+	struct weston_compositor *compositor = data;
+	struct weston_output *output;
+	struct weston_layer *layer;
+	struct weston_view *view;
+
+	wl_list_for_each(output, &compositor->output_list, link) {
+		weston_debug_stream_printf(stream, "Output \"%s\":\n",
+					   output->name);
+		latency_histogram_print(stream, output->latency);
+	}
+
+	wl_list_for_each(layer, &compositor->layer_list, link) {
+		wl_list_for_each(view, &layer->view_list.link, layer_link.link) {
+			struct weston_surface *surface = view->surface;
+
+			/* Once per surface, and only those having input */
+			if (surface->views.next != &view->surface_link ||
+			    !surface->latency)
+				continue;
+
+			latency_print_surface(stream, surface);
+		}
+	}
+
+	weston_debug_stream_complete(stream);
+}
+
+void
+weston_compositor_latency_init(struct weston_compositor *compositor)
+{
+	compositor->debug_latency =
+		weston_compositor_add_debug_scope(compositor, "input-latency",
+			"Input to presentation latency histograms\n",
+			latency_debug_cb, compositor);
+}
+
+/** Tag a surface with input delivered to it
+ *
+ * \param surface The surface having the focus of the input device.
+ * \param time The timestamp of the event.
+ *
+ * Timestamps not on the presentation clock, such as those of the test
+ * input injector, are replaced with the current time.
+ */
+void
+weston_surface_latency_tag_input(struct weston_surface *surface,
+				 const struct timespec *time)
+{
+	struct timespec now;
+	int64_t age;
+
+	if (!timespec_is_zero(&surface->latency_input_time))
+		return;
+
+	weston_compositor_read_presentation_clock(surface->compositor, &now);
+
+	age = timespec_sub_to_nsec(&now, time);
+	if (age >= 0 && age < LATENCY_MAX_NSEC)
+		surface->latency_input_time = *time;
+	else
+		surface->latency_input_time = now;
+}
+
+/* A buffer was committed, in response to the input tagged if any. */
+void
+weston_surface_latency_commit(struct weston_surface *surface)
+{
+	struct timespec now;
+
+	if (timespec_is_zero(&surface->latency_input_time))
+		return;
+
+	weston_compositor_read_presentation_clock(surface->compositor, &now);
+
+	if (timespec_is_zero(&surface->latency_commit_time) &&
+	    timespec_sub_to_nsec(&now, &surface->latency_input_time) <
+	    LATENCY_MAX_NSEC)
+		surface->latency_commit_time = surface->latency_input_time;
+
+	surface->latency_input_time = (struct timespec) { 0 };
+}
+
+void
+weston_surface_latency_release(struct weston_surface *surface)
+{
+	struct weston_output *output;
+	struct latency_sample *sample;
+
+	wl_list_for_each(output, &surface->compositor->output_list, link) {
+		wl_array_for_each(sample, &output->latency_samples) {
+			if (sample->surface == surface)
+				sample->surface = NULL;
+		}
+	}
+
+	free(surface->latency);
+	surface->latency = NULL;
+}
+
+/* Take the committed response of a surface into the frame being
+ * repainted. A response that waited too long for a repaint, such as one
+ * committed while the surface was on no output, is dropped. */
+void
+weston_output_latency_take(struct weston_output *output,
+			   struct weston_surface *surface)
+{
+	struct latency_sample *sample;
+	struct timespec now;
+
+	if (timespec_is_zero(&surface->latency_commit_time))
+		return;
+
+	weston_compositor_read_presentation_clock(surface->compositor, &now);
+	if (timespec_sub_to_nsec(&now, &surface->latency_commit_time) >=
+	    LATENCY_MAX_NSEC) {
+		surface->latency_commit_time = (struct timespec) { 0 };
+		return;
+	}
+
+	sample = wl_array_add(&output->latency_samples, sizeof *sample);
+	if (sample) {
+		sample->surface = surface;
+		sample->input_time = surface->latency_commit_time;
+	}
+
+	surface->latency_commit_time = (struct timespec) { 0 };
+}
+
+/* The frame was presented at stamp. */
+void
+weston_output_latency_present(struct weston_output *output,
+			      const struct timespec *stamp)
+{
+	struct latency_sample *sample;
+	int64_t usec;
+
+	wl_array_for_each(sample, &output->latency_samples) {
+		usec = timespec_sub_to_nsec(stamp, &sample->input_time) / 1000;
+		if (usec < 0)
+			usec = 0;
+
+		latency_histogram_add(&output->latency, usec);
+		if (sample->surface)
+			latency_histogram_add(&sample->surface->latency, usec);
+	}
+
+	output->latency_samples.size = 0;
+}
+
+/* The frame will not be presented. */
+void
+weston_output_latency_discard(struct weston_output *output)
+{
+	output->latency_samples.size = 0;
+}
+
+void
+weston_output_latency_release(struct weston_output *output)
+{
+	wl_array_release(&output->latency_samples);
+	free(output->latency);
+	output->latency = NULL;
+}
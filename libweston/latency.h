@@ -0,0 +1,62 @@
+/*
+ * Copyright © 2018 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef WESTON_LATENCY_H
+#define WESTON_LATENCY_H
+
+#include <time.h>
+
+struct weston_compositor;
+struct weston_output;
+struct weston_surface;
+
+void
+weston_compositor_latency_init(struct weston_compositor *compositor);
+
+void
+weston_surface_latency_tag_input(struct weston_surface *surface,
+				 const struct timespec *time);
+
+void
+weston_surface_latency_commit(struct weston_surface *surface);
+
+void
+weston_surface_latency_release(struct weston_surface *surface);
+
+void
+weston_output_latency_take(struct weston_output *output,
+			   struct weston_surface *surface);
+
+void
+weston_output_latency_present(struct weston_output *output,
+			      const struct timespec *stamp);
+
+void
+weston_output_latency_discard(struct weston_output *output);
+
+void
+weston_output_latency_release(struct weston_output *output);
+
+#endif /* WESTON_LATENCY_H */
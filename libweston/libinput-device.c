@@ -40,6 +40,7 @@
 
 #include "compositor.h"
 #include "libinput-device.h"
+#include "libinput-seat.h"
 #include "shared/helpers.h"
 #include "shared/timespec-util.h"
 #include "pointer-gestures-unstable-v1-server-protocol.h"
@@ -331,14 +332,27 @@ touch_get_calibration_head_name(struct weston_touch_device *device)
 	return NULL;
 }
 
+/* The input thread, when there is one, uses libinput concurrently. */
+static struct udev_input *
+evdev_device_get_input(struct evdev_device *device)
+{
+	struct libinput *libinput =
+		libinput_device_get_context(device->device);
+
+	return libinput_get_user_data(libinput);
+}
+
 static void
 touch_get_calibration(struct weston_touch_device *device,
 		      struct weston_touch_device_matrix *cal)
 {
 	struct evdev_device *evdev_device = device->backend_data;
+	struct udev_input *input = evdev_device_get_input(evdev_device);
 
+	udev_input_lock(input);
 	libinput_device_config_calibration_get_matrix(evdev_device->device,
 						      cal->m);
+	udev_input_unlock(input);
 }
 
 static void
@@ -365,13 +379,16 @@ touch_set_calibration(struct weston_touch_device *device,
 		      const struct weston_touch_device_matrix *cal)
 {
 	struct evdev_device *evdev_device = device->backend_data;
+	struct udev_input *input = evdev_device_get_input(evdev_device);
 
 	/* Stop output hotplug from reloading the WL_CALIBRATION values.
 	 * libinput will maintain the latest calibration for us.
 	 */
 	evdev_device->override_wl_calibration = true;
 
+	udev_input_lock(input);
 	do_set_calibration(evdev_device, cal);
+	udev_input_unlock(input);
 }
 
 static const struct weston_touch_device_ops touch_calibration_ops = {
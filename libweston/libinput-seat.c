@@ -26,11 +26,18 @@
 
 #include "config.h"
 
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/eventfd.h>
 #include <libinput.h>
 #include <libudev.h>
 
@@ -38,7 +45,52 @@
 #include "launcher-util.h"
 #include "libinput-seat.h"
 #include "libinput-device.h"
+#include "input-ring.h"
+#include "weston-debug.h"
 #include "shared/helpers.h"
+#include "shared/timespec-util.h"
+
+/* A device to open or close for libinput, on the compositor thread */
+struct launcher_request {
+	bool pending;
+	bool done;
+	const char *path;	/* NULL to close fd */
+	int flags;
+	int fd;
+};
+
+/* Drains libinput on its own thread, so that events are read from the
+ * kernel as they come even while the compositor thread is busy. They are
+ * handed over through a single producer, single consumer ring, and the
+ * compositor thread is woken through an eventfd to process them. The
+ * events keep the kernel timestamps libinput gave them.
+ *
+ * The launchers are not thread safe, so devices libinput opens or closes
+ * from the input thread, on hotplug, are handled by the compositor
+ * thread. It serves such a request from its event loop, and whenever it
+ * waits for the input thread: for the libinput lock, or for the thread
+ * to exit. */
+struct udev_input_thread {
+	struct udev_input *input;
+	pthread_t thread;
+	int notify_fd;		/* input thread to compositor thread */
+	int wake_fd;		/* compositor thread to input thread */
+	struct wl_event_source *notify_source;
+	struct weston_debug_scope *debug;
+
+	bool quit;
+	struct input_ring ring;	/* of struct libinput_event */
+
+	/* Guards the request and exited, and signals their changes as
+	 * well as the release of the libinput lock by the input thread. */
+	pthread_mutex_t request_lock;
+	pthread_cond_t request_cond;
+	struct launcher_request request;
+	bool exited;
+};
+
+/* Set on the input thread */
+static __thread struct udev_input_thread *current_input_thread;
 
 static void
 process_events(struct udev_input *input);
@@ -165,8 +217,13 @@ udev_input_disable(struct udev_input *input)
 	if (input->suspended)
 		return;
 
-	wl_event_source_remove(input->libinput_source);
-	input->libinput_source = NULL;
+	if (input->thread) {
+		udev_input_thread_stop(input->thread);
+		input->thread = NULL;
+	} else {
+		wl_event_source_remove(input->libinput_source);
+		input->libinput_source = NULL;
+	}
 	libinput_suspend(input->libinput);
 	process_events(input);
 	input->suspended = 1;
@@ -215,6 +272,322 @@ process_events(struct udev_input *input)
 	}
 }
 
+static void
+eventfd_signal(int fd)
+{
+	uint64_t value = 1;
+	ssize_t ret;
+
+	do {
+		ret = write(fd, &value, sizeof value);
+	} while (ret < 0 && errno == EINTR);
+}
+
+static void
+eventfd_clear(int fd)
+{
+	uint64_t value;
+	ssize_t ret;
+
+	do {
+		ret = read(fd, &value, sizeof value);
+	} while (ret < 0 && errno == EINTR);
+}
+
+/* Open or close the device of a request. Called on the compositor
+ * thread with request_lock held. */
+static void
+udev_input_thread_serve(struct udev_input_thread *thread)
+{
+	struct weston_launcher *launcher = thread->input->compositor->launcher;
+	struct launcher_request *request = &thread->request;
+
+	if (!request->pending || request->done)
+		return;
+
+	if (request->path)
+		request->fd = weston_launcher_open(launcher, request->path,
+						   request->flags);
+	else
+		weston_launcher_close(launcher, request->fd);
+
+	request->done = true;
+	pthread_cond_broadcast(&thread->request_cond);
+}
+
+/* Have the compositor thread handle a request, from the input thread. */
+static int
+udev_input_thread_call(struct udev_input_thread *thread,
+		       const char *path, int flags, int fd)
+{
+	struct launcher_request *request = &thread->request;
+
+	pthread_mutex_lock(&thread->request_lock);
+	request->path = path;
+	request->flags = flags;
+	request->fd = fd;
+	request->done = false;
+	request->pending = true;
+	pthread_cond_broadcast(&thread->request_cond);
+	eventfd_signal(thread->notify_fd);
+
+	while (!request->done)
+		pthread_cond_wait(&thread->request_cond, &thread->request_lock);
+
+	fd = request->fd;
+	request->pending = false;
+	pthread_mutex_unlock(&thread->request_lock);
+
+	return fd;
+}
+
+/* Release the libinput lock on the input thread, waking the compositor
+ * thread if it waits for it. */
+static void
+udev_input_thread_unlock(struct udev_input_thread *thread)
+{
+	pthread_mutex_unlock(&thread->input->lock);
+
+	pthread_mutex_lock(&thread->request_lock);
+	pthread_cond_broadcast(&thread->request_cond);
+	pthread_mutex_unlock(&thread->request_lock);
+}
+
+/* Take the libinput lock on the compositor thread. While the input
+ * thread holds it, it may be waiting for a request to be served. */
+void
+udev_input_lock(struct udev_input *input)
+{
+	struct udev_input_thread *thread = input->thread;
+
+	if (!thread) {
+		pthread_mutex_lock(&input->lock);
+		return;
+	}
+
+	pthread_mutex_lock(&thread->request_lock);
+	while (pthread_mutex_trylock(&input->lock) != 0) {
+		udev_input_thread_serve(thread);
+		pthread_cond_wait(&thread->request_cond, &thread->request_lock);
+	}
+	pthread_mutex_unlock(&thread->request_lock);
+}
+
+void
+udev_input_unlock(struct udev_input *input)
+{
+	pthread_mutex_unlock(&input->lock);
+}
+
+/* Move what libinput has to the ring. Returns true if it is full, events
+ * being left in libinput. */
+static bool
+udev_input_thread_read(struct udev_input_thread *thread)
+{
+	struct udev_input *input = thread->input;
+	struct libinput_event *event;
+	bool full;
+
+	pthread_mutex_lock(&input->lock);
+	libinput_dispatch(input->libinput);
+	while (!(full = input_ring_is_full(&thread->ring)) &&
+	       (event = libinput_get_event(input->libinput)))
+		input_ring_push(&thread->ring, event);
+	udev_input_thread_unlock(thread);
+
+	if (input_ring_publish(&thread->ring))
+		eventfd_signal(thread->notify_fd);
+
+	return full;
+}
+
+static void *
+udev_input_thread_run(void *data)
+{
+	struct udev_input_thread *thread = data;
+	struct pollfd fds[2];
+	bool full = false;
+	int ret;
+
+	current_input_thread = thread;
+
+	fds[0].fd = thread->wake_fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = libinput_get_fd(thread->input->libinput);
+	fds[1].events = POLLIN;
+
+	for (;;) {
+		/* With a full ring, the kernel queue is left alone until
+		 * there is room again, wake_fd being signalled then. */
+		if (!full)
+			ret = poll(fds, 2, -1);
+		else if (!input_ring_has_room(&thread->ring))
+			ret = poll(fds, 1, -1);
+		else
+			ret = 0;
+		if (ret < 0 && errno != EINTR)
+			break;
+
+		if (ret > 0 && fds[0].revents & POLLIN)
+			eventfd_clear(thread->wake_fd);
+		if (__atomic_load_n(&thread->quit, __ATOMIC_ACQUIRE))
+			break;
+
+		full = udev_input_thread_read(thread);
+	}
+
+	pthread_mutex_lock(&thread->request_lock);
+	thread->exited = true;
+	pthread_cond_broadcast(&thread->request_cond);
+	pthread_mutex_unlock(&thread->request_lock);
+
+	return NULL;
+}
+
+/* Process the events the input thread read, in order */
+static void
+udev_input_thread_process(struct udev_input_thread *thread)
+{
+	struct udev_input *input = thread->input;
+	struct input_ring_entry *entry;
+	struct timespec now;
+	int64_t wait_usec, max_wait_usec = 0;
+	uint32_t i, n;
+
+	n = input_ring_available(&thread->ring);
+	if (n == 0)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	udev_input_lock(input);
+	for (i = 0; i < n; i++) {
+		entry = input_ring_entry(&thread->ring, i);
+
+		wait_usec = timespec_sub_to_nsec(&now, &entry->read_time) /
+			    1000;
+		if (wait_usec > max_wait_usec)
+			max_wait_usec = wait_usec;
+
+		process_event(entry->event);
+		libinput_event_destroy(entry->event);
+	}
+	udev_input_unlock(input);
+
+	if (input_ring_release(&thread->ring, n))
+		eventfd_signal(thread->wake_fd);
+
+	if (weston_debug_scope_is_enabled(thread->debug))
+		weston_debug_scope_printf(thread->debug,
+			"%u events, waited up to %" PRId64 " us\n",
+			n, max_wait_usec);
+}
+
+static int
+udev_input_thread_notify(int fd, uint32_t mask, void *data)
+{
+	struct udev_input_thread *thread = data;
+
+	eventfd_clear(fd);
+
+	pthread_mutex_lock(&thread->request_lock);
+	udev_input_thread_serve(thread);
+	pthread_mutex_unlock(&thread->request_lock);
+
+	udev_input_thread_process(thread);
+
+	return 0;
+}
+
+static void
+udev_input_thread_destroy(struct udev_input_thread *thread)
+{
+	if (thread->notify_source)
+		wl_event_source_remove(thread->notify_source);
+	if (thread->notify_fd >= 0)
+		close(thread->notify_fd);
+	if (thread->wake_fd >= 0)
+		close(thread->wake_fd);
+	weston_debug_scope_destroy(thread->debug);
+	pthread_cond_destroy(&thread->request_cond);
+	pthread_mutex_destroy(&thread->request_lock);
+	free(thread);
+}
+
+static struct udev_input_thread *
+udev_input_thread_start(struct udev_input *input)
+{
+	struct weston_compositor *c = input->compositor;
+	struct udev_input_thread *thread;
+	struct wl_event_loop *loop;
+	sigset_t mask, old_mask;
+	int ret;
+
+	thread = zalloc(sizeof *thread);
+	if (!thread)
+		return NULL;
+
+	thread->input = input;
+	input_ring_init(&thread->ring);
+	pthread_mutex_init(&thread->request_lock, NULL);
+	pthread_cond_init(&thread->request_cond, NULL);
+	thread->notify_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	thread->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (thread->notify_fd < 0 || thread->wake_fd < 0)
+		goto err;
+
+	loop = wl_display_get_event_loop(c->wl_display);
+	thread->notify_source =
+		wl_event_loop_add_fd(loop, thread->notify_fd, WL_EVENT_READABLE,
+				     udev_input_thread_notify, thread);
+	if (!thread->notify_source)
+		goto err;
+
+	thread->debug =
+		weston_compositor_add_debug_scope(c, "libinput-thread",
+			"Events handed over by the libinput thread\n",
+			NULL, NULL);
+
+	/* Keep signals going to the compositor thread. */
+	sigfillset(&mask);
+	sigdelset(&mask, SIGBUS);
+	sigdelset(&mask, SIGSEGV);
+	sigdelset(&mask, SIGFPE);
+	sigdelset(&mask, SIGILL);
+	pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+	ret = pthread_create(&thread->thread, NULL, udev_input_thread_run,
+			     thread);
+	pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+	if (ret != 0)
+		goto err;
+
+	return thread;
+
+err:
+	weston_log("libinput: Failed to start the input thread\n");
+	udev_input_thread_destroy(thread);
+	return NULL;
+}
+
+/* Stop the thread, and process what it read. */
+static void
+udev_input_thread_stop(struct udev_input_thread *thread)
+{
+	__atomic_store_n(&thread->quit, true, __ATOMIC_RELEASE);
+	eventfd_signal(thread->wake_fd);
+
+	pthread_mutex_lock(&thread->request_lock);
+	while (!thread->exited) {
+		udev_input_thread_serve(thread);
+		pthread_cond_wait(&thread->request_cond, &thread->request_lock);
+	}
+	pthread_mutex_unlock(&thread->request_lock);
+	pthread_join(thread->thread, NULL);
+
+	udev_input_thread_process(thread);
+	udev_input_thread_destroy(thread);
+}
+
 static int
 udev_input_dispatch(struct udev_input *input)
 {
@@ -240,6 +613,10 @@ open_restricted(const char *path, int flags, void *user_data)
 	struct udev_input *input = user_data;
 	struct weston_launcher *launcher = input->compositor->launcher;
 
+	if (current_input_thread)
+		return udev_input_thread_call(current_input_thread,
+					      path, flags, -1);
+
 	return weston_launcher_open(launcher, path, flags);
 }
 
@@ -249,6 +626,11 @@ close_restricted(int fd, void *user_data)
 	struct udev_input *input = user_data;
 	struct weston_launcher *launcher = input->compositor->launcher;
 
+	if (current_input_thread) {
+		udev_input_thread_call(current_input_thread, NULL, 0, fd);
+		return;
+	}
+
 	weston_launcher_close(launcher, fd);
 }
 
@@ -266,25 +648,29 @@ udev_input_enable(struct udev_input *input)
 	struct udev_seat *seat;
 	int devices_found = 0;
 
-	loop = wl_display_get_event_loop(c->wl_display);
-	fd = libinput_get_fd(input->libinput);
-	input->libinput_source =
-		wl_event_loop_add_fd(loop, fd, WL_EVENT_READABLE,
-				     libinput_source_dispatch, input);
-	if (!input->libinput_source) {
-		return -1;
-	}
-
 	if (input->suspended) {
-		if (libinput_resume(input->libinput) != 0) {
-			wl_event_source_remove(input->libinput_source);
-			input->libinput_source = NULL;
+		if (libinput_resume(input->libinput) != 0)
 			return -1;
-		}
 		input->suspended = 0;
 		process_events(input);
 	}
 
+	if (c->input_thread)
+		input->thread = udev_input_thread_start(input);
+
+	if (!input->thread) {
+		loop = wl_display_get_event_loop(c->wl_display);
+		fd = libinput_get_fd(input->libinput);
+		input->libinput_source =
+			wl_event_loop_add_fd(loop, fd, WL_EVENT_READABLE,
+					     libinput_source_dispatch, input);
+		if (!input->libinput_source) {
+			libinput_suspend(input->libinput);
+			input->suspended = 1;
+			return -1;
+		}
+	}
+
 	wl_list_for_each(seat, &input->compositor->seat_list, base.link) {
 		evdev_notify_keyboard_focus(&seat->base, &seat->devices_list);
 
@@ -327,9 +713,16 @@ udev_input_init(struct udev_input *input, struct weston_compositor *c,
 {
 	enum libinput_log_priority priority = LIBINPUT_LOG_PRIORITY_INFO;
 	const char *log_priority = NULL;
+	pthread_mutexattr_t attr;
 
 	memset(input, 0, sizeof *input);
 
+	/* Event handlers call back into libinput, with the lock held. */
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&input->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+
 	input->compositor = c;
 	input->configure_device = configure_device;
 
@@ -338,6 +731,7 @@ udev_input_init(struct udev_input *input, struct weston_compositor *c,
 	input->libinput = libinput_udev_create_context(&libinput_interface,
 						       input, udev);
 	if (!input->libinput) {
+		pthread_mutex_destroy(&input->lock);
 		return -1;
 	}
 
@@ -357,6 +751,7 @@ udev_input_init(struct udev_input *input, struct weston_compositor *c,
 
 	if (libinput_udev_assign_seat(input->libinput, seat_id) != 0) {
 		libinput_unref(input->libinput);
+		pthread_mutex_destroy(&input->lock);
 		return -1;
 	}
 
@@ -370,11 +765,18 @@ udev_input_destroy(struct udev_input *input)
 {
 	struct udev_seat *seat, *next;
 
-	if (input->libinput_source)
+	if (input->thread) {
+		udev_input_thread_stop(input->thread);
+		input->thread = NULL;
+	}
+	if (input->libinput_source) {
 		wl_event_source_remove(input->libinput_source);
+		input->libinput_source = NULL;
+	}
 	wl_list_for_each_safe(seat, next, &input->compositor->seat_list, base.link)
 		udev_seat_destroy(seat);
 	libinput_unref(input->libinput);
+	pthread_mutex_destroy(&input->lock);
 }
 
 static void
@@ -383,8 +785,10 @@ udev_seat_led_update(struct weston_seat *seat_base, enum weston_led leds)
 	struct udev_seat *seat = (struct udev_seat *) seat_base;
 	struct evdev_device *device;
 
+	udev_input_lock(seat->input);
 	wl_list_for_each(device, &seat->devices_list, link)
 		evdev_led_update(device, leds);
+	udev_input_unlock(seat->input);
 }
 
 static void
@@ -393,6 +797,7 @@ udev_seat_output_changed(struct udev_seat *seat, struct weston_output *output)
 	struct evdev_device *device;
 	struct weston_output *found;
 
+	udev_input_lock(seat->input);
 	wl_list_for_each(device, &seat->devices_list, link) {
 		/* If we find any input device without an associated output
 		 * or an output name to associate with, just tie it with the
@@ -412,6 +817,7 @@ udev_seat_output_changed(struct udev_seat *seat, struct weston_output *output)
 						 device->output_name);
 		evdev_device_set_output(device, found);
 	}
+	udev_input_unlock(seat->input);
 }
 
 static void
@@ -445,6 +851,7 @@ udev_seat_create(struct udev_input *input, const char *seat_name)
 		return NULL;
 
 	weston_seat_init(&seat->base, c, seat_name);
+	seat->input = input;
 	seat->base.led_update = udev_seat_led_update;
 
 	seat->output_create_listener.notify = notify_output_create;
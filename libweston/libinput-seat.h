@@ -27,14 +27,17 @@
 #ifndef _LIBINPUT_SEAT_H_
 #define _LIBINPUT_SEAT_H_
 
+#include <pthread.h>
 #include <libudev.h>
 
 #include "compositor.h"
 
 struct libinput_device;
+struct udev_input_thread;
 
 struct udev_seat {
 	struct weston_seat base;
+	struct udev_input *input;
 	struct wl_list devices_list;
 	struct wl_listener output_create_listener;
 	struct wl_listener output_heads_listener;
@@ -49,6 +52,11 @@ struct udev_input {
 	struct weston_compositor *compositor;
 	int suspended;
 	udev_configure_device_t configure_device;
+
+	/* Reads libinput when compositor->input_thread is set. libinput
+	 * is not thread safe, the recursive lock guards its use. */
+	struct udev_input_thread *thread;
+	pthread_mutex_t lock;
 };
 
 int
@@ -64,6 +72,11 @@ udev_input_init(struct udev_input *input,
 void
 udev_input_destroy(struct udev_input *input);
 
+void
+udev_input_lock(struct udev_input *input);
+void
+udev_input_unlock(struct udev_input *input);
+
 struct udev_seat *
 udev_seat_get_named(struct udev_input *u,
 		    const char *seat_name);
@@ -0,0 +1,102 @@
+/*
+ * Copyright © 2018 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef WESTON_OUTPUT_EXPORT_H
+#define WESTON_OUTPUT_EXPORT_H
+
+#include <stdint.h>
+
+/* Output export protocol
+ *
+ * The headless backend can render an output into a ring of shared memory
+ * buffers, and hand them to a consumer process connected to a
+ * SOCK_SEQPACKET Unix socket. One consumer is served at a time, messages
+ * are in native byte order.
+ *
+ * On connection, the compositor sends a buffers message, with the file
+ * descriptors of the n_buffers buffers attached as SCM_RIGHTS. They are
+ * to be mapped read-only.
+ *
+ * Each frame message hands buffer 'buffer' over to the consumer, until it
+ * sends a release message for it. The compositor does not touch a buffer
+ * the consumer holds. A buffer always holds a complete image; the
+ * rectangles list what changed since the previous frame message, so
+ * that the consumer only has to read those pixels. The first frame after
+ * connecting is damaged in full.
+ *
+ * The sequence number counts repaints of the output. Repaints happening
+ * while the consumer holds all the buffers, or is not reading its socket,
+ * are not sent; their damage is merged into the next frame message, and
+ * the sequence number skips them.
+ */
+
+#define WESTON_OUTPUT_EXPORT_VERSION	1
+
+/* DRM_FORMAT_XRGB8888, the only format for now */
+#define WESTON_OUTPUT_EXPORT_FORMAT_XRGB8888	0x34325258
+
+/* Frames with more rectangles are sent with their bounding box. */
+#define WESTON_OUTPUT_EXPORT_MAX_RECTS	64
+
+enum weston_output_export_message_type {
+	WESTON_OUTPUT_EXPORT_BUFFERS = 1,	/* compositor to consumer */
+	WESTON_OUTPUT_EXPORT_FRAME,		/* compositor to consumer */
+	WESTON_OUTPUT_EXPORT_RELEASE,		/* consumer to compositor */
+};
+
+struct weston_output_export_buffers {
+	uint32_t type;
+	uint32_t version;
+	uint32_t format;
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride;	/* in bytes */
+	uint32_t size;		/* of each buffer, in bytes */
+	uint32_t n_buffers;
+};
+
+struct weston_output_export_rect {
+	int32_t x;
+	int32_t y;
+	int32_t width;
+	int32_t height;
+};
+
+/* Followed by n_rects rectangles, in buffer coordinates */
+struct weston_output_export_frame {
+	uint32_t type;
+	uint32_t buffer;
+	uint64_t seq;
+	uint64_t time;		/* of the presentation clock, in nanoseconds */
+	uint32_t n_rects;
+	uint32_t padding;
+};
+
+struct weston_output_export_release {
+	uint32_t type;
+	uint32_t buffer;
+};
+
+#endif /* WESTON_OUTPUT_EXPORT_H */
@@ -0,0 +1,399 @@
+/*
+ * Copyright © 2018 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "pick-grid.h"
+
+/* Smallest cell edge is 1 << PICK_GRID_MIN_SHIFT pixels. The cell size
+ * grows in powers of two until the grid has at most PICK_GRID_MAX_CELLS
+ * cells, which bounds the memory use for very large desktops.
+ */
+#define PICK_GRID_MIN_SHIFT 6
+#define PICK_GRID_MAX_CELLS 4096
+
+void
+weston_pick_grid_init(struct weston_pick_grid *grid)
+{
+	memset(grid, 0, sizeof *grid);
+}
+
+void
+weston_pick_grid_release(struct weston_pick_grid *grid)
+{
+	uint32_t i;
+
+	for (i = 0; i < grid->cells_alloc; i++)
+		free(grid->cells[i].index);
+
+	free(grid->cells);
+	free(grid->entries);
+	weston_pick_grid_init(grid);
+}
+
+/** Drop all entries, keeping the allocations for reuse */
+void
+weston_pick_grid_clear(struct weston_pick_grid *grid)
+{
+	grid->n_entries = 0;
+	grid->cols = 0;
+	grid->rows = 0;
+}
+
+/** Append an entry below all previously added entries
+ *
+ * Empty boxes are accepted but never returned by a lookup.
+ *
+ * \return 0 on success, -1 on allocation failure.
+ */
+int
+weston_pick_grid_add(struct weston_pick_grid *grid,
+		     int32_t x1, int32_t y1, int32_t x2, int32_t y2,
+		     void *data)
+{
+	struct weston_pick_grid_entry *entry;
+
+	if (grid->n_entries == grid->entries_alloc) {
+		uint32_t alloc = grid->entries_alloc ? grid->entries_alloc * 2 : 64;
+
+		entry = realloc(grid->entries, alloc * sizeof *entry);
+		if (!entry)
+			return -1;
+
+		grid->entries = entry;
+		grid->entries_alloc = alloc;
+	}
+
+	entry = &grid->entries[grid->n_entries++];
+	entry->x1 = x1;
+	entry->y1 = y1;
+	entry->x2 = x2;
+	entry->y2 = y2;
+	entry->data = data;
+
+	return 0;
+}
+
+static int
+cell_append(struct weston_pick_grid_cell *cell, uint32_t index)
+{
+	if (cell->count == cell->alloc) {
+		uint32_t alloc = cell->alloc ? cell->alloc * 2 : 8;
+		uint32_t *tmp;
+
+		tmp = realloc(cell->index, alloc * sizeof *tmp);
+		if (!tmp)
+			return -1;
+
+		cell->index = tmp;
+		cell->alloc = alloc;
+	}
+
+	cell->index[cell->count++] = index;
+
+	return 0;
+}
+
+static inline bool
+entry_is_empty(const struct weston_pick_grid_entry *entry)
+{
+	return entry->x1 >= entry->x2 || entry->y1 >= entry->y2;
+}
+
+/** Distribute the entries into grid cells
+ *
+ * Must be called after adding entries and before looking up points.
+ * On failure the grid is left empty, and lookups return no candidates.
+ *
+ * \return 0 on success, -1 on allocation failure.
+ */
+int
+weston_pick_grid_build(struct weston_pick_grid *grid)
+{
+	int64_t x1 = INT64_MAX, y1 = INT64_MAX;
+	int64_t x2 = INT64_MIN, y2 = INT64_MIN;
+	uint64_t width, height;
+	unsigned int shift = PICK_GRID_MIN_SHIFT;
+	uint32_t n_cells;
+	uint32_t i;
+
+	grid->cols = 0;
+	grid->rows = 0;
+
+	for (i = 0; i < grid->n_entries; i++) {
+		const struct weston_pick_grid_entry *e = &grid->entries[i];
+
+		if (entry_is_empty(e))
+			continue;
+
+		if (e->x1 < x1)
+			x1 = e->x1;
+		if (e->y1 < y1)
+			y1 = e->y1;
+		if (e->x2 > x2)
+			x2 = e->x2;
+		if (e->y2 > y2)
+			y2 = e->y2;
+	}
+
+	if (x1 >= x2 || y1 >= y2)
+		return 0;
+
+	width = x2 - x1;
+	height = y2 - y1;
+	while ((((width - 1) >> shift) + 1) * (((height - 1) >> shift) + 1) >
+	       PICK_GRID_MAX_CELLS)
+		shift++;
+
+	grid->origin_x = x1;
+	grid->origin_y = y1;
+	grid->cell_shift = shift;
+	n_cells = (((width - 1) >> shift) + 1) * (((height - 1) >> shift) + 1);
+
+	if (n_cells > grid->cells_alloc) {
+		struct weston_pick_grid_cell *cells;
+
+		cells = realloc(grid->cells, n_cells * sizeof *cells);
+		if (!cells)
+			return -1;
+
+		memset(cells + grid->cells_alloc, 0,
+		       (n_cells - grid->cells_alloc) * sizeof *cells);
+		grid->cells = cells;
+		grid->cells_alloc = n_cells;
+	}
+
+	for (i = 0; i < n_cells; i++)
+		grid->cells[i].count = 0;
+
+	grid->cols = ((width - 1) >> shift) + 1;
+	grid->rows = ((height - 1) >> shift) + 1;
+
+	for (i = 0; i < grid->n_entries; i++) {
+		const struct weston_pick_grid_entry *e = &grid->entries[i];
+		uint32_t cx1, cy1, cx2, cy2, cx, cy;
+
+		if (entry_is_empty(e))
+			continue;
+
+		cx1 = (e->x1 - grid->origin_x) >> shift;
+		cy1 = (e->y1 - grid->origin_y) >> shift;
+		cx2 = ((int64_t)e->x2 - 1 - grid->origin_x) >> shift;
+		cy2 = ((int64_t)e->y2 - 1 - grid->origin_y) >> shift;
+
+		for (cy = cy1; cy <= cy2; cy++) {
+			for (cx = cx1; cx <= cx2; cx++) {
+				if (cell_append(&grid->cells[cy * grid->cols + cx],
+						i) < 0) {
+					grid->cols = 0;
+					grid->rows = 0;
+					return -1;
+				}
+			}
+		}
+	}
+
+	return 0;
+}
+
+/* Position of index in the ascending list of a cell, or of where it would
+ * be inserted */
+static uint32_t
+cell_find(const struct weston_pick_grid_cell *cell, uint32_t index)
+{
+	uint32_t lo = 0, hi = cell->count;
+
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+
+		if (cell->index[mid] < index)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+static int
+cell_insert(struct weston_pick_grid_cell *cell, uint32_t index)
+{
+	uint32_t pos;
+
+	if (cell_append(cell, index) < 0)
+		return -1;
+
+	pos = cell_find(cell, index);
+	memmove(&cell->index[pos + 1], &cell->index[pos],
+		(cell->count - 1 - pos) * sizeof cell->index[0]);
+	cell->index[pos] = index;
+
+	return 0;
+}
+
+static void
+cell_remove(struct weston_pick_grid_cell *cell, uint32_t index)
+{
+	uint32_t pos = cell_find(cell, index);
+
+	if (pos == cell->count || cell->index[pos] != index)
+		return;
+
+	memmove(&cell->index[pos], &cell->index[pos + 1],
+		(cell->count - 1 - pos) * sizeof cell->index[0]);
+	cell->count--;
+}
+
+struct cell_span {
+	uint32_t cx1, cy1, cx2, cy2;
+	bool empty;
+};
+
+/* The cells covered by a box, false if it reaches out of the grid */
+static bool
+cell_span_get(const struct weston_pick_grid *grid,
+	      int32_t x1, int32_t y1, int32_t x2, int32_t y2,
+	      struct cell_span *span)
+{
+	span->empty = x1 >= x2 || y1 >= y2;
+	if (span->empty)
+		return true;
+
+	if (x1 < grid->origin_x || y1 < grid->origin_y ||
+	    (((int64_t)x2 - 1 - grid->origin_x) >> grid->cell_shift) >= grid->cols ||
+	    (((int64_t)y2 - 1 - grid->origin_y) >> grid->cell_shift) >= grid->rows)
+		return false;
+
+	span->cx1 = (x1 - grid->origin_x) >> grid->cell_shift;
+	span->cy1 = (y1 - grid->origin_y) >> grid->cell_shift;
+	span->cx2 = ((int64_t)x2 - 1 - grid->origin_x) >> grid->cell_shift;
+	span->cy2 = ((int64_t)y2 - 1 - grid->origin_y) >> grid->cell_shift;
+
+	return true;
+}
+
+static inline bool
+cell_span_contains(const struct cell_span *span, uint32_t cx, uint32_t cy)
+{
+	return !span->empty &&
+	       cx >= span->cx1 && cx <= span->cx2 &&
+	       cy >= span->cy1 && cy <= span->cy2;
+}
+
+/** Give an entry of a built grid a new box
+ *
+ * The entry keeps its place in the stacking order. Only the cells the
+ * old or the new box covers are touched, so this is much cheaper than
+ * building the grid again, e.g. for a cursor moving every frame.
+ *
+ * \return 0 on success. -1 if the new box reaches out of the area the
+ * grid was built for, leaving the grid unchanged, or on allocation
+ * failure, leaving the grid empty. The grid must be built again then.
+ */
+int
+weston_pick_grid_move(struct weston_pick_grid *grid, uint32_t index,
+		      int32_t x1, int32_t y1, int32_t x2, int32_t y2)
+{
+	struct weston_pick_grid_entry *e = &grid->entries[index];
+	struct cell_span old_span, new_span;
+	uint32_t cx, cy;
+
+	if (grid->cols == 0 ||
+	    !cell_span_get(grid, e->x1, e->y1, e->x2, e->y2, &old_span) ||
+	    !cell_span_get(grid, x1, y1, x2, y2, &new_span))
+		return -1;
+
+	if (!old_span.empty) {
+		for (cy = old_span.cy1; cy <= old_span.cy2; cy++) {
+			for (cx = old_span.cx1; cx <= old_span.cx2; cx++) {
+				if (cell_span_contains(&new_span, cx, cy))
+					continue;
+				cell_remove(&grid->cells[cy * grid->cols + cx],
+					    index);
+			}
+		}
+	}
+
+	if (!new_span.empty) {
+		for (cy = new_span.cy1; cy <= new_span.cy2; cy++) {
+			for (cx = new_span.cx1; cx <= new_span.cx2; cx++) {
+				if (cell_span_contains(&old_span, cx, cy))
+					continue;
+				if (cell_insert(&grid->cells[cy * grid->cols + cx],
+						index) < 0) {
+					grid->cols = 0;
+					grid->rows = 0;
+					return -1;
+				}
+			}
+		}
+	}
+
+	e->x1 = x1;
+	e->y1 = y1;
+	e->x2 = x2;
+	e->y2 = y2;
+
+	return 0;
+}
+
+/** Find the entries whose cell covers a point
+ *
+ * \param grid The grid, built with weston_pick_grid_build().
+ * \param x The X coordinate.
+ * \param y The Y coordinate.
+ * \param count Returns the number of candidate indices.
+ * \return Candidate entry indices in stacking order, top-most first.
+ *
+ * The candidates are a superset of the entries containing the point;
+ * use weston_pick_grid_entry_contains() to filter them.
+ */
+const uint32_t *
+weston_pick_grid_lookup(const struct weston_pick_grid *grid,
+			int32_t x, int32_t y, uint32_t *count)
+{
+	const struct weston_pick_grid_cell *cell;
+	int64_t dx = x - grid->origin_x;
+	int64_t dy = y - grid->origin_y;
+	uint64_t cx, cy;
+
+	*count = 0;
+
+	if (grid->cols == 0 || dx < 0 || dy < 0)
+		return NULL;
+
+	cx = dx >> grid->cell_shift;
+	cy = dy >> grid->cell_shift;
+	if (cx >= grid->cols || cy >= grid->rows)
+		return NULL;
+
+	cell = &grid->cells[cy * grid->cols + cx];
+	*count = cell->count;
+
+	return cell->index;
+}
@@ -0,0 +1,98 @@
+/*
+ * Copyright © 2018 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef WESTON_PICK_GRID_H
+#define WESTON_PICK_GRID_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/** Uniform grid for point-in-box hit testing
+ *
+ * Entries are added in stacking order, top-most first, and are
+ * identified by their index in that order. Each grid cell keeps the
+ * ascending list of entry indices whose box overlaps the cell, so a
+ * lookup returns candidates in stacking order without sorting.
+ *
+ * Boxes are half-open: x1 <= x < x2, y1 <= y < y2, like pixman boxes.
+ */
+struct weston_pick_grid_entry {
+	int32_t x1, y1, x2, y2;
+	void *data;
+};
+
+struct weston_pick_grid_cell {
+	uint32_t *index;
+	uint32_t count;
+	uint32_t alloc;
+};
+
+struct weston_pick_grid {
+	struct weston_pick_grid_entry *entries;
+	uint32_t n_entries;
+	uint32_t entries_alloc;
+
+	/* Grid geometry, valid after weston_pick_grid_build() */
+	int64_t origin_x, origin_y;
+	unsigned int cell_shift;
+	uint32_t cols, rows;
+	struct weston_pick_grid_cell *cells;
+	uint32_t cells_alloc;
+};
+
+void
+weston_pick_grid_init(struct weston_pick_grid *grid);
+
+void
+weston_pick_grid_release(struct weston_pick_grid *grid);
+
+void
+weston_pick_grid_clear(struct weston_pick_grid *grid);
+
+int
+weston_pick_grid_add(struct weston_pick_grid *grid,
+		     int32_t x1, int32_t y1, int32_t x2, int32_t y2,
+		     void *data);
+
+int
+weston_pick_grid_build(struct weston_pick_grid *grid);
+
+int
+weston_pick_grid_move(struct weston_pick_grid *grid, uint32_t index,
+		      int32_t x1, int32_t y1, int32_t x2, int32_t y2);
+
+const uint32_t *
+weston_pick_grid_lookup(const struct weston_pick_grid *grid,
+			int32_t x, int32_t y, uint32_t *count);
+
+static inline bool
+weston_pick_grid_entry_contains(const struct weston_pick_grid_entry *entry,
+				int32_t x, int32_t y)
+{
+	return x >= entry->x1 && x < entry->x2 &&
+	       y >= entry->y1 && y < entry->y2;
+}
+
+#endif /* WESTON_PICK_GRID_H */
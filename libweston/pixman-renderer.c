@@ -33,6 +33,8 @@
 #include <assert.h>
 
 #include "pixman-renderer.h"
+#include "thread-pool.h"
+#include "yuv-convert.h"
 #include "shared/helpers.h"
 
 #include <linux/input.h>
@@ -48,13 +50,32 @@ struct pixman_surface_state {
 	struct weston_surface *surface;
 
 	pixman_image_t *image;
+	pixman_color_t color; /* of a solid color image */
 	struct weston_buffer_reference buffer_ref;
 
-	struct wl_listener buffer_destroy_listener;
+	/* x8r8g8b8 copy of a YUV buffer, updated on flush_damage */
+	pixman_image_t *convert_image;
+	enum weston_yuv_layout convert_layout;
+	bool convert_full;
+
 	struct wl_listener surface_destroy_listener;
 	struct wl_listener renderer_destroy_listener;
 };
 
+/* Image of a wl_shm_buffer, kept for as long as the buffer exists, so
+ * that clients cycling through a few buffers do not cause an image to be
+ * created on every attach. YUV buffers have no image: pixman cannot
+ * sample them, so they are converted into an image of the surface. */
+struct pixman_buffer_state {
+	pixman_image_t *image;
+	pixman_format_code_t format;
+	bool is_opaque;
+	bool is_yuv;
+	enum weston_yuv_layout yuv_layout;
+
+	struct wl_listener destroy_listener;
+};
+
 struct pixman_renderer {
 	struct weston_renderer base;
 
@@ -62,9 +83,29 @@ struct pixman_renderer {
 	pixman_image_t *debug_color;
 	struct weston_binding *debug_binding;
 
+	/* NULL when compositing on the compositor thread only */
+	struct weston_thread_pool *thread_pool;
+
 	struct wl_signal destroy_signal;
 };
 
+/* Horizontal band of an output, painted by one pool thread. The target
+ * image aliases the pixels of the output image, so that the clip region
+ * set while painting stays private to the thread. */
+struct pixman_band {
+	pixman_region32_t region; /* in output buffer coordinates */
+	pixman_image_t *target;
+};
+
+/* Bands are at least this many rows high, and each pool thread gets
+ * several of them so that uneven damage is still spread out. */
+#define PIXMAN_BAND_MIN_HEIGHT 32
+#define PIXMAN_BANDS_PER_THREAD 4
+
+static const pixman_color_t repaint_debug_color = {
+	0x3fff, 0x0000, 0x0000, 0x3fff
+};
+
 static inline struct pixman_output_state *
 get_output_state(struct weston_output *output)
 {
@@ -89,6 +130,19 @@ get_renderer(struct weston_compositor *ec)
 	return (struct pixman_renderer *)ec->renderer;
 }
 
+/* The image to paint the surface with, or NULL if there is none. The
+ * image of a wl_shm_buffer cannot be used after the buffer has been
+ * destroyed, as the pixels may be gone with it. */
+static inline pixman_image_t *
+surface_state_get_image(struct pixman_surface_state *ps)
+{
+	if (ps->image && pixman_image_get_data(ps->image) &&
+	    !ps->buffer_ref.buffer)
+		return NULL;
+
+	return ps->image;
+}
+
 static int
 pixman_renderer_read_pixels(struct weston_output *output,
 			       pixman_format_code_t format, void *pixels,
@@ -317,6 +371,28 @@ composite_clipped(pixman_image_t *src,
 	}
 }
 
+/* A new image sharing the pixels of a bits image */
+static pixman_image_t *
+image_create_alias(pixman_image_t *image)
+{
+	return pixman_image_create_bits_no_clear(pixman_image_get_format(image),
+						 pixman_image_get_width(image),
+						 pixman_image_get_height(image),
+						 pixman_image_get_data(image),
+						 pixman_image_get_stride(image));
+}
+
+/* Pixman images are not thread-safe, not even as a source, so each
+ * band gets its own image of the surface contents. */
+static pixman_image_t *
+band_create_source_image(struct pixman_surface_state *ps)
+{
+	if (!pixman_image_get_data(ps->image))
+		return pixman_image_create_solid_fill(&ps->color);
+
+	return image_create_alias(ps->image);
+}
+
 /** Paint an intersected region
  *
  * \param ev The view to be painted.
@@ -325,28 +401,52 @@ composite_clipped(pixman_image_t *src,
  * \param source_clip The region of the source image to use, in source image
  *                    coordinates. If NULL, use the whole source image.
  * \param pixman_op Compositing operator, either SRC or OVER.
+ * \param band The band to limit painting to, or NULL for the whole output.
  */
 static void
 repaint_region(struct weston_view *ev, struct weston_output *output,
 	       pixman_region32_t *repaint_output,
 	       pixman_region32_t *source_clip,
-	       pixman_op_t pixman_op)
+	       pixman_op_t pixman_op,
+	       struct pixman_band *band)
 {
 	struct pixman_renderer *pr =
 		(struct pixman_renderer *) output->compositor->renderer;
 	struct pixman_surface_state *ps = get_surface_state(ev->surface);
 	struct pixman_output_state *po = get_output_state(output);
 	struct weston_buffer_viewport *vp = &ev->surface->buffer_viewport;
+	pixman_region32_t band_output;
 	pixman_image_t *target_image;
+	pixman_image_t *src_image;
+	pixman_image_t *debug_color;
 	pixman_transform_t transform;
 	pixman_filter_t filter;
 	pixman_image_t *mask_image;
 	pixman_color_t mask = { 0, };
 
-	if (po->shadow_image)
-		target_image = po->shadow_image;
-	else
-		target_image = po->hw_buffer;
+	if (band) {
+		pixman_region32_init(&band_output);
+		pixman_region32_intersect(&band_output, repaint_output,
+					  &band->region);
+		if (!pixman_region32_not_empty(&band_output)) {
+			pixman_region32_fini(&band_output);
+			return;
+		}
+
+		repaint_output = &band_output;
+		target_image = band->target;
+		src_image = band_create_source_image(ps);
+		debug_color = pr->repaint_debug ?
+			pixman_image_create_solid_fill(&repaint_debug_color) :
+			NULL;
+	} else {
+		if (po->shadow_image)
+			target_image = po->shadow_image;
+		else
+			target_image = po->hw_buffer;
+		src_image = ps->image;
+		debug_color = pr->debug_color;
+	}
 
  	/* Clip rendering to the damaged output region */
 	pixman_image_set_clip_region32(target_image, repaint_output);
@@ -369,10 +469,10 @@ repaint_region(struct weston_view *ev, struct weston_output *output,
 	}
 
 	if (source_clip)
-		composite_clipped(ps->image, mask_image, target_image,
+		composite_clipped(src_image, mask_image, target_image,
 				  &transform, filter, source_clip);
 	else
-		composite_whole(pixman_op, ps->image, mask_image,
+		composite_whole(pixman_op, src_image, mask_image,
 				target_image, &transform, filter);
 
 	if (mask_image)
@@ -383,7 +483,7 @@ repaint_region(struct weston_view *ev, struct weston_output *output,
 
 	if (pr->repaint_debug)
 		pixman_image_composite32(PIXMAN_OP_OVER,
-					 pr->debug_color, /* src */
+					 debug_color, /* src */
 					 NULL /* mask */,
 					 target_image, /* dest */
 					 0, 0, /* src_x, src_y */
@@ -393,11 +493,19 @@ repaint_region(struct weston_view *ev, struct weston_output *output,
 					 pixman_image_get_height (target_image) /* height */);
 
 	pixman_image_set_clip_region32(target_image, NULL);
+
+	if (band) {
+		if (debug_color)
+			pixman_image_unref(debug_color);
+		pixman_image_unref(src_image);
+		pixman_region32_fini(&band_output);
+	}
 }
 
 static void
 draw_view_translated(struct weston_view *view, struct weston_output *output,
-		     pixman_region32_t *repaint_global)
+		     pixman_region32_t *repaint_global,
+		     struct pixman_band *band)
 {
 	struct weston_surface *surface = view->surface;
 	/* non-opaque region in surface coordinates: */
@@ -425,7 +533,7 @@ draw_view_translated(struct weston_view *view, struct weston_output *output,
 			region_global_to_output(output, &repaint_output);
 
 			repaint_region(view, output, &repaint_output, NULL,
-				       PIXMAN_OP_SRC);
+				       PIXMAN_OP_SRC, band);
 		}
 	}
 
@@ -436,7 +544,7 @@ draw_view_translated(struct weston_view *view, struct weston_output *output,
 		region_global_to_output(output, &repaint_output);
 
 		repaint_region(view, output, &repaint_output, NULL,
-			       PIXMAN_OP_OVER);
+			       PIXMAN_OP_OVER, band);
 	}
 
 	pixman_region32_fini(&surface_blend);
@@ -446,7 +554,8 @@ draw_view_translated(struct weston_view *view, struct weston_output *output,
 static void
 draw_view_source_clipped(struct weston_view *view,
 			 struct weston_output *output,
-			 pixman_region32_t *repaint_global)
+			 pixman_region32_t *repaint_global,
+			 struct pixman_band *band)
 {
 	struct weston_surface *surface = view->surface;
 	pixman_region32_t surf_region;
@@ -472,7 +581,7 @@ draw_view_source_clipped(struct weston_view *view,
 	region_global_to_output(output, &repaint_output);
 
 	repaint_region(view, output, &repaint_output, &buffer_region,
-		       PIXMAN_OP_OVER);
+		       PIXMAN_OP_OVER, band);
 
 	pixman_region32_fini(&repaint_output);
 	pixman_region32_fini(&buffer_region);
@@ -481,14 +590,15 @@ draw_view_source_clipped(struct weston_view *view,
 
 static void
 draw_view(struct weston_view *ev, struct weston_output *output,
-	  pixman_region32_t *damage) /* in global coordinates */
+	  pixman_region32_t *damage, /* in global coordinates */
+	  struct pixman_band *band)
 {
 	struct pixman_surface_state *ps = get_surface_state(ev->surface);
 	/* repaint bounding region in global coordinates: */
 	pixman_region32_t repaint;
 
 	/* No buffer attached */
-	if (!ps->image)
+	if (!surface_state_get_image(ps))
 		return;
 
 	pixman_region32_init(&repaint);
@@ -507,7 +617,7 @@ draw_view(struct weston_view *ev, struct weston_output *output,
 		 * Also the boundingbox is accurate rather than an
 		 * approximation.
 		 */
-		draw_view_translated(ev, output, &repaint);
+		draw_view_translated(ev, output, &repaint, band);
 	} else {
 		/* The complex case: the view transformation does not allow
 		 * converting opaque etc. regions into global coordinate space.
@@ -516,54 +626,168 @@ draw_view(struct weston_view *ev, struct weston_output *output,
 		 * to be used whole. Source clipping does not work with
 		 * PIXMAN_OP_SRC.
 		 */
-		draw_view_source_clipped(ev, output, &repaint);
+		draw_view_source_clipped(ev, output, &repaint, band);
 	}
 
 out:
 	pixman_region32_fini(&repaint);
 }
 static void
-repaint_surfaces(struct weston_output *output, pixman_region32_t *damage)
+repaint_surfaces(struct weston_output *output, pixman_region32_t *damage,
+		 struct pixman_band *band)
 {
 	struct weston_compositor *compositor = output->compositor;
 	struct weston_view *view;
 
 	wl_list_for_each_reverse(view, &compositor->view_list, link)
 		if (view->plane == &compositor->primary_plane)
-			draw_view(view, output, damage);
+			draw_view(view, output, damage, band);
 }
 
 static void
-copy_to_hw_buffer(struct weston_output *output, pixman_region32_t *region)
+copy_to_hw_buffer(struct weston_output *output, pixman_region32_t *region,
+		  struct pixman_band *band)
 {
 	struct pixman_output_state *po = get_output_state(output);
 	pixman_region32_t output_region;
+	pixman_image_t *src, *dest;
 
 	pixman_region32_init(&output_region);
 	pixman_region32_copy(&output_region, region);
 
 	region_global_to_output(output, &output_region);
 
-	pixman_image_set_clip_region32 (po->hw_buffer, &output_region);
+	if (band) {
+		pixman_region32_intersect(&output_region, &output_region,
+					  &band->region);
+		if (!pixman_region32_not_empty(&output_region)) {
+			pixman_region32_fini(&output_region);
+			return;
+		}
+
+		src = image_create_alias(po->shadow_image);
+		dest = image_create_alias(po->hw_buffer);
+	} else {
+		src = po->shadow_image;
+		dest = po->hw_buffer;
+	}
+
+	pixman_image_set_clip_region32 (dest, &output_region);
 	pixman_region32_fini(&output_region);
 
 	pixman_image_composite32(PIXMAN_OP_SRC,
-				 po->shadow_image, /* src */
+				 src, /* src */
 				 NULL /* mask */,
-				 po->hw_buffer, /* dest */
+				 dest, /* dest */
 				 0, 0, /* src_x, src_y */
 				 0, 0, /* mask_x, mask_y */
 				 0, 0, /* dest_x, dest_y */
-				 pixman_image_get_width (po->hw_buffer), /* width */
-				 pixman_image_get_height (po->hw_buffer) /* height */);
+				 pixman_image_get_width (dest), /* width */
+				 pixman_image_get_height (dest) /* height */);
+
+	pixman_image_set_clip_region32 (dest, NULL);
 
-	pixman_image_set_clip_region32 (po->hw_buffer, NULL);
+	if (band) {
+		pixman_image_unref(dest);
+		pixman_image_unref(src);
+	}
+}
+
+struct pixman_band_job {
+	struct weston_output *output;
+	pixman_region32_t *damage; /* views to paint, in global coordinates */
+	pixman_region32_t *copy_damage; /* to copy from the shadow, or NULL */
+	pixman_image_t *image; /* painted image, split into bands */
+	int32_t y1, y2; /* rows covered by the bands */
+	unsigned int n_bands;
+};
+
+static void
+repaint_band(void *data, unsigned int index)
+{
+	struct pixman_band_job *job = data;
+	struct pixman_band band;
+	int32_t height = job->y2 - job->y1;
+	int32_t y1 = job->y1 + height * index / job->n_bands;
+	int32_t y2 = job->y1 + height * (index + 1) / job->n_bands;
+
+	pixman_region32_init_rect(&band.region, 0, y1,
+				  pixman_image_get_width(job->image), y2 - y1);
+
+	band.target = image_create_alias(job->image);
+	repaint_surfaces(job->output, job->damage, &band);
+	pixman_image_unref(band.target);
+
+	/* The shadow to hardware copy of a band only reads back pixels of
+	 * the same band, so it needs no synchronisation with the others. */
+	if (job->copy_damage)
+		copy_to_hw_buffer(job->output, job->copy_damage, &band);
+
+	pixman_region32_fini(&band.region);
+}
+
+/** Paint, and copy to the hardware buffer, on all pool threads
+ *
+ * The output is split into horizontal bands covering the damage, and
+ * each band is painted exactly like the whole output would be, only with
+ * a smaller clip. The result is the same as repaint_surfaces() followed
+ * by copy_to_hw_buffer().
+ *
+ * \return false if the damage is too small to be worth splitting.
+ */
+static bool
+repaint_output_banded(struct weston_output *output,
+		      pixman_region32_t *damage,
+		      pixman_region32_t *copy_damage)
+{
+	struct pixman_renderer *pr = get_renderer(output->compositor);
+	struct pixman_output_state *po = get_output_state(output);
+	struct weston_compositor *compositor = output->compositor;
+	struct pixman_band_job job;
+	struct weston_view *view;
+	pixman_region32_t output_damage;
+	pixman_box32_t *extents;
+	unsigned int max_bands;
+
+	job.output = output;
+	job.damage = damage;
+	job.copy_damage = copy_damage;
+	job.image = po->shadow_image ? po->shadow_image : po->hw_buffer;
+
+	pixman_region32_init(&output_damage);
+	pixman_region32_copy(&output_damage,
+			     copy_damage ? copy_damage : damage);
+	region_global_to_output(output, &output_damage);
+	extents = pixman_region32_extents(&output_damage);
+	job.y1 = MAX(extents->y1, 0);
+	job.y2 = MIN(extents->y2, pixman_image_get_height(job.image));
+	pixman_region32_fini(&output_damage);
+
+	if (job.y2 - job.y1 < 2 * PIXMAN_BAND_MIN_HEIGHT)
+		return false;
+
+	max_bands = (job.y2 - job.y1) / PIXMAN_BAND_MIN_HEIGHT;
+	job.n_bands = weston_thread_pool_get_size(pr->thread_pool) *
+		      PIXMAN_BANDS_PER_THREAD;
+	if (job.n_bands > max_bands)
+		job.n_bands = max_bands;
+
+	/* Creating the surface state allocates, keep it off the pool. */
+	wl_list_for_each(view, &compositor->view_list, link)
+		if (view->plane == &compositor->primary_plane)
+			get_surface_state(view->surface);
+
+	weston_thread_pool_run(pr->thread_pool, repaint_band, &job,
+			       job.n_bands);
+
+	return true;
 }
 
 static void
 pixman_renderer_repaint_output(struct weston_output *output,
 			       pixman_region32_t *output_damage)
 {
+	struct pixman_renderer *pr = get_renderer(output->compositor);
 	struct pixman_output_state *po = get_output_state(output);
 	pixman_region32_t hw_damage;
 
@@ -582,10 +806,16 @@ pixman_renderer_repaint_output(struct weston_output *output,
 	}
 
 	if (po->shadow_image) {
-		repaint_surfaces(output, output_damage);
-		copy_to_hw_buffer(output, &hw_damage);
+		if (!pr->thread_pool ||
+		    !repaint_output_banded(output, output_damage,
+					   &hw_damage)) {
+			repaint_surfaces(output, output_damage, NULL);
+			copy_to_hw_buffer(output, &hw_damage, NULL);
+		}
 	} else {
-		repaint_surfaces(output, &hw_damage);
+		if (!pr->thread_pool ||
+		    !repaint_output_banded(output, &hw_damage, NULL))
+			repaint_surfaces(output, &hw_damage, NULL);
 	}
 	pixman_region32_fini(&hw_damage);
 
@@ -595,94 +825,330 @@ pixman_renderer_repaint_output(struct weston_output *output,
 	/* Actual flip should be done by caller */
 }
 
+/* Rows of the damage converted by one pool thread */
+struct pixman_convert_job {
+	struct wl_shm_buffer *shm_buffer;
+	struct weston_yuv_source src;
+	uint32_t *dst;
+	int32_t dst_stride;
+	pixman_box32_t *boxes;
+	int n_boxes;
+	int32_t y1;
+	int32_t band_height;
+};
+
 static void
-pixman_renderer_flush_damage(struct weston_surface *surface)
+convert_boxes(struct pixman_convert_job *job, int32_t y1, int32_t y2)
 {
-	/* No-op for pixman renderer */
+	int i;
+
+	for (i = 0; i < job->n_boxes; i++) {
+		pixman_box32_t *b = &job->boxes[i];
+
+		weston_yuv_convert_rect(&job->src, job->dst, job->dst_stride,
+					b->x1, MAX(b->y1, y1),
+					b->x2, MIN(b->y2, y2));
+	}
 }
 
 static void
-buffer_state_handle_buffer_destroy(struct wl_listener *listener, void *data)
+convert_band(void *data, unsigned int index)
 {
-	struct pixman_surface_state *ps;
+	struct pixman_convert_job *job = data;
+	int32_t y1 = job->y1 + index * job->band_height;
 
-	ps = container_of(listener, struct pixman_surface_state,
-			  buffer_destroy_listener);
+	/* The SIGBUS protection of a client pool is per thread. */
+	wl_shm_buffer_begin_access(job->shm_buffer);
+	convert_boxes(job, y1, y1 + job->band_height);
+	wl_shm_buffer_end_access(job->shm_buffer);
+}
 
-	if (ps->image) {
-		pixman_image_unref(ps->image);
-		ps->image = NULL;
+static void
+pixman_renderer_flush_damage(struct weston_surface *surface)
+{
+	struct pixman_surface_state *ps = get_surface_state(surface);
+	struct pixman_renderer *pr = get_renderer(surface->compositor);
+	struct weston_buffer *buffer = ps->buffer_ref.buffer;
+	struct pixman_convert_job job;
+	pixman_region32_t damage;
+	pixman_box32_t *extents;
+	int32_t rows;
+	unsigned int n_bands;
+
+	/* Only YUV buffers need work, the others are sampled directly. */
+	if (!ps->convert_image || !buffer)
+		return;
+
+	pixman_region32_init_rect(&damage, 0, 0,
+				  buffer->width, buffer->height);
+	if (!ps->convert_full) {
+		pixman_region32_t buffer_damage;
+
+		pixman_region32_init(&buffer_damage);
+		weston_surface_to_buffer_region(surface, &surface->damage,
+						&buffer_damage);
+		pixman_region32_intersect(&damage, &damage, &buffer_damage);
+		pixman_region32_fini(&buffer_damage);
+	}
+	ps->convert_full = false;
+
+	if (!pixman_region32_not_empty(&damage)) {
+		pixman_region32_fini(&damage);
+		return;
 	}
 
-	ps->buffer_destroy_listener.notify = NULL;
+	job.shm_buffer = buffer->shm_buffer;
+	job.src.layout = ps->convert_layout;
+	job.src.data = wl_shm_buffer_get_data(buffer->shm_buffer);
+	job.src.stride = wl_shm_buffer_get_stride(buffer->shm_buffer);
+	job.src.width = buffer->width;
+	job.src.height = buffer->height;
+	job.dst = pixman_image_get_data(ps->convert_image);
+	job.dst_stride = pixman_image_get_stride(ps->convert_image);
+	job.boxes = pixman_region32_rectangles(&damage, &job.n_boxes);
+
+	extents = pixman_region32_extents(&damage);
+	job.y1 = extents->y1;
+	rows = extents->y2 - extents->y1;
+
+	/* A video frame is worth spreading over the pool, a cursor is not. */
+	n_bands = pr->thread_pool ?
+		  weston_thread_pool_get_size(pr->thread_pool) : 1;
+	if (rows < (int32_t)n_bands * PIXMAN_BAND_MIN_HEIGHT)
+		n_bands = 1;
+
+	if (n_bands > 1) {
+		job.band_height = (rows + n_bands - 1) / n_bands;
+		weston_thread_pool_run(pr->thread_pool, convert_band,
+				       &job, n_bands);
+	} else {
+		wl_shm_buffer_begin_access(buffer->shm_buffer);
+		convert_boxes(&job, extents->y1, extents->y2);
+		wl_shm_buffer_end_access(buffer->shm_buffer);
+	}
+
+	pixman_region32_fini(&damage);
 }
 
 static void
-pixman_renderer_attach(struct weston_surface *es, struct weston_buffer *buffer)
+buffer_state_handle_buffer_destroy(struct wl_listener *listener, void *data)
 {
-	struct pixman_surface_state *ps = get_surface_state(es);
-	struct wl_shm_buffer *shm_buffer;
-	pixman_format_code_t pixman_format;
+	struct pixman_buffer_state *bs;
 
-	weston_buffer_reference(&ps->buffer_ref, buffer);
+	bs = container_of(listener, struct pixman_buffer_state,
+			  destroy_listener);
 
-	if (ps->buffer_destroy_listener.notify) {
-		wl_list_remove(&ps->buffer_destroy_listener.link);
-		ps->buffer_destroy_listener.notify = NULL;
-	}
+	wl_list_remove(&bs->destroy_listener.link);
+	if (bs->image)
+		pixman_image_unref(bs->image);
+	free(bs);
+}
 
-	if (ps->image) {
-		pixman_image_unref(ps->image);
-		ps->image = NULL;
-	}
+static struct pixman_buffer_state *
+get_buffer_state(struct weston_buffer *buffer)
+{
+	struct wl_listener *listener;
 
-	if (!buffer)
-		return;
+	listener = wl_signal_get(&buffer->destroy_signal,
+				 buffer_state_handle_buffer_destroy);
+	if (!listener)
+		return NULL;
 
-	shm_buffer = wl_shm_buffer_get(buffer->resource);
+	return container_of(listener, struct pixman_buffer_state,
+			    destroy_listener);
+}
 
-	if (! shm_buffer) {
-		weston_log("Pixman renderer supports only SHM buffers\n");
-		weston_buffer_reference(&ps->buffer_ref, NULL);
-		return;
-	}
+static struct pixman_buffer_state *
+pixman_renderer_create_buffer_state(struct weston_buffer *buffer,
+				    struct wl_shm_buffer *shm_buffer)
+{
+	struct pixman_buffer_state *bs;
+	pixman_format_code_t pixman_format = 0;
+	enum weston_yuv_layout yuv_layout = WESTON_YUV_LAYOUT_NV12;
+	bool is_opaque = true;
+	bool is_yuv = false;
 
 	switch (wl_shm_buffer_get_format(shm_buffer)) {
 	case WL_SHM_FORMAT_XRGB8888:
 		pixman_format = PIXMAN_x8r8g8b8;
-		es->is_opaque = true;
+		is_opaque = true;
 		break;
 	case WL_SHM_FORMAT_ARGB8888:
 		pixman_format = PIXMAN_a8r8g8b8;
-		es->is_opaque = false;
+		is_opaque = false;
 		break;
 	case WL_SHM_FORMAT_RGB565:
 		pixman_format = PIXMAN_r5g6b5;
-		es->is_opaque = true;
+		is_opaque = true;
+		break;
+	case WL_SHM_FORMAT_ABGR8888:
+		pixman_format = PIXMAN_a8b8g8r8;
+		is_opaque = false;
+		break;
+	case WL_SHM_FORMAT_XBGR8888:
+		pixman_format = PIXMAN_x8b8g8r8;
+		is_opaque = true;
+		break;
+	case WL_SHM_FORMAT_RGB888:
+		pixman_format = PIXMAN_r8g8b8;
+		is_opaque = true;
+		break;
+	case WL_SHM_FORMAT_NV12:
+		is_yuv = true;
+		yuv_layout = WESTON_YUV_LAYOUT_NV12;
+		break;
+	case WL_SHM_FORMAT_YUYV:
+		is_yuv = true;
+		yuv_layout = WESTON_YUV_LAYOUT_YUYV;
+		break;
+	case WL_SHM_FORMAT_YUV420:
+		is_yuv = true;
+		yuv_layout = WESTON_YUV_LAYOUT_YUV420;
 		break;
 	default:
 		weston_log("Unsupported SHM buffer format 0x%x\n",
 			wl_shm_buffer_get_format(shm_buffer));
-		weston_buffer_reference(&ps->buffer_ref, NULL);
                 weston_buffer_send_server_error(buffer,
 			"disconnecting due to unhandled buffer type");
-		return;
+		return NULL;
 	break;
 	}
 
+	bs = zalloc(sizeof *bs);
+	if (!bs)
+		return NULL;
+
 	buffer->shm_buffer = shm_buffer;
 	buffer->width = wl_shm_buffer_get_width(shm_buffer);
 	buffer->height = wl_shm_buffer_get_height(shm_buffer);
 
-	ps->image = pixman_image_create_bits(pixman_format,
-		buffer->width, buffer->height,
-		wl_shm_buffer_get_data(shm_buffer),
-		wl_shm_buffer_get_stride(shm_buffer));
+	bs->format = pixman_format;
+	bs->is_opaque = is_opaque;
+	bs->is_yuv = is_yuv;
+	bs->yuv_layout = yuv_layout;
+	if (!is_yuv) {
+		bs->image = pixman_image_create_bits(pixman_format,
+			buffer->width, buffer->height,
+			wl_shm_buffer_get_data(shm_buffer),
+			wl_shm_buffer_get_stride(shm_buffer));
+		if (!bs->image) {
+			free(bs);
+			return NULL;
+		}
+	}
+
+	bs->destroy_listener.notify = buffer_state_handle_buffer_destroy;
+	wl_signal_add(&buffer->destroy_signal, &bs->destroy_listener);
+
+	return bs;
+}
+
+/* The image of a buffer state, which is created again if the pool of the
+ * buffer has been mapped elsewhere since, as wl_shm_pool.resize may do. */
+static pixman_image_t *
+buffer_state_get_image(struct pixman_buffer_state *bs,
+		       struct weston_buffer *buffer)
+{
+	void *data = wl_shm_buffer_get_data(buffer->shm_buffer);
+	pixman_image_t *image;
+
+	if ((void *) pixman_image_get_data(bs->image) == data)
+		return bs->image;
+
+	image = pixman_image_create_bits(bs->format,
+		buffer->width, buffer->height, data,
+		wl_shm_buffer_get_stride(buffer->shm_buffer));
+	if (!image)
+		return NULL;
+
+	pixman_image_unref(bs->image);
+	bs->image = image;
 
-	ps->buffer_destroy_listener.notify =
-		buffer_state_handle_buffer_destroy;
-	wl_signal_add(&buffer->destroy_signal,
-		      &ps->buffer_destroy_listener);
+	return image;
+}
+
+static void
+surface_state_release_convert_image(struct pixman_surface_state *ps)
+{
+	if (ps->convert_image) {
+		pixman_image_unref(ps->convert_image);
+		ps->convert_image = NULL;
+	}
+}
+
+static void
+pixman_renderer_attach(struct weston_surface *es, struct weston_buffer *buffer)
+{
+	struct pixman_surface_state *ps = get_surface_state(es);
+	struct pixman_buffer_state *bs;
+	struct wl_shm_buffer *shm_buffer;
+	pixman_image_t *image;
+
+	weston_buffer_reference(&ps->buffer_ref, buffer);
+
+	if (ps->image) {
+		pixman_image_unref(ps->image);
+		ps->image = NULL;
+	}
+
+	if (!buffer) {
+		surface_state_release_convert_image(ps);
+		return;
+	}
+
+	bs = get_buffer_state(buffer);
+	if (!bs) {
+		shm_buffer = wl_shm_buffer_get(buffer->resource);
+
+		if (! shm_buffer) {
+			weston_log("Pixman renderer supports only SHM buffers\n");
+			weston_buffer_reference(&ps->buffer_ref, NULL);
+			return;
+		}
+
+		bs = pixman_renderer_create_buffer_state(buffer, shm_buffer);
+		if (!bs) {
+			weston_buffer_reference(&ps->buffer_ref, NULL);
+			return;
+		}
+	}
+
+	es->is_opaque = bs->is_opaque;
+
+	if (!bs->is_yuv) {
+		surface_state_release_convert_image(ps);
+		image = buffer_state_get_image(bs, buffer);
+		if (!image) {
+			weston_buffer_reference(&ps->buffer_ref, NULL);
+			return;
+		}
+		ps->image = pixman_image_ref(image);
+		return;
+	}
+
+	if (!ps->convert_image ||
+	    pixman_image_get_width(ps->convert_image) != buffer->width ||
+	    pixman_image_get_height(ps->convert_image) != buffer->height) {
+		surface_state_release_convert_image(ps);
+		ps->convert_image = pixman_image_create_bits(PIXMAN_x8r8g8b8,
+							     buffer->width,
+							     buffer->height,
+							     NULL, 0);
+		ps->convert_full = true;
+		if (!ps->convert_image) {
+			weston_log("Failed to allocate a %dx%d image for a "
+				   "YUV buffer\n", buffer->width, buffer->height);
+			weston_buffer_reference(&ps->buffer_ref, NULL);
+			return;
+		}
+	}
+
+	/* The damage is relative to the previous buffer, unless the image
+	 * has just been created or the layout changed. */
+	if (ps->convert_layout != bs->yuv_layout)
+		ps->convert_full = true;
+	ps->convert_layout = bs->yuv_layout;
+	ps->image = pixman_image_ref(ps->convert_image);
 }
 
 static void
@@ -690,10 +1156,6 @@ pixman_renderer_surface_state_destroy(struct pixman_surface_state *ps)
 {
 	wl_list_remove(&ps->surface_destroy_listener.link);
 	wl_list_remove(&ps->renderer_destroy_listener.link);
-	if (ps->buffer_destroy_listener.notify) {
-		wl_list_remove(&ps->buffer_destroy_listener.link);
-		ps->buffer_destroy_listener.notify = NULL;
-	}
 
 	ps->surface->renderer_state = NULL;
 
@@ -701,6 +1163,7 @@ pixman_renderer_surface_state_destroy(struct pixman_surface_state *ps)
 		pixman_image_unref(ps->image);
 		ps->image = NULL;
 	}
+	surface_state_release_convert_image(ps);
 	weston_buffer_reference(&ps->buffer_ref, NULL);
 	free(ps);
 }
@@ -765,6 +1228,7 @@ pixman_renderer_surface_set_color(struct weston_surface *es,
 	color.green = green * 0xffff;
 	color.blue = blue * 0xffff;
 	color.alpha = alpha * 0xffff;
+	ps->color = color;
 
 	if (ps->image) {
 		pixman_image_unref(ps->image);
@@ -781,6 +1245,7 @@ pixman_renderer_destroy(struct weston_compositor *ec)
 
 	wl_signal_emit(&pr->destroy_signal, pr);
 	weston_binding_destroy(pr->debug_binding);
+	weston_thread_pool_destroy(pr->thread_pool);
 	free(pr);
 
 	ec->renderer = NULL;
@@ -791,10 +1256,11 @@ pixman_renderer_surface_get_content_size(struct weston_surface *surface,
 					 int *width, int *height)
 {
 	struct pixman_surface_state *ps = get_surface_state(surface);
+	pixman_image_t *image = surface_state_get_image(ps);
 
-	if (ps->image) {
-		*width = pixman_image_get_width(ps->image);
-		*height = pixman_image_get_height(ps->image);
+	if (image) {
+		*width = pixman_image_get_width(image);
+		*height = pixman_image_get_height(image);
 	} else {
 		*width = 0;
 		*height = 0;
@@ -812,7 +1278,7 @@ pixman_renderer_surface_copy_content(struct weston_surface *surface,
 	struct pixman_surface_state *ps = get_surface_state(surface);
 	pixman_image_t *out_buf;
 
-	if (!ps->image)
+	if (!surface_state_get_image(ps))
 		return -1;
 
 	out_buf = pixman_image_create_bits(format, width, height,
@@ -843,11 +1309,8 @@ debug_binding(struct weston_keyboard *keyboard, const struct timespec *time,
 	pr->repaint_debug ^= 1;
 
 	if (pr->repaint_debug) {
-		pixman_color_t red = {
-			0x3fff, 0x0000, 0x0000, 0x3fff
-		};
-
-		pr->debug_color = pixman_image_create_solid_fill(&red);
+		pr->debug_color =
+			pixman_image_create_solid_fill(&repaint_debug_color);
 	} else {
 		pixman_image_unref(pr->debug_color);
 		weston_compositor_damage_all(ec);
@@ -885,9 +1348,27 @@ pixman_renderer_init(struct weston_compositor *ec)
 						    debug_binding, ec);
 
 	wl_display_add_shm_format(ec->wl_display, WL_SHM_FORMAT_RGB565);
+	wl_display_add_shm_format(ec->wl_display, WL_SHM_FORMAT_ABGR8888);
+	wl_display_add_shm_format(ec->wl_display, WL_SHM_FORMAT_XBGR8888);
+	wl_display_add_shm_format(ec->wl_display, WL_SHM_FORMAT_RGB888);
+	wl_display_add_shm_format(ec->wl_display, WL_SHM_FORMAT_NV12);
+	wl_display_add_shm_format(ec->wl_display, WL_SHM_FORMAT_YUYV);
+	wl_display_add_shm_format(ec->wl_display, WL_SHM_FORMAT_YUV420);
 
 	wl_signal_init(&renderer->destroy_signal);
 
+	if (ec->renderer_threads > 1) {
+		renderer->thread_pool =
+			weston_thread_pool_create(ec->renderer_threads);
+		if (renderer->thread_pool)
+			weston_log("Pixman renderer: compositing on %d threads\n",
+				   ec->renderer_threads);
+		else
+			weston_log("Pixman renderer: failed to start %d "
+				   "threads, compositing on one\n",
+				   ec->renderer_threads);
+	}
+
 	return 0;
 }
 
@@ -26,14 +26,21 @@
 #include "config.h"
 
 #include <stdlib.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <linux/input.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
 #include <unistd.h>
 #include <sys/uio.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "compositor.h"
 #include "shared/helpers.h"
 #include "shared/timespec-util.h"
@@ -209,14 +216,48 @@ weston_screenshooter_shoot(struct weston_output *output,
 	return 0;
 }
 
+/* Frames are snapshotted on the compositor thread, then encoded and written
+ * out by a worker thread. Each queue slot holds the damaged rectangles of
+ * one frame, read back into a packed pixel buffer. When the worker falls
+ * behind and the queue is full, the frame is dropped and its damage is
+ * carried over to the next frame that fits, so that the file stays a
+ * correct sequence of deltas.
+ */
+#define RECORDER_QUEUE_LENGTH 4
+
+struct weston_recorder_frame {
+	uint32_t msecs;
+	pixman_region32_t damage; /* in output buffer coordinates */
+	uint32_t *pixels; /* rows of each rectangle, as read_pixels gives them */
+};
+
 struct weston_recorder {
 	struct weston_output *output;
-	uint32_t *frame, *rect;
-	uint32_t *tmpbuf;
+	int do_yflip;
+	int stride; /* of frame, in pixels */
+	int height;
+
+	/* Owned by the worker thread while it runs */
+	uint32_t *frame; /* previous frame, bottom-up */
+	uint32_t *outbuf;
+	uint32_t *delta;
 	uint32_t total;
 	int fd;
+
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	struct weston_recorder_frame queue[RECORDER_QUEUE_LENGTH];
+	int head, depth; /* protected by mutex */
+	bool quit; /* protected by mutex */
+
+	/* Damage of the frames dropped since the last queued one */
+	pixman_region32_t dropped_damage;
+
 	struct wl_listener frame_listener;
 	int count, destroying;
+	int dropped;
+	int max_depth;
 };
 
 static uint32_t *
@@ -238,16 +279,160 @@ output_run(uint32_t *p, uint32_t delta, int run)
 	return p;
 }
 
-static uint32_t
-component_delta(uint32_t next, uint32_t prev)
+/* Per-channel difference of the RGB components, modulo 256, of n pixels.
+ * Bytes are subtracted without borrowing into the next one. */
+static void
+component_delta(uint32_t *delta, const uint32_t *next, const uint32_t *prev,
+		int n)
+{
+	int k = 0;
+
+#ifdef __SSE2__
+	const __m128i rgb_mask = _mm_set1_epi32(0x00ffffff);
+
+	for (; k + 4 <= n; k += 4) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(next + k));
+		__m128i b = _mm_loadu_si128((const __m128i *)(prev + k));
+
+		_mm_storeu_si128((__m128i *)(delta + k),
+				 _mm_and_si128(_mm_sub_epi8(a, b), rgb_mask));
+	}
+#endif
+
+	for (; k < n; k++) {
+		uint32_t a = next[k], b = prev[k];
+
+		delta[k] = (((a | 0x80808080) - (b & 0x7f7f7f7f)) ^
+			    ((a ^ ~b) & 0x80808080)) & 0x00ffffff;
+	}
+}
+
+/* Number of leading entries of delta equal to value, at most n */
+static int
+delta_run(const uint32_t *delta, int n, uint32_t value)
+{
+	int k = 0;
+
+#ifdef __SSE2__
+	const __m128i v = _mm_set1_epi32(value);
+
+	for (; k + 4 <= n; k += 4) {
+		__m128i d = _mm_loadu_si128((const __m128i *)(delta + k));
+		int mask = _mm_movemask_epi8(_mm_cmpeq_epi32(d, v));
+
+		if (mask != 0xffff)
+			return k + __builtin_ctz(~mask) / 4;
+	}
+#endif
+
+	while (k < n && delta[k] == value)
+		k++;
+
+	return k;
+}
+
+static void
+recorder_write(struct weston_recorder *recorder, const struct iovec *v,
+	       int n)
+{
+	ssize_t ret;
+
+	ret = writev(recorder->fd, v, n);
+	if (ret > 0)
+		recorder->total += ret;
+}
+
+/* Encode and write out one frame. Called on the worker thread. */
+static void
+recorder_encode_frame(struct weston_recorder *recorder,
+		      struct weston_recorder_frame *frame)
+{
+	pixman_box32_t *r;
+	int i, j, k, n, len, width, height, run;
+	uint32_t prev, *d, *s, *p, *pixels;
+	struct {
+		uint32_t msecs;
+		uint32_t nrects;
+	} header;
+	struct iovec v[2];
+
+	r = pixman_region32_rectangles(&frame->damage, &n);
+
+	header.msecs = frame->msecs;
+	header.nrects = n;
+	v[0].iov_base = &header;
+	v[0].iov_len = sizeof header;
+	v[1].iov_base = r;
+	v[1].iov_len = n * sizeof *r;
+	recorder_write(recorder, v, 2);
+
+	pixels = frame->pixels;
+	for (i = 0; i < n; i++) {
+		width = r[i].x2 - r[i].x1;
+		height = r[i].y2 - r[i].y1;
+
+		p = recorder->outbuf;
+		run = prev = 0; /* quiet gcc */
+		for (j = 0; j < height; j++) {
+			if (recorder->do_yflip)
+				s = pixels + width * j;
+			else
+				s = pixels + width * (height - j - 1);
+			d = recorder->frame + recorder->stride * (r[i].y2 - j - 1) +
+			    r[i].x1;
+
+			component_delta(recorder->delta, s, d, width);
+			memcpy(d, s, width * 4);
+
+			for (k = 0; k < width; k += len) {
+				if (run > 0 && recorder->delta[k] != prev) {
+					p = output_run(p, prev, run);
+					run = 0;
+				}
+				prev = recorder->delta[k];
+				len = delta_run(recorder->delta + k,
+						width - k, prev);
+				run += len;
+			}
+		}
+
+		p = output_run(p, prev, run);
+
+		v[0].iov_base = recorder->outbuf;
+		v[0].iov_len = (p - recorder->outbuf) * 4;
+		recorder_write(recorder, v, 1);
+
+		pixels += width * height;
+	}
+}
+
+static void *
+recorder_worker(void *data)
 {
-	unsigned char dr, dg, db;
+	struct weston_recorder *recorder = data;
+	struct weston_recorder_frame *frame;
+
+	pthread_mutex_lock(&recorder->mutex);
+	for (;;) {
+		while (!recorder->quit && recorder->depth == 0)
+			pthread_cond_wait(&recorder->cond, &recorder->mutex);
+
+		/* The queue is drained before quitting. */
+		if (recorder->depth == 0)
+			break;
+
+		frame = &recorder->queue[recorder->head];
+		pthread_mutex_unlock(&recorder->mutex);
+
+		recorder_encode_frame(recorder, frame);
 
-	dr = (next >> 16) - (prev >> 16);
-	dg = (next >>  8) - (prev >>  8);
-	db = (next >>  0) - (prev >>  0);
+		pthread_mutex_lock(&recorder->mutex);
+		recorder->head = (recorder->head + 1) % RECORDER_QUEUE_LENGTH;
+		recorder->depth--;
+	}
+	pthread_mutex_unlock(&recorder->mutex);
 
-	return (dr << 16) | (dg << 8) | (db << 0);
+	return NULL;
 }
 
 static void
@@ -260,25 +445,11 @@ weston_recorder_frame_notify(struct wl_listener *listener, void *data)
 		container_of(listener, struct weston_recorder, frame_listener);
 	struct weston_output *output = data;
 	struct weston_compositor *compositor = output->compositor;
-	uint32_t msecs = timespec_to_msec(&output->frame_time);
+	struct weston_recorder_frame *frame;
 	pixman_box32_t *r;
 	pixman_region32_t damage, transformed_damage;
-	int i, j, k, n, width, height, run, stride;
-	uint32_t delta, prev, *d, *s, *p, next;
-	struct {
-		uint32_t msecs;
-		uint32_t nrects;
-	} header;
-	struct iovec v[2];
-	int do_yflip;
-	int y_orig;
-	uint32_t *outbuf;
-
-	do_yflip = !!(compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
-	if (do_yflip)
-		outbuf = recorder->rect;
-	else
-		outbuf = recorder->tmpbuf;
+	int i, n, head, depth, width, height, y_orig;
+	uint32_t *pixels;
 
 	pixman_region32_init(&damage);
 	pixman_region32_init(&transformed_damage);
@@ -290,75 +461,58 @@ weston_recorder_frame_notify(struct wl_listener *listener, void *data)
 				 &damage, &transformed_damage);
 	pixman_region32_fini(&damage);
 
-	r = pixman_region32_rectangles(&transformed_damage, &n);
-	if (n == 0) {
-		pixman_region32_fini(&transformed_damage);
-		return;
+	pixman_region32_union(&transformed_damage, &transformed_damage,
+			      &recorder->dropped_damage);
+	if (!pixman_region32_not_empty(&transformed_damage))
+		goto out;
+
+	/* The slot after the queued ones is not touched by the worker. */
+	pthread_mutex_lock(&recorder->mutex);
+	head = recorder->head;
+	depth = recorder->depth;
+	pthread_mutex_unlock(&recorder->mutex);
+
+	if (depth == RECORDER_QUEUE_LENGTH) {
+		pixman_region32_copy(&recorder->dropped_damage,
+				     &transformed_damage);
+		recorder->dropped++;
+		goto out;
 	}
+	pixman_region32_clear(&recorder->dropped_damage);
 
-	header.msecs = msecs;
-	header.nrects = n;
-	v[0].iov_base = &header;
-	v[0].iov_len = sizeof header;
-	v[1].iov_base = r;
-	v[1].iov_len = n * sizeof *r;
-	recorder->total += writev(recorder->fd, v, 2);
-	stride = output->current_mode->width;
+	frame = &recorder->queue[(head + depth) % RECORDER_QUEUE_LENGTH];
+	frame->msecs = timespec_to_msec(&output->frame_time);
+	pixman_region32_copy(&frame->damage, &transformed_damage);
 
+	/* Copy the damage only; the worker has the rest of the frame. */
+	pixels = frame->pixels;
+	r = pixman_region32_rectangles(&frame->damage, &n);
 	for (i = 0; i < n; i++) {
 		width = r[i].x2 - r[i].x1;
 		height = r[i].y2 - r[i].y1;
 
-		if (do_yflip)
-			y_orig = output->current_mode->height - r[i].y2;
+		if (recorder->do_yflip)
+			y_orig = recorder->height - r[i].y2;
 		else
 			y_orig = r[i].y1;
 
 		compositor->renderer->read_pixels(output,
-				compositor->read_format, recorder->rect,
+				compositor->read_format, pixels,
 				r[i].x1, y_orig, width, height);
+		pixels += width * height;
+	}
 
-		p = outbuf;
-		run = prev = 0; /* quiet gcc */
-		for (j = 0; j < height; j++) {
-			if (do_yflip)
-				s = recorder->rect + width * j;
-			else
-				s = recorder->rect + width * (height - j - 1);
-			y_orig = r[i].y2 - j - 1;
-			d = recorder->frame + stride * y_orig + r[i].x1;
-
-			for (k = 0; k < width; k++) {
-				next = *s++;
-				delta = component_delta(next, *d);
-				*d++ = next;
-				if (run == 0 || delta == prev) {
-					run++;
-				} else {
-					p = output_run(p, prev, run);
-					run = 1;
-				}
-				prev = delta;
-			}
-		}
-
-		p = output_run(p, prev, run);
-
-		recorder->total += write(recorder->fd,
-					 outbuf, (p - outbuf) * 4);
+	pthread_mutex_lock(&recorder->mutex);
+	recorder->depth++;
+	if (recorder->depth > recorder->max_depth)
+		recorder->max_depth = recorder->depth;
+	pthread_cond_signal(&recorder->cond);
+	pthread_mutex_unlock(&recorder->mutex);
 
-#if 0
-		fprintf(stderr,
-			"%dx%d at %d,%d rle from %d to %d bytes (%f) total %dM\n",
-			width, height, r[i].x1, r[i].y1,
-			width * height * 4, (int) (p - outbuf) * 4,
-			(float) (p - outbuf) / (width * height),
-			recorder->total / 1024 / 1024);
-#endif
-	}
+	recorder->count++;
 
+out:
 	pixman_region32_fini(&transformed_damage);
-	recorder->count++;
 
 	if (recorder->destroying)
 		weston_recorder_destroy(recorder);
@@ -367,11 +521,20 @@ weston_recorder_frame_notify(struct wl_listener *listener, void *data)
 static void
 weston_recorder_free(struct weston_recorder *recorder)
 {
+	int i;
+
 	if (recorder == NULL)
 		return;
 
-	free(recorder->tmpbuf);
-	free(recorder->rect);
+	for (i = 0; i < RECORDER_QUEUE_LENGTH; i++) {
+		pixman_region32_fini(&recorder->queue[i].damage);
+		free(recorder->queue[i].pixels);
+	}
+	pixman_region32_fini(&recorder->dropped_damage);
+	pthread_cond_destroy(&recorder->cond);
+	pthread_mutex_destroy(&recorder->mutex);
+	free(recorder->delta);
+	free(recorder->outbuf);
 	free(recorder->frame);
 	free(recorder);
 }
@@ -381,11 +544,9 @@ weston_recorder_create(struct weston_output *output, const char *filename)
 {
 	struct weston_compositor *compositor = output->compositor;
 	struct weston_recorder *recorder;
-	int stride, size;
+	int i, stride, size;
 	struct { uint32_t magic, format, width, height; } header;
-	int do_yflip;
-
-	do_yflip = !!(compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
+	sigset_t mask, old_mask;
 
 	recorder = zalloc(sizeof *recorder);
 	if (recorder == NULL) {
@@ -393,20 +554,32 @@ weston_recorder_create(struct weston_output *output, const char *filename)
 		return NULL;
 	}
 
+	pthread_mutex_init(&recorder->mutex, NULL);
+	pthread_cond_init(&recorder->cond, NULL);
+	pixman_region32_init(&recorder->dropped_damage);
+	for (i = 0; i < RECORDER_QUEUE_LENGTH; i++)
+		pixman_region32_init(&recorder->queue[i].damage);
+
+	recorder->do_yflip =
+		!!(compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
 	stride = output->current_mode->width;
 	size = stride * 4 * output->current_mode->height;
-	recorder->frame = zalloc(size);
-	recorder->rect = malloc(size);
+	recorder->stride = stride;
+	recorder->height = output->current_mode->height;
 	recorder->output = output;
+	recorder->frame = zalloc(size);
+	recorder->outbuf = malloc(size);
+	recorder->delta = malloc(stride * 4);
 
-	if ((recorder->frame == NULL) || (recorder->rect == NULL)) {
+	if ((recorder->frame == NULL) || (recorder->outbuf == NULL) ||
+	    (recorder->delta == NULL)) {
 		weston_log("%s: out of memory\n", __func__);
 		goto err_recorder;
 	}
 
-	if (!do_yflip) {
-		recorder->tmpbuf = malloc(size);
-		if (recorder->tmpbuf == NULL) {
+	for (i = 0; i < RECORDER_QUEUE_LENGTH; i++) {
+		recorder->queue[i].pixels = malloc(size);
+		if (recorder->queue[i].pixels == NULL) {
 			weston_log("%s: out of memory\n", __func__);
 			goto err_recorder;
 		}
@@ -439,6 +612,22 @@ weston_recorder_create(struct weston_output *output, const char *filename)
 	header.height = output->current_mode->height;
 	recorder->total += write(recorder->fd, &header, sizeof header);
 
+	/* Keep signals going to the compositor thread. */
+	sigfillset(&mask);
+	sigdelset(&mask, SIGBUS);
+	sigdelset(&mask, SIGSEGV);
+	sigdelset(&mask, SIGFPE);
+	sigdelset(&mask, SIGILL);
+	pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+	i = pthread_create(&recorder->thread, NULL, recorder_worker, recorder);
+	pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+	if (i != 0) {
+		weston_log("failed to start the recorder thread\n");
+		close(recorder->fd);
+		goto err_recorder;
+	}
+
 	recorder->frame_listener.notify = weston_recorder_frame_notify;
 	wl_signal_add(&output->frame_signal, &recorder->frame_listener);
 	output->disable_planes++;
@@ -455,8 +644,22 @@ static void
 weston_recorder_destroy(struct weston_recorder *recorder)
 {
 	wl_list_remove(&recorder->frame_listener.link);
-	close(recorder->fd);
 	recorder->output->disable_planes--;
+
+	/* Let the worker write out the frames still queued. */
+	pthread_mutex_lock(&recorder->mutex);
+	recorder->quit = true;
+	pthread_cond_signal(&recorder->cond);
+	pthread_mutex_unlock(&recorder->mutex);
+	pthread_join(recorder->thread, NULL);
+
+	weston_log("recorder stopped, total file size %dM, %d frames, "
+		   "%d dropped, queue depth reached %d of %d\n",
+		   recorder->total / (1024 * 1024), recorder->count,
+		   recorder->dropped, recorder->max_depth,
+		   RECORDER_QUEUE_LENGTH);
+
+	close(recorder->fd);
 	weston_recorder_free(recorder);
 }
 
@@ -481,8 +684,7 @@ weston_recorder_start(struct weston_output *output, const char *filename)
 WL_EXPORT void
 weston_recorder_stop(struct weston_recorder *recorder)
 {
-	weston_log("stopping recorder, total file size %dM, %d frames\n",
-		   recorder->total / (1024 * 1024), recorder->count);
+	weston_log("stopping recorder on output %s\n", recorder->output->name);
 
 	recorder->destroying = 1;
 	weston_output_schedule_repaint(recorder->output);
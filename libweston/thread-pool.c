@@ -0,0 +1,228 @@
+/*
+ * Copyright © 2018 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "thread-pool.h"
+#include "shared/zalloc.h"
+
+struct weston_thread_pool {
+	pthread_mutex_t mutex;
+	pthread_cond_t job_cond;
+	pthread_cond_t done_cond;
+
+	pthread_t *threads;
+	unsigned int n_workers;
+	bool quit;
+
+	/* Current job, protected by mutex */
+	uint64_t generation;
+	weston_thread_pool_func_t func;
+	void *data;
+	unsigned int count;
+	unsigned int next;
+	unsigned int done;
+};
+
+/* Process indices of the current job until none are left. Called and
+ * returns with the mutex held. */
+static void
+thread_pool_work(struct weston_thread_pool *pool)
+{
+	while (pool->next < pool->count) {
+		unsigned int index = pool->next++;
+
+		pthread_mutex_unlock(&pool->mutex);
+		pool->func(pool->data, index);
+		pthread_mutex_lock(&pool->mutex);
+
+		if (++pool->done == pool->count)
+			pthread_cond_signal(&pool->done_cond);
+	}
+}
+
+static void *
+thread_pool_worker(void *data)
+{
+	struct weston_thread_pool *pool = data;
+	uint64_t generation = 0;
+
+	pthread_mutex_lock(&pool->mutex);
+	for (;;) {
+		while (!pool->quit && pool->generation == generation)
+			pthread_cond_wait(&pool->job_cond, &pool->mutex);
+
+		if (pool->quit)
+			break;
+
+		generation = pool->generation;
+		thread_pool_work(pool);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	return NULL;
+}
+
+static void
+thread_pool_stop(struct weston_thread_pool *pool, unsigned int n_started)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->quit = true;
+	pthread_cond_broadcast(&pool->job_cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	for (i = 0; i < n_started; i++)
+		pthread_join(pool->threads[i], NULL);
+}
+
+/** Create a thread pool
+ *
+ * \param n_threads Number of threads working on each job, including the
+ * thread calling weston_thread_pool_run(). Must be at least 1.
+ * \return The pool, or NULL on failure.
+ *
+ * Workers run with all asynchronous signals blocked, so that signals
+ * keep being delivered to the compositor thread.
+ */
+struct weston_thread_pool *
+weston_thread_pool_create(unsigned int n_threads)
+{
+	struct weston_thread_pool *pool;
+	sigset_t mask, old_mask;
+	unsigned int i;
+
+	if (n_threads < 1)
+		return NULL;
+
+	pool = zalloc(sizeof *pool);
+	if (!pool)
+		return NULL;
+
+	pool->n_workers = n_threads - 1;
+	if (pool->n_workers > 0) {
+		pool->threads = calloc(pool->n_workers, sizeof *pool->threads);
+		if (!pool->threads) {
+			free(pool);
+			return NULL;
+		}
+	}
+
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->job_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+
+	sigfillset(&mask);
+	sigdelset(&mask, SIGBUS);
+	sigdelset(&mask, SIGSEGV);
+	sigdelset(&mask, SIGFPE);
+	sigdelset(&mask, SIGILL);
+	pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+
+	for (i = 0; i < pool->n_workers; i++) {
+		if (pthread_create(&pool->threads[i], NULL,
+				   thread_pool_worker, pool) != 0)
+			break;
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+	if (i < pool->n_workers) {
+		thread_pool_stop(pool, i);
+		pthread_cond_destroy(&pool->done_cond);
+		pthread_cond_destroy(&pool->job_cond);
+		pthread_mutex_destroy(&pool->mutex);
+		free(pool->threads);
+		free(pool);
+		return NULL;
+	}
+
+	return pool;
+}
+
+void
+weston_thread_pool_destroy(struct weston_thread_pool *pool)
+{
+	if (!pool)
+		return;
+
+	thread_pool_stop(pool, pool->n_workers);
+	pthread_cond_destroy(&pool->done_cond);
+	pthread_cond_destroy(&pool->job_cond);
+	pthread_mutex_destroy(&pool->mutex);
+	free(pool->threads);
+	free(pool);
+}
+
+/** Number of threads working on a job, including the caller */
+unsigned int
+weston_thread_pool_get_size(struct weston_thread_pool *pool)
+{
+	return pool->n_workers + 1;
+}
+
+/** Call func(data, index) for every index in [0, count)
+ *
+ * The calls are spread over the pool threads and the calling thread,
+ * in no particular order. Returns when all calls have returned.
+ */
+void
+weston_thread_pool_run(struct weston_thread_pool *pool,
+		       weston_thread_pool_func_t func, void *data,
+		       unsigned int count)
+{
+	unsigned int i;
+
+	if (count == 0)
+		return;
+
+	if (pool->n_workers == 0 || count == 1) {
+		for (i = 0; i < count; i++)
+			func(data, i);
+		return;
+	}
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->func = func;
+	pool->data = data;
+	pool->count = count;
+	pool->next = 0;
+	pool->done = 0;
+	pool->generation++;
+	pthread_cond_broadcast(&pool->job_cond);
+
+	thread_pool_work(pool);
+
+	while (pool->done < pool->count)
+		pthread_cond_wait(&pool->done_cond, &pool->mutex);
+	pthread_mutex_unlock(&pool->mutex);
+}
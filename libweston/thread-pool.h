@@ -0,0 +1,57 @@
+/*
+ * Copyright © 2018 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef WESTON_THREAD_POOL_H
+#define WESTON_THREAD_POOL_H
+
+/** Fixed set of worker threads running data-parallel jobs
+ *
+ * A job is a function called once for every index in [0, count). The
+ * indices are handed out to the workers and to the calling thread, and
+ * weston_thread_pool_run() returns only after all of them have been
+ * processed, so the caller may use the results right away.
+ *
+ * The pool is meant to be driven from a single thread, normally the
+ * compositor thread. Job functions must not call back into the pool.
+ */
+struct weston_thread_pool;
+
+typedef void (*weston_thread_pool_func_t)(void *data, unsigned int index);
+
+struct weston_thread_pool *
+weston_thread_pool_create(unsigned int n_threads);
+
+void
+weston_thread_pool_destroy(struct weston_thread_pool *pool);
+
+unsigned int
+weston_thread_pool_get_size(struct weston_thread_pool *pool);
+
+void
+weston_thread_pool_run(struct weston_thread_pool *pool,
+		       weston_thread_pool_func_t func, void *data,
+		       unsigned int count);
+
+#endif /* WESTON_THREAD_POOL_H */
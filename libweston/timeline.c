@@ -28,33 +28,180 @@
 
 #include <stdio.h>
 #include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
 #include <assert.h>
 
 #include "timeline.h"
 #include "compositor.h"
 #include "file-util.h"
+#include "shared/helpers.h"
+#include "shared/timespec-util.h"
+#include "timeline/timeline-format.h"
 
 #ifndef ETIME
 #define ETIME ETIMEDOUT
 #endif
 
+/* Records of the binary format are stored into a ring by the compositor
+ * thread, and written out by a thread of their own, so that a tracepoint
+ * costs no more than reading the clock and filling in a record. When the
+ * writer falls behind, points are dropped and counted.
+ */
+#define TIMELINE_RING_SIZE (1 << 16) /* records, a power of two */
+#define TIMELINE_WRITER_PERIOD_MSEC 20
+
+struct timeline_ring {
+	struct weston_timeline_record records[TIMELINE_RING_SIZE];
+	uint32_t head;		/* written by the compositor thread */
+	uint32_t tail;		/* written by the writer thread */
+	bool quit;
+	uint64_t dropped;	/* not yet reported */
+	int fd;
+	pthread_t writer;
+
+	/* String ids of tracepoint names, by address */
+	struct {
+		const char *name;
+		uint32_t id;
+	} names[128];
+	uint32_t n_names;
+};
+
 struct timeline_log {
 	clock_t clk_id;
 	FILE *file;
 	unsigned series;
 	struct wl_listener compositor_destroy_listener;
+	struct timeline_ring *ring; /* binary format only */
 };
 
 WL_EXPORT int weston_timeline_enabled_;
 static struct timeline_log timeline_ = { CLOCK_MONOTONIC, NULL, 0 };
 
 static int
-weston_timeline_do_open(void)
+write_all(int fd, const void *data, size_t len)
+{
+	const char *p = data;
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = write(fd, p, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+
+		p += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+static void *
+timeline_writer(void *data)
+{
+	struct timeline_ring *ring = data;
+	struct timespec period;
+	uint32_t head, tail, start, n;
+	bool quit;
+
+	timespec_from_msec(&period, TIMELINE_WRITER_PERIOD_MSEC);
+
+	for (;;) {
+		quit = __atomic_load_n(&ring->quit, __ATOMIC_ACQUIRE);
+		head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		tail = ring->tail;
+
+		while (tail != head) {
+			start = tail & (TIMELINE_RING_SIZE - 1);
+			n = MIN(head - tail, TIMELINE_RING_SIZE - start);
+			if (write_all(ring->fd, &ring->records[start],
+				      n * sizeof ring->records[0]) < 0)
+				break;
+			tail += n;
+		}
+
+		/* On a write error, the records are lost. */
+		__atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+
+		if (quit)
+			break;
+
+		nanosleep(&period, NULL);
+	}
+
+	return NULL;
+}
+
+static int
+timeline_ring_start(FILE *file)
+{
+	struct weston_timeline_file_header header;
+	struct timeline_ring *ring;
+	sigset_t mask, old_mask;
+	int ret;
+
+	ring = zalloc(sizeof *ring);
+	if (!ring)
+		return -1;
+
+	header.magic = WESTON_TIMELINE_MAGIC;
+	header.version = WESTON_TIMELINE_VERSION;
+	header.record_size = sizeof(struct weston_timeline_record);
+	header.clock_id = timeline_.clk_id;
+	if (fwrite(&header, sizeof header, 1, file) != 1 || fflush(file) != 0) {
+		free(ring);
+		return -1;
+	}
+	ring->fd = fileno(file);
+
+	/* Keep signals going to the compositor thread. */
+	sigfillset(&mask);
+	sigdelset(&mask, SIGBUS);
+	sigdelset(&mask, SIGSEGV);
+	sigdelset(&mask, SIGFPE);
+	sigdelset(&mask, SIGILL);
+	pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+	ret = pthread_create(&ring->writer, NULL, timeline_writer, ring);
+	pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+	if (ret != 0) {
+		free(ring);
+		return -1;
+	}
+
+	timeline_.ring = ring;
+
+	return 0;
+}
+
+static void
+timeline_ring_stop(void)
+{
+	struct timeline_ring *ring = timeline_.ring;
+
+	__atomic_store_n(&ring->quit, true, __ATOMIC_RELEASE);
+	pthread_join(ring->writer, NULL);
+
+	if (ring->dropped > 0)
+		weston_log("Timeline: %llu points were dropped\n",
+			   (unsigned long long)ring->dropped);
+
+	free(ring);
+	timeline_.ring = NULL;
+}
+
+static int
+weston_timeline_do_open(struct weston_compositor *compositor)
 {
 	const char *prefix = "weston-timeline-";
-	const char *suffix = ".log";
+	const char *suffix = compositor->timeline_binary ? ".wtl" : ".log";
 	char fname[1000];
 
 	timeline_.file = file_create_dated(NULL, prefix, suffix,
@@ -75,6 +222,13 @@ weston_timeline_do_open(void)
 		return -1;
 	}
 
+	if (compositor->timeline_binary && timeline_ring_start(timeline_.file) < 0) {
+		weston_log("Cannot start the timeline writer for '%s'\n", fname);
+		fclose(timeline_.file);
+		timeline_.file = NULL;
+		return -1;
+	}
+
 	weston_log("Opened timeline file '%s'\n", fname);
 
 	return 0;
@@ -92,7 +246,7 @@ weston_timeline_open(struct weston_compositor *compositor)
 	if (weston_timeline_enabled_)
 		return;
 
-	if (weston_timeline_do_open() < 0)
+	if (weston_timeline_do_open(compositor) < 0)
 		return;
 
 	timeline_.compositor_destroy_listener.notify = timeline_notify_destroy;
@@ -115,6 +269,9 @@ weston_timeline_close(void)
 
 	wl_list_remove(&timeline_.compositor_destroy_listener.link);
 
+	if (timeline_.ring)
+		timeline_ring_stop();
+
 	fclose(timeline_.file);
 	timeline_.file = NULL;
 	weston_log("Timeline log file closed.\n");
@@ -138,11 +295,10 @@ timeline_new_id(void)
 }
 
 static int
-check_series(struct timeline_emit_context *ctx,
-	     struct weston_timeline_object *to)
+check_series(unsigned series, struct weston_timeline_object *to)
 {
-	if (to->series == 0 || to->series != ctx->series) {
-		to->series = ctx->series;
+	if (to->series == 0 || to->series != series) {
+		to->series = series;
 		to->id = timeline_new_id();
 		return 1;
 	}
@@ -171,7 +327,7 @@ emit_weston_output(struct timeline_emit_context *ctx, void *obj)
 {
 	struct weston_output *o = obj;
 
-	if (check_series(ctx, &o->timeline)) {
+	if (check_series(ctx->series, &o->timeline)) {
 		fprintf(ctx->out, "{ \"id\":%u, "
 			"\"type\":\"weston_output\", \"name\":",
 			o->timeline.id);
@@ -192,7 +348,7 @@ check_weston_surface_description(struct timeline_emit_context *ctx,
 	char d[512];
 	char mainstr[32];
 
-	if (!check_series(ctx, &s->timeline))
+	if (!check_series(ctx->series, &s->timeline))
 		return;
 
 	mains = weston_surface_get_main_surface(s);
@@ -256,6 +412,190 @@ static const type_func type_dispatch[] = {
 	[TLT_GPU] = emit_gpu_timestamp,
 };
 
+/* Reserve n records, after a report of the points dropped before, if any.
+ * Returns the index of the first one, or -1 if the ring is full. The
+ * records are handed to the writer by ring_commit(). */
+static int64_t
+ring_reserve(struct timeline_ring *ring, uint32_t n)
+{
+	uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	uint32_t head = ring->head;
+	struct weston_timeline_record *rec;
+
+	if (head - tail + n + (ring->dropped ? 1 : 0) > TIMELINE_RING_SIZE) {
+		ring->dropped++;
+		return -1;
+	}
+
+	if (ring->dropped) {
+		rec = &ring->records[head & (TIMELINE_RING_SIZE - 1)];
+		memset(rec, 0, sizeof *rec);
+		rec->type = WESTON_TIMELINE_RECORD_DROPPED;
+		rec->time2 = ring->dropped;
+		ring->dropped = 0;
+		head++;
+	}
+
+	return head;
+}
+
+static inline struct weston_timeline_record *
+ring_record(struct timeline_ring *ring, uint32_t index)
+{
+	return &ring->records[index & (TIMELINE_RING_SIZE - 1)];
+}
+
+static void
+ring_commit(struct timeline_ring *ring, uint32_t head)
+{
+	__atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+}
+
+/* Store a definition with its text. Returns false if the ring is full. */
+static bool
+ring_define(struct timeline_ring *ring, uint16_t type, uint32_t name,
+	    uint32_t output, uint32_t surface, uint64_t time2,
+	    const char *text)
+{
+	struct weston_timeline_record *rec;
+	size_t len = strlen(text) + 1;
+	uint32_t n = (len + sizeof *rec - 1) / sizeof *rec;
+	uint32_t i;
+	int64_t head;
+
+	head = ring_reserve(ring, n + 1);
+	if (head < 0)
+		return false;
+
+	rec = ring_record(ring, head);
+	memset(rec, 0, sizeof *rec);
+	rec->type = type;
+	rec->extra = n;
+	rec->name = name;
+	rec->output = output;
+	rec->surface = surface;
+	rec->time2 = time2;
+
+	/* The text may wrap around the end of the ring. */
+	for (i = 0; i < n; i++) {
+		rec = ring_record(ring, head + 1 + i);
+		memset(rec, 0, sizeof *rec);
+		memcpy(rec, text + i * sizeof *rec,
+		       MIN(sizeof *rec, len - i * sizeof *rec));
+	}
+
+	ring_commit(ring, head + 1 + n);
+
+	return true;
+}
+
+static uint32_t
+ring_name_id(struct timeline_ring *ring, const char *name)
+{
+	unsigned int mask = ARRAY_LENGTH(ring->names) - 1;
+	unsigned int i = ((uintptr_t)name >> 3) & mask;
+
+	/* Tracepoint names are string literals, known by their address. */
+	while (ring->names[i].name) {
+		if (ring->names[i].name == name)
+			return ring->names[i].id;
+		i = (i + 1) & mask;
+	}
+
+	if (ring->n_names == ARRAY_LENGTH(ring->names) - 1 ||
+	    !ring_define(ring, WESTON_TIMELINE_RECORD_STRING,
+			 ring->n_names + 1, 0, 0, 0, name))
+		return 0;
+
+	ring->names[i].name = name;
+	ring->names[i].id = ++ring->n_names;
+
+	return ring->names[i].id;
+}
+
+static uint32_t
+ring_output_id(struct timeline_ring *ring, struct weston_output *o)
+{
+	if (check_series(timeline_.series, &o->timeline) &&
+	    !ring_define(ring, WESTON_TIMELINE_RECORD_OUTPUT, 0,
+			 o->timeline.id, 0, 0, o->name ? o->name : ""))
+		o->timeline.force_refresh = 1;
+
+	return o->timeline.id;
+}
+
+static uint32_t
+ring_surface_id(struct timeline_ring *ring, struct weston_surface *s)
+{
+	struct weston_surface *mains;
+	uint32_t main_id = 0;
+	char d[512];
+
+	if (!check_series(timeline_.series, &s->timeline))
+		return s->timeline.id;
+
+	mains = weston_surface_get_main_surface(s);
+	if (mains != s)
+		main_id = ring_surface_id(ring, mains);
+
+	if (!s->get_label || s->get_label(s, d, sizeof(d)) < 0)
+		d[0] = '\0';
+
+	if (!ring_define(ring, WESTON_TIMELINE_RECORD_SURFACE, 0, 0,
+			 s->timeline.id, main_id, d))
+		s->timeline.force_refresh = 1;
+
+	return s->timeline.id;
+}
+
+static void
+timeline_binary_point(struct timeline_ring *ring, const struct timespec *ts,
+		      const char *name, va_list argp)
+{
+	struct weston_timeline_record rec = {
+		.type = WESTON_TIMELINE_RECORD_POINT,
+		.time = timespec_to_nsec(ts),
+	};
+	enum timeline_type otype;
+	void *obj;
+	int64_t head;
+
+	while (1) {
+		otype = va_arg(argp, enum timeline_type);
+		if (otype == TLT_END)
+			break;
+
+		obj = va_arg(argp, void *);
+		switch (otype) {
+		case TLT_OUTPUT:
+			rec.output = ring_output_id(ring, obj);
+			break;
+		case TLT_SURFACE:
+			rec.surface = ring_surface_id(ring, obj);
+			break;
+		case TLT_VBLANK:
+			rec.extra |= WESTON_TIMELINE_POINT_VBLANK;
+			rec.time2 = timespec_to_nsec(obj);
+			break;
+		case TLT_GPU:
+			rec.extra |= WESTON_TIMELINE_POINT_GPU;
+			rec.time2 = timespec_to_nsec(obj);
+			break;
+		default:
+			break;
+		}
+	}
+
+	rec.name = ring_name_id(ring, name);
+
+	head = ring_reserve(ring, 1);
+	if (head < 0)
+		return;
+
+	*ring_record(ring, head) = rec;
+	ring_commit(ring, head + 1);
+}
+
 WL_EXPORT void
 weston_timeline_point(const char *name, ...)
 {
@@ -268,6 +608,13 @@ weston_timeline_point(const char *name, ...)
 
 	clock_gettime(timeline_.clk_id, &ts);
 
+	if (timeline_.ring) {
+		va_start(argp, name);
+		timeline_binary_point(timeline_.ring, &ts, name, argp);
+		va_end(argp);
+		return;
+	}
+
 	ctx.out = timeline_.file;
 	ctx.cur = fmemopen(buf, sizeof(buf), "w");
 	ctx.series = timeline_.series;
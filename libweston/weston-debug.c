@@ -35,9 +35,16 @@
 #include <assert.h>
 #include <unistd.h>
 #include <stdarg.h>
+#include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 
 /** Main weston-debug context
  *
@@ -67,6 +74,9 @@ struct weston_debug_scope {
 	struct wl_list compositor_link;
 };
 
+/** Size of the buffer of a debug stream whose client does not keep up */
+#define WESTON_DEBUG_STREAM_BUFFER_SIZE (1024 * 1024)
+
 /** A debug stream created by a client
  *
  * A client provides a file descriptor for the server to write debug
@@ -74,11 +84,39 @@ struct weston_debug_scope {
  * weston_debug_scope via the scope name, and the scope provides the messages.
  * There can be several streams for the same scope, all streams getting the
  * same messages.
+ *
+ * The file descriptor is written without blocking, leaving its flags
+ * alone: they are shared with the client, whose stdout it often is. What
+ * the client does not read in time is kept in a ring buffer, flushed when
+ * the fd becomes writable. Messages that do not fit in the ring are
+ * dropped whole, and a line telling how much was lost is written in their
+ * place once there is room. A message partly written already cannot be
+ * dropped, the stream fails instead.
  */
+enum stream_write_mode {
+	STREAM_WRITE_PLAIN,	/**< regular file, or reopened non-blocking */
+	STREAM_WRITE_SOCKET,	/**< sendmsg() with MSG_DONTWAIT */
+	STREAM_WRITE_POLL,	/**< PIPE_BUF at a time, when writable */
+};
+
 struct weston_debug_stream {
 	int fd;				/**< client provided fd */
+	enum stream_write_mode write_mode;
 	struct wl_resource *resource;	/**< weston_debug_stream_v1 object */
 	struct wl_list scope_link;
+
+	struct weston_debug_compositor *wdc;
+	struct wl_event_source *writable_source; /**< while ring not empty */
+	bool complete_pending;		/**< complete once the ring is flushed */
+
+	char *ring;			/**< allocated on first use */
+	size_t ring_head;		/**< offset of the oldest byte */
+	size_t ring_len;		/**< bytes waiting */
+
+	uint64_t bytes_written;
+	uint64_t bytes_dropped;		/**< in total */
+	uint64_t gap_bytes;		/**< dropped and not yet marked */
+	uint32_t gaps;			/**< number of overflows */
 };
 
 static struct weston_debug_scope *
@@ -96,6 +134,22 @@ get_scope(struct weston_debug_compositor *wdc, const char *name)
 static void
 stream_close_unlink(struct weston_debug_stream *stream)
 {
+	if (stream->gaps > 0)
+		weston_log("weston-debug: a stream overflowed %u times, "
+			   "%llu of %llu bytes were dropped\n", stream->gaps,
+			   (unsigned long long)stream->bytes_dropped,
+			   (unsigned long long)(stream->bytes_dropped +
+						stream->bytes_written));
+	stream->gaps = 0;
+
+	if (stream->writable_source)
+		wl_event_source_remove(stream->writable_source);
+	stream->writable_source = NULL;
+
+	free(stream->ring);
+	stream->ring = NULL;
+	stream->ring_len = 0;
+
 	if (stream->fd != -1)
 		close(stream->fd);
 	stream->fd = -1;
@@ -127,6 +181,42 @@ stream_close_on_failure(struct weston_debug_stream *stream,
 	}
 }
 
+/* Find a way to write the fd without blocking, and without changing the
+ * flags of its open file description. */
+static void
+stream_setup_fd(struct weston_debug_stream *stream)
+{
+	char path[64];
+	struct stat st;
+	int fd;
+
+	stream->write_mode = STREAM_WRITE_POLL;
+
+	if (fstat(stream->fd, &st) < 0)
+		return;
+
+	if (S_ISREG(st.st_mode)) {
+		stream->write_mode = STREAM_WRITE_PLAIN;
+		return;
+	}
+
+	if (S_ISSOCK(st.st_mode)) {
+		stream->write_mode = STREAM_WRITE_SOCKET;
+		return;
+	}
+
+	/* A pipe or a terminal opened again is a new open file
+	 * description, with flags of its own. */
+	snprintf(path, sizeof path, "/proc/self/fd/%d", stream->fd);
+	fd = open(path, O_WRONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	close(stream->fd);
+	stream->fd = fd;
+	stream->write_mode = STREAM_WRITE_PLAIN;
+}
+
 static struct weston_debug_stream *
 stream_create(struct weston_debug_compositor *wdc, const char *name,
 	      int32_t streamfd, struct wl_resource *stream_resource)
@@ -140,6 +230,10 @@ stream_create(struct weston_debug_compositor *wdc, const char *name,
 
 	stream->fd = streamfd;
 	stream->resource = stream_resource;
+	stream->wdc = wdc;
+
+	/* Never let a slow client block the compositor. */
+	stream_setup_fd(stream);
 
 	scope = get_scope(wdc, name);
 	if (scope) {
@@ -164,8 +258,7 @@ stream_destroy(struct wl_resource *stream_resource)
 
 	stream = wl_resource_get_user_data(stream_resource);
 
-	if (stream->fd != -1)
-		close(stream->fd);
+	stream_close_unlink(stream);
 	wl_list_remove(&stream->scope_link);
 	free(stream);
 }
@@ -320,9 +413,10 @@ weston_debug_compositor_destroy(struct weston_compositor *compositor)
  * This enables the weston_debug_v1 Wayland protocol extension which any client
  * can use to get debug messsages from the compositor.
  *
- * WARNING: This feature should not be used in production. If a client
- * provides a file descriptor that blocks writes, it will block the whole
- * compositor indefinitely.
+ * Streams are written without blocking: a client that does not read fast
+ * enough loses messages rather than stalling the compositor. Writing debug
+ * messages still costs time, so scopes should only be subscribed to when
+ * needed.
  *
  * There is no control on which client is allowed to subscribe to debug
  * messages. Any and all clients are allowed.
@@ -509,6 +603,178 @@ weston_debug_scope_is_enabled(struct weston_debug_scope *scope)
 	return !wl_list_empty(&scope->stream_list);
 }
 
+/* Write out as much of data as the fd takes without blocking. Returns the
+ * number of bytes written, or -1 after closing the stream on failure. */
+static ssize_t
+stream_write_fd(struct weston_debug_stream *stream,
+		const struct iovec *iov, int iovcnt, size_t len)
+{
+	struct pollfd pfd = { .fd = stream->fd, .events = POLLOUT };
+	struct iovec first;
+	struct msghdr msg;
+	ssize_t ret;
+	int e;
+
+	if (stream->write_mode == STREAM_WRITE_POLL) {
+		/* A writable pipe takes PIPE_BUF bytes without blocking. */
+		if (poll(&pfd, 1, 0) <= 0 || !(pfd.revents & POLLOUT))
+			return 0;
+
+		first.iov_base = iov[0].iov_base;
+		first.iov_len = MIN(iov[0].iov_len, PIPE_BUF);
+		iov = &first;
+		iovcnt = 1;
+	}
+
+	do {
+		if (stream->write_mode == STREAM_WRITE_SOCKET) {
+			memset(&msg, 0, sizeof msg);
+			msg.msg_iov = (struct iovec *)iov;
+			msg.msg_iovlen = iovcnt;
+			ret = sendmsg(stream->fd, &msg,
+				      MSG_DONTWAIT | MSG_NOSIGNAL);
+		} else {
+			ret = writev(stream->fd, iov, iovcnt);
+		}
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret >= 0) {
+		stream->bytes_written += ret;
+		return ret;
+	}
+
+	e = errno;
+	if (e == EAGAIN || e == EWOULDBLOCK)
+		return 0;
+
+	stream_close_on_failure(stream, "Error writing %zu bytes: %s (%d)",
+				len, strerror(e), e);
+	return -1;
+}
+
+static void
+ring_append(struct weston_debug_stream *stream, const char *data, size_t len)
+{
+	size_t tail = (stream->ring_head + stream->ring_len) %
+		      WESTON_DEBUG_STREAM_BUFFER_SIZE;
+	size_t n = MIN(len, WESTON_DEBUG_STREAM_BUFFER_SIZE - tail);
+
+	memcpy(stream->ring + tail, data, n);
+	memcpy(stream->ring, data + n, len - n);
+	stream->ring_len += len;
+}
+
+/* Write out the ring. Returns false if the stream was closed. */
+static bool
+stream_flush(struct weston_debug_stream *stream)
+{
+	struct iovec iov[2];
+	size_t first;
+	ssize_t ret;
+
+	while (stream->ring_len > 0) {
+		first = MIN(stream->ring_len,
+			    WESTON_DEBUG_STREAM_BUFFER_SIZE - stream->ring_head);
+		iov[0].iov_base = stream->ring + stream->ring_head;
+		iov[0].iov_len = first;
+		iov[1].iov_base = stream->ring;
+		iov[1].iov_len = stream->ring_len - first;
+
+		ret = stream_write_fd(stream, iov, iov[1].iov_len ? 2 : 1,
+				      stream->ring_len);
+		if (ret < 0)
+			return false;
+		if (ret == 0)
+			break;
+
+		stream->ring_head = (stream->ring_head + ret) %
+				    WESTON_DEBUG_STREAM_BUFFER_SIZE;
+		stream->ring_len -= ret;
+	}
+
+	return true;
+}
+
+static int
+stream_handle_writable(int fd, uint32_t mask, void *data)
+{
+	struct weston_debug_stream *stream = data;
+
+	if (!stream_flush(stream))
+		return 0;
+
+	if (stream->ring_len > 0)
+		return 0;
+
+	wl_event_source_remove(stream->writable_source);
+	stream->writable_source = NULL;
+
+	if (stream->complete_pending)
+		weston_debug_stream_complete(stream);
+
+	return 0;
+}
+
+/* Keep what the fd did not take. On overflow the message is dropped, and
+ * the next message that fits is preceded by a line saying so, unless part
+ * of it was written already: then the stream fails. */
+static void
+stream_buffer(struct weston_debug_stream *stream, const char *data,
+	      size_t len, bool partial)
+{
+	struct wl_display *display = stream->wdc->compositor->wl_display;
+	struct wl_event_loop *loop;
+	char gap[80];
+	int gap_len = 0;
+
+	if (!stream->ring) {
+		stream->ring = malloc(WESTON_DEBUG_STREAM_BUFFER_SIZE);
+		if (!stream->ring) {
+			stream_close_on_failure(stream, "Out of memory");
+			return;
+		}
+		stream->ring_head = 0;
+	}
+
+	if (stream->gap_bytes > 0)
+		gap_len = snprintf(gap, sizeof gap,
+				   "\n[weston-debug: %llu bytes dropped, "
+				   "client too slow]\n",
+				   (unsigned long long)stream->gap_bytes);
+
+	if (stream->ring_len + gap_len + len >
+	    WESTON_DEBUG_STREAM_BUFFER_SIZE) {
+		if (partial) {
+			stream_close_on_failure(stream,
+				"Client too slow, %zu bytes of a message "
+				"do not fit in the buffer", len);
+			return;
+		}
+
+		if (stream->gap_bytes == 0)
+			stream->gaps++;
+		stream->gap_bytes += len;
+		stream->bytes_dropped += len;
+		return;
+	}
+
+	if (gap_len > 0) {
+		ring_append(stream, gap, gap_len);
+		stream->gap_bytes = 0;
+	}
+	ring_append(stream, data, len);
+
+	if (!stream->writable_source) {
+		loop = wl_display_get_event_loop(display);
+		stream->writable_source =
+			wl_event_loop_add_fd(loop, stream->fd,
+					     WL_EVENT_WRITABLE,
+					     stream_handle_writable, stream);
+		if (!stream->writable_source)
+			stream_close_on_failure(stream, "Out of memory");
+	}
+}
+
 /** Write data into a specific debug stream
  *
  * \param stream The debug stream to write into; must not be NULL.
@@ -518,9 +784,11 @@ weston_debug_scope_is_enabled(struct weston_debug_scope *scope)
  * Writes the given data (binary verbatim) into the debug stream.
  * If \c len is zero or negative, the write is silently dropped.
  *
- * Writing is continued until all data has been written or
- * a write fails. If the write fails due to a signal, it is re-tried.
- * Otherwise on failure, the stream is closed and
+ * The write never blocks. What the client is not ready to read is
+ * buffered and written when it is. If the buffer is full, the data is
+ * dropped whole and the client is later told how many bytes it missed.
+ * If part of the data was written already, the stream fails instead.
+ * If a write fails for another reason, the stream is closed and
  * \c weston_debug_stream_v1.failure event is sent to the client.
  *
  * \memberof weston_debug_stream
@@ -529,29 +797,29 @@ WL_EXPORT void
 weston_debug_stream_write(struct weston_debug_stream *stream,
 			  const char *data, size_t len)
 {
-	ssize_t len_ = len;
+	struct iovec iov;
 	ssize_t ret;
-	int e;
+	bool partial = false;
 
-	if (stream->fd == -1)
+	if (stream->fd == -1 || stream->complete_pending || len == 0)
 		return;
 
-	while (len_ > 0) {
-		ret = write(stream->fd, data, len_);
-		e = errno;
-		if (ret < 0) {
-			if (e == EINTR)
-				continue;
-
-			stream_close_on_failure(stream,
-					"Error writing %zd bytes: %s (%d)",
-					len_, strerror(e), e);
-			break;
-		}
+	/* Keep the order: nothing goes out before what is buffered. */
+	if (stream->ring_len == 0 && stream->gap_bytes == 0) {
+		iov.iov_base = (void *)data;
+		iov.iov_len = len;
+		ret = stream_write_fd(stream, &iov, 1, len);
+		if (ret < 0)
+			return;
 
-		len_ -= ret;
 		data += ret;
+		len -= ret;
+		if (len == 0)
+			return;
+		partial = ret > 0;
 	}
+
+	stream_buffer(stream, data, len, partial);
 }
 
 /** Write a formatted string into a specific debug stream (varargs)
@@ -608,11 +876,21 @@ weston_debug_stream_printf(struct weston_debug_stream *stream,
  * event to the client. This tells the client the debug information dump
  * is complete.
  *
+ * If some of the data is still buffered, the stream stops taking new
+ * data and is closed once the buffer has been written out.
+ *
  * \memberof weston_debug_stream
  */
 WL_EXPORT void
 weston_debug_stream_complete(struct weston_debug_stream *stream)
 {
+	if (stream->writable_source && stream->ring_len > 0) {
+		stream->complete_pending = true;
+		wl_list_remove(&stream->scope_link);
+		wl_list_init(&stream->scope_link);
+		return;
+	}
+
 	stream_close_unlink(stream);
 	weston_debug_stream_v1_send_complete(stream->resource);
 }
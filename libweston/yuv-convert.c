@@ -0,0 +1,270 @@
+/*
+ * Copyright © 2018 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "yuv-convert.h"
+
+/* BT.601 limited range to RGB, with the coefficients of the GL renderer
+ * shaders in 19.13 fixed point. They fit in 16 bits, so that the SIMD
+ * code can use 16-bit multiplies with 32-bit results. The scalar code
+ * does the same integer arithmetic, and gives the same results.
+ */
+#define YUV_SHIFT 13
+#define YUV_Y	9539	/* 1.16438356 */
+#define YUV_RV	13075	/* 1.59602678 */
+#define YUV_GU	3209	/* 0.39176229 */
+#define YUV_GV	6660	/* 0.81296764 */
+#define YUV_BU	16525	/* 2.01723214 */
+#define YUV_ROUND (1 << (YUV_SHIFT - 1))
+
+static inline uint32_t
+clamp_u8(int32_t v)
+{
+	v >>= YUV_SHIFT;
+
+	return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+static inline uint32_t
+yuv_pixel(int32_t luma, int32_t cb, int32_t cr)
+{
+	int32_t l = YUV_Y * (luma - 16) + YUV_ROUND;
+
+	cb -= 128;
+	cr -= 128;
+
+	return 0xff000000 |
+	       clamp_u8(l + YUV_RV * cr) << 16 |
+	       clamp_u8(l - YUV_GU * cb - YUV_GV * cr) << 8 |
+	       clamp_u8(l + YUV_BU * cb);
+}
+
+#ifdef __SSE2__
+
+/* Convert 8 pixels. luma holds their Y samples, chroma the Cb:Cr pairs
+ * of the 4 chroma samples, all as 16-bit integers. */
+static inline void
+convert_block_sse2(uint32_t *dst, __m128i luma, __m128i chroma)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i round = _mm_set1_epi32(YUV_ROUND);
+	__m128i y_lo, y_hi, prod_lo, prod_hi;
+	__m128i rc, gc, bc;
+	__m128i r, g, b, bg, ra;
+
+	luma = _mm_sub_epi16(luma, _mm_set1_epi16(16));
+	chroma = _mm_sub_epi16(chroma, _mm_set1_epi16(128));
+
+	/* Y * luma in 32 bits, for pixels 0-3 and 4-7 */
+	prod_lo = _mm_mullo_epi16(luma, _mm_set1_epi16(YUV_Y));
+	prod_hi = _mm_mulhi_epi16(luma, _mm_set1_epi16(YUV_Y));
+	y_lo = _mm_add_epi32(_mm_unpacklo_epi16(prod_lo, prod_hi), round);
+	y_hi = _mm_add_epi32(_mm_unpackhi_epi16(prod_lo, prod_hi), round);
+
+	/* Chroma terms of the 4 samples, from the Cb:Cr pairs */
+	rc = _mm_madd_epi16(chroma, _mm_set1_epi32(YUV_RV << 16));
+	gc = _mm_madd_epi16(chroma, _mm_set_epi16(-YUV_GV, -YUV_GU,
+						  -YUV_GV, -YUV_GU,
+						  -YUV_GV, -YUV_GU,
+						  -YUV_GV, -YUV_GU));
+	bc = _mm_madd_epi16(chroma, _mm_set1_epi32(YUV_BU));
+
+#define CHANNEL(c)							\
+	_mm_packs_epi32(						\
+		_mm_srai_epi32(_mm_add_epi32(y_lo,			\
+				_mm_unpacklo_epi32(c, c)), YUV_SHIFT),	\
+		_mm_srai_epi32(_mm_add_epi32(y_hi,			\
+				_mm_unpackhi_epi32(c, c)), YUV_SHIFT))
+
+	/* Saturating packs clamp to [0, 255] */
+	r = _mm_packus_epi16(CHANNEL(rc), zero);
+	g = _mm_packus_epi16(CHANNEL(gc), zero);
+	b = _mm_packus_epi16(CHANNEL(bc), zero);
+#undef CHANNEL
+
+	bg = _mm_unpacklo_epi8(b, g);
+	ra = _mm_unpacklo_epi8(r, _mm_set1_epi8((char)0xff));
+	_mm_storeu_si128((__m128i *)dst, _mm_unpacklo_epi16(bg, ra));
+	_mm_storeu_si128((__m128i *)(dst + 4), _mm_unpackhi_epi16(bg, ra));
+}
+
+static inline __m128i
+load_u8x8(const uint8_t *p)
+{
+	return _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)p),
+				 _mm_setzero_si128());
+}
+
+static inline __m128i
+load_u8x4(const uint8_t *p)
+{
+	int32_t v;
+
+	memcpy(&v, p, sizeof v);
+
+	return _mm_cvtsi32_si128(v);
+}
+
+/* Convert blocks of 8 pixels from chroma sample c on, as long as they fit
+ * before chroma sample c2. Returns the first chroma sample not done. */
+static int32_t
+convert_row_sse2(uint32_t *dst, const uint8_t *y,
+		 const uint8_t *u, const uint8_t *v,
+		 enum weston_yuv_layout layout, int32_t c, int32_t c2)
+{
+	__m128i luma, chroma, packed;
+
+	for (; c + 4 <= c2; c += 4) {
+		switch (layout) {
+		case WESTON_YUV_LAYOUT_NV12:
+			luma = load_u8x8(y + 2 * c);
+			chroma = load_u8x8(u + 2 * c);
+			break;
+		case WESTON_YUV_LAYOUT_YUYV:
+			packed = _mm_loadu_si128((const __m128i *)(y + 4 * c));
+			luma = _mm_and_si128(packed, _mm_set1_epi16(0xff));
+			chroma = _mm_srli_epi16(packed, 8);
+			break;
+		case WESTON_YUV_LAYOUT_YUV420:
+		default:
+			luma = load_u8x8(y + 2 * c);
+			chroma = _mm_unpacklo_epi8(
+				_mm_unpacklo_epi8(load_u8x4(u + c),
+						  load_u8x4(v + c)),
+				_mm_setzero_si128());
+			break;
+		}
+
+		convert_block_sse2(dst + 2 * c, luma, chroma);
+	}
+
+	return c;
+}
+
+#endif /* __SSE2__ */
+
+/* Convert the pixels [x1, x2) of a row, x1 being even. Chroma sample n
+ * covers the pixels 2n and 2n+1. */
+static void
+convert_row(uint32_t *dst, const uint8_t *y, int y_step,
+	    const uint8_t *u, const uint8_t *v, int uv_step,
+	    enum weston_yuv_layout layout, int32_t x1, int32_t x2)
+{
+	int32_t c = x1 / 2;
+	int32_t c2 = x2 / 2;
+
+#ifdef __SSE2__
+	c = convert_row_sse2(dst, y, u, v, layout, c, c2);
+#endif
+
+	for (; c < c2; c++) {
+		int32_t cb = u[c * uv_step];
+		int32_t cr = v[c * uv_step];
+
+		dst[2 * c] = yuv_pixel(y[2 * c * y_step], cb, cr);
+		dst[2 * c + 1] = yuv_pixel(y[(2 * c + 1) * y_step], cb, cr);
+	}
+
+	/* Last column of an odd width image */
+	if (x2 & 1)
+		dst[x2 - 1] = yuv_pixel(y[(x2 - 1) * y_step],
+					u[c2 * uv_step], v[c2 * uv_step]);
+}
+
+/* Row of the vertically subsampled chroma planes. An odd last row
+ * shares the chroma of the row above. */
+static inline int32_t
+chroma_row(const struct weston_yuv_source *src, int32_t row)
+{
+	int32_t rows = src->height / 2;
+
+	row /= 2;
+
+	return (row < rows || rows == 0) ? row : rows - 1;
+}
+
+/** Convert a rectangle of a YUV image to x8r8g8b8
+ *
+ * \param src The YUV image.
+ * \param dst The first pixel of the x8r8g8b8 image, which has the same
+ * size as the YUV image.
+ * \param dst_stride The stride of dst in bytes.
+ *
+ * The rectangle is clipped to the image. Pixels outside it may be
+ * written as well, with the same values as a full conversion would give.
+ */
+void
+weston_yuv_convert_rect(const struct weston_yuv_source *src,
+			uint32_t *dst, int32_t dst_stride,
+			int32_t x1, int32_t y1, int32_t x2, int32_t y2)
+{
+	const uint8_t *chroma = src->data + src->stride * src->height;
+	int32_t chroma_stride;
+	int32_t row;
+
+	if (x1 < 0)
+		x1 = 0;
+	if (y1 < 0)
+		y1 = 0;
+	if (x2 > src->width)
+		x2 = src->width;
+	if (y2 > src->height)
+		y2 = src->height;
+	if (x1 >= x2 || y1 >= y2)
+		return;
+
+	/* Start on a chroma sample boundary. */
+	x1 &= ~1;
+
+	for (row = y1; row < y2; row++) {
+		uint32_t *d = (uint32_t *)((uint8_t *)dst + row * dst_stride);
+		const uint8_t *y = src->data + row * src->stride;
+		const uint8_t *u, *v;
+
+		switch (src->layout) {
+		case WESTON_YUV_LAYOUT_NV12:
+			u = chroma + chroma_row(src, row) * src->stride;
+			convert_row(d, y, 1, u, u + 1, 2, src->layout, x1, x2);
+			break;
+		case WESTON_YUV_LAYOUT_YUYV:
+			convert_row(d, y, 2, y + 1, y + 3, 4, src->layout,
+				    x1, x2);
+			break;
+		case WESTON_YUV_LAYOUT_YUV420:
+			chroma_stride = src->stride / 2;
+			u = chroma + chroma_row(src, row) * chroma_stride;
+			v = u + chroma_stride * (src->height / 2);
+			convert_row(d, y, 1, u, v, 1, src->layout, x1, x2);
+			break;
+		}
+	}
+}
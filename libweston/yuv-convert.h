@@ -0,0 +1,56 @@
+/*
+ * Copyright © 2018 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef WESTON_YUV_CONVERT_H
+#define WESTON_YUV_CONVERT_H
+
+#include <stdint.h>
+
+/** Memory layouts of the YUV formats the software renderer converts
+ *
+ * The planes follow each other in a single buffer, as the GL renderer
+ * expects of wl_shm buffers: the chroma planes of YUV420 have half the
+ * luma stride, the interleaved chroma plane of NV12 has the same stride.
+ */
+enum weston_yuv_layout {
+	WESTON_YUV_LAYOUT_NV12,		/* Y plane, then Cb:Cr, 2x2 subsampled */
+	WESTON_YUV_LAYOUT_YUYV,		/* packed Y0:Cb:Y1:Cr, 2x1 subsampled */
+	WESTON_YUV_LAYOUT_YUV420,	/* Y, Cb and Cr planes, 2x2 subsampled */
+};
+
+struct weston_yuv_source {
+	enum weston_yuv_layout layout;
+	const uint8_t *data;
+	int32_t stride; /* of the first plane, in bytes */
+	int32_t width;
+	int32_t height;
+};
+
+void
+weston_yuv_convert_rect(const struct weston_yuv_source *src,
+			uint32_t *dst, int32_t dst_stride,
+			int32_t x1, int32_t y1, int32_t x2, int32_t y2);
+
+#endif /* WESTON_YUV_CONVERT_H */
@@ -36,26 +36,36 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <fcntl.h>
-#include <gbm.h>
+#include <drm_fourcc.h>
 
 #include <gst/gst.h>
 #include <gst/allocators/gstdmabuf.h>
+#include <gst/allocators/gstfdmemory.h>
 #include <gst/app/gstappsrc.h>
 #include <gst/video/gstvideometa.h>
 
 #include "remoting-plugin.h"
 #include "compositor-drm.h"
+#include "compositor-headless.h"
 #include "shared/helpers.h"
 #include "shared/timespec-util.h"
 
 #define MAX_RETRY_COUNT	3
 
+/* Frames with more damage rectangles are marked with their bounding box */
+#define MAX_DAMAGE_RECTS	16
+
 struct weston_remoting {
 	struct weston_compositor *compositor;
 	struct wl_list output_list;
 	struct wl_listener destroy_listener;
+
+	/* Virtual outputs of the DRM backend, or else of the headless
+	 * backend with the pixman renderer */
 	const struct weston_drm_virtual_output_api *virtual_output_api;
+	const struct weston_headless_virtual_output_api *headless_api;
 
+	/* dmabuf allocator for DRM, shared memory for headless */
 	GstAllocator *allocator;
 };
 
@@ -74,15 +84,15 @@ struct remoted_output_support_gbm_format {
 
 static const struct remoted_output_support_gbm_format supported_formats[] = {
 	{
-		.gbm_format = GBM_FORMAT_XRGB8888,
+		.gbm_format = DRM_FORMAT_XRGB8888,
 		.gst_format_string = "BGRx",
 		.gst_video_format = GST_VIDEO_FORMAT_BGRx,
 	}, {
-		.gbm_format = GBM_FORMAT_RGB565,
+		.gbm_format = DRM_FORMAT_RGB565,
 		.gst_format_string = "RGB16",
 		.gst_video_format = GST_VIDEO_FORMAT_RGB16,
 	}, {
-		.gbm_format = GBM_FORMAT_XRGB2101010,
+		.gbm_format = DRM_FORMAT_XRGB2101010,
 		.gst_format_string = "r210",
 		.gst_video_format = GST_VIDEO_FORMAT_r210,
 	}
@@ -97,6 +107,7 @@ struct remoted_output {
 
 	char *host;
 	int port;
+	char *gst_pipeline;
 	const struct remoted_output_support_gbm_format *format;
 
 	struct weston_head *head;
@@ -118,7 +129,7 @@ struct remoted_output {
 
 struct mem_free_cb_data {
 	struct remoted_output *output;
-	struct drm_fb *output_buffer;
+	void *output_buffer;	/* drm_fb or weston_headless_virtual_buffer */
 };
 
 struct gst_frame_buffer_data {
@@ -147,7 +158,10 @@ remoting_gst_init(struct weston_remoting *remoting)
 		return -1;
 	}
 
-	remoting->allocator = gst_dmabuf_allocator_new();
+	if (remoting->headless_api)
+		remoting->allocator = gst_fd_allocator_new();
+	else
+		remoting->allocator = gst_dmabuf_allocator_new();
 
 	return 0;
 }
@@ -181,25 +195,32 @@ static int
 remoting_gst_pipeline_init(struct remoted_output *output)
 {
 	char pipeline_str[1024];
+	const char *pipeline_desc = pipeline_str;
 	GstCaps *caps;
 	GError *err = NULL;
 	GstStateChangeReturn ret;
 	struct weston_mode *mode = output->output->current_mode;
 
-	/* TODO: use encodebin instead of jpegenc */
-	snprintf(pipeline_str, sizeof(pipeline_str),
-		 "rtpbin name=rtpbin "
-		 "appsrc name=src ! videoconvert ! video/x-raw,format=I420 ! "
-		 "jpegenc ! rtpjpegpay ! rtpbin.send_rtp_sink_0 "
-		 "rtpbin.send_rtp_src_0 ! udpsink name=sink host=%s port=%d "
-		 "rtpbin.send_rtcp_src_0 ! "
-		 "udpsink host=%s port=%d sync=false async=false "
-		 "udpsrc port=%d ! rtpbin.recv_rtcp_sink_0",
-		 output->host, output->port, output->host, output->port + 1,
-		 output->port + 2);
-	weston_log("GST pipeline: %s\n", pipeline_str);
-
-	output->pipeline = gst_parse_launch(pipeline_str, &err);
+	if (output->gst_pipeline) {
+		pipeline_desc = output->gst_pipeline;
+	} else {
+		/* TODO: use encodebin instead of jpegenc */
+		snprintf(pipeline_str, sizeof(pipeline_str),
+			 "rtpbin name=rtpbin "
+			 "appsrc name=src ! videoconvert ! "
+			 "video/x-raw,format=I420 ! "
+			 "jpegenc ! rtpjpegpay ! rtpbin.send_rtp_sink_0 "
+			 "rtpbin.send_rtp_src_0 ! "
+			 "udpsink name=sink host=%s port=%d "
+			 "rtpbin.send_rtcp_src_0 ! "
+			 "udpsink host=%s port=%d sync=false async=false "
+			 "udpsrc port=%d ! rtpbin.recv_rtcp_sink_0",
+			 output->host, output->port, output->host,
+			 output->port + 1, output->port + 2);
+	}
+	weston_log("GST pipeline: %s\n", pipeline_desc);
+
+	output->pipeline = gst_parse_launch(pipeline_desc, &err);
 	if (!output->pipeline) {
 		weston_log("Could not create gstreamer pipeline. Error: %s\n",
 			   err->message);
@@ -341,10 +362,12 @@ remoting_gst_bus_message_handler(struct remoted_output *output)
 static void
 remoting_output_buffer_release(struct remoted_output *output, void *buffer)
 {
-	const struct weston_drm_virtual_output_api *api
-		= output->remoting->virtual_output_api;
+	struct weston_remoting *remoting = output->remoting;
 
-	api->buffer_released(buffer);
+	if (remoting->headless_api)
+		remoting->headless_api->buffer_released(buffer);
+	else
+		remoting->virtual_output_api->buffer_released(buffer);
 }
 
 static int
@@ -449,16 +472,20 @@ static int
 remoting_output_finish_frame_handler(void *data)
 {
 	struct remoted_output *output = data;
-	const struct weston_drm_virtual_output_api *api
-		= output->remoting->virtual_output_api;
+	struct weston_remoting *remoting = output->remoting;
 	struct timespec now;
 	int64_t msec;
 
 	if (output->submitted_frame) {
-		struct weston_compositor *c = output->remoting->compositor;
+		struct weston_compositor *c = remoting->compositor;
 		output->submitted_frame = false;
 		weston_compositor_read_presentation_clock(c, &now);
-		api->finish_frame(output->output, &now, 0);
+		if (remoting->headless_api)
+			remoting->headless_api->finish_frame(output->output,
+							     &now, 0);
+		else
+			remoting->virtual_output_api->finish_frame(output->output,
+								   &now, 0);
 	}
 
 	msec = millihz_to_nsec(output->output->current_mode->refresh) / 1000000;
@@ -608,6 +635,86 @@ remoting_output_frame(struct weston_output *output_base, int fd, int stride,
 	return 0;
 }
 
+/* Mark what changed since the previous frame, so that the elements that
+ * care can limit their work to it. */
+static void
+remoting_output_add_damage_meta(GstBuffer *buf, pixman_region32_t *damage)
+{
+	pixman_box32_t *boxes;
+	int i, n;
+
+	boxes = pixman_region32_rectangles(damage, &n);
+	if (n > MAX_DAMAGE_RECTS) {
+		boxes = pixman_region32_extents(damage);
+		n = 1;
+	}
+
+	for (i = 0; i < n; i++)
+		gst_buffer_add_video_region_of_interest_meta(buf, "damage",
+					boxes[i].x1, boxes[i].y1,
+					boxes[i].x2 - boxes[i].x1,
+					boxes[i].y2 - boxes[i].y1);
+}
+
+static int
+remoting_output_frame_shm(struct weston_output *output_base, int fd,
+			  int stride, pixman_region32_t *damage,
+			  struct weston_headless_virtual_buffer *output_buffer)
+{
+	struct remoted_output *output = lookup_remoted_output(output_base);
+	struct weston_remoting *remoting;
+	struct weston_mode *mode;
+	GstBuffer *buf;
+	GstMemory *mem;
+	gsize offset = 0;
+	struct mem_free_cb_data *cb_data;
+
+	if (!output)
+		return -1;
+
+	remoting = output->remoting;
+
+	/* Nothing changed: let the stream repeat the previous frame, and
+	 * keep pacing the output as if it had been sent. */
+	if (!pixman_region32_not_empty(damage)) {
+		close(fd);
+		remoting->headless_api->buffer_released(output_buffer);
+		output->submitted_frame = true;
+		return 0;
+	}
+
+	cb_data = zalloc(sizeof *cb_data);
+	if (!cb_data)
+		return -1;
+
+	mode = output->output->current_mode;
+	buf = gst_buffer_new();
+	mem = gst_fd_allocator_alloc(remoting->allocator, fd,
+				     stride * mode->height,
+				     GST_FD_MEMORY_FLAG_NONE);
+	gst_buffer_append_memory(buf, mem);
+	gst_buffer_add_video_meta_full(buf,
+				       GST_VIDEO_FRAME_FLAG_NONE,
+				       output->format->gst_video_format,
+				       mode->width,
+				       mode->height,
+				       1,
+				       &offset,
+				       &stride);
+	remoting_output_add_damage_meta(buf, damage);
+
+	cb_data->output = output;
+	cb_data->output_buffer = output_buffer;
+	gst_mini_object_weak_ref(GST_MINI_OBJECT(mem),
+				 (GstMiniObjectNotify)remoting_gst_mem_free_cb,
+				 cb_data);
+
+	/* The pixman renderer is done with the frame already. */
+	remoting_output_gst_push_buffer(output, buf);
+
+	return 0;
+}
+
 static void
 remoting_output_destroy(struct weston_output *output)
 {
@@ -626,6 +733,7 @@ remoting_output_destroy(struct weston_output *output)
 
 	if (remoted_output->host)
 		free(remoted_output->host);
+	free(remoted_output->gst_pipeline);
 
 	wl_list_remove(&remoted_output->link);
 	weston_head_release(remoted_output->head);
@@ -651,12 +759,16 @@ remoting_output_enable(struct weston_output *output)
 {
 	struct remoted_output *remoted_output = lookup_remoted_output(output);
 	struct weston_compositor *c = output->compositor;
-	const struct weston_drm_virtual_output_api *api
-		= remoted_output->remoting->virtual_output_api;
+	struct weston_remoting *remoting = remoted_output->remoting;
 	struct wl_event_loop *loop;
 	int ret;
 
-	api->set_submit_frame_cb(output, remoting_output_frame);
+	if (remoting->headless_api)
+		remoting->headless_api->set_submit_frame_cb(output,
+						remoting_output_frame_shm);
+	else
+		remoting->virtual_output_api->set_submit_frame_cb(output,
+						remoting_output_frame);
 
 	ret = remoted_output->saved_enable(output);
 	if (ret < 0)
@@ -697,7 +809,6 @@ remoting_output_create(struct weston_compositor *c, char *name)
 	struct weston_remoting *remoting = weston_remoting_get(c);
 	struct remoted_output *output;
 	struct weston_head *head;
-	const struct weston_drm_virtual_output_api *api;
 	const char *make = "Renesas";
 	const char *model = "Virtual Display";
 	const char *serial_number = "unknown";
@@ -706,8 +817,6 @@ remoting_output_create(struct weston_compositor *c, char *name)
 	if (!name || !strlen(name))
 		return NULL;
 
-	api = remoting->virtual_output_api;
-
 	output = zalloc(sizeof *output);
 	if (!output)
 		return NULL;
@@ -721,7 +830,11 @@ remoting_output_create(struct weston_compositor *c, char *name)
 		goto err;
 	}
 
-	output->output = api->create_output(c, name);
+	if (remoting->headless_api)
+		output->output = remoting->headless_api->create_output(c, name);
+	else
+		output->output =
+			remoting->virtual_output_api->create_output(c, name);
 	if (!output->output) {
 		weston_log("Can not create virtual output\n");
 		goto err;
@@ -814,7 +927,15 @@ remoting_output_set_gbm_format(struct weston_output *output,
 	if (!remoted_output)
 		return;
 
+	/* Headless virtual outputs are always XRGB8888. */
 	api = remoted_output->remoting->virtual_output_api;
+	if (!api) {
+		if (gbm_format && strcmp(gbm_format, "xrgb8888"))
+			weston_log("Remoted output %s only supports "
+				   "xrgb8888\n", output->name);
+		return;
+	}
+
 	format = api->set_gbm_format(output, gbm_format);
 
 	for (i = 0; i < ARRAY_LENGTH(supported_formats); i++) {
@@ -853,6 +974,19 @@ remoting_output_set_port(struct weston_output *output, int port)
 		remoted_output->port = port;
 }
 
+static void
+remoting_output_set_gst_pipeline(struct weston_output *output,
+				 char *gst_pipeline)
+{
+	struct remoted_output *remoted_output = lookup_remoted_output(output);
+
+	if (!remoted_output)
+		return;
+
+	free(remoted_output->gst_pipeline);
+	remoted_output->gst_pipeline = strdup(gst_pipeline);
+}
+
 static const struct weston_remoting_api remoting_api = {
 	remoting_output_create,
 	remoting_output_is_remoted,
@@ -861,6 +995,7 @@ static const struct weston_remoting_api remoting_api = {
 	remoting_output_set_seat,
 	remoting_output_set_host,
 	remoting_output_set_port,
+	remoting_output_set_gst_pipeline,
 };
 
 WL_EXPORT int
@@ -870,8 +1005,11 @@ weston_module_init(struct weston_compositor *compositor)
 	struct weston_remoting *remoting;
 	const struct weston_drm_virtual_output_api *api =
 		weston_drm_virtual_output_get_api(compositor);
+	const struct weston_headless_virtual_output_api *headless_api = NULL;
 
 	if (!api)
+		headless_api = weston_headless_virtual_output_get_api(compositor);
+	if (!api && !headless_api)
 		return -1;
 
 	remoting = zalloc(sizeof *remoting);
@@ -879,6 +1017,7 @@ weston_module_init(struct weston_compositor *compositor)
 		return -1;
 
 	remoting->virtual_output_api = api;
+	remoting->headless_api = headless_api;
 	remoting->compositor = compositor;
 	wl_list_init(&remoting->output_list);
 
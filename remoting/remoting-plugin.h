@@ -59,6 +59,11 @@ struct weston_remoting_api {
 
 	/** Set the port number */
 	void (*set_port)(struct weston_output *output, int port);
+
+	/** Set a GStreamer pipeline to use instead of the RTP one, with an
+	 * appsrc named "src" to push the frames to */
+	void (*set_gst_pipeline)(struct weston_output *output,
+				 char *gst_pipeline);
 };
 
 static inline const struct weston_remoting_api *
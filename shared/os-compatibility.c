@@ -25,13 +25,12 @@
 
 #include "config.h"
 
-#ifdef __FreeBSD__
-#include <sys/mman.h>
-#elif HAVE_LINUX_MEMFD_H
+#if !defined(__FreeBSD__) && HAVE_LINUX_MEMFD_H
 #define _GNU_SOURCE
 #include <sys/syscall.h>
 #include <linux/memfd.h>
 #endif
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <unistd.h>
@@ -39,6 +38,7 @@
 #include <errno.h>
 #include <sys/epoll.h>
 #include <string.h>
+#include <stdbool.h>
 #include <stdlib.h>
 
 #include "os-compatibility.h"
@@ -213,6 +213,136 @@ os_create_anonymous_file(off_t size)
 	return fd;
 }
 
+struct ro_anonymous_file {
+	int fd;
+	size_t size;
+	const char *data;	/* for per-client copies */
+	bool shared;		/* fd is sealed, and can be handed out */
+};
+
+#if defined(HAVE_LINUX_MEMFD_H) && defined(F_ADD_SEALS)
+/* A memfd holding a copy of data, sealed so that no one, including the
+ * processes it is sent to, can modify it any more. */
+static int
+create_sealed_file(const char *data, size_t size)
+{
+	void *area;
+	int fd;
+
+	fd = syscall(SYS_memfd_create, "weston-shared",
+		     MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0)
+		return -1;
+
+	if (ftruncate(fd, size) < 0)
+		goto err;
+
+	area = mmap(NULL, size, PROT_WRITE, MAP_SHARED, fd, 0);
+	if (area == MAP_FAILED)
+		goto err;
+	memcpy(area, data, size);
+	munmap(area, size);
+
+	if (fcntl(fd, F_ADD_SEALS, F_SEAL_WRITE | F_SEAL_SHRINK |
+				   F_SEAL_GROW | F_SEAL_SEAL) < 0)
+		goto err;
+
+	return fd;
+
+err:
+	close(fd);
+	return -1;
+}
+#endif
+
+static int
+create_file_copy(const char *data, size_t size)
+{
+	void *area;
+	int fd;
+
+	fd = os_create_anonymous_file(size);
+	if (fd < 0)
+		return -1;
+
+	area = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (area == MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+	memcpy(area, data, size);
+	munmap(area, size);
+
+	return fd;
+}
+
+/*
+ * Create a file holding a copy of the given data, to be handed out
+ * read-only to any number of processes, with os_ro_anonymous_file_get_fd().
+ *
+ * Where the kernel supports sealing memfds, all of them share a single
+ * sealed file. Otherwise, each gets a copy of its own, so that none of
+ * them can change what the others see. The data must outlive the file
+ * in that case.
+ *
+ * Returns NULL on failure.
+ */
+struct ro_anonymous_file *
+os_ro_anonymous_file_create(const char *data, size_t size)
+{
+	struct ro_anonymous_file *file;
+
+	file = calloc(1, sizeof *file);
+	if (!file)
+		return NULL;
+
+	file->size = size;
+	file->data = data;
+	file->fd = -1;
+
+#if defined(HAVE_LINUX_MEMFD_H) && defined(F_ADD_SEALS)
+	file->fd = create_sealed_file(data, size);
+	file->shared = file->fd >= 0;
+#endif
+
+	return file;
+}
+
+void
+os_ro_anonymous_file_destroy(struct ro_anonymous_file *file)
+{
+	if (file->fd >= 0)
+		close(file->fd);
+	free(file);
+}
+
+/*
+ * Get a file descriptor to send to a process, which may only read it.
+ * It is given back with os_ro_anonymous_file_put_fd() once sent.
+ *
+ * The shared sealed file can only be mapped MAP_PRIVATE, or MAP_SHARED
+ * without PROT_WRITE. A process that may map it MAP_SHARED for writing
+ * anyway, as older wl_keyboard clients do, gets a copy of its own.
+ *
+ * Returns -1 on failure.
+ */
+int
+os_ro_anonymous_file_get_fd(struct ro_anonymous_file *file,
+			    enum ro_anonymous_file_mapmode mapmode)
+{
+	if (file->shared && mapmode == RO_ANONYMOUS_FILE_MAPMODE_PRIVATE)
+		return file->fd;
+
+	return create_file_copy(file->data, file->size);
+}
+
+void
+os_ro_anonymous_file_put_fd(struct ro_anonymous_file *file, int fd)
+{
+	if (fd != file->fd)
+		close(fd);
+}
+
 #ifndef HAVE_STRCHRNUL
 char *
 strchrnul(const char *s, int c)
@@ -42,6 +42,27 @@ os_epoll_create_cloexec(void);
 int
 os_create_anonymous_file(off_t size);
 
+struct ro_anonymous_file;
+
+/* How the process the file is sent to may map it */
+enum ro_anonymous_file_mapmode {
+	RO_ANONYMOUS_FILE_MAPMODE_PRIVATE,
+	RO_ANONYMOUS_FILE_MAPMODE_SHARED,
+};
+
+struct ro_anonymous_file *
+os_ro_anonymous_file_create(const char *data, size_t size);
+
+void
+os_ro_anonymous_file_destroy(struct ro_anonymous_file *file);
+
+int
+os_ro_anonymous_file_get_fd(struct ro_anonymous_file *file,
+			    enum ro_anonymous_file_mapmode mapmode);
+
+void
+os_ro_anonymous_file_put_fd(struct ro_anonymous_file *file, int fd);
+
 #ifndef HAVE_STRCHRNUL
 char *
 strchrnul(const char *s, int c);
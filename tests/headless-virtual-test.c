@@ -0,0 +1,264 @@
+/*
+ * Copyright © 2018 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Drives a virtual output of the headless backend the way the remoting
+ * plugin does. The buffers handed over are held, so that frames have to
+ * rotate through the ring and then fall back to the scratch buffer. Needs
+ * the pixman renderer, and is skipped without it. */
+
+#include "config.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "compositor.h"
+#include "compositor/weston.h"
+#include "compositor-headless.h"
+#include "shared/helpers.h"
+
+#define VIRTUAL_WIDTH 64
+#define VIRTUAL_HEIGHT 48
+#define VIRTUAL_BUFFERS 3
+
+struct virtual_test {
+	struct weston_compositor *compositor;
+	const struct weston_headless_virtual_output_api *api;
+	struct weston_output *output;
+	struct weston_head head;
+	struct weston_mode mode;
+	struct weston_layer layer;
+	struct weston_surface *surface;
+	struct wl_listener frame_listener;
+
+	int step;
+	struct weston_headless_virtual_buffer *held[VIRTUAL_BUFFERS + 1];
+};
+
+/* The submit callback gets no user data. */
+static struct virtual_test *virtual_test;
+
+/* The color of the surface at each step. The frame of step 3 is rendered
+ * into the scratch buffer, as the plugin holds all the others. */
+static const uint32_t step_colors[] = {
+	0xff0000, 0x00ff00, 0x0000ff, 0xffffff, 0x000000
+};
+
+static void
+test_set_color(struct virtual_test *test, uint32_t rgb)
+{
+	weston_surface_set_color(test->surface,
+				 ((rgb >> 16) & 0xff) / 255.0f,
+				 ((rgb >> 8) & 0xff) / 255.0f,
+				 (rgb & 0xff) / 255.0f, 1.0f);
+	weston_surface_damage(test->surface);
+}
+
+static uint32_t
+frame_center_pixel(int fd, int stride)
+{
+	size_t size = (size_t)stride * VIRTUAL_HEIGHT;
+	uint8_t *data;
+	uint32_t pixel;
+
+	data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	assert(data != MAP_FAILED);
+	pixel = ((uint32_t *)(data + VIRTUAL_HEIGHT / 2 * stride))
+		[VIRTUAL_WIDTH / 2];
+	munmap(data, size);
+
+	return pixel & 0xffffff;
+}
+
+static void
+test_next_step(void *data)
+{
+	struct virtual_test *test = data;
+	struct timespec now;
+	int i;
+
+	switch (test->step) {
+	case 1:
+	case 2:
+	case 3:
+		weston_compositor_read_presentation_clock(test->compositor,
+							  &now);
+		test->api->finish_frame(test->output, &now, 0);
+		test_set_color(test, step_colors[test->step]);
+		break;
+	case 4:
+		/* The first buffer becomes the only free one. */
+		test->api->buffer_released(test->held[0]);
+		test_set_color(test, step_colors[test->step]);
+		break;
+	case 5:
+		for (i = 1; i <= VIRTUAL_BUFFERS; i++)
+			test->api->buffer_released(test->held[i]);
+		weston_compositor_exit_with_code(test->compositor,
+						 EXIT_SUCCESS);
+		break;
+	default:
+		assert(0);
+	}
+}
+
+static void
+test_schedule_next_step(struct virtual_test *test)
+{
+	struct wl_event_loop *loop =
+		wl_display_get_event_loop(test->compositor->wl_display);
+
+	test->step++;
+	wl_event_loop_add_idle(loop, test_next_step, test);
+}
+
+static int
+test_submit_frame(struct weston_output *output, int fd, int stride,
+		  pixman_region32_t *damage,
+		  struct weston_headless_virtual_buffer *buffer)
+{
+	struct virtual_test *test = virtual_test;
+	pixman_box32_t all = { 0, 0, VIRTUAL_WIDTH, VIRTUAL_HEIGHT };
+	uint32_t pixel;
+	int i;
+
+	assert(output == test->output);
+	assert(test->step != 3);
+	assert(stride >= VIRTUAL_WIDTH * 4);
+
+	pixel = frame_center_pixel(fd, stride);
+	close(fd);
+
+	fprintf(stderr, "step %d: frame in buffer %p, center 0x%06x\n",
+		test->step, buffer, pixel);
+
+	assert(pixel == step_colors[test->step]);
+	assert(pixman_region32_contains_rectangle(damage, &all) ==
+	       PIXMAN_REGION_IN);
+
+	if (test->step < VIRTUAL_BUFFERS) {
+		/* A held buffer is not rendered to. */
+		for (i = 0; i < test->step; i++)
+			assert(buffer != test->held[i]);
+	} else {
+		assert(buffer == test->held[0]);
+	}
+	test->held[test->step == 4 ? VIRTUAL_BUFFERS : test->step] = buffer;
+
+	test_schedule_next_step(test);
+
+	return 0;
+}
+
+/* Frames that go to the scratch buffer are repainted without being
+ * handed over. */
+static void
+test_frame(struct wl_listener *listener, void *data)
+{
+	struct virtual_test *test =
+		container_of(listener, struct virtual_test, frame_listener);
+
+	if (test->step == 3)
+		test_schedule_next_step(test);
+}
+
+static void
+test_start(void *data)
+{
+	struct virtual_test *test = data;
+	struct weston_compositor *compositor = test->compositor;
+	struct weston_output *output;
+	struct weston_view *view;
+	static char name[] = "virtual";
+
+	test->api = weston_headless_virtual_output_get_api(compositor);
+	if (!test->api) {
+		weston_log("headless-virtual: no virtual output API, "
+			   "skipping\n");
+		weston_compositor_exit_with_code(compositor, 77);
+		return;
+	}
+
+	output = test->api->create_output(compositor, name);
+	assert(output);
+	test->output = output;
+
+	test->mode.flags = WL_OUTPUT_MODE_CURRENT;
+	test->mode.width = VIRTUAL_WIDTH;
+	test->mode.height = VIRTUAL_HEIGHT;
+	test->mode.refresh = 60000;
+	wl_list_insert(&output->mode_list, &test->mode.link);
+	output->current_mode = &test->mode;
+
+	weston_head_init(&test->head, name);
+	weston_output_attach_head(output, &test->head);
+	weston_output_set_scale(output, 1);
+	weston_output_set_transform(output, WL_OUTPUT_TRANSFORM_NORMAL);
+
+	test->api->set_submit_frame_cb(output, test_submit_frame);
+	assert(weston_output_enable(output) == 0);
+
+	test->frame_listener.notify = test_frame;
+	wl_signal_add(&output->frame_signal, &test->frame_listener);
+
+	/* A surface covering the virtual output */
+	weston_layer_init(&test->layer, compositor);
+	weston_layer_set_position(&test->layer, WESTON_LAYER_POSITION_NORMAL);
+
+	test->surface = weston_surface_create(compositor);
+	assert(test->surface);
+	view = weston_view_create(test->surface);
+	assert(view);
+
+	weston_surface_set_size(test->surface, VIRTUAL_WIDTH, VIRTUAL_HEIGHT);
+	test->surface->is_mapped = true;
+	weston_view_set_position(view, output->x, output->y);
+	view->is_mapped = true;
+	weston_layer_entry_insert(&test->layer.view_list, &view->layer_link);
+	weston_view_update_transform(view);
+
+	test_set_color(test, step_colors[0]);
+}
+
+WL_EXPORT int
+wet_module_init(struct weston_compositor *compositor,
+		int *argc, char *argv[])
+{
+	struct wl_event_loop *loop;
+
+	virtual_test = zalloc(sizeof *virtual_test);
+	if (!virtual_test)
+		return -1;
+
+	virtual_test->compositor = compositor;
+
+	loop = wl_display_get_event_loop(compositor->wl_display);
+	wl_event_loop_add_idle(loop, test_start, virtual_test);
+
+	return 0;
+}
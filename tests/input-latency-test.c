@@ -0,0 +1,197 @@
+/*
+ * Copyright © 2018 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "shared/timespec-util.h"
+#include "weston-test-client-helper.h"
+#include "weston-debug-client-protocol.h"
+
+char *server_parameters = "--debug";
+
+/* Not on the presentation clock: the compositor uses the arrival time. */
+static const struct timespec t1 = { .tv_sec = 1, .tv_nsec = 1000001 };
+
+struct latency_stream {
+	struct weston_debug_stream_v1 *obj;
+	bool done;
+};
+
+static struct weston_debug_v1 *
+get_weston_debug(struct client *client)
+{
+	struct global *g;
+	struct global *global_debug = NULL;
+
+	wl_list_for_each(g, &client->global_list, link) {
+		if (strcmp(g->interface, weston_debug_v1_interface.name))
+			continue;
+
+		if (global_debug)
+			assert(0 && "multiple weston_debug objects");
+
+		global_debug = g;
+	}
+
+	assert(global_debug && "no weston_debug found");
+
+	return wl_registry_bind(client->wl_registry, global_debug->name,
+				&weston_debug_v1_interface, 1);
+}
+
+static void
+stream_handle_complete(void *data, struct weston_debug_stream_v1 *obj)
+{
+	struct latency_stream *stream = data;
+
+	stream->done = true;
+}
+
+static void
+stream_handle_failure(void *data, struct weston_debug_stream_v1 *obj,
+		      const char *msg)
+{
+	fprintf(stderr, "input-latency stream failed: %s\n", msg);
+	assert(0);
+}
+
+static const struct weston_debug_stream_v1_listener stream_listener = {
+	stream_handle_complete,
+	stream_handle_failure
+};
+
+/* Number of samples in the histogram of the first output */
+static uint64_t
+get_output_samples(struct client *client)
+{
+	struct weston_debug_v1 *debug = get_weston_debug(client);
+	struct latency_stream stream = { 0 };
+	char buf[16384];
+	size_t len = 0;
+	ssize_t ret;
+	uint64_t samples = 0;
+	const char *line;
+	int fds[2];
+
+	assert(pipe2(fds, O_CLOEXEC) == 0);
+	assert(fcntl(fds[0], F_SETFL, O_NONBLOCK) == 0);
+
+	stream.obj = weston_debug_v1_subscribe(debug, "input-latency", fds[1]);
+	weston_debug_stream_v1_add_listener(stream.obj, &stream_listener,
+					    &stream);
+	close(fds[1]);
+
+	while (!stream.done)
+		assert(wl_display_dispatch(client->wl_display) >= 0);
+
+	while (len < sizeof buf - 1) {
+		ret = read(fds[0], buf + len, sizeof buf - 1 - len);
+		if (ret <= 0) {
+			assert(ret == 0 || errno == EAGAIN);
+			break;
+		}
+		len += ret;
+	}
+	buf[len] = '\0';
+	close(fds[0]);
+
+	weston_debug_stream_v1_destroy(stream.obj);
+	weston_debug_v1_destroy(debug);
+
+	fprintf(stderr, "%s", buf);
+
+	line = strstr(buf, "Output \"");
+	assert(line);
+	line = strchr(line, '\n');
+	assert(line);
+	sscanf(line + 1, "\t%" SCNu64 " samples", &samples);
+
+	return samples;
+}
+
+static void
+send_key(struct client *client, const struct timespec *time,
+	 uint32_t key, uint32_t state)
+{
+	uint32_t tv_sec_hi, tv_sec_lo, tv_nsec;
+
+	timespec_to_proto(time, &tv_sec_hi, &tv_sec_lo, &tv_nsec);
+	weston_test_send_key(client->test->weston_test, tv_sec_hi, tv_sec_lo,
+			     tv_nsec, key, state);
+	client_roundtrip(client);
+}
+
+static void
+commit_and_wait(struct client *client)
+{
+	struct surface *surface = client->surface;
+	int done;
+
+	wl_surface_attach(surface->wl_surface, surface->buffer->proxy, 0, 0);
+	wl_surface_damage(surface->wl_surface, 0, 0, surface->width,
+			  surface->height);
+	frame_callback_set(surface->wl_surface, &done);
+	wl_surface_commit(surface->wl_surface);
+	frame_callback_wait(client, &done);
+}
+
+TEST(input_latency_one_sample_per_response)
+{
+	struct client *client;
+	uint64_t before;
+
+	client = create_client_and_test_surface(10, 10, 100, 100);
+	assert(client);
+
+	weston_test_activate_surface(client->test->weston_test,
+				     client->surface->wl_surface);
+	client_roundtrip(client);
+
+	before = get_output_samples(client);
+
+	/* Both keys are answered by the same frame. */
+	send_key(client, &t1, 1, WL_KEYBOARD_KEY_STATE_PRESSED);
+	send_key(client, &t1, 1, WL_KEYBOARD_KEY_STATE_RELEASED);
+	commit_and_wait(client);
+
+	/* The frame callbacks of the next frame come after the
+	 * presentation of the previous one. */
+	commit_and_wait(client);
+
+	assert(get_output_samples(client) == before + 1);
+
+	/* No input, no sample */
+	commit_and_wait(client);
+	commit_and_wait(client);
+
+	assert(get_output_samples(client) == before + 1);
+}
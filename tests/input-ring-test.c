@@ -0,0 +1,213 @@
+/*
+ * Copyright © 2018 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "weston-test-runner.h"
+
+#include "shared/helpers.h"
+#include "input-ring.h"
+
+/* Stand-in events: their sequence numbers, from 1 */
+#define EVENT(seq) ((void *)(uintptr_t)(seq))
+#define EVENT_SEQ(event) ((uintptr_t)(event))
+
+#define N_EVENTS (20 * INPUT_RING_SIZE)
+
+TEST(input_ring_fill_and_release)
+{
+	static struct input_ring ring;
+	struct input_ring_entry *entry;
+	uintptr_t seq = 1;
+	uint32_t i;
+
+	input_ring_init(&ring);
+	assert(input_ring_available(&ring) == 0);
+	assert(!input_ring_publish(&ring));
+
+	/* Nothing is seen before it is published. */
+	while (!input_ring_is_full(&ring))
+		input_ring_push(&ring, EVENT(seq++));
+	assert(seq == INPUT_RING_SIZE + 1);
+	assert(input_ring_available(&ring) == 0);
+
+	assert(input_ring_publish(&ring));
+	assert(input_ring_available(&ring) == INPUT_RING_SIZE);
+
+	/* The producer waits, and is to be woken by the next release. */
+	assert(!input_ring_has_room(&ring));
+
+	for (i = 0; i < 10; i++) {
+		entry = input_ring_entry(&ring, i);
+		assert(EVENT_SEQ(entry->event) == i + 1);
+	}
+	assert(input_ring_release(&ring, 10));
+	assert(input_ring_available(&ring) == INPUT_RING_SIZE - 10);
+
+	/* Only once */
+	assert(!input_ring_release(&ring, 0));
+	assert(input_ring_has_room(&ring));
+	assert(!input_ring_release(&ring, 0));
+
+	/* Entries wrap around. */
+	for (i = 0; i < 10; i++)
+		input_ring_push(&ring, EVENT(seq++));
+	assert(input_ring_is_full(&ring));
+	assert(input_ring_publish(&ring));
+
+	for (i = 0; i < INPUT_RING_SIZE; i++) {
+		entry = input_ring_entry(&ring, i);
+		assert(EVENT_SEQ(entry->event) == i + 11);
+	}
+	assert(!input_ring_release(&ring, INPUT_RING_SIZE));
+	assert(input_ring_available(&ring) == 0);
+	assert(!input_ring_is_full(&ring));
+}
+
+/* Hands the events over the way the libinput thread does, from another
+ * thread, waking up the consumer through notify_fd, and being woken up
+ * through wake_fd once the ring has room again. */
+struct handoff {
+	struct input_ring ring;
+	int notify_fd;
+	int wake_fd;
+	uintptr_t next_seq;
+};
+
+static void
+eventfd_signal(int fd)
+{
+	uint64_t value = 1;
+	ssize_t ret;
+
+	do {
+		ret = write(fd, &value, sizeof value);
+	} while (ret < 0 && errno == EINTR);
+}
+
+static void
+eventfd_clear(int fd)
+{
+	uint64_t value;
+	ssize_t ret;
+
+	do {
+		ret = read(fd, &value, sizeof value);
+	} while (ret < 0 && errno == EINTR);
+}
+
+/* Some events become readable at a time, as from a device. */
+static bool
+handoff_read(struct handoff *handoff)
+{
+	int burst = 1 + handoff->next_seq % 37;
+	bool full;
+
+	while (!(full = input_ring_is_full(&handoff->ring)) &&
+	       handoff->next_seq <= N_EVENTS && burst-- > 0)
+		input_ring_push(&handoff->ring, EVENT(handoff->next_seq++));
+
+	if (input_ring_publish(&handoff->ring))
+		eventfd_signal(handoff->notify_fd);
+
+	return full;
+}
+
+static void *
+handoff_produce(void *data)
+{
+	struct handoff *handoff = data;
+	struct pollfd fd = { .fd = handoff->wake_fd, .events = POLLIN };
+	bool full = false;
+
+	while (handoff->next_seq <= N_EVENTS) {
+		if (full && !input_ring_has_room(&handoff->ring)) {
+			assert(poll(&fd, 1, 10000) == 1);
+			eventfd_clear(handoff->wake_fd);
+		}
+
+		full = handoff_read(handoff);
+	}
+
+	return NULL;
+}
+
+TEST(input_ring_handoff_between_threads)
+{
+	static struct handoff handoff;
+	struct pollfd fd;
+	struct input_ring_entry *entry;
+	pthread_t thread;
+	uintptr_t expected = 1;
+	uint32_t i, n;
+	int round = 0;
+
+	input_ring_init(&handoff.ring);
+	handoff.next_seq = 1;
+	handoff.notify_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	handoff.wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	assert(handoff.notify_fd >= 0 && handoff.wake_fd >= 0);
+
+	assert(pthread_create(&thread, NULL, handoff_produce, &handoff) == 0);
+
+	fd.fd = handoff.notify_fd;
+	fd.events = POLLIN;
+	while (expected <= N_EVENTS) {
+		/* A lost wake-up would stall here. */
+		assert(poll(&fd, 1, 10000) == 1);
+		eventfd_clear(handoff.notify_fd);
+
+		n = input_ring_available(&handoff.ring);
+		assert(n <= INPUT_RING_SIZE);
+
+		/* Every event arrives once, in order. */
+		for (i = 0; i < n; i++) {
+			entry = input_ring_entry(&handoff.ring, i);
+			assert(EVENT_SEQ(entry->event) == expected);
+			expected++;
+		}
+
+		/* Lag behind now and then, so that the ring fills up. */
+		if (++round % 8 == 0)
+			usleep(1000);
+
+		if (input_ring_release(&handoff.ring, n))
+			eventfd_signal(handoff.wake_fd);
+	}
+
+	assert(pthread_join(thread, NULL) == 0);
+	assert(input_ring_available(&handoff.ring) == 0);
+
+	close(handoff.notify_fd);
+	close(handoff.wake_fd);
+}
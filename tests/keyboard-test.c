@@ -25,7 +25,16 @@
 
 #include "config.h"
 
+#include <fcntl.h>
 #include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(HAVE_LINUX_MEMFD_H)
+#include <sys/syscall.h>
+#include <linux/memfd.h>
+#endif
 
 #include "input-timestamps-helper.h"
 #include "shared/timespec-util.h"
@@ -155,3 +164,67 @@ TEST(keyboard_timestamps_stop_after_client_releases_wl_keyboard)
 
 	input_timestamps_destroy(input_ts);
 }
+
+/* Whether the compositor, running on the same system, can hand out a
+ * single sealed keymap file. */
+static bool
+memfd_sealing_available(void)
+{
+#if defined(HAVE_LINUX_MEMFD_H) && defined(F_ADD_SEALS)
+	bool sealed;
+	int fd;
+
+	fd = syscall(SYS_memfd_create, "keyboard-test", MFD_ALLOW_SEALING);
+	if (fd < 0)
+		return false;
+
+	sealed = fcntl(fd, F_ADD_SEALS, F_SEAL_WRITE) == 0;
+	close(fd);
+
+	return sealed;
+#else
+	return false;
+#endif
+}
+
+TEST(keymap_cannot_be_changed_by_clients)
+{
+	struct client *client = create_client_with_keyboard_focus();
+	struct client *other = create_client_with_keyboard_focus();
+	struct keyboard *keyboard = client->input->keyboard;
+	struct keyboard *other_keyboard = other->input->keyboard;
+	char *map, *other_map;
+
+	assert(keyboard->keymap_fd >= 0);
+	assert(other_keyboard->keymap_fd >= 0);
+	assert(keyboard->keymap_size == other_keyboard->keymap_size);
+
+	other_map = mmap(NULL, other_keyboard->keymap_size, PROT_READ,
+			 MAP_PRIVATE, other_keyboard->keymap_fd, 0);
+	assert(other_map != MAP_FAILED);
+	assert(other_map[other_keyboard->keymap_size - 1] == '\0');
+	assert(strncmp(other_map, "xkb_keymap", 10) == 0);
+
+	/* Clients bind wl_seat version 7, so the keymap is a single sealed
+	 * file shared by all of them when the system can seal it. */
+	if (memfd_sealing_available()) {
+		struct stat st, other_st;
+
+		assert(fstat(keyboard->keymap_fd, &st) == 0);
+		assert(fstat(other_keyboard->keymap_fd, &other_st) == 0);
+		assert(st.st_dev == other_st.st_dev);
+		assert(st.st_ino == other_st.st_ino);
+	}
+
+	/* Whether shared or a copy of their own, no client can change what
+	 * another one reads. */
+	map = mmap(NULL, keyboard->keymap_size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED, keyboard->keymap_fd, 0);
+	if (map != MAP_FAILED) {
+		map[0] = 'X';
+		munmap(map, keyboard->keymap_size);
+	}
+
+	assert(other_map[0] == 'x');
+	munmap(other_map, other_keyboard->keymap_size);
+}
@@ -0,0 +1,275 @@
+/*
+ * Copyright © 2018 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "weston-test-client-helper.h"
+#include "libweston/output-export.h"
+
+/* The socket and buffers are set up by output-export.ini. */
+char *server_parameters = "--use-pixman --width=320 --height=240"
+	" --shell=weston-test-desktop-shell.so";
+
+#define EXPORT_SOCKET "output-export.sock"
+#define EXPORT_BUFFERS 2
+
+/* Frames to wait for a change to show up */
+#define MAX_FRAMES 10
+
+struct consumer {
+	int fd;
+	struct weston_output_export_buffers info;
+	void *data[EXPORT_BUFFERS];
+};
+
+struct frame {
+	struct weston_output_export_frame frame;
+	struct weston_output_export_rect rects[WESTON_OUTPUT_EXPORT_MAX_RECTS];
+};
+
+static void
+consumer_connect(struct consumer *consumer)
+{
+	char control[CMSG_SPACE(sizeof(int) * EXPORT_BUFFERS)];
+	struct sockaddr_un addr;
+	struct iovec iov;
+	struct msghdr hdr;
+	struct cmsghdr *cmsg;
+	int fds[EXPORT_BUFFERS];
+	ssize_t len;
+	int i;
+
+	consumer->fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	assert(consumer->fd >= 0);
+
+	memset(&addr, 0, sizeof addr);
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, EXPORT_SOCKET);
+	assert(connect(consumer->fd, (struct sockaddr *)&addr,
+		       sizeof addr) == 0);
+
+	iov.iov_base = &consumer->info;
+	iov.iov_len = sizeof consumer->info;
+	memset(&hdr, 0, sizeof hdr);
+	hdr.msg_iov = &iov;
+	hdr.msg_iovlen = 1;
+	hdr.msg_control = control;
+	hdr.msg_controllen = sizeof control;
+
+	len = recvmsg(consumer->fd, &hdr, MSG_CMSG_CLOEXEC);
+	assert(len == sizeof consumer->info);
+
+	assert(consumer->info.type == WESTON_OUTPUT_EXPORT_BUFFERS);
+	assert(consumer->info.version == WESTON_OUTPUT_EXPORT_VERSION);
+	assert(consumer->info.format ==
+	       WESTON_OUTPUT_EXPORT_FORMAT_XRGB8888);
+	assert(consumer->info.width == 320);
+	assert(consumer->info.height == 240);
+	assert(consumer->info.stride >= consumer->info.width * 4);
+	assert(consumer->info.size >=
+	       consumer->info.stride * consumer->info.height);
+	assert(consumer->info.n_buffers == EXPORT_BUFFERS);
+
+	cmsg = CMSG_FIRSTHDR(&hdr);
+	assert(cmsg);
+	assert(cmsg->cmsg_level == SOL_SOCKET);
+	assert(cmsg->cmsg_type == SCM_RIGHTS);
+	assert(cmsg->cmsg_len == CMSG_LEN(sizeof fds));
+	memcpy(fds, CMSG_DATA(cmsg), sizeof fds);
+
+	for (i = 0; i < EXPORT_BUFFERS; i++) {
+		consumer->data[i] = mmap(NULL, consumer->info.size, PROT_READ,
+					 MAP_SHARED, fds[i], 0);
+		assert(consumer->data[i] != MAP_FAILED);
+		close(fds[i]);
+	}
+}
+
+static void
+consumer_disconnect(struct consumer *consumer)
+{
+	int i;
+
+	for (i = 0; i < EXPORT_BUFFERS; i++)
+		munmap(consumer->data[i], consumer->info.size);
+	close(consumer->fd);
+}
+
+static void
+consumer_receive_frame(struct consumer *consumer, struct frame *msg)
+{
+	ssize_t len;
+
+	len = recv(consumer->fd, msg, sizeof *msg, 0);
+	assert(len >= (ssize_t)sizeof msg->frame);
+	assert(msg->frame.type == WESTON_OUTPUT_EXPORT_FRAME);
+	assert(msg->frame.buffer < EXPORT_BUFFERS);
+	assert(msg->frame.n_rects >= 1);
+	assert(msg->frame.n_rects <= WESTON_OUTPUT_EXPORT_MAX_RECTS);
+	assert(len == (ssize_t)(sizeof msg->frame +
+				msg->frame.n_rects * sizeof msg->rects[0]));
+}
+
+static void
+consumer_release(struct consumer *consumer, uint32_t buffer)
+{
+	struct weston_output_export_release msg = {
+		.type = WESTON_OUTPUT_EXPORT_RELEASE,
+		.buffer = buffer,
+	};
+
+	assert(send(consumer->fd, &msg, sizeof msg, 0) == sizeof msg);
+}
+
+static uint32_t
+consumer_pixel(struct consumer *consumer, uint32_t buffer, int x, int y)
+{
+	uint8_t *row = (uint8_t *)consumer->data[buffer] +
+		       y * consumer->info.stride;
+
+	return ((uint32_t *)row)[x] & 0xffffff;
+}
+
+/* Whether the rectangles of a frame cover the given one */
+static bool
+frame_covers(struct frame *msg, int x, int y, int width, int height)
+{
+	pixman_region32_t damage;
+	pixman_region32_t rect;
+	bool covered;
+	uint32_t i;
+
+	pixman_region32_init(&damage);
+	for (i = 0; i < msg->frame.n_rects; i++)
+		pixman_region32_union_rect(&damage, &damage,
+					   msg->rects[i].x, msg->rects[i].y,
+					   msg->rects[i].width,
+					   msg->rects[i].height);
+
+	pixman_region32_init_rect(&rect, x, y, width, height);
+	pixman_region32_subtract(&rect, &rect, &damage);
+	covered = !pixman_region32_not_empty(&rect);
+
+	pixman_region32_fini(&rect);
+	pixman_region32_fini(&damage);
+
+	return covered;
+}
+
+static void
+commit_color(struct client *client, uint32_t argb)
+{
+	struct surface *surface = client->surface;
+	pixman_color_t color = {
+		.red = ((argb >> 16) & 0xff) * 0x101,
+		.green = ((argb >> 8) & 0xff) * 0x101,
+		.blue = (argb & 0xff) * 0x101,
+		.alpha = 0xffff,
+	};
+	pixman_image_t *solid;
+	int done;
+
+	solid = pixman_image_create_solid_fill(&color);
+	pixman_image_composite32(PIXMAN_OP_SRC, solid, NULL,
+				 surface->buffer->image,
+				 0, 0, 0, 0, 0, 0,
+				 surface->width, surface->height);
+	pixman_image_unref(solid);
+
+	wl_surface_attach(surface->wl_surface, surface->buffer->proxy, 0, 0);
+	wl_surface_damage(surface->wl_surface, 0, 0, surface->width,
+			  surface->height);
+	frame_callback_set(surface->wl_surface, &done);
+	wl_surface_commit(surface->wl_surface);
+	frame_callback_wait(client, &done);
+}
+
+/* Receive frames until the surface shows the given color, releasing
+ * them. Returns the sequence number of that frame. */
+static uint64_t
+consumer_wait_color(struct consumer *consumer, struct surface *surface,
+		    uint32_t rgb, uint64_t after_seq)
+{
+	struct frame msg;
+	uint32_t pixel;
+	int i;
+
+	for (i = 0; i < MAX_FRAMES; i++) {
+		consumer_receive_frame(consumer, &msg);
+		assert(msg.frame.seq > after_seq);
+		after_seq = msg.frame.seq;
+
+		pixel = consumer_pixel(consumer, msg.frame.buffer,
+				       surface->x + surface->width / 2,
+				       surface->y + surface->height / 2);
+		consumer_release(consumer, msg.frame.buffer);
+
+		if (pixel == rgb) {
+			assert(frame_covers(&msg, surface->x, surface->y,
+					    surface->width, surface->height));
+			return msg.frame.seq;
+		}
+	}
+
+	assert(0 && "color never exported");
+	return 0;
+}
+
+TEST(output_export_frames)
+{
+	struct client *client;
+	struct consumer consumer;
+	struct frame msg;
+	uint64_t seq;
+
+	client = create_client_and_test_surface(40, 30, 50, 40);
+	assert(client);
+	commit_color(client, 0xff0000);
+
+	consumer_connect(&consumer);
+
+	/* The first frame is damaged in full. */
+	consumer_receive_frame(&consumer, &msg);
+	assert(frame_covers(&msg, 0, 0, 320, 240));
+	assert(consumer_pixel(&consumer, msg.frame.buffer, 60, 50) ==
+	       0xff0000);
+	consumer_release(&consumer, msg.frame.buffer);
+	seq = msg.frame.seq;
+
+	commit_color(client, 0x00ff00);
+	seq = consumer_wait_color(&consumer, client->surface, 0x00ff00, seq);
+
+	commit_color(client, 0x0000ff);
+	consumer_wait_color(&consumer, client->surface, 0x0000ff, seq);
+
+	consumer_disconnect(&consumer);
+}
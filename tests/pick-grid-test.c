@@ -0,0 +1,260 @@
+/*
+ * Copyright © 2018 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "weston-test-runner.h"
+
+#include "shared/helpers.h"
+#include "pick-grid.h"
+
+#define DESKTOP_WIDTH 3840
+#define DESKTOP_HEIGHT 2160
+#define N_PICKS 200000
+
+/* Deterministic pseudo-random numbers, so failures are reproducible. */
+static uint32_t
+lcg_next(uint32_t *state)
+{
+	*state = *state * 1103515245u + 12345u;
+	return *state >> 8;
+}
+
+static void
+build_scene(struct weston_pick_grid *grid, int n_views, uint32_t seed)
+{
+	int i;
+
+	weston_pick_grid_clear(grid);
+
+	/* A desktop-sized background at the bottom, like a shell would
+	 * have, and a mix of small and large windows above it.
+	 */
+	for (i = 0; i < n_views - 1; i++) {
+		int32_t w = 16 + lcg_next(&seed) % 800;
+		int32_t h = 16 + lcg_next(&seed) % 600;
+		int32_t x = (int32_t)(lcg_next(&seed) % (DESKTOP_WIDTH + 200)) - 100;
+		int32_t y = (int32_t)(lcg_next(&seed) % (DESKTOP_HEIGHT + 200)) - 100;
+
+		assert(weston_pick_grid_add(grid, x, y, x + w, y + h,
+					    (void *)(uintptr_t)(i + 1)) == 0);
+	}
+	assert(weston_pick_grid_add(grid, 0, 0, DESKTOP_WIDTH, DESKTOP_HEIGHT,
+				    (void *)(uintptr_t)n_views) == 0);
+
+	assert(weston_pick_grid_build(grid) == 0);
+}
+
+static void *
+pick_linear(const struct weston_pick_grid *grid, int32_t x, int32_t y)
+{
+	uint32_t i;
+
+	for (i = 0; i < grid->n_entries; i++) {
+		if (weston_pick_grid_entry_contains(&grid->entries[i], x, y))
+			return grid->entries[i].data;
+	}
+
+	return NULL;
+}
+
+static void *
+pick_grid(const struct weston_pick_grid *grid, int32_t x, int32_t y)
+{
+	const uint32_t *candidates;
+	uint32_t count, i;
+
+	candidates = weston_pick_grid_lookup(grid, x, y, &count);
+	for (i = 0; i < count; i++) {
+		const struct weston_pick_grid_entry *e =
+			&grid->entries[candidates[i]];
+
+		if (weston_pick_grid_entry_contains(e, x, y))
+			return e->data;
+	}
+
+	return NULL;
+}
+
+static double
+elapsed_ns(const struct timespec *a, const struct timespec *b)
+{
+	return (b->tv_sec - a->tv_sec) * 1e9 + (b->tv_nsec - a->tv_nsec);
+}
+
+TEST(pick_grid_empty)
+{
+	struct weston_pick_grid grid;
+	uint32_t count;
+
+	weston_pick_grid_init(&grid);
+
+	assert(weston_pick_grid_build(&grid) == 0);
+	assert(weston_pick_grid_lookup(&grid, 0, 0, &count) == NULL);
+	assert(count == 0);
+
+	/* Empty boxes never match. */
+	assert(weston_pick_grid_add(&grid, 10, 10, 10, 20, NULL) == 0);
+	assert(weston_pick_grid_build(&grid) == 0);
+	assert(pick_grid(&grid, 10, 15) == NULL);
+
+	weston_pick_grid_release(&grid);
+}
+
+TEST(pick_grid_stacking_order)
+{
+	struct weston_pick_grid grid;
+	void *top = (void *)(uintptr_t)1;
+	void *bottom = (void *)(uintptr_t)2;
+
+	weston_pick_grid_init(&grid);
+
+	assert(weston_pick_grid_add(&grid, 100, 100, 200, 200, top) == 0);
+	assert(weston_pick_grid_add(&grid, 0, 0, 1000, 1000, bottom) == 0);
+	assert(weston_pick_grid_build(&grid) == 0);
+
+	assert(pick_grid(&grid, 150, 150) == top);
+	assert(pick_grid(&grid, 99, 150) == bottom);
+	assert(pick_grid(&grid, 200, 150) == bottom);
+	assert(pick_grid(&grid, 999, 999) == bottom);
+	assert(pick_grid(&grid, 1000, 999) == NULL);
+	assert(pick_grid(&grid, -1, 0) == NULL);
+
+	/* Rebuilding reuses the allocations. */
+	weston_pick_grid_clear(&grid);
+	assert(weston_pick_grid_add(&grid, -5000, -5000, -4000, -4000,
+				    top) == 0);
+	assert(weston_pick_grid_add(&grid, 4000, 4000, 5000, 5000,
+				    bottom) == 0);
+	assert(weston_pick_grid_build(&grid) == 0);
+	assert(pick_grid(&grid, -4500, -4500) == top);
+	assert(pick_grid(&grid, 4500, 4500) == bottom);
+	assert(pick_grid(&grid, 0, 0) == NULL);
+
+	weston_pick_grid_release(&grid);
+}
+
+TEST(pick_grid_move)
+{
+	struct weston_pick_grid grid;
+	void *top = (void *)(uintptr_t)1;
+	void *bottom = (void *)(uintptr_t)2;
+	uint32_t seed = 0x5eed;
+	int32_t x, y;
+	int i, j;
+
+	weston_pick_grid_init(&grid);
+
+	assert(weston_pick_grid_add(&grid, 100, 100, 132, 132, top) == 0);
+	assert(weston_pick_grid_add(&grid, 0, 0, 1000, 1000, bottom) == 0);
+	assert(weston_pick_grid_build(&grid) == 0);
+
+	/* Moving keeps the stacking order. */
+	assert(weston_pick_grid_move(&grid, 0, 500, 600, 532, 632) == 0);
+	assert(pick_grid(&grid, 110, 110) == bottom);
+	assert(pick_grid(&grid, 510, 610) == top);
+
+	/* Overlapping the old cells */
+	assert(weston_pick_grid_move(&grid, 0, 520, 610, 552, 642) == 0);
+	assert(pick_grid(&grid, 510, 610) == bottom);
+	assert(pick_grid(&grid, 540, 640) == top);
+
+	/* Empty boxes leave all cells. */
+	assert(weston_pick_grid_move(&grid, 0, 520, 610, 520, 642) == 0);
+	assert(pick_grid(&grid, 540, 640) == bottom);
+
+	/* Out of the area the grid was built for, unchanged */
+	assert(weston_pick_grid_move(&grid, 0, 990, 990, 1100, 1100) < 0);
+	assert(grid.entries[0].x1 == 520 && grid.entries[0].x2 == 520);
+	assert(pick_grid(&grid, 995, 995) == bottom);
+
+	/* Moving views around matches building the grid again. */
+	build_scene(&grid, 100, 42);
+	for (i = 0; i < 1000; i++) {
+		uint32_t index = lcg_next(&seed) % (grid.n_entries - 1);
+		int32_t w = lcg_next(&seed) % 300;
+		int32_t h = lcg_next(&seed) % 300;
+
+		x = lcg_next(&seed) % (DESKTOP_WIDTH - w);
+		y = lcg_next(&seed) % (DESKTOP_HEIGHT - h);
+		assert(weston_pick_grid_move(&grid, index, x, y,
+					     x + w, y + h) == 0);
+
+		for (j = 0; j < 16; j++) {
+			x = lcg_next(&seed) % DESKTOP_WIDTH;
+			y = lcg_next(&seed) % DESKTOP_HEIGHT;
+			assert(pick_grid(&grid, x, y) ==
+			       pick_linear(&grid, x, y));
+		}
+	}
+
+	weston_pick_grid_release(&grid);
+}
+
+static const int view_counts[] = { 10, 100, 1000 };
+
+TEST_P(pick_grid_matches_linear_walk, view_counts)
+{
+	const int *n_views = data;
+	struct weston_pick_grid grid;
+	struct timespec t0, t1, t2;
+	uint32_t seed = 0x5eed;
+	uintptr_t sum_linear = 0, sum_grid = 0;
+	int32_t xs[256], ys[256];
+	int i;
+
+	weston_pick_grid_init(&grid);
+	build_scene(&grid, *n_views, 42);
+
+	for (i = 0; i < (int)ARRAY_LENGTH(xs); i++) {
+		xs[i] = (int32_t)(lcg_next(&seed) % (DESKTOP_WIDTH + 400)) - 200;
+		ys[i] = (int32_t)(lcg_next(&seed) % (DESKTOP_HEIGHT + 400)) - 200;
+		assert(pick_grid(&grid, xs[i], ys[i]) ==
+		       pick_linear(&grid, xs[i], ys[i]));
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < N_PICKS; i++)
+		sum_linear += (uintptr_t)pick_linear(&grid, xs[i & 255],
+						     ys[i & 255]);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	for (i = 0; i < N_PICKS; i++)
+		sum_grid += (uintptr_t)pick_grid(&grid, xs[i & 255],
+						 ys[i & 255]);
+	clock_gettime(CLOCK_MONOTONIC, &t2);
+
+	assert(sum_linear == sum_grid);
+
+	fprintf(stderr, "%4d views: linear %8.1f ns/pick, grid %8.1f ns/pick\n",
+		*n_views, elapsed_ns(&t0, &t1) / N_PICKS,
+		elapsed_ns(&t1, &t2) / N_PICKS);
+
+	weston_pick_grid_release(&grid);
+}
@@ -0,0 +1,231 @@
+/*
+ * Copyright © 2018 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Manual benchmark of the pixman renderer on the headless backend.
+ *
+ * Run as, for instance:
+ *
+ *	weston --backend=headless-backend.so --use-pixman \
+ *		--width=3840 --height=2160 --config=bench.ini \
+ *		--modules=pixman-bench.so
+ *
+ * with [core] renderer-threads=N in bench.ini. The scene is repainted
+ * in full for a number of frames, then the average repaint time and a
+ * checksum of the output contents are printed. The checksum must not
+ * depend on the thread count.
+ */
+
+#include "config.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "compositor.h"
+#include "compositor/weston.h"
+#include "shared/helpers.h"
+
+#define BENCH_VIEWS 64
+#define BENCH_FRAMES 120
+
+struct pixman_bench {
+	struct weston_compositor *compositor;
+	struct weston_output *output;
+	struct weston_layer layer;
+	struct wl_listener frame_listener;
+	int frames;
+};
+
+static uint32_t
+lcg_next(uint32_t *state)
+{
+	*state = *state * 1103515245u + 12345u;
+	return *state >> 8;
+}
+
+static void
+bench_create_scene(struct pixman_bench *bench)
+{
+	struct weston_output *output = bench->output;
+	uint32_t seed = 0x5eed;
+	int i;
+
+	weston_layer_init(&bench->layer, bench->compositor);
+	weston_layer_set_position(&bench->layer, WESTON_LAYER_POSITION_NORMAL);
+
+	for (i = 0; i < BENCH_VIEWS; i++) {
+		struct weston_surface *surface;
+		struct weston_view *view;
+		int32_t w = output->width / 8 + lcg_next(&seed) % output->width / 2;
+		int32_t h = output->height / 8 + lcg_next(&seed) % output->height / 2;
+
+		surface = weston_surface_create(bench->compositor);
+		view = weston_view_create(surface);
+		if (!surface || !view) {
+			weston_log("pixman-bench: out of memory\n");
+			return;
+		}
+
+		/* Half of the views are blended, to exercise OVER. */
+		weston_surface_set_color(surface,
+					 (lcg_next(&seed) % 256) / 255.0f,
+					 (lcg_next(&seed) % 256) / 255.0f,
+					 (lcg_next(&seed) % 256) / 255.0f,
+					 (i & 1) ? 0.5f : 1.0f);
+		weston_surface_set_size(surface, w, h);
+		surface->is_mapped = true;
+
+		weston_view_set_position(view,
+			output->x + lcg_next(&seed) % (output->width - w / 2),
+			output->y + lcg_next(&seed) % (output->height - h / 2));
+		view->is_mapped = true;
+		weston_layer_entry_insert(&bench->layer.view_list,
+					  &view->layer_link);
+		weston_view_update_transform(view);
+	}
+}
+
+static uint64_t
+bench_checksum(struct pixman_bench *bench)
+{
+	struct weston_output *output = bench->output;
+	struct weston_compositor *compositor = bench->compositor;
+	int width = output->current_mode->width;
+	int height = output->current_mode->height;
+	uint64_t hash = 0xcbf29ce484222325ull;
+	uint8_t *pixels;
+	size_t i, size;
+
+	size = (size_t)width * height *
+	       (PIXMAN_FORMAT_BPP(compositor->read_format) / 8);
+	pixels = malloc(size);
+	if (!pixels)
+		return 0;
+
+	if (compositor->renderer->read_pixels(output,
+					      compositor->read_format, pixels,
+					      0, 0, width, height) < 0) {
+		free(pixels);
+		return 0;
+	}
+
+	/* FNV-1a */
+	for (i = 0; i < size; i++) {
+		hash ^= pixels[i];
+		hash *= 0x100000001b3ull;
+	}
+
+	free(pixels);
+
+	return hash;
+}
+
+static void
+bench_report(struct pixman_bench *bench)
+{
+	struct weston_output_repaint_timing *rt = &bench->output->repaint_timing;
+	int64_t total = 0;
+	unsigned int i;
+
+	for (i = 0; i < rt->n_samples; i++)
+		total += rt->samples_nsec[i];
+
+	fprintf(stderr, "pixman-bench: %dx%d, %d views, renderer-threads=%d: "
+		"%.3f ms per repaint over the last %u frames, "
+		"checksum %016llx\n",
+		bench->output->current_mode->width,
+		bench->output->current_mode->height, BENCH_VIEWS,
+		bench->compositor->renderer_threads,
+		rt->n_samples ? total / 1e6 / rt->n_samples : 0.0,
+		rt->n_samples,
+		(unsigned long long)bench_checksum(bench));
+}
+
+static void
+bench_damage_all(void *data)
+{
+	struct pixman_bench *bench = data;
+
+	weston_output_damage(bench->output);
+}
+
+static void
+bench_frame(struct wl_listener *listener, void *data)
+{
+	struct pixman_bench *bench =
+		container_of(listener, struct pixman_bench, frame_listener);
+	struct wl_event_loop *loop =
+		wl_display_get_event_loop(bench->compositor->wl_display);
+
+	if (++bench->frames < BENCH_FRAMES) {
+		wl_event_loop_add_idle(loop, bench_damage_all, bench);
+		return;
+	}
+
+	wl_list_remove(&bench->frame_listener.link);
+	bench_report(bench);
+	wl_display_terminate(bench->compositor->wl_display);
+}
+
+static void
+bench_start(void *data)
+{
+	struct pixman_bench *bench = data;
+	struct weston_compositor *compositor = bench->compositor;
+
+	if (wl_list_empty(&compositor->output_list)) {
+		weston_log("pixman-bench: no output\n");
+		wl_display_terminate(compositor->wl_display);
+		return;
+	}
+
+	bench->output = container_of(compositor->output_list.next,
+				     struct weston_output, link);
+
+	bench_create_scene(bench);
+
+	bench->frame_listener.notify = bench_frame;
+	wl_signal_add(&bench->output->frame_signal, &bench->frame_listener);
+	weston_output_damage(bench->output);
+}
+
+WL_EXPORT int
+wet_module_init(struct weston_compositor *compositor,
+		int *argc, char *argv[])
+{
+	struct pixman_bench *bench;
+	struct wl_event_loop *loop;
+
+	bench = zalloc(sizeof *bench);
+	if (!bench)
+		return -1;
+
+	bench->compositor = compositor;
+
+	loop = wl_display_get_event_loop(compositor->wl_display);
+	wl_event_loop_add_idle(loop, bench_start, bench);
+
+	return 0;
+}
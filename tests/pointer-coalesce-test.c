@@ -0,0 +1,318 @@
+/*
+ * Copyright © 2018 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Runs with coalesce-pointer-motion set for the test seat, see
+ * pointer-coalesce.ini. */
+
+#include "config.h"
+
+#include <linux/input.h>
+#include <string.h>
+
+#include "shared/helpers.h"
+#include "weston-test-client-helper.h"
+#include "relative-pointer-unstable-v1-client-protocol.h"
+
+#define MAX_EVENTS 16
+
+enum recorded_event {
+	RECORDED_MOTION,
+	RECORDED_BUTTON,
+};
+
+/* The pointer events of the seat as the client gets them, on a pointer
+ * of its own */
+struct recorder {
+	struct wl_pointer *wl_pointer;
+	struct zwp_relative_pointer_manager_v1 *manager;
+	struct zwp_relative_pointer_v1 *relative_pointer;
+
+	enum recorded_event events[MAX_EVENTS];
+	int n_events;
+	int x, y;		/* of the last motion, surface local */
+
+	int n_relative;
+	double dx, dy;		/* summed */
+};
+
+static void
+recorder_add(struct recorder *recorder, enum recorded_event event)
+{
+	assert(recorder->n_events < MAX_EVENTS);
+	recorder->events[recorder->n_events++] = event;
+}
+
+static void
+recorder_reset(struct recorder *recorder)
+{
+	recorder->n_events = 0;
+	recorder->n_relative = 0;
+	recorder->dx = 0.0;
+	recorder->dy = 0.0;
+}
+
+static void
+pointer_handle_enter(void *data, struct wl_pointer *wl_pointer,
+		     uint32_t serial, struct wl_surface *wl_surface,
+		     wl_fixed_t x, wl_fixed_t y)
+{
+	struct recorder *recorder = data;
+
+	recorder->x = wl_fixed_to_int(x);
+	recorder->y = wl_fixed_to_int(y);
+}
+
+static void
+pointer_handle_leave(void *data, struct wl_pointer *wl_pointer,
+		     uint32_t serial, struct wl_surface *wl_surface)
+{
+}
+
+static void
+pointer_handle_motion(void *data, struct wl_pointer *wl_pointer,
+		      uint32_t time_msec, wl_fixed_t x, wl_fixed_t y)
+{
+	struct recorder *recorder = data;
+
+	recorder->x = wl_fixed_to_int(x);
+	recorder->y = wl_fixed_to_int(y);
+	recorder_add(recorder, RECORDED_MOTION);
+}
+
+static void
+pointer_handle_button(void *data, struct wl_pointer *wl_pointer,
+		      uint32_t serial, uint32_t time_msec, uint32_t button,
+		      uint32_t state)
+{
+	struct recorder *recorder = data;
+
+	recorder_add(recorder, RECORDED_BUTTON);
+}
+
+static void
+pointer_handle_axis(void *data, struct wl_pointer *wl_pointer,
+		    uint32_t time_msec, uint32_t axis, wl_fixed_t value)
+{
+}
+
+static void
+pointer_handle_frame(void *data, struct wl_pointer *wl_pointer)
+{
+}
+
+static void
+pointer_handle_axis_source(void *data, struct wl_pointer *wl_pointer,
+			   uint32_t source)
+{
+}
+
+static void
+pointer_handle_axis_stop(void *data, struct wl_pointer *wl_pointer,
+			 uint32_t time_msec, uint32_t axis)
+{
+}
+
+static void
+pointer_handle_axis_discrete(void *data, struct wl_pointer *wl_pointer,
+			     uint32_t axis, int32_t discrete)
+{
+}
+
+static const struct wl_pointer_listener pointer_listener = {
+	pointer_handle_enter,
+	pointer_handle_leave,
+	pointer_handle_motion,
+	pointer_handle_button,
+	pointer_handle_axis,
+	pointer_handle_frame,
+	pointer_handle_axis_source,
+	pointer_handle_axis_stop,
+	pointer_handle_axis_discrete,
+};
+
+static void
+relative_pointer_handle_motion(void *data,
+			       struct zwp_relative_pointer_v1 *relative_pointer,
+			       uint32_t utime_hi, uint32_t utime_lo,
+			       wl_fixed_t dx, wl_fixed_t dy,
+			       wl_fixed_t dx_unaccel, wl_fixed_t dy_unaccel)
+{
+	struct recorder *recorder = data;
+
+	recorder->n_relative++;
+	recorder->dx += wl_fixed_to_double(dx);
+	recorder->dy += wl_fixed_to_double(dy);
+}
+
+static const struct zwp_relative_pointer_v1_listener relative_pointer_listener = {
+	relative_pointer_handle_motion,
+};
+
+static struct zwp_relative_pointer_manager_v1 *
+get_relative_pointer_manager(struct client *client)
+{
+	struct global *g;
+	struct global *global_manager = NULL;
+
+	wl_list_for_each(g, &client->global_list, link) {
+		if (strcmp(g->interface,
+			   zwp_relative_pointer_manager_v1_interface.name))
+			continue;
+
+		if (global_manager)
+			assert(0 && "multiple relative pointer managers");
+
+		global_manager = g;
+	}
+
+	assert(global_manager && "no relative pointer manager found");
+
+	return wl_registry_bind(client->wl_registry, global_manager->name,
+				&zwp_relative_pointer_manager_v1_interface, 1);
+}
+
+static void
+recorder_init(struct recorder *recorder, struct client *client)
+{
+	memset(recorder, 0, sizeof *recorder);
+
+	recorder->wl_pointer = wl_seat_get_pointer(client->input->wl_seat);
+	wl_pointer_add_listener(recorder->wl_pointer, &pointer_listener,
+				recorder);
+
+	recorder->manager = get_relative_pointer_manager(client);
+	recorder->relative_pointer =
+		zwp_relative_pointer_manager_v1_get_relative_pointer(
+			recorder->manager, recorder->wl_pointer);
+	zwp_relative_pointer_v1_add_listener(recorder->relative_pointer,
+					     &relative_pointer_listener,
+					     recorder);
+	client_roundtrip(client);
+}
+
+static void
+recorder_fini(struct recorder *recorder)
+{
+	zwp_relative_pointer_v1_destroy(recorder->relative_pointer);
+	zwp_relative_pointer_manager_v1_destroy(recorder->manager);
+	wl_pointer_release(recorder->wl_pointer);
+}
+
+/* Queued, to reach the compositor all at once with the next flush */
+static void
+send_motion(struct client *client, int x, int y)
+{
+	weston_test_move_pointer(client->test->weston_test, 0, 1, 0, x, y);
+}
+
+/* Wait for a repaint, with the requests sent so far handled before it. */
+static void
+wait_repaint(struct client *client)
+{
+	struct surface *surface = client->surface;
+	int done;
+
+	frame_callback_set(surface->wl_surface, &done);
+	wl_surface_commit(surface->wl_surface);
+	frame_callback_wait(client, &done);
+}
+
+/* The pointer enters the surface, at 10, 10 of it. */
+static struct client *
+create_client_with_pointer_focus(struct recorder *recorder)
+{
+	struct client *client = create_client_and_test_surface(50, 50, 100, 100);
+
+	assert(client);
+	recorder_init(recorder, client);
+
+	send_motion(client, 60, 60);
+	wait_repaint(client);
+
+	assert(client->input->pointer->focus == client->surface);
+	assert(recorder->x == 10 && recorder->y == 10);
+	recorder_reset(recorder);
+
+	return client;
+}
+
+TEST(pointer_motion_sent_once_per_repaint)
+{
+	static const int steps[] = { 1, 3, 6, 10 };
+	struct recorder recorder;
+	struct client *client = create_client_with_pointer_focus(&recorder);
+	int round, i, x = 60, y = 60;
+
+	for (round = 0; round < 3; round++) {
+		for (i = 0; i < (int)ARRAY_LENGTH(steps); i++)
+			send_motion(client, x + steps[i], y + 2 * steps[i]);
+		x += 10;
+		y += 20;
+		wait_repaint(client);
+
+		/* One motion, where the last one went */
+		assert(recorder.n_events == 1);
+		assert(recorder.events[0] == RECORDED_MOTION);
+		assert(recorder.x == x - 50 && recorder.y == y - 50);
+		assert(client->test->pointer_x == x);
+		assert(client->test->pointer_y == y);
+
+		/* All of the relative motion, at once */
+		assert(recorder.n_relative == 1);
+		assert(recorder.dx == 10.0);
+		assert(recorder.dy == 20.0);
+
+		recorder_reset(&recorder);
+	}
+
+	recorder_fini(&recorder);
+}
+
+TEST(pointer_button_flushes_pending_motion)
+{
+	struct recorder recorder;
+	struct client *client = create_client_with_pointer_focus(&recorder);
+
+	send_motion(client, 65, 70);
+	send_motion(client, 70, 80);
+	weston_test_send_button(client->test->weston_test, 0, 1, 0,
+				BTN_LEFT, WL_POINTER_BUTTON_STATE_PRESSED);
+	client_roundtrip(client);
+
+	/* The motion comes first, without waiting for a repaint. */
+	assert(recorder.n_events == 2);
+	assert(recorder.events[0] == RECORDED_MOTION);
+	assert(recorder.events[1] == RECORDED_BUTTON);
+	assert(recorder.x == 20 && recorder.y == 30);
+	assert(recorder.n_relative == 1);
+	assert(recorder.dx == 10.0);
+	assert(recorder.dy == 20.0);
+
+	weston_test_send_button(client->test->weston_test, 0, 1, 0,
+				BTN_LEFT, WL_POINTER_BUTTON_STATE_RELEASED);
+	client_roundtrip(client);
+
+	recorder_fini(&recorder);
+}
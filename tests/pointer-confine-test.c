@@ -0,0 +1,221 @@
+/*
+ * Copyright © 2018 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "shared/timespec-util.h"
+#include "weston-test-client-helper.h"
+#include "pointer-constraints-unstable-v1-client-protocol.h"
+
+/* Motion events sent by the benchmark */
+#define BENCH_MOTIONS 20000
+
+/* Teeth of the comb shaped region of the benchmark */
+#define BENCH_TEETH 60
+
+static const struct timespec t0 = { .tv_sec = 0, .tv_nsec = 100000000 };
+
+struct confinement {
+	struct zwp_pointer_constraints_v1 *constraints;
+	struct zwp_confined_pointer_v1 *confined_pointer;
+	bool confined;
+};
+
+static void
+confined_pointer_handle_confined(void *data,
+				 struct zwp_confined_pointer_v1 *confined_pointer)
+{
+	struct confinement *confinement = data;
+
+	confinement->confined = true;
+}
+
+static void
+confined_pointer_handle_unconfined(void *data,
+				   struct zwp_confined_pointer_v1 *confined_pointer)
+{
+	struct confinement *confinement = data;
+
+	confinement->confined = false;
+}
+
+static const struct zwp_confined_pointer_v1_listener confined_pointer_listener = {
+	confined_pointer_handle_confined,
+	confined_pointer_handle_unconfined,
+};
+
+static struct zwp_pointer_constraints_v1 *
+get_pointer_constraints(struct client *client)
+{
+	struct global *g;
+	struct global *global_constraints = NULL;
+
+	wl_list_for_each(g, &client->global_list, link) {
+		if (strcmp(g->interface,
+			   zwp_pointer_constraints_v1_interface.name))
+			continue;
+
+		if (global_constraints)
+			assert(0 && "multiple pointer constraints objects");
+
+		global_constraints = g;
+	}
+
+	assert(global_constraints && "no pointer constraints found");
+
+	return wl_registry_bind(client->wl_registry, global_constraints->name,
+				&zwp_pointer_constraints_v1_interface, 1);
+}
+
+static void
+send_motion(struct client *client, const struct timespec *time, int x, int y)
+{
+	uint32_t tv_sec_hi, tv_sec_lo, tv_nsec;
+
+	timespec_to_proto(time, &tv_sec_hi, &tv_sec_lo, &tv_nsec);
+	weston_test_move_pointer(client->test->weston_test, tv_sec_hi, tv_sec_lo,
+				 tv_nsec, x, y);
+}
+
+/* Confine the pointer of the client to region, moving it to x, y of the
+ * surface first. */
+static void
+confine_pointer(struct client *client, struct confinement *confinement,
+		struct wl_region *region, int x, int y)
+{
+	struct surface *surface = client->surface;
+
+	confinement->constraints = get_pointer_constraints(client);
+	confinement->confined_pointer =
+		zwp_pointer_constraints_v1_confine_pointer(
+			confinement->constraints,
+			surface->wl_surface,
+			client->input->pointer->wl_pointer,
+			region,
+			ZWP_POINTER_CONSTRAINTS_V1_LIFETIME_PERSISTENT);
+	zwp_confined_pointer_v1_add_listener(confinement->confined_pointer,
+					     &confined_pointer_listener,
+					     confinement);
+
+	send_motion(client, &t0, surface->x + x, surface->y + y);
+	weston_test_activate_surface(client->test->weston_test,
+				     surface->wl_surface);
+	client_roundtrip(client);
+
+	assert(confinement->confined);
+}
+
+static void
+check_pointer_move(struct client *client, int x, int y,
+		   int expect_x, int expect_y)
+{
+	struct surface *surface = client->surface;
+
+	send_motion(client, &t0, surface->x + x, surface->y + y);
+	client_roundtrip(client);
+
+	assert(client->test->pointer_x == surface->x + expect_x);
+	assert(client->test->pointer_y == surface->y + expect_y);
+}
+
+TEST(confined_pointer_stops_at_borders)
+{
+	struct client *client = create_client_and_test_surface(20, 40,
+								200, 200);
+	struct confinement confinement = { 0 };
+	struct wl_region *region;
+
+	/* An L shape */
+	region = wl_compositor_create_region(client->wl_compositor);
+	wl_region_add(region, 0, 0, 50, 150);
+	wl_region_add(region, 0, 100, 150, 50);
+
+	confine_pointer(client, &confinement, region, 25, 25);
+	wl_region_destroy(region);
+
+	/* Right and bottom borders are outside the region. */
+	check_pointer_move(client, 25, -100, 25, 0);
+	check_pointer_move(client, 100, 0, 49, 0);
+	check_pointer_move(client, 25, 125, 25, 125);
+	check_pointer_move(client, 300, 125, 149, 125);
+	check_pointer_move(client, 120, 300, 120, 149);
+
+	/* Moving up from the foot stops under the leg's corner. */
+	check_pointer_move(client, 120, 0, 120, 100);
+}
+
+static bool
+comb_contains(int x, int y)
+{
+	if (x < 0 || x >= BENCH_TEETH * 4 || y < 0 || y >= 180)
+		return false;
+
+	return y >= 150 || x % 4 < 2;
+}
+
+/* Moves the pointer around a comb shaped confinement region, and reports
+ * how long the compositor took to handle the motion events. */
+TEST(confined_pointer_motion_bench)
+{
+	struct client *client =
+		create_client_and_test_surface(20, 40, BENCH_TEETH * 4, 180);
+	struct confinement confinement = { 0 };
+	struct wl_region *region;
+	struct timespec start, end;
+	int64_t elapsed_nsec;
+	int i, x, y;
+
+	region = wl_compositor_create_region(client->wl_compositor);
+	for (i = 0; i < BENCH_TEETH; i++)
+		wl_region_add(region, i * 4, 0, 2, 150);
+	wl_region_add(region, 0, 150, BENCH_TEETH * 4, 30);
+
+	confine_pointer(client, &confinement, region, 10, 165);
+	wl_region_destroy(region);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < BENCH_MOTIONS; i++) {
+		x = (i * 37) % (BENCH_TEETH * 4 + 40) - 20;
+		y = (i * 53) % 220 - 20;
+		send_motion(client, &t0, client->surface->x + x,
+			    client->surface->y + y);
+		if (i % 1000 == 999)
+			client_roundtrip(client);
+	}
+	client_roundtrip(client);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	elapsed_nsec = timespec_sub_to_nsec(&end, &start);
+	fprintf(stderr, "confined pointer: %d motions in a comb of %d teeth "
+		"in %.3f ms, %.2f us each\n", BENCH_MOTIONS, BENCH_TEETH,
+		elapsed_nsec / 1e6, elapsed_nsec / 1e3 / BENCH_MOTIONS);
+
+	assert(comb_contains(client->test->pointer_x - client->surface->x,
+			     client->test->pointer_y - client->surface->y));
+}
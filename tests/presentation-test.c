@@ -235,3 +235,48 @@ TEST(test_presentation_feedback_simple)
 
 	feedback_destroy(fb);
 }
+
+static struct feedback *
+commit_with_feedback(struct client *client)
+{
+	struct feedback *fb;
+
+	wl_surface_attach(client->surface->wl_surface,
+			  client->surface->buffer->proxy, 0, 0);
+	fb = feedback_create(client, client->surface->wl_surface);
+	wl_surface_damage(client->surface->wl_surface, 0, 0, 100, 100);
+	wl_surface_commit(client->surface->wl_surface);
+
+	client_roundtrip(client);
+	feedback_wait(fb);
+
+	return fb;
+}
+
+TEST(test_presentation_feedback_vblank_aligned)
+{
+	struct client *client;
+	struct feedback *fb[2];
+	int64_t delta;
+
+	client = create_client_and_test_surface(100, 50, 123, 77);
+	assert(client);
+
+	fb[0] = commit_with_feedback(client);
+	fb[1] = commit_with_feedback(client);
+
+	/* The headless backend presents on a virtual vblank: timestamps
+	 * are whole periods apart, and counted by the sequence. */
+	assert(fb[0]->result == FB_PRESENTED);
+	assert(fb[1]->result == FB_PRESENTED);
+	assert(fb[1]->flags & WP_PRESENTATION_FEEDBACK_KIND_VSYNC);
+	assert(fb[1]->refresh_nsec > 0);
+	assert(fb[1]->seq > fb[0]->seq);
+
+	delta = timespec_sub_to_nsec(&fb[1]->time, &fb[0]->time);
+	assert(delta == (int64_t)(fb[1]->seq - fb[0]->seq) *
+			fb[1]->refresh_nsec);
+
+	feedback_destroy(fb[0]);
+	feedback_destroy(fb[1]);
+}
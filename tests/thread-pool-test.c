@@ -0,0 +1,106 @@
+/*
+ * Copyright © 2018 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "weston-test-runner.h"
+
+#include "shared/helpers.h"
+#include "thread-pool.h"
+
+#define N_ITEMS 1000
+
+struct job {
+	int hits[N_ITEMS];
+	uint64_t results[N_ITEMS];
+};
+
+static void
+job_func(void *data, unsigned int index)
+{
+	struct job *job = data;
+	uint64_t v = index;
+	int i;
+
+	/* Some busy work, so that the workers get a share of it. */
+	for (i = 0; i < 1000; i++)
+		v = v * 6364136223846793005ull + 1442695040888963407ull;
+
+	job->hits[index]++;
+	job->results[index] = v;
+}
+
+static void
+check_job(struct weston_thread_pool *pool, unsigned int count)
+{
+	static struct job job, reference;
+	unsigned int i;
+
+	memset(&job, 0, sizeof job);
+	memset(&reference, 0, sizeof reference);
+
+	for (i = 0; i < count; i++)
+		job_func(&reference, i);
+
+	weston_thread_pool_run(pool, job_func, &job, count);
+
+	for (i = 0; i < N_ITEMS; i++)
+		assert(job.hits[i] == (i < count ? 1 : 0));
+	assert(memcmp(job.results, reference.results,
+		      sizeof job.results) == 0);
+}
+
+static const unsigned int pool_sizes[] = { 1, 2, 4, 16 };
+
+TEST_P(thread_pool_runs_each_index_once, pool_sizes)
+{
+	const unsigned int *n_threads = data;
+	struct weston_thread_pool *pool;
+	int round;
+
+	pool = weston_thread_pool_create(*n_threads);
+	assert(pool);
+	assert(weston_thread_pool_get_size(pool) == *n_threads);
+
+	/* Jobs shorter and longer than the pool, run back to back. */
+	for (round = 0; round < 50; round++) {
+		check_job(pool, 0);
+		check_job(pool, 1);
+		check_job(pool, *n_threads);
+		check_job(pool, N_ITEMS);
+	}
+
+	weston_thread_pool_destroy(pool);
+}
+
+TEST(thread_pool_invalid_size)
+{
+	assert(weston_thread_pool_create(0) == NULL);
+	weston_thread_pool_destroy(NULL);
+}
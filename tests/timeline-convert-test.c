@@ -0,0 +1,255 @@
+/*
+ * Copyright © 2018 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "weston-test-runner.h"
+
+#include "shared/helpers.h"
+#include "timeline/timeline-format.h"
+#include "timeline/timeline-convert.h"
+
+#define STRING_REPAINT_BEGIN	1
+#define STRING_REPAINT_POSTED	2
+#define STRING_COMMIT		3
+#define OUTPUT_ID		7
+#define SURFACE_MAIN		9
+#define SURFACE_SUB		10
+
+static FILE *
+timeline_create(void)
+{
+	struct weston_timeline_file_header header = {
+		.magic = WESTON_TIMELINE_MAGIC,
+		.version = WESTON_TIMELINE_VERSION,
+		.record_size = WESTON_TIMELINE_RECORD_SIZE,
+		.clock_id = CLOCK_MONOTONIC,
+	};
+	FILE *file = tmpfile();
+
+	assert(file);
+	assert(fwrite(&header, sizeof header, 1, file) == 1);
+
+	return file;
+}
+
+static void
+write_record(FILE *file, const struct weston_timeline_record *rec)
+{
+	assert(fwrite(rec, sizeof *rec, 1, file) == 1);
+}
+
+/* As libweston writes them: the text follows in as many records as
+ * 'extra' says. */
+static void
+write_definition(FILE *file, struct weston_timeline_record rec,
+		 const char *text)
+{
+	struct weston_timeline_record text_rec;
+	size_t len = strlen(text) + 1;
+	uint16_t i;
+
+	rec.extra = (len + sizeof rec - 1) / sizeof rec;
+	write_record(file, &rec);
+
+	for (i = 0; i < rec.extra; i++) {
+		memset(&text_rec, 0, sizeof text_rec);
+		memcpy(&text_rec, text + i * sizeof rec,
+		       MIN(sizeof rec, len - i * sizeof rec));
+		write_record(file, &text_rec);
+	}
+}
+
+static void
+write_string(FILE *file, uint32_t id, const char *text)
+{
+	write_definition(file, (struct weston_timeline_record) {
+		.type = WESTON_TIMELINE_RECORD_STRING,
+		.name = id,
+	}, text);
+}
+
+static void
+write_point(FILE *file, uint32_t name, uint64_t time, uint32_t output,
+	    uint32_t surface)
+{
+	write_record(file, &(struct weston_timeline_record) {
+		.type = WESTON_TIMELINE_RECORD_POINT,
+		.name = name,
+		.time = time,
+		.output = output,
+		.surface = surface,
+	});
+}
+
+/* Converts the file, returning the JSON, or NULL if it failed */
+static char *
+timeline_convert_to_json(FILE *file)
+{
+	char *json;
+	size_t size;
+	FILE *out;
+	int ret;
+
+	rewind(file);
+	out = open_memstream(&json, &size);
+	assert(out);
+
+	ret = timeline_convert(file, out);
+	fclose(out);
+	fclose(file);
+
+	if (ret < 0) {
+		free(json);
+		return NULL;
+	}
+
+	return json;
+}
+
+static void
+assert_contains(const char *json, const char *event)
+{
+	if (strstr(json, event))
+		return;
+
+	fprintf(stderr, "missing %s in:\n%s\n", event, json);
+	assert(0);
+}
+
+TEST(timeline_convert_records)
+{
+	FILE *file = timeline_create();
+	char *json;
+
+	write_string(file, STRING_REPAINT_BEGIN, "core_repaint_begin");
+	write_string(file, STRING_REPAINT_POSTED, "core_repaint_posted");
+	write_string(file, STRING_COMMIT, "core_commit_damage");
+
+	/* Longer than a record, and with characters to escape */
+	write_definition(file, (struct weston_timeline_record) {
+		.type = WESTON_TIMELINE_RECORD_OUTPUT,
+		.output = OUTPUT_ID,
+	}, "Virtual-1 \"left\", named at length\\");
+	write_definition(file, (struct weston_timeline_record) {
+		.type = WESTON_TIMELINE_RECORD_SURFACE,
+		.surface = SURFACE_MAIN,
+	}, "top-level");
+	write_definition(file, (struct weston_timeline_record) {
+		.type = WESTON_TIMELINE_RECORD_SURFACE,
+		.surface = SURFACE_SUB,
+		.time2 = SURFACE_MAIN,
+	}, "sub-surface");
+
+	write_point(file, STRING_COMMIT, 1000500, 0, SURFACE_SUB);
+	write_point(file, STRING_REPAINT_BEGIN, 2000000, OUTPUT_ID, 0);
+	write_record(file, &(struct weston_timeline_record) {
+		.type = WESTON_TIMELINE_RECORD_POINT,
+		.extra = WESTON_TIMELINE_POINT_VBLANK,
+		.name = STRING_REPAINT_POSTED,
+		.time = 2500000,
+		.time2 = 2600000,
+		.output = OUTPUT_ID,
+	});
+	write_record(file, &(struct weston_timeline_record) {
+		.type = WESTON_TIMELINE_RECORD_DROPPED,
+		.time2 = 5,
+	});
+	write_point(file, STRING_COMMIT, 3000000, 0, SURFACE_MAIN);
+
+	json = timeline_convert_to_json(file);
+	assert(json);
+
+	assert(strncmp(json, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[",
+		       39) == 0);
+	assert(strcmp(json + strlen(json) - 4, "\n]}\n") == 0);
+
+	/* The output track, named by its whole text */
+	assert_contains(json, "{\"name\":\"thread_name\",\"ph\":\"M\","
+			"\"pid\":1,\"tid\":7,\"args\":{\"name\":"
+			"\"Virtual-1 \\\"left\\\", named at length\\\\\"}}");
+
+	assert_contains(json, "{\"name\":\"core_commit_damage\",\"ph\":\"i\","
+			"\"ts\":1000.500,\"pid\":1,\"tid\":0,\"s\":\"t\","
+			"\"args\":{\"surface\":10,\"desc\":\"sub-surface\","
+			"\"main_surface\":9}}");
+	assert_contains(json, "{\"name\":\"core_commit_damage\",\"ph\":\"i\","
+			"\"ts\":3000.000,\"pid\":1,\"tid\":0,\"s\":\"t\","
+			"\"args\":{\"surface\":9,\"desc\":\"top-level\"}}");
+
+	/* The repaint as a slice, and the vblank it reported */
+	assert_contains(json, "{\"name\":\"repaint\",\"ph\":\"X\","
+			"\"ts\":2000.000,\"pid\":1,\"tid\":7,"
+			"\"dur\":500.000}");
+	assert_contains(json, "{\"name\":\"vblank\",\"ph\":\"i\","
+			"\"ts\":2600.000,\"pid\":1,\"tid\":7,\"s\":\"t\","
+			"\"args\":{\"vblank\":true}}");
+
+	free(json);
+}
+
+TEST(timeline_convert_truncated_definition)
+{
+	FILE *file = timeline_create();
+	struct weston_timeline_record text = { 0 };
+	char *json;
+
+	write_string(file, STRING_COMMIT, "core_commit_damage");
+	write_point(file, STRING_COMMIT, 1000000, 0, 0);
+
+	/* Three text records announced, one written */
+	write_record(file, &(struct weston_timeline_record) {
+		.type = WESTON_TIMELINE_RECORD_STRING,
+		.extra = 3,
+		.name = STRING_REPAINT_BEGIN,
+	});
+	write_record(file, &text);
+
+	/* What came before is kept, and the JSON still well-formed. */
+	json = timeline_convert_to_json(file);
+	assert(json);
+	assert_contains(json, "{\"name\":\"core_commit_damage\",\"ph\":\"i\","
+			"\"ts\":1000.000,");
+	assert(strcmp(json + strlen(json) - 4, "\n]}\n") == 0);
+
+	free(json);
+}
+
+TEST(timeline_convert_rejects_other_files)
+{
+	FILE *file = tmpfile();
+
+	assert(file);
+	assert(fputs("{\"traceEvents\":[]}\n", file) >= 0);
+
+	assert(timeline_convert_to_json(file) == NULL);
+}
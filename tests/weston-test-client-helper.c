@@ -246,7 +246,12 @@ static void
 keyboard_handle_keymap(void *data, struct wl_keyboard *wl_keyboard,
 		       uint32_t format, int fd, uint32_t size)
 {
-	close(fd);
+	struct keyboard *keyboard = data;
+
+	if (keyboard->keymap_fd >= 0)
+		close(keyboard->keymap_fd);
+	keyboard->keymap_fd = fd;
+	keyboard->keymap_size = size;
 
 	fprintf(stderr, "test-client: got keyboard keymap\n");
 }
@@ -563,6 +568,8 @@ input_destroy(struct input *inp)
 	}
 	if (inp->keyboard) {
 		wl_keyboard_release(inp->keyboard->wl_keyboard);
+		if (inp->keyboard->keymap_fd >= 0)
+			close(inp->keyboard->keymap_fd);
 		free(inp->keyboard);
 	}
 	if (inp->touch) {
@@ -600,6 +607,7 @@ input_update_devices(struct input *input)
 
 	if ((caps & WL_SEAT_CAPABILITY_KEYBOARD) && !input->keyboard) {
 		keyboard = xzalloc(sizeof *keyboard);
+		keyboard->keymap_fd = -1;
 		keyboard->wl_keyboard = wl_seat_get_keyboard(seat);
 		wl_keyboard_set_user_data(keyboard->wl_keyboard, keyboard);
 		wl_keyboard_add_listener(keyboard->wl_keyboard, &keyboard_listener,
@@ -607,6 +615,8 @@ input_update_devices(struct input *input)
 		input->keyboard = keyboard;
 	} else if (!(caps & WL_SEAT_CAPABILITY_KEYBOARD) && input->keyboard) {
 		wl_keyboard_destroy(input->keyboard->wl_keyboard);
+		if (input->keyboard->keymap_fd >= 0)
+			close(input->keyboard->keymap_fd);
 		free(input->keyboard);
 		input->keyboard = NULL;
 	}
@@ -122,6 +122,8 @@ struct keyboard {
 	uint32_t key_time_msec;
 	struct timespec input_timestamp;
 	struct timespec key_time_timespec;
+	int keymap_fd;
+	uint32_t keymap_size;
 };
 
 struct touch {
@@ -143,13 +143,28 @@ get_seat(struct weston_test *test)
 	return &test->seat;
 }
 
+/* Where the pointer is, counting the motion held back by coalescing */
+static void
+get_pointer_position(struct weston_seat *seat, wl_fixed_t *x, wl_fixed_t *y)
+{
+	struct weston_pointer *pointer = weston_seat_get_pointer(seat);
+
+	if (seat->motion_pending) {
+		weston_pointer_motion_to_abs(pointer, &seat->motion, x, y);
+	} else {
+		*x = pointer->x;
+		*y = pointer->y;
+	}
+}
+
 static void
 notify_pointer_position(struct weston_test *test, struct wl_resource *resource)
 {
 	struct weston_seat *seat = get_seat(test);
-	struct weston_pointer *pointer = weston_seat_get_pointer(seat);
+	wl_fixed_t x, y;
 
-	weston_test_send_pointer_position(resource, pointer->x, pointer->y);
+	get_pointer_position(seat, &x, &y);
+	weston_test_send_pointer_position(resource, x, y);
 }
 
 static void
@@ -212,14 +227,15 @@ move_pointer(struct wl_client *client, struct wl_resource *resource,
 {
 	struct weston_test *test = wl_resource_get_user_data(resource);
 	struct weston_seat *seat = get_seat(test);
-	struct weston_pointer *pointer = weston_seat_get_pointer(seat);
 	struct weston_pointer_motion_event event = { 0 };
 	struct timespec time;
+	wl_fixed_t from_x, from_y;
 
+	get_pointer_position(seat, &from_x, &from_y);
 	event = (struct weston_pointer_motion_event) {
 		.mask = WESTON_POINTER_MOTION_REL,
-		.dx = wl_fixed_to_double(wl_fixed_from_int(x) - pointer->x),
-		.dy = wl_fixed_to_double(wl_fixed_from_int(y) - pointer->y),
+		.dx = wl_fixed_to_double(wl_fixed_from_int(x) - from_x),
+		.dy = wl_fixed_to_double(wl_fixed_from_int(y) - from_y),
 	};
 
 	timespec_from_proto(&time, tv_sec_hi, tv_sec_lo, tv_nsec);
@@ -272,11 +288,21 @@ activate_surface(struct wl_client *client, struct wl_resource *resource,
 	struct weston_test *test = wl_resource_get_user_data(resource);
 	struct weston_seat *seat;
 	struct weston_keyboard *keyboard;
+	struct weston_view *view;
 
 	seat = get_seat(test);
 	keyboard = weston_seat_get_keyboard(seat);
 	if (surface) {
-		weston_seat_set_keyboard_focus(seat, surface);
+		/* Activate as a click would, which pointer constraints
+		 * wait for. */
+		if (!wl_list_empty(&surface->views)) {
+			view = container_of(surface->views.next,
+					    struct weston_view, surface_link);
+			weston_view_activate(view, seat,
+					     WESTON_ACTIVATE_FLAG_CLICKED);
+		} else {
+			weston_seat_set_keyboard_focus(seat, surface);
+		}
 		notify_keyboard_focus_in(seat, &keyboard->keys,
 					 STATE_UPDATE_AUTOMATIC);
 	}
@@ -0,0 +1,221 @@
+/*
+ * Copyright © 2018 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "weston-test-runner.h"
+
+#include "shared/helpers.h"
+#include "yuv-convert.h"
+
+#define WIDTH 37
+#define HEIGHT 23
+#define STRIDE 40
+
+/* Deterministic pseudo-random numbers, so failures are reproducible. */
+static uint32_t
+lcg_next(uint32_t *state)
+{
+	*state = *state * 1103515245u + 12345u;
+	return *state >> 8;
+}
+
+static uint8_t *
+create_source(struct weston_yuv_source *src, enum weston_yuv_layout layout,
+	      int32_t width, int32_t height, int32_t stride)
+{
+	size_t size = (size_t)stride * height * 2 + stride * 2;
+	uint32_t seed = 0x5eed;
+	uint8_t *data;
+	size_t i;
+
+	data = malloc(size);
+	assert(data);
+	for (i = 0; i < size; i++)
+		data[i] = lcg_next(&seed);
+
+	src->layout = layout;
+	src->data = data;
+	src->stride = stride;
+	src->width = width;
+	src->height = height;
+
+	return data;
+}
+
+/* The same conversion in floating point, as the GL renderer does it */
+static void
+reference_pixel(const struct weston_yuv_source *src, int32_t x, int32_t y,
+		int *r, int *g, int *b)
+{
+	const uint8_t *chroma = src->data + src->stride * src->height;
+	int32_t cy = y / 2 < src->height / 2 ? y / 2 : src->height / 2 - 1;
+	double luma, cb, cr;
+
+	switch (src->layout) {
+	case WESTON_YUV_LAYOUT_NV12:
+		luma = src->data[y * src->stride + x];
+		cb = chroma[cy * src->stride + (x / 2) * 2];
+		cr = chroma[cy * src->stride + (x / 2) * 2 + 1];
+		break;
+	case WESTON_YUV_LAYOUT_YUYV:
+		luma = src->data[y * src->stride + x * 2];
+		cb = src->data[y * src->stride + (x / 2) * 4 + 1];
+		cr = src->data[y * src->stride + (x / 2) * 4 + 3];
+		break;
+	case WESTON_YUV_LAYOUT_YUV420:
+	default:
+		luma = src->data[y * src->stride + x];
+		cb = chroma[cy * (src->stride / 2) + x / 2];
+		cr = chroma[(src->stride / 2) * (src->height / 2) +
+			    cy * (src->stride / 2) + x / 2];
+		break;
+	}
+
+	luma = 1.16438356 * (luma - 16.0);
+	cb -= 128.0;
+	cr -= 128.0;
+
+#define CLAMP_ROUND(v) ((v) < 0.0 ? 0 : ((v) > 255.0 ? 255 : (int)((v) + 0.5)))
+	*r = CLAMP_ROUND(luma + 1.59602678 * cr);
+	*g = CLAMP_ROUND(luma - 0.39176229 * cb - 0.81296764 * cr);
+	*b = CLAMP_ROUND(luma + 2.01723214 * cb);
+#undef CLAMP_ROUND
+}
+
+static int
+channel_diff(uint32_t pixel, int shift, int expected)
+{
+	return abs((int)((pixel >> shift) & 0xff) - expected);
+}
+
+static const enum weston_yuv_layout layouts[] = {
+	WESTON_YUV_LAYOUT_NV12,
+	WESTON_YUV_LAYOUT_YUYV,
+	WESTON_YUV_LAYOUT_YUV420,
+};
+
+TEST_P(yuv_convert_matches_reference, layouts)
+{
+	const enum weston_yuv_layout *layout = data;
+	struct weston_yuv_source src;
+	uint32_t dst[WIDTH * HEIGHT];
+	uint8_t *buf;
+	int32_t x, y;
+
+	buf = create_source(&src, *layout, WIDTH, HEIGHT,
+			    *layout == WESTON_YUV_LAYOUT_YUYV ?
+			    STRIDE * 2 : STRIDE);
+
+	weston_yuv_convert_rect(&src, dst, WIDTH * 4, 0, 0, WIDTH, HEIGHT);
+
+	for (y = 0; y < HEIGHT; y++) {
+		for (x = 0; x < WIDTH; x++) {
+			uint32_t p = dst[y * WIDTH + x];
+			int r, g, b;
+
+			reference_pixel(&src, x, y, &r, &g, &b);
+			assert((p >> 24) == 0xff);
+			assert(channel_diff(p, 16, r) <= 1);
+			assert(channel_diff(p, 8, g) <= 1);
+			assert(channel_diff(p, 0, b) <= 1);
+		}
+	}
+
+	free(buf);
+}
+
+TEST_P(yuv_convert_rect_is_partial, layouts)
+{
+	const enum weston_yuv_layout *layout = data;
+	struct weston_yuv_source src;
+	uint32_t full[WIDTH * HEIGHT];
+	uint32_t part[WIDTH * HEIGHT];
+	uint8_t *buf;
+	int32_t x, y;
+
+	buf = create_source(&src, *layout, WIDTH, HEIGHT,
+			    *layout == WESTON_YUV_LAYOUT_YUYV ?
+			    STRIDE * 2 : STRIDE);
+
+	weston_yuv_convert_rect(&src, full, WIDTH * 4, 0, 0, WIDTH, HEIGHT);
+
+	memset(part, 0, sizeof part);
+	weston_yuv_convert_rect(&src, part, WIDTH * 4, 5, 3, 17, 11);
+	/* Clipped to the image */
+	weston_yuv_convert_rect(&src, part, WIDTH * 4, 30, 20, 100, 100);
+
+	for (y = 0; y < HEIGHT; y++) {
+		for (x = 0; x < WIDTH; x++) {
+			/* The rectangle starts on an even column. */
+			bool in_a = x >= 4 && x < 17 && y >= 3 && y < 11;
+			bool in_b = x >= 30 && y >= 20;
+
+			if (in_a || in_b)
+				assert(part[y * WIDTH + x] ==
+				       full[y * WIDTH + x]);
+			else
+				assert(part[y * WIDTH + x] == 0);
+		}
+	}
+
+	free(buf);
+}
+
+TEST(yuv_convert_1080p_speed)
+{
+	const int32_t width = 1920, height = 1080;
+	struct weston_yuv_source src;
+	struct timespec t0, t1;
+	uint32_t *dst;
+	uint8_t *buf;
+	int i;
+
+	buf = create_source(&src, WESTON_YUV_LAYOUT_NV12,
+			    width, height, width);
+	dst = malloc(width * height * 4);
+	assert(dst);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < 20; i++)
+		weston_yuv_convert_rect(&src, dst, width * 4,
+					0, 0, width, height);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	fprintf(stderr, "NV12 1920x1080: %.3f ms per frame\n",
+		((t1.tv_sec - t0.tv_sec) * 1e3 +
+		 (t1.tv_nsec - t0.tv_nsec) / 1e6) / 20);
+
+	free(dst);
+	free(buf);
+}
@@ -0,0 +1,85 @@
+/*
+ * Copyright © 2018 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Converts a binary weston timeline (weston-timeline-*.wtl) into the
+ * Chrome trace event JSON format, which Perfetto and chrome://tracing
+ * load. Each output gets a track of its own, with the repaints as slices.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "timeline-convert.h"
+
+static void
+usage(const char *name)
+{
+	fprintf(stderr, "usage: %s FILE.wtl [OUTPUT.json]\n\n"
+		"Converts a binary weston timeline to the Chrome trace event\n"
+		"format. Writes to stdout without OUTPUT.json.\n", name);
+}
+
+int
+main(int argc, char *argv[])
+{
+	FILE *in, *out;
+	int ret;
+
+	if (argc < 2 || argc > 3 || argv[1][0] == '-') {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	in = fopen(argv[1], "rb");
+	if (!in) {
+		fprintf(stderr, "cannot open %s: %s\n", argv[1],
+			strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	if (argc == 3) {
+		out = fopen(argv[2], "w");
+		if (!out) {
+			fprintf(stderr, "cannot open %s: %s\n", argv[2],
+				strerror(errno));
+			fclose(in);
+			return EXIT_FAILURE;
+		}
+	} else {
+		out = stdout;
+	}
+
+	ret = timeline_convert(in, out);
+
+	fclose(in);
+	if (out != stdout)
+		fclose(out);
+
+	return ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,347 @@
+/*
+ * Copyright © 2018 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "shared/helpers.h"
+#include "timeline-format.h"
+#include "timeline-convert.h"
+
+/* Text of the strings, outputs and surfaces, by id */
+struct definition {
+	uint32_t id;
+	uint32_t main_surface;
+	uint64_t repaint_begin; /* of an output, 0 if not repainting */
+	char *text;
+};
+
+struct definition_table {
+	struct definition *entries;
+	uint32_t size; /* a power of two */
+	uint32_t count;
+};
+
+struct converter {
+	FILE *in, *out;
+	struct definition_table strings, outputs, surfaces;
+	bool first_event;
+	uint64_t points, dropped;
+};
+
+static struct definition *
+table_find(struct definition_table *table, uint32_t id, bool create)
+{
+	struct definition *old = table->entries;
+	uint32_t i, old_size = table->size;
+
+	if (id == 0)
+		return NULL;
+
+	if (create && (table->count + 1) * 2 > table->size) {
+		table->size = table->size ? table->size * 2 : 64;
+		table->entries = calloc(table->size, sizeof *table->entries);
+		if (!table->entries) {
+			fprintf(stderr, "out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+		table->count = 0;
+		for (i = 0; i < old_size; i++)
+			if (old[i].id)
+				*table_find(table, old[i].id, true) = old[i];
+		free(old);
+	}
+
+	if (table->size == 0)
+		return NULL;
+
+	for (i = id & (table->size - 1); table->entries[i].id;
+	     i = (i + 1) & (table->size - 1))
+		if (table->entries[i].id == id)
+			return &table->entries[i];
+
+	if (!create)
+		return NULL;
+
+	table->entries[i].id = id;
+	table->count++;
+
+	return &table->entries[i];
+}
+
+static void
+table_release(struct definition_table *table)
+{
+	uint32_t i;
+
+	for (i = 0; i < table->size; i++)
+		free(table->entries[i].text);
+	free(table->entries);
+}
+
+static void
+print_json_string(FILE *out, const char *str)
+{
+	const unsigned char *p;
+
+	fputc('"', out);
+	for (p = (const unsigned char *)str; *p; p++) {
+		if (*p == '"' || *p == '\\')
+			fprintf(out, "\\%c", *p);
+		else if (*p < 0x20)
+			fprintf(out, "\\u%04x", *p);
+		else
+			fputc(*p, out);
+	}
+	fputc('"', out);
+}
+
+static const char *
+lookup_text(struct definition_table *table, uint32_t id)
+{
+	struct definition *def = table_find(table, id, false);
+
+	return def && def->text ? def->text : "";
+}
+
+/* Starts a trace event, up to the opening brace of its args. */
+static void
+begin_event(struct converter *conv, const char *name, const char *phase,
+	    uint64_t time, uint32_t tid)
+{
+	fprintf(conv->out, "%s\n{\"name\":", conv->first_event ? "" : ",");
+	conv->first_event = false;
+	print_json_string(conv->out, name);
+	fprintf(conv->out, ",\"ph\":\"%s\",\"ts\":%" PRIu64 ".%03u,"
+		"\"pid\":1,\"tid\":%u", phase, time / 1000,
+		(unsigned)(time % 1000), tid);
+}
+
+static void
+emit_thread_name(struct converter *conv, uint32_t tid, const char *name)
+{
+	fprintf(conv->out, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\","
+		"\"pid\":1,\"tid\":%u,\"args\":{\"name\":",
+		conv->first_event ? "" : ",", tid);
+	conv->first_event = false;
+	print_json_string(conv->out, name);
+	fprintf(conv->out, "}}");
+}
+
+static int
+read_text(struct converter *conv, uint16_t n, char **text)
+{
+	size_t size = (size_t)n * WESTON_TIMELINE_RECORD_SIZE;
+
+	*text = malloc(size + 1);
+	if (!*text)
+		return -1;
+
+	if (fread(*text, WESTON_TIMELINE_RECORD_SIZE, n, conv->in) != n) {
+		free(*text);
+		*text = NULL;
+		return -1;
+	}
+	(*text)[size] = '\0';
+
+	return 0;
+}
+
+static int
+handle_definition(struct converter *conv,
+		  const struct weston_timeline_record *rec)
+{
+	struct definition_table *table;
+	struct definition *def;
+	uint32_t id;
+	char *text;
+
+	if (read_text(conv, rec->extra, &text) < 0)
+		return -1;
+
+	switch (rec->type) {
+	case WESTON_TIMELINE_RECORD_STRING:
+		table = &conv->strings;
+		id = rec->name;
+		break;
+	case WESTON_TIMELINE_RECORD_OUTPUT:
+		table = &conv->outputs;
+		id = rec->output;
+		break;
+	case WESTON_TIMELINE_RECORD_SURFACE:
+	default:
+		table = &conv->surfaces;
+		id = rec->surface;
+		break;
+	}
+
+	def = table_find(table, id, true);
+	if (!def) {
+		free(text);
+		return 0;
+	}
+
+	free(def->text);
+	def->text = text;
+	def->main_surface = rec->time2;
+
+	if (rec->type == WESTON_TIMELINE_RECORD_OUTPUT)
+		emit_thread_name(conv, id, text);
+
+	return 0;
+}
+
+static void
+handle_point(struct converter *conv, const struct weston_timeline_record *rec)
+{
+	const char *name = lookup_text(&conv->strings, rec->name);
+	struct definition *output = table_find(&conv->outputs,
+					       rec->output, false);
+	struct definition *surface;
+
+	conv->points++;
+
+	/* Repaints of an output become slices on its track. */
+	if (output && strcmp(name, "core_repaint_begin") == 0) {
+		output->repaint_begin = rec->time;
+	} else if (output && output->repaint_begin &&
+		   strcmp(name, "core_repaint_posted") == 0) {
+		begin_event(conv, "repaint", "X", output->repaint_begin,
+			    rec->output);
+		fprintf(conv->out, ",\"dur\":%.3f}",
+			(rec->time - output->repaint_begin) / 1000.0);
+		output->repaint_begin = 0;
+	}
+
+	begin_event(conv, name[0] ? name : "unknown", "i", rec->time,
+		    rec->output);
+	fprintf(conv->out, ",\"s\":\"t\",\"args\":{");
+	if (rec->surface) {
+		surface = table_find(&conv->surfaces, rec->surface, false);
+		fprintf(conv->out, "\"surface\":%u,\"desc\":", rec->surface);
+		print_json_string(conv->out,
+				  surface && surface->text ? surface->text : "");
+		if (surface && surface->main_surface)
+			fprintf(conv->out, ",\"main_surface\":%u",
+				surface->main_surface);
+	}
+	fprintf(conv->out, "}}");
+
+	/* The time the point reports, as an event of its own */
+	if (rec->extra & (WESTON_TIMELINE_POINT_VBLANK |
+			  WESTON_TIMELINE_POINT_GPU)) {
+		begin_event(conv,
+			    rec->extra & WESTON_TIMELINE_POINT_VBLANK ?
+			    "vblank" : name, "i", rec->time2, rec->output);
+		fprintf(conv->out, ",\"s\":\"t\",\"args\":{\"%s\":true}}",
+			rec->extra & WESTON_TIMELINE_POINT_VBLANK ?
+			"vblank" : "gpu");
+	}
+}
+
+static int
+convert(struct converter *conv)
+{
+	struct weston_timeline_file_header header;
+	struct weston_timeline_record rec;
+
+	if (fread(&header, sizeof header, 1, conv->in) != 1 ||
+	    header.magic != WESTON_TIMELINE_MAGIC) {
+		fprintf(stderr, "not a binary weston timeline\n");
+		return -1;
+	}
+
+	if (header.version != WESTON_TIMELINE_VERSION ||
+	    header.record_size != sizeof rec) {
+		fprintf(stderr, "unsupported timeline version %u\n",
+			header.version);
+		return -1;
+	}
+
+	fprintf(conv->out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+	conv->first_event = true;
+	emit_thread_name(conv, 0, "surfaces");
+
+	while (fread(&rec, sizeof rec, 1, conv->in) == 1) {
+		switch (rec.type) {
+		case WESTON_TIMELINE_RECORD_POINT:
+			handle_point(conv, &rec);
+			break;
+		case WESTON_TIMELINE_RECORD_STRING:
+		case WESTON_TIMELINE_RECORD_OUTPUT:
+		case WESTON_TIMELINE_RECORD_SURFACE:
+			if (handle_definition(conv, &rec) < 0) {
+				fprintf(stderr, "truncated definition\n");
+				goto out;
+			}
+			break;
+		case WESTON_TIMELINE_RECORD_DROPPED:
+			conv->dropped += rec.time2;
+			break;
+		default:
+			fprintf(stderr, "unknown record type %u, stopping\n",
+				rec.type);
+			goto out;
+		}
+	}
+
+out:
+	fprintf(conv->out, "\n]}\n");
+
+	fprintf(stderr, "%" PRIu64 " points converted", conv->points);
+	if (conv->dropped)
+		fprintf(stderr, ", %" PRIu64 " were lost while tracing",
+			conv->dropped);
+	fprintf(stderr, "\n");
+
+	return 0;
+}
+
+/* Converts the binary timeline read from 'in' into the Chrome trace event
+ * JSON written to 'out'. Returns -1 if 'in' is not a timeline this
+ * understands. */
+int
+timeline_convert(FILE *in, FILE *out)
+{
+	struct converter conv = { 0 };
+	int ret;
+
+	conv.in = in;
+	conv.out = out;
+
+	ret = convert(&conv);
+
+	table_release(&conv.strings);
+	table_release(&conv.outputs);
+	table_release(&conv.surfaces);
+
+	return ret;
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright © 2018 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef WESTON_TIMELINE_FORMAT_H
+#define WESTON_TIMELINE_FORMAT_H
+
+#include <stdint.h>
+
+/* Binary timeline files
+ *
+ * A file starts with a weston_timeline_file_header, followed by records
+ * of WESTON_TIMELINE_RECORD_SIZE bytes in native byte order.
+ *
+ * Strings and objects are defined before the first record using them.
+ * A definition record is followed by as many records of raw text as its
+ * 'extra' field says, the NUL terminated string padded with zeroes.
+ */
+
+#define WESTON_TIMELINE_MAGIC		0x4c545757 /* "WWTL" */
+#define WESTON_TIMELINE_VERSION		1
+#define WESTON_TIMELINE_RECORD_SIZE	32
+
+struct weston_timeline_file_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t record_size;
+	uint32_t clock_id;	/* the clock of all timestamps */
+};
+
+enum weston_timeline_record_type {
+	/* A tracepoint: name is a string id, output and surface are object
+	 * ids or 0, extra holds WESTON_TIMELINE_POINT_* flags. */
+	WESTON_TIMELINE_RECORD_POINT = 1,
+	/* Defines the string 'name' */
+	WESTON_TIMELINE_RECORD_STRING,
+	/* Defines output 'output', named by the text */
+	WESTON_TIMELINE_RECORD_OUTPUT,
+	/* Defines surface 'surface', described by the text. The main
+	 * surface of a sub-surface is in time2, else time2 is 0. */
+	WESTON_TIMELINE_RECORD_SURFACE,
+	/* time2 points were lost because the writer fell behind */
+	WESTON_TIMELINE_RECORD_DROPPED,
+};
+
+/* Flags of a point */
+#define WESTON_TIMELINE_POINT_VBLANK	(1 << 0) /* time2 is a vblank */
+#define WESTON_TIMELINE_POINT_GPU	(1 << 1) /* time2 is a GPU time */
+
+struct weston_timeline_record {
+	uint16_t type;
+	uint16_t extra;		/* flags, or text records that follow */
+	uint32_t name;
+	uint64_t time;		/* nanoseconds */
+	uint64_t time2;
+	uint32_t output;
+	uint32_t surface;
+};
+
+#endif /* WESTON_TIMELINE_FORMAT_H */